@@ -1,7 +1,7 @@
 /**
  * @brief Show block device statistics, where available.
  *
- * Shows cache hit/miss/write counts for ATA devices, mostly.
+ * Shows block cache hit/miss/write counts for cached devices.
  *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
@@ -17,13 +17,22 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
 
 #define CHUNK_SIZE 4096
+#define SPLICE_SIZE 0x100000
 
 static char * _argv_0;
 static char * _file;
 
 void doit(int fd) {
+	/* Have the kernel move the data if it can; if it can't, we copy it ourselves. */
+	while (1) {
+		ssize_t s = sendfile(STDOUT_FILENO, fd, NULL, SPLICE_SIZE);
+		if (!s) return;
+		if (s < 0) break;
+	}
+
 	while (1) {
 		char buf[CHUNK_SIZE];
 		memset(buf, 0, CHUNK_SIZE);
@@ -16,6 +16,7 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
 
 #define CHUNK_SIZE 4096
 
@@ -64,6 +65,13 @@ static int copy_file(char * source, char * dest, int mode,int uid, int gid) {
 
 	//fprintf(stderr, "%d bytes to copy\n", length);
 
+	/* Let the kernel copy straight out of the page cache; anything it can't do we copy ourselves. */
+	while (length > 0) {
+		ssize_t s = sendfile(d_fd, s_fd, NULL, length);
+		if (s <= 0) break;
+		length -= s;
+	}
+
 	char buf[CHUNK_SIZE];
 
 	while (length > 0) {
@@ -72,6 +80,7 @@ static int copy_file(char * source, char * dest, int mode,int uid, int gid) {
 			fprintf(stderr, APP_NAME ": %s: %s\n", source, strerror(errno));
 			return 1;
 		}
+		if (!r) break;
 		//fprintf(stderr, "copying %d bytes from %s to %s\n", r, source, dest);
 		ssize_t w = write(d_fd, buf, r);
 		if (w < 0) {
@@ -52,10 +52,16 @@ struct flock {
 #define FD_CLOEXEC (1 << 0)
 #define FD_CLOFORK (1 << 1)
 
+/* splice() flags; these are accepted as hints and otherwise ignored. */
+#define SPLICE_F_MOVE     (1 << 0)
+#define SPLICE_F_NONBLOCK (1 << 1)
+#define SPLICE_F_MORE     (1 << 2)
+
 #ifndef __kernel__
 extern int open (const char *, int, ...);
 extern int fcntl(int fd, int cmd, ...);
 extern int creat(const char *path, mode_t mode);
+extern ssize_t splice(int fd_in, off_t * off_in, int fd_out, off_t * off_out, size_t len, unsigned int flags);
 #endif
 
 _End_C_Header
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+#include <kernel/types.h>
+#include <kernel/vfs.h>
+
+#define BCACHE_BLOCK_SIZE 4096
+
+/**
+ * Wrap a raw block device node in the shared block cache.
+ * Drivers mount the returned node in place of their own; the
+ * raw node then only sees whole, block-aligned reads and writes.
+ */
+extern fs_node_t * bcache_create(fs_node_t * raw);
+
+/**
+ * Bring a byte range of the device into the cache without copying it
+ * anywhere, reading runs of missing blocks with as few device requests
+ * as possible. Filesystems use this to read ahead of sequential readers.
+ */
+#define BCACHE_IOCTL_READAHEAD 0x2A01235UL
+
+struct bcache_readahead {
+	uint64_t offset;
+	uint64_t length;
+};
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Blocks range from a single frame up to 4MiB */
+#define BUDDY_ORDERS 11
+#define BUDDY_NONE   ((uintptr_t)-1)
+#define BUDDY_CPUS   32
+
+struct buddy_stats {
+	size_t free_blocks[BUDDY_ORDERS];
+	size_t cached[BUDDY_CPUS];
+	size_t free_frames;
+};
+
+void buddy_attach(volatile uint32_t * bitmap, uintptr_t first_frame, size_t nframes);
+void buddy_initialize(void);
+
+void buddy_reserve(uintptr_t frame);
+void buddy_release(uintptr_t frame);
+int buddy_test(uintptr_t frame);
+
+uintptr_t buddy_alloc(int order);
+uintptr_t buddy_alloc_frames(size_t n);
+void buddy_free(uintptr_t frame, int order);
+
+size_t buddy_free_frames(void);
+void buddy_get_stats(struct buddy_stats * out);
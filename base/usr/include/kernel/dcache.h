@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+#include <kernel/types.h>
+#include <kernel/vfs.h>
+
+#define DCACHE_MISS     0
+#define DCACHE_POSITIVE 1
+#define DCACHE_NEGATIVE 2
+
+extern void dcache_initialize(void);
+extern int dcache_lookup(fs_node_t * dir, const char * name, uint64_t * inode, uint64_t * generation);
+extern void dcache_insert(fs_node_t * dir, const char * name, fs_node_t * found, uint64_t generation);
+extern void dcache_invalidate(fs_node_t * dir, const char * name);
+extern void dcache_invalidate_dir(void * device, uint64_t dir);
+extern void dcache_purge(void);
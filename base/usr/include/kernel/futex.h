@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <bits/timespec.h>
+
+extern long futex_wait(volatile int * address, int expected, const struct timespec * timeout);
+extern long futex_wake(volatile int * address, int count);
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+size_t iov_length(const struct iovec * iov, size_t iovcnt);
+size_t iov_gather(uint8_t * dest, const struct iovec * iov, size_t iovcnt, size_t offset, size_t size);
+size_t iov_scatter(const struct iovec * iov, size_t iovcnt, size_t offset, const uint8_t * src, size_t size);
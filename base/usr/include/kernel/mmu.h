@@ -25,6 +25,8 @@
 
 #define MMU_GET_MAKE 0x01
 
+#define MMU_LARGE_PAGE_SIZE 0x200000UL
+
 
 #define MMU_PTR_NULL  1
 #define MMU_PTR_WRITE 2
@@ -33,11 +35,11 @@ void mmu_frame_set(uintptr_t frame_addr);
 void mmu_frame_clear(uintptr_t frame_addr);
 void mmu_frame_release(uintptr_t frame_addr);
 int mmu_frame_test(uintptr_t frame_addr);
-uintptr_t mmu_first_n_frames(int n);
-uintptr_t mmu_first_frame(void);
 void mmu_frame_allocate(union PML * page, unsigned int flags);
 void mmu_frame_map_address(union PML * page, unsigned int flags, uintptr_t physAddr);
 void mmu_frame_free(union PML * page);
+int mmu_map_shared_frame(union PML * page, unsigned int flags, uintptr_t physAddr);
+void mmu_release_shared_frame(uintptr_t physAddr);
 uintptr_t mmu_map_to_physical(union PML * root, uintptr_t virtAddr);
 union PML * mmu_get_page(uintptr_t virtAddr, int flags);
 void mmu_set_directory(union PML * new_pml);
@@ -59,6 +61,12 @@ size_t mmu_total_memory(void);
 size_t mmu_used_memory(void);
 
 void * sbrk(size_t);
+void mmu_heap_release(uintptr_t start, size_t size);
+void mmu_heap_commit(uintptr_t start, size_t size);
+
+int mmu_map_large(uintptr_t virtAddr, uintptr_t physAddr, unsigned int flags);
+int mmu_allocate_large(uintptr_t virtAddr, unsigned int flags);
+int mmu_unmap_large(uintptr_t virtAddr);
 
 union PML * mmu_get_page_other(union PML * root, uintptr_t virtAddr);
 int mmu_validate_user_pointer(const void * addr, size_t size, int flags);
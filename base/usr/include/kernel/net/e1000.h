@@ -26,6 +26,7 @@
 #define E1000_REG_TXDESCHEAD 0x3810
 #define E1000_REG_TXDESCTAIL 0x3818
 
+#define E1000_REG_RXCSUM     0x5000
 #define E1000_REG_RXADDR     0x5400
 
 #define E1000_NUM_RX_DESC 512
@@ -68,6 +69,14 @@
 #define TCTL_SWXOFF                     (1 << 22)   /* Software XOFF Transmission */
 #define TCTL_RTLC                       (1 << 24)   /* Re-transmit on Late Collision */
 
+#define RXCSUM_IPOFL                    (1 << 8)    /* IP Checksum Offload Enable */
+#define RXCSUM_TUOFL                    (1 << 9)    /* TCP/UDP Checksum Offload Enable */
+
+#define RX_STATUS_DD                    (1 << 0)    /* Descriptor Done */
+#define RX_STATUS_IXSM                  (1 << 2)    /* Ignore Checksum Indication */
+#define RX_STATUS_TCPCS                 (1 << 5)    /* TCP/UDP Checksum Calculated */
+#define RX_ERRORS_TCPE                  (1 << 5)    /* TCP/UDP Checksum Error */
+
 #define CMD_EOP                         (1 << 0)    /* End of Packet */
 #define CMD_IFCS                        (1 << 1)    /* Insert FCS */
 #define CMD_IC                          (1 << 2)    /* Insert Checksum */
@@ -16,7 +16,10 @@ struct ethernet_packet {
 	uint8_t payload[];
 } __attribute__((packed)) __attribute__((aligned(2)));
 
-void net_eth_handle(struct ethernet_packet * frame, fs_node_t * nic, size_t size);
+struct net_buffer;
+
+void net_eth_handle(struct ethernet_packet * frame, fs_node_t * nic, size_t size, int flags);
+void net_eth_receive(struct net_buffer * buf, fs_node_t * nic);
 
 struct EthernetDevice {
 	char if_name[32];
@@ -33,9 +36,18 @@ struct EthernetDevice {
 	/* TODO: Address lists? */
 
 	fs_node_t * device_node;
+
+	/**
+	 * Set by drivers for NICs that can finish TCP and UDP checksums:
+	 * send a frame with the folded pseudo-header sum at @p csum_start
+	 * + @p csum_offset, summing from @p csum_start to the end of the
+	 * frame and storing the complement there.
+	 */
+	void (*send_partial)(struct EthernetDevice * nic, void * frame, size_t size, size_t csum_start, size_t csum_offset);
 };
 
 void net_eth_send(struct EthernetDevice *, size_t, void*, uint16_t, uint8_t*);
+void net_eth_send_partial(struct EthernetDevice *, size_t, void*, uint16_t, uint8_t*, size_t, size_t);
 
 struct ArpCacheEntry {
 	uint8_t hwaddr[6];
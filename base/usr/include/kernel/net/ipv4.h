@@ -1,5 +1,10 @@
 #pragma once
 #include <stdint.h>
+#include <stddef.h>
+
+/* For addresses as they appear on the wire, eg. packet->source */
+#define IPV4_FORMAT "%d.%d.%d.%d"
+#define FORMAT_IPV4(a) ((a) & 0xFF), (((a) >> 8) & 0xFF), (((a) >> 16) & 0xFF), (((a) >> 24) & 0xFF)
 
 struct ipv4_packet {
 	uint8_t  version_ihl;
@@ -58,3 +63,10 @@ struct tcp_check_header {
 #define IPV4_PROT_UDP 17
 #define IPV4_PROT_TCP 6
 
+/* Internet checksums; results are in network byte order. */
+uint32_t net_checksum_add(const void * data, size_t len, uint32_t sum);
+uint32_t net_checksum_pseudo(uint32_t source, uint32_t destination, uint8_t protocol, size_t length);
+uint16_t net_checksum_fold(uint32_t sum);
+uint16_t net_checksum_finish(uint32_t sum);
+uint16_t net_checksum(const void * data, size_t len);
+
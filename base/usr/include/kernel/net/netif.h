@@ -1,6 +1,8 @@
 #pragma once
 
 #include <kernel/vfs.h>
+#include <kernel/list.h>
+#include <kernel/spinlock.h>
 #include <sys/socket.h>
 
 #define htonl(l)  ( (((l) & 0xFF) << 24) | (((l) & 0xFF00) << 8) | (((l) & 0xFF0000) >> 8) | (((l) & 0xFF000000) >> 24))
@@ -12,6 +14,57 @@ int net_add_interface(const char * name, fs_node_t * deviceNode);
 fs_node_t * net_if_lookup(const char * name);
 fs_node_t * net_if_route(uint32_t addr);
 
+/* Two packet buffers fit in a slab page, with room for a full frame plus headers. */
+#define NET_PACKET_SIZE 2016
+extern struct kmem_cache net_packet_cache;
+void * net_packet_alloc(size_t size);
+
+/**
+ * A received frame. Delivery hands sockets references to the buffer
+ * instead of copies, and whoever drops the last reference frees it.
+ * Frames that fit come from the packet cache, which net_install()
+ * fills ahead of time so the receive path doesn't have to grow it.
+ */
+typedef struct net_buffer {
+	volatile int refcount;
+	int flags;
+	size_t size;
+	uint8_t data[];
+} net_buffer_t;
+
+/* The NIC has checked (or will fill in) the TCP or UDP checksum */
+#define NET_BUFFER_CSUM_OK 0x01
+
+#define NET_BUFFER_PRELOAD 256
+
+net_buffer_t * net_buffer_alloc(size_t size);
+net_buffer_t * net_buffer_ref(net_buffer_t * buf);
+void net_buffer_release(net_buffer_t * buf);
+
+/**
+ * Deferred receive processing for a NIC, in the style of NAPI.
+ * The interrupt handler masks the device's receive interrupts and
+ * calls net_poll_schedule(); a worker thread then calls poll() with
+ * a budget until it handles fewer frames than that, and calls
+ * enable() to unmask them again before going to sleep. enable()
+ * returns non-zero if frames are already waiting, in which case it
+ * leaves interrupts masked and polling continues.
+ */
+#define NET_POLL_BUDGET 64
+
+struct net_poll {
+	spin_lock_t lock;
+	int scheduled;
+	list_t * wait;
+	int (*poll)(struct net_poll * poll, int budget);
+	int (*enable)(struct net_poll * poll);
+	void * device;
+};
+
+void net_poll_start(struct net_poll * poll, const char * name, void * device,
+	int (*poll_func)(struct net_poll *, int), int (*enable)(struct net_poll *));
+void net_poll_schedule(struct net_poll * poll);
+
 typedef struct SockData {
 	fs_node_t _fnode;
 	spin_lock_t alert_lock;
@@ -41,11 +94,25 @@ typedef struct SockData {
 
 	long (*sock_accept)(struct SockData * sock, struct sockaddr *addr, socklen_t *addrlen);
 	long (*sock_listen)(struct SockData * sock, int backlog);
+
+	void * proto; /* Protocol control block, eg. for TCP */
 } sock_t;
 
+/**
+ * An entry in a socket's receive queue: @p size bytes at @p data,
+ * somewhere inside a shared receive buffer.
+ */
+typedef struct sock_packet {
+	node_t node;
+	net_buffer_t * buf;
+	void * data;
+	size_t size;
+} sock_packet_t;
+
 void net_sock_alert(sock_t * sock);
-void net_sock_add(sock_t * sock, void * frame, size_t size);
-void * net_sock_get(sock_t * sock);
+void net_sock_add(sock_t * sock, net_buffer_t * buf, void * data, size_t size);
+sock_packet_t * net_sock_get(sock_t * sock);
+void net_sock_packet_free(sock_packet_t * packet);
 sock_t * net_sock_create(void);
 
 extern long net_socket(int,int,int);
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+#include <kernel/types.h>
+#include <kernel/vfs.h>
+#include <kernel/mmu.h>
+
+extern void pagecache_initialize(void);
+extern ssize_t pagecache_read(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer);
+extern ssize_t pagecache_splice(fs_node_t * node, off_t offset, size_t size, fs_node_t * out, off_t out_offset);
+extern void pagecache_write(fs_node_t * node, off_t offset, size_t size);
+extern void pagecache_truncate(fs_node_t * node, size_t size);
+extern void pagecache_invalidate(void * device, uint64_t inode);
+extern int pagecache_map(fs_node_t * node, off_t offset, union PML * page, unsigned int flags);
+extern size_t pagecache_reclaim(size_t pages);
+extern size_t pagecache_count(void);
@@ -22,12 +22,14 @@
 
 #define PROC_REUSE_FDS 0x0001
 #define KERNEL_STACK_SIZE 0x9000
+#define SCHED_TIME_SLICE 10000 /* Microseconds a process runs before it is preempted */
 #define USER_ROOT_UID 0
 
 typedef struct {
 	intptr_t refcount;
 	union PML * directory;
 	spin_lock_t lock;
+	list_t * mappings;   /* File mappings filled on demand, see mman.c */
 } page_directory_t;
 
 typedef struct {
@@ -102,6 +104,22 @@ struct signal_config {
 
 #define PROC_FLAG_RESTORE_SIGMASK    0x100
 
+/**
+ * @brief Pending timed wakeup.
+ *
+ * Embedded in each process so that timed sleeps and fswait
+ * timeouts never allocate. @c heap_index is the sleeper's
+ * position in the scheduler's timeout heap, or 0 if it is
+ * not currently queued.
+ */
+typedef struct {
+	uint64_t end_tick;
+	uint64_t end_subtick;
+	struct process * process;
+	int is_fswait;
+	size_t heap_index;
+} sleeper_t;
+
 typedef struct process {
 	pid_t id;    /* PID */
 	pid_t tgid; /* thread group */
@@ -134,8 +152,8 @@ typedef struct process {
 
 	node_t sched_node;
 	node_t sleep_node;
-	node_t * timed_sleep_node;
-	node_t * timeout_node;
+	int sched_core; /* Core whose ready queue this thread is placed on */
+	sleeper_t sleeper;
 
 	struct timeval start;
 	int awoken_index;
@@ -184,12 +202,6 @@ typedef struct process {
 
 _Static_assert((__builtin_offsetof(process_t,flags) == 20), "flags is not at expected offset for assembly");
 
-typedef struct {
-	uint64_t end_tick;
-	uint64_t end_subtick;
-	process_t * process;
-	int is_fswait;
-} sleeper_t;
 
 struct ProcessorLocal {
 	/**
@@ -233,12 +245,34 @@ struct ProcessorLocal {
 	const char * cpu_manufacturer; /* 0x68 */
 	uintptr_t syscall_stack;       /* 0x70: Should match TSS.RSP[0] */
 	uintptr_t user_sysret_stack;   /* 0x78: Used only at start of SYSCALL entry to store user RSP before pushing it */
+	/* Page directories this core has given PCIDs to; slot i is PCID i+1. Other
+	 * cores set a slot's bit in pcid_stale when they change its directory, so
+	 * that this core flushes it instead of reusing it the next time it loads it. */
+	union PML * pcid_owner[16];
+	volatile uint32_t pcid_stale;
+	int pcid_next;
 #endif
 
 #ifdef __aarch64__
 	uintptr_t sp_el1;
 	uint64_t  midr;
 #endif
+
+	/**
+	 * @brief Core-local ready queue.
+	 *
+	 * Threads are queued on the core they last ran on, so wakeups
+	 * land where their cache state is. A core with nothing left in
+	 * its own queue steals from the busiest other queue before it
+	 * falls back to its idle task. Protected by @c ready_lock, which
+	 * other cores also take when stealing or waking.
+	 */
+	list_t * ready_queue;
+	spin_lock_t ready_lock;
+	uint64_t sched_steals;     /* Threads this core took from another core's queue */
+	uint64_t sched_migrations; /* Threads this core resumed that last ran on another core */
+	uint64_t timer_interrupts; /* Timer interrupts taken by this core */
+	uint64_t idle_wakeups;     /* Times this core's idle task came out of a halt */
 };
 
 extern struct ProcessorLocal processor_local_data[];
@@ -264,10 +298,13 @@ extern process_t * process_from_pid(pid_t pid);
 extern void process_delete(process_t * proc);
 extern void make_process_ready(volatile process_t * proc);
 extern volatile process_t * next_ready_process(void);
+extern int ready_process_available(void);
 extern int wakeup_queue(list_t * queue);
 extern int wakeup_queue_interrupted(list_t * queue);
+extern int wakeup_queue_one(list_t * queue);
 extern int sleep_on(list_t * queue);
 extern int sleep_on_unlocking(list_t * queue, spin_lock_t * release);
+extern int sleep_on_unlocking_until(list_t * queue, spin_lock_t * release, unsigned long seconds, unsigned long subseconds);
 extern int process_alert_node(process_t * process, void * value);
 extern void sleep_until(process_t * process, unsigned long seconds, unsigned long subseconds);
 extern void switch_task(uint8_t reschedule);
@@ -275,6 +312,7 @@ extern int process_wait_nodes(process_t * process,fs_node_t * nodes[], int timeo
 extern process_t * process_get_parent(process_t * process);
 extern int process_is_ready(process_t * proc);
 extern void wakeup_sleepers(unsigned long seconds, unsigned long subseconds);
+extern void sched_arm_timer(void);
 extern void task_exit(long retval);
 extern __attribute__((noreturn)) void switch_next(void);
 extern int process_awaken_from_fswait(process_t * process, int index);
@@ -296,8 +334,6 @@ extern size_t process_get_tty(process_t * proc, size_t len, char * out);
 
 extern tree_t * process_tree;  /* Parent->Children tree */
 extern list_t * process_list;  /* Flat storage */
-extern list_t * process_queue; /* Ready queue */
-extern list_t * sleep_queue;
 
 extern void arch_enter_tasklet(void);
 extern __attribute__((noreturn)) void arch_resume_user(void);
@@ -310,6 +346,10 @@ extern void arch_enter_user(uintptr_t entrypoint, int argc, char * argv[], char
 __attribute__((noreturn))
 extern void arch_enter_signal_handler(struct signal_config *, siginfo_t *,struct regs*);
 extern void arch_wakeup_others(void);
+extern void arch_wakeup_core(int cpu);
+extern void arch_timer_arm(unsigned long usecs);
+extern const char * arch_timer_mode(void);
+extern unsigned long arch_timer_resolution(void);
 extern int arch_return_from_signal_handler(struct regs *r);
 extern void arch_clear_icache(uintptr_t,uintptr_t);
 
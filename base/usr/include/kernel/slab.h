@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/spinlock.h>
+
+#define KMEM_MAGAZINE_SIZE 16
+#define KMEM_CPUS 32
+
+/**
+ * Per-CPU stack of free objects sitting in front of a cache.
+ * Counters are kept per CPU so the fast path never shares a line.
+ */
+struct kmem_magazine {
+	spin_lock_t lock;
+	unsigned int count;
+	uint64_t allocs;
+	uint64_t hits;
+	uint64_t frees;
+	void * objects[KMEM_MAGAZINE_SIZE];
+};
+
+struct kmem_slab;
+
+typedef struct kmem_cache {
+	const char * name;
+	size_t size;
+	int kmalloc;                 /* backed by a klmalloc bin instead of private slabs */
+	int registered;
+	struct kmem_cache * next;
+	struct kmem_slab * partial;  /* private slabs with free objects */
+	size_t slabs;
+	struct kmem_magazine magazines[KMEM_CPUS];
+} kmem_cache_t;
+
+/**
+ * Declare a cache for objects of a fixed type, eg.
+ *   static kmem_cache_t node_cache = KMEM_CACHE("node_t", sizeof(node_t));
+ * Objects fit in a single page slab; anything they are freed with,
+ * including plain free(), finds its way back to the cache.
+ */
+#define KMEM_CACHE(_name, _size) { .name = _name, .size = (((_size) + 15) & ~15UL) }
+
+void * kmem_cache_alloc(kmem_cache_t * cache);
+void * kmem_cache_zalloc(kmem_cache_t * cache);
+void kmem_cache_free(kmem_cache_t * cache, void * ptr);
+kmem_cache_t * kmem_cache_list(void);
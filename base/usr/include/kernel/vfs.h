@@ -4,6 +4,7 @@
 #include <stddef.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <bits/dirent.h>
 
 #define PATH_SEPARATOR '/'
@@ -21,6 +22,7 @@
 #define FS_SYMLINK     0x20
 #define FS_MOUNTPOINT  0x40
 #define FS_SOCKET      0x80
+#define FS_PAGECACHE   0x100 /* Contents may be kept in the page cache */
 
 #define _IFMT       0170000 /* type of file */
 #define     _IFDIR  0040000 /* directory */
@@ -35,6 +37,8 @@ struct fs_node;
 
 typedef ssize_t (*read_type_t) (struct fs_node *,  off_t, size_t, uint8_t *);
 typedef ssize_t (*write_type_t) (struct fs_node *, off_t, size_t, uint8_t *);
+typedef ssize_t (*readv_type_t) (struct fs_node *, off_t, const struct iovec *, int);
+typedef ssize_t (*writev_type_t) (struct fs_node *, off_t, const struct iovec *, int);
 typedef void (*open_type_t) (struct fs_node *, unsigned int flags);
 typedef void (*close_type_t) (struct fs_node *);
 typedef int (*readdir_type_t) (struct fs_node *, unsigned long, struct dirent *);
@@ -52,6 +56,7 @@ typedef int (*selectwait_type_t) (struct fs_node *, void * process);
 typedef int (*chown_type_t) (struct fs_node *, uid_t, gid_t);
 typedef int (*truncate_type_t) (struct fs_node *, size_t size);
 typedef int (*rename_type_t) (struct fs_node *, struct fs_node *, const char *, struct fs_node *, const char *);
+typedef struct fs_node *(*iget_type_t) (struct fs_node *, const char *name, uint64_t inode);
 
 typedef struct fs_node {
 	struct fs_node * mount;      /* Root fs_node_t entry of mountpoint. */
@@ -94,6 +99,9 @@ typedef struct fs_node {
 	selectwait_type_t selectwait;
 	chown_type_t chown;
 	rename_type_t rename;
+	iget_type_t iget;       /* Directories: rebuild a node for an entry's inode, for the dentry cache */
+	readv_type_t readv;     /* Optional; read_fs is called per segment if unset */
+	writev_type_t writev;   /* Optional; write_fs is called per segment if unset */
 } fs_node_t;
 
 struct vfs_entry {
@@ -104,6 +112,7 @@ struct vfs_entry {
 };
 
 extern fs_node_t *fs_root;
+extern struct kmem_cache fs_node_cache;
 extern int pty_create(void *size, fs_node_t ** fs_master, fs_node_t ** fs_slave);
 
 #include <bits/access.h>
@@ -111,6 +120,8 @@ extern int pty_create(void *size, fs_node_t ** fs_master, fs_node_t ** fs_slave)
 int has_permission(fs_node_t *node, int permission_bit);
 ssize_t read_fs(fs_node_t *node,  off_t offset, size_t size, uint8_t *buffer);
 ssize_t write_fs(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer);
+ssize_t readv_fs(fs_node_t *node, off_t offset, const struct iovec *iov, int iovcnt);
+ssize_t writev_fs(fs_node_t *node, off_t offset, const struct iovec *iov, int iovcnt);
 void open_fs(fs_node_t *node, unsigned int flags);
 void close_fs(fs_node_t *node);
 int readdir_fs(fs_node_t *node, unsigned long index, struct dirent *dent);
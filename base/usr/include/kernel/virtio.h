@@ -0,0 +1,142 @@
+#pragma once
+/**
+ * @file kernel/virtio.h
+ * @brief Virtio PCI transport and split virtqueues.
+ *
+ * Shared by the virtio drivers: finds a device's configuration
+ * structures through its PCI capabilities, negotiates features,
+ * and manages split virtqueues with optional event index
+ * notification suppression.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/types.h>
+#include <kernel/spinlock.h>
+
+#define VIRTIO_STATUS_ACKNOWLEDGE  1
+#define VIRTIO_STATUS_DRIVER       2
+#define VIRTIO_STATUS_DRIVER_OK    4
+#define VIRTIO_STATUS_FEATURES_OK  8
+#define VIRTIO_STATUS_FAILED       128
+
+/* Feature bits common to all device types */
+#define VIRTIO_F_RING_EVENT_IDX    (1ULL << 29)
+#define VIRTIO_F_VERSION_1         (1ULL << 32)
+
+#define VIRTQ_DESC_F_NEXT          1
+#define VIRTQ_DESC_F_WRITE         2
+
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+#define VIRTQ_USED_F_NO_NOTIFY     1
+
+struct virtq_desc {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags;
+	uint16_t next;
+};
+
+/* Followed by used_event when VIRTIO_F_RING_EVENT_IDX is negotiated */
+struct virtq_avail {
+	uint16_t flags;
+	uint16_t idx;
+	uint16_t ring[];
+};
+
+struct virtq_used_elem {
+	uint32_t id;
+	uint32_t len;
+};
+
+/* Followed by avail_event when VIRTIO_F_RING_EVENT_IDX is negotiated */
+struct virtq_used {
+	uint16_t flags;
+	uint16_t idx;
+	struct virtq_used_elem ring[];
+};
+
+struct virtio_pci_common_cfg {
+	volatile uint32_t dev_feature_select;
+	volatile uint32_t dev_feature;
+	volatile uint32_t guest_feature_select;
+	volatile uint32_t guest_feature;
+	volatile uint16_t msix;
+	volatile uint16_t queues;
+	volatile uint8_t  device_status;
+	volatile uint8_t  config_generation;
+
+	volatile uint16_t queue_select;
+	volatile uint16_t queue_size;
+	volatile uint16_t queue_msix_vector;
+	volatile uint16_t queue_enable;
+	volatile uint16_t queue_notify_off;
+	volatile uint64_t queue_desc;
+	volatile uint64_t queue_avail;
+	volatile uint64_t queue_used;
+};
+
+struct virtio_device {
+	uint32_t pci;
+	struct virtio_pci_common_cfg * common;
+	volatile uint8_t * isr;
+	volatile void * device_cfg;
+	uintptr_t notify_base;
+	uint32_t notify_mul;
+	uint64_t features;
+};
+
+/**
+ * A physically contiguous piece of a request. Drivers describe a
+ * request as its device-readable pieces followed by its
+ * device-writable pieces.
+ */
+struct virtq_sg {
+	uintptr_t phys;
+	uint32_t len;
+};
+
+struct virtq {
+	struct virtio_device * dev;
+	uint16_t index;
+	uint16_t size;
+
+	volatile struct virtq_desc * desc;
+	volatile struct virtq_avail * avail;
+	volatile struct virtq_used * used;
+	volatile uint16_t * used_event;
+	volatile uint16_t * avail_event;
+	volatile uint16_t * notify;
+
+	uint16_t free_head;
+	uint16_t num_free;
+	uint16_t avail_idx;   /* our copy of avail->idx */
+	uint16_t kicked_idx;  /* avail->idx when the device was last notified */
+	uint16_t last_used;
+	int event_idx;
+
+	void ** cookies;
+	spin_lock_t lock;
+};
+
+/**
+ * DMA-able memory for rings and small driver-owned buffers.
+ * @p size is rounded up to whole pages, which are physically contiguous.
+ */
+extern void * virtio_alloc(size_t size, uintptr_t * phys);
+
+extern int virtio_pci_init(struct virtio_device * dev, uint32_t pcidev);
+extern void virtio_reset(struct virtio_device * dev);
+extern int virtio_negotiate(struct virtio_device * dev, uint64_t wanted);
+extern void virtio_driver_ok(struct virtio_device * dev);
+extern uint8_t virtio_isr(struct virtio_device * dev);
+
+extern struct virtq * virtq_create(struct virtio_device * dev, uint16_t index, uint16_t max_size);
+
+/* The rest are called with the queue's lock held, or otherwise serialized. */
+extern int virtq_add(struct virtq * q, struct virtq_sg * sg, int out, int in, void * cookie);
+extern int virtq_kick_prepare(struct virtq * q);
+extern void virtq_notify(struct virtq * q);
+extern void virtq_kick(struct virtq * q);
+extern void * virtq_get(struct virtq * q, uint32_t * len);
+extern void virtq_disable_cb(struct virtq * q);
+extern int virtq_enable_cb(struct virtq * q);
@@ -2,6 +2,8 @@
 
 #include <_cheader.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <bits/timespec.h>
 
 _Begin_C_Header
 
@@ -12,6 +14,8 @@ typedef struct {
 	int volatile atomic_lock;
 	int volatile readers;
 	int writerPid;
+	int volatile seq;
+	int waiters;
 } pthread_rwlock_t;
 
 extern int pthread_create(pthread_t * thread, pthread_attr_t * attr, void *(*start_routine)(void *), void * arg);
@@ -36,6 +40,20 @@ extern int pthread_mutex_unlock(pthread_mutex_t *mutex);
 extern int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr);
 extern int pthread_mutex_destroy(pthread_mutex_t *mutex);
 
+typedef struct {
+	int volatile seq;
+} pthread_cond_t;
+typedef int pthread_condattr_t;
+
+#define PTHREAD_COND_INITIALIZER { 0 }
+
+extern int pthread_cond_init(pthread_cond_t * cond, const pthread_condattr_t * attr);
+extern int pthread_cond_destroy(pthread_cond_t * cond);
+extern int pthread_cond_wait(pthread_cond_t * cond, pthread_mutex_t * mutex);
+extern int pthread_cond_timedwait(pthread_cond_t * cond, pthread_mutex_t * mutex, const struct timespec * abstime);
+extern int pthread_cond_signal(pthread_cond_t * cond);
+extern int pthread_cond_broadcast(pthread_cond_t * cond);
+
 extern int pthread_attr_init(pthread_attr_t *attr);
 extern int pthread_attr_destroy(pthread_attr_t *attr);
 
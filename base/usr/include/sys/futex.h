@@ -0,0 +1,18 @@
+#pragma once
+
+#include <_cheader.h>
+#include <sys/types.h>
+#include <bits/timespec.h>
+
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+
+_Begin_C_Header
+
+#ifndef __kernel__
+
+extern int futex(volatile int * address, int op, int value, const struct timespec * timeout);
+
+#endif
+
+_End_C_Header
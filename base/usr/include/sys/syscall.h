@@ -103,3 +103,9 @@
 #define SYS_NPROC 100
 #define SYS_SETTLSBASE 101
 #define SYS_GETSID 102
+#define SYS_FUTEX 103
+#define SYS_SPLICE 104
+#define SYS_READV 105
+#define SYS_WRITEV 106
+#define SYS_PREADV 107
+#define SYS_PWRITEV 108
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <_cheader.h>
+#include <sys/types.h>
+
+_Begin_C_Header
+
+/* Most segments one call to readv/writev will take */
+#define IOV_MAX 1024
+
+struct iovec {                    /* Scatter/gather array items */
+	void  *iov_base;              /* Starting address */
+	size_t iov_len;               /* Number of bytes to transfer */
+};
+
+#ifndef __kernel__
+
+extern ssize_t readv(int fd, const struct iovec * iov, int iovcnt);
+extern ssize_t writev(int fd, const struct iovec * iov, int iovcnt);
+extern ssize_t preadv(int fd, const struct iovec * iov, int iovcnt, off_t offset);
+extern ssize_t pwritev(int fd, const struct iovec * iov, int iovcnt, off_t offset);
+
+#endif
+
+_End_C_Header
@@ -24,6 +24,7 @@
 #include <kernel/ptrace.h>
 #include <kernel/ksym.h>
 #include <kernel/syscall.h>
+#include <kernel/mman.h>
 #include <kernel/elf.h>
 #include <bits/errno.h>
 
@@ -161,15 +162,43 @@ void relative_time(unsigned long seconds, unsigned long subseconds, unsigned lon
 }
 
 #define TIMER_IRQ 27
-static void set_tick(void) {
-	asm volatile (
-		"mrs x0, CNTFRQ_EL0\n"
-		"mov x1, 100\n" // without this, one second
-		"udiv x0, x0, x1\n"
-		"msr CNTV_TVAL_EL0, x0\n"
-		"mov x0, 1\n"
-		"msr CNTV_CTL_EL0, x0\n"
-		:::"x0","x1");
+
+/**
+ * @brief Arm this core's virtual timer to fire in @p usecs microseconds.
+ *
+ * A value of zero disarms it. Called by the scheduler every time this
+ * core switches tasks, so an idle core only takes timer interrupts
+ * when it has a sleeper to wake.
+ */
+void arch_timer_arm(unsigned long usecs) {
+	if (!usecs) {
+		asm volatile ("msr CNTV_CTL_EL0, %0" :: "r"(0UL));
+		return;
+	}
+
+	uint64_t freq;
+	asm volatile ("mrs %0, CNTFRQ_EL0" : "=r"(freq));
+	uint64_t count = usecs * freq / 1000000;
+	if (!count) count = 1;
+	if (count > 0x7FFFFFFF) count = 0x7FFFFFFF;
+	asm volatile ("msr CNTV_TVAL_EL0, %0" :: "r"(count));
+	asm volatile ("msr CNTV_CTL_EL0, %0" :: "r"(1UL));
+}
+
+/**
+ * @brief Name of the preemption timer mode, for procfs.
+ */
+const char * arch_timer_mode(void) {
+	return "generic timer one-shot";
+}
+
+/**
+ * @brief Granularity of the preemption timer, in nanoseconds.
+ */
+unsigned long arch_timer_resolution(void) {
+	uint64_t freq;
+	asm volatile ("mrs %0, CNTFRQ_EL0" : "=r"(freq));
+	return freq >= 1000000000 ? 1 : 1000000000 / freq;
 }
 
 void timer_start(void) {
@@ -177,7 +206,7 @@ void timer_start(void) {
 	asm volatile ("msr DAIFSet, #0b1111");
 
 	/* Enable the local timer */
-	set_tick();
+	arch_timer_arm(SCHED_TIME_SLICE);
 
 	/* This is global, we only need to do this once... */
 	gic_regs[0] = 1;
@@ -349,6 +378,12 @@ void aarch64_sync_enter(struct regs * r) {
 		goto _resume_user;
 	}
 
+	/* Data or instruction abort from a lazily-filled file mapping? */
+	if (((esr >> 26) == 0x24 || (esr >> 26) == 0x20) && far < 0x800000000000) {
+		int write = (esr >> 26) == 0x24 && (esr & (1 << 6));
+		if (generic_page_fault(far, write ? MMU_PTR_WRITE : 0)) goto _resume_user;
+	}
+
 	if (far < 0x800000000000 && far > 0x700000000000) {
 		if (map_more_stack(far & 0xFFFFffffFFFFf000)) goto _resume_user;
 	}
@@ -393,8 +428,9 @@ int aarch64_interrupt_dispatch(int from_wfi) {
 
 	switch (irq) {
 		case TIMER_IRQ:
+			this_core->timer_interrupts++;
 			update_clock();
-			set_tick();
+			sched_arm_timer();
 			EOI(iar);
 			if (from_wfi) break;
 			switch_task(1);
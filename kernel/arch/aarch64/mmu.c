@@ -15,11 +15,12 @@
 #include <kernel/spinlock.h>
 #include <kernel/misc.h>
 #include <kernel/mmu.h>
+#include <kernel/mman.h>
+#include <kernel/buddy.h>
 
 static volatile uint32_t *frames;
 static size_t nframes;
 static size_t total_memory = 0;
-static size_t unavailable_memory = 0;
 static uint64_t ram_starts_at = 0;
 
 uintptr_t aarch64_kernel_phys_base = 0;
@@ -79,108 +80,49 @@ union PML kbase_pmls[65][512] _pagemap;
 
 void mmu_frame_set(uintptr_t frame_addr) {
 	if (frame_addr < ram_starts_at) return;
-	frame_addr -= ram_starts_at;
-	if (frame_addr < nframes * PAGE_SIZE) {
-		uint64_t frame  = frame_addr >> 12;
-		uint64_t index  = INDEX_FROM_BIT(frame);
-		uint32_t offset = OFFSET_FROM_BIT(frame);
-		__sync_or_and_fetch(&frames[index], ((uint32_t)1 << offset));
-		asm ("isb" ::: "memory");
+	if (frame_addr - ram_starts_at < nframes * PAGE_SIZE) {
+		buddy_reserve(frame_addr >> PAGE_SHIFT);
 	}
 }
 
-static uintptr_t lowest_available = 0;
-
 void mmu_frame_clear(uintptr_t frame_addr) {
 	if (frame_addr < ram_starts_at) return;
-	frame_addr -= ram_starts_at;
-	if (frame_addr < nframes * PAGE_SIZE) {
-		uint64_t frame  = frame_addr >> PAGE_SHIFT;
-		uint64_t index  = INDEX_FROM_BIT(frame);
-		uint32_t offset = OFFSET_FROM_BIT(frame);
-		__sync_and_and_fetch(&frames[index], ~((uint32_t)1 << offset));
-		asm ("isb" ::: "memory");
-		if (frame < lowest_available) lowest_available = frame;
+	if (frame_addr - ram_starts_at < nframes * PAGE_SIZE) {
+		buddy_release(frame_addr >> PAGE_SHIFT);
 	}
 }
 
 int mmu_frame_test(uintptr_t frame_addr) {
 	if (frame_addr < ram_starts_at) return 1;
-	frame_addr -= ram_starts_at;
-	if (!(frame_addr < nframes * PAGE_SIZE)) return 1;
-	uint64_t frame  = frame_addr >> PAGE_SHIFT;
-	uint64_t index  = INDEX_FROM_BIT(frame);
-	uint32_t offset = OFFSET_FROM_BIT(frame);
-	asm ("" ::: "memory");
-	return !!(frames[index] & ((uint32_t)1 << offset));
+	if (!(frame_addr - ram_starts_at < nframes * PAGE_SIZE)) return 1;
+	return buddy_test(frame_addr >> PAGE_SHIFT);
 }
 
+
 static spin_lock_t frame_alloc_lock = { 0 };
 static spin_lock_t kheap_lock = { 0 };
 static spin_lock_t mmio_space_lock = { 0 };
 static spin_lock_t module_space_lock = { 0 };
 
 void mmu_frame_release(uintptr_t frame_addr) {
-	spin_lock(frame_alloc_lock);
 	mmu_frame_clear(frame_addr);
-	spin_unlock(frame_alloc_lock);
 }
 
-uintptr_t mmu_first_n_frames(int n) {
-	for (uint64_t i = 0; i < nframes * PAGE_SIZE; i += PAGE_SIZE) {
-		int bad = 0;
-		for (int j = 0; j < n; ++j) {
-			if (mmu_frame_test(i + ram_starts_at + PAGE_SIZE * j)) {
-				bad = j + 1;
-			}
-		}
-		if (!bad) {
-			return (i + ram_starts_at) / PAGE_SIZE;
-		}
-	}
-
+static void mmu_out_of_memory(int n) {
 	arch_fatal_prepare();
-	dprintf("Failed to allocate %d contiguous frames.\n", n);
-	arch_dump_traceback();
-	arch_fatal();
-	return (uintptr_t)-1;
-}
-
-uintptr_t mmu_first_frame(void) {
-	uintptr_t i, j;
-	for (i = INDEX_FROM_BIT(lowest_available); i < INDEX_FROM_BIT(nframes); ++i) {
-		if (frames[i] != (uint32_t)-1) {
-			for (j = 0; j < (sizeof(uint32_t)*8); ++j) {
-				uint32_t testFrame = (uint32_t)1 << j;
-				if (!(frames[i] & testFrame)) {
-					uintptr_t out = (i << 5) + j;
-					lowest_available = out + 1;
-					return out + (ram_starts_at >> 12);
-				}
-			}
-		}
-	}
-
-	if (lowest_available != 0) {
-		lowest_available = 0;
-		return mmu_first_frame();
+	if (n == 1) {
+		dprintf("Out of memory.\n");
+	} else {
+		dprintf("Failed to allocate %d contiguous frames.\n", n);
 	}
-
-	arch_fatal_prepare();
-	dprintf("Out of memory.\n");
 	arch_dump_traceback();
 	arch_fatal();
-	return (uintptr_t)-1;
 }
 
 void mmu_frame_allocate(union PML * page, unsigned int flags) {
 	/* If page is not set... */
 	if (page->bits.page == 0) {
-		spin_lock(frame_alloc_lock);
-		uintptr_t index = mmu_first_frame();
-		mmu_frame_set(index << PAGE_SHIFT);
-		page->bits.page     = index;
-		spin_unlock(frame_alloc_lock);
+		page->bits.page = mmu_allocate_a_frame();
 	}
 
 	page->bits.table_page = 1;
@@ -318,8 +260,7 @@ union PML * mmu_get_page(uintptr_t virtAddr, int flags) {
 	spin_lock(frame_alloc_lock);
 	if (!root[pml4_entry].bits.present) {
 		if (!(flags & MMU_GET_MAKE)) goto _noentry;
-		uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-		mmu_frame_set(newPage);
+		uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 		/* zero it */
 		memset(mmu_map_from_physical(newPage), 0, PAGE_SIZE);
 		root[pml4_entry].raw = (newPage) | PTE_VALID | PTE_TABLE | PTE_AF;
@@ -331,8 +272,7 @@ union PML * mmu_get_page(uintptr_t virtAddr, int flags) {
 	spin_lock(frame_alloc_lock);
 	if (!pdp[pdp_entry].bits.present) {
 		if (!(flags & MMU_GET_MAKE)) goto _noentry;
-		uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-		mmu_frame_set(newPage);
+		uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 		/* zero it */
 		memset(mmu_map_from_physical(newPage), 0, PAGE_SIZE);
 		pdp[pdp_entry].raw = (newPage) | PTE_VALID | PTE_TABLE | PTE_AF;
@@ -349,8 +289,7 @@ union PML * mmu_get_page(uintptr_t virtAddr, int flags) {
 	spin_lock(frame_alloc_lock);
 	if (!pd[pd_entry].bits.present) {
 		if (!(flags & MMU_GET_MAKE)) goto _noentry;
-		uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-		mmu_frame_set(newPage);
+		uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 		/* zero it */
 		memset(mmu_map_from_physical(newPage), 0, PAGE_SIZE);
 		pd[pd_entry].raw = (newPage) | PTE_VALID | PTE_TABLE | PTE_AF;
@@ -371,6 +310,24 @@ _noentry:
 	return NULL;
 }
 
+/**
+ * @brief Large user pages are not supported here yet.
+ *
+ * Callers always get the 4KiB fallback, so nothing below ever has to
+ * deal with a user block descriptor.
+ */
+int mmu_map_large(uintptr_t virtAddr, uintptr_t physAddr, unsigned int flags) {
+	return 0;
+}
+
+int mmu_allocate_large(uintptr_t virtAddr, unsigned int flags) {
+	return 0;
+}
+
+int mmu_unmap_large(uintptr_t virtAddr) {
+	return 0;
+}
+
 void mmu_flush(char* page_out) {
 	asm volatile ("dmb sy\nisb" ::: "memory");
 	for (uintptr_t x = (uintptr_t)page_out; x < (uintptr_t)page_out + PAGE_SIZE; x += 64) {
@@ -387,8 +344,7 @@ static int copy_page_maybe(union PML * pt_in, union PML * pt_out, size_t l, uint
 	/* TODO cow bits */
 
 	char * page_in = mmu_map_from_physical((uintptr_t)pt_in[l].bits.page << PAGE_SHIFT);
-	uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-	mmu_frame_set(newPage);
+	uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 	char * page_out = mmu_map_from_physical(newPage);
 	memcpy(page_out,page_in,PAGE_SIZE);
 	mmu_flush(page_out);
@@ -413,10 +369,7 @@ union PML * mmu_clone(union PML * from) {
 	if (!from) from = this_core->current_pml;
 
 	/* First get a page for ourselves. */
-	spin_lock(frame_alloc_lock);
-	uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-	mmu_frame_set(newPage);
-	spin_unlock(frame_alloc_lock);
+	uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 	union PML * pml4_out = mmu_map_from_physical(newPage);
 
 	/* Zero bottom half */
@@ -429,10 +382,7 @@ union PML * mmu_clone(union PML * from) {
 	for (size_t i = 0; i < 256; ++i) {
 		if (from[i].bits.present) {
 			union PML * pdp_in = mmu_map_from_physical((uintptr_t)from[i].bits.page << PAGE_SHIFT);
-			spin_lock(frame_alloc_lock);
-			uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-			mmu_frame_set(newPage);
-			spin_unlock(frame_alloc_lock);
+			uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 			union PML * pdp_out = mmu_map_from_physical(newPage);
 			memset(pdp_out, 0, 512 * sizeof(union PML));
 			pml4_out[i].raw = (newPage) | PTE_VALID | PTE_TABLE | PTE_AF;
@@ -441,10 +391,7 @@ union PML * mmu_clone(union PML * from) {
 			for (size_t j = 0; j < 512; ++j) {
 				if (pdp_in[j].bits.present) {
 					union PML * pd_in = mmu_map_from_physical((uintptr_t)pdp_in[j].bits.page << PAGE_SHIFT);
-					spin_lock(frame_alloc_lock);
-					uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-					mmu_frame_set(newPage);
-					spin_unlock(frame_alloc_lock);
+					uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 					union PML * pd_out = mmu_map_from_physical(newPage);
 					memset(pd_out, 0, 512 * sizeof(union PML));
 					pdp_out[j].raw = (newPage) | PTE_VALID | PTE_TABLE | PTE_AF;
@@ -453,10 +400,7 @@ union PML * mmu_clone(union PML * from) {
 					for (size_t k = 0; k < 512; ++k) {
 						if (pd_in[k].bits.present) {
 							union PML * pt_in = mmu_map_from_physical((uintptr_t)pd_in[k].bits.page << PAGE_SHIFT);
-							spin_lock(frame_alloc_lock);
-							uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-							mmu_frame_set(newPage);
-							spin_unlock(frame_alloc_lock);
+							uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 							union PML * pt_out = mmu_map_from_physical(newPage);
 							memset(pt_out, 0, 512 * sizeof(union PML));
 							pd_out[k].raw = (newPage) | PTE_VALID | PTE_TABLE | PTE_AF;
@@ -485,20 +429,14 @@ union PML * mmu_clone(union PML * from) {
 }
 
 uintptr_t mmu_allocate_a_frame(void) {
-	spin_lock(frame_alloc_lock);
-	uintptr_t index = mmu_first_frame();
-	mmu_frame_set(index << PAGE_SHIFT);
-	spin_unlock(frame_alloc_lock);
+	uintptr_t index = buddy_alloc(0);
+	if (index == BUDDY_NONE) mmu_out_of_memory(1);
 	return index;
 }
 
 uintptr_t mmu_allocate_n_frames(int n) {
-	spin_lock(frame_alloc_lock);
-	uintptr_t index = mmu_first_n_frames(n);
-	for (int i = 0; i < n; ++i) {
-		mmu_frame_set((index+i) << PAGE_SHIFT);
-	}
-	spin_unlock(frame_alloc_lock);
+	uintptr_t index = buddy_alloc_frames(n);
+	if (index == BUDDY_NONE) mmu_out_of_memory(n);
 	return index;
 }
 
@@ -574,17 +512,7 @@ size_t mmu_total_memory(void) {
 }
 
 size_t mmu_used_memory(void) {
-	size_t ret = 0;
-	size_t i, j;
-	for (i = 0; i < INDEX_FROM_BIT(nframes); ++i) {
-		for (j = 0; j < 32; ++j) {
-			uint32_t testFrame = (uint32_t)0x1 << j;
-			if (frames[i] & testFrame) {
-				ret++;
-			}
-		}
-	}
-	return ret * 4 - unavailable_memory;
+	return total_memory - buddy_free_frames() * 4;
 }
 
 void mmu_free(union PML * from) {
@@ -780,6 +708,39 @@ void * sbrk(size_t bytes) {
 	return out;
 }
 
+void mmu_heap_release(uintptr_t start, size_t size) {
+	int released = 0;
+	spin_lock(kheap_lock);
+	/* Unmap first and only free the frames once the broadcast invalidation
+	 * has completed, so no core can still write to them through the heap. */
+	for (uintptr_t p = start; p < start + size; p += PAGE_SIZE) {
+		union PML * page = mmu_get_page(p, 0);
+		if (!page || !page->bits.present) continue;
+		page->bits.present = 0;
+		released = 1;
+	}
+	if (released) {
+		asm volatile ("dsb ishst\ntlbi vmalle1is\ndsb ish\nisb" ::: "memory");
+		for (uintptr_t p = start; p < start + size; p += PAGE_SIZE) {
+			union PML * page = mmu_get_page(p, 0);
+			if (!page || page->bits.present || !page->bits.page) continue;
+			mmu_frame_release((uintptr_t)page->bits.page << PAGE_SHIFT);
+			page->raw = 0;
+		}
+	}
+	spin_unlock(kheap_lock);
+}
+
+void mmu_heap_commit(uintptr_t start, size_t size) {
+	spin_lock(kheap_lock);
+	for (uintptr_t p = start; p < start + size; p += PAGE_SIZE) {
+		union PML * page = mmu_get_page(p, MMU_GET_MAKE);
+		if (page->bits.present) continue;
+		mmu_frame_allocate(page, MMU_FLAG_WRITABLE | MMU_FLAG_KERNEL);
+	}
+	spin_unlock(kheap_lock);
+}
+
 static uintptr_t mmio_base_address = MMIO_BASE_START;
 void * mmu_map_mmio_region(uintptr_t physical_address, size_t size) {
 	if (size & PAGE_LOW_MASK) {
@@ -823,6 +784,16 @@ void * mmu_map_module(size_t size) {
 void mmu_unmap_module(uintptr_t start_address, size_t size) {
 }
 
+/* Without COW there is no safe way to share a frame with a user mapping;
+ * callers fall back to copying. */
+int mmu_map_shared_frame(union PML * page, unsigned int flags, uintptr_t physAddr) {
+	return 1;
+}
+
+void mmu_release_shared_frame(uintptr_t physAddr) {
+	mmu_frame_release(physAddr);
+}
+
 int mmu_copy_on_write(uintptr_t address) {
 	
 	return 1;
@@ -846,11 +817,11 @@ int mmu_validate_user_pointer(const void * addr, size_t size, int flags) {
 	for (uintptr_t page = page_base; page <= page_end; ++page) {
 		if ((page & 0xffff800000000) != 0 && (page & 0xffff800000000) != 0xffff800000000) return 0;
 		union PML * page_entry = mmu_get_page_other(this_core->current_process->thread.page_directory->directory, page << 12);
-		if (!page_entry) {
-			return 0;
-		}
-		if (!page_entry->bits.present) {
-			return 0;
+		if (!page_entry || !page_entry->bits.present) {
+			/* Fill in file mappings now rather than faulting on them later. */
+			if (!generic_page_fault(page << 12, flags & MMU_PTR_WRITE)) return 0;
+			page_entry = mmu_get_page_other(this_core->current_process->thread.page_directory->directory, page << 12);
+			if (!page_entry || !page_entry->bits.present) return 0;
 		}
 		if (!(page_entry->bits.ap & 1)) {
 			return 0;
@@ -874,9 +845,6 @@ void mmu_init(uintptr_t memaddr, size_t memsize, uintptr_t firstFreePage, uintpt
 	/* Convert from bytes to kibibytes */
 	total_memory = memsize / 1024;
 
-	/* We don't currently support gaps in this setup. */
-	unavailable_memory = 0;
-
 	/* MAIR setup? */
 	uint64_t mair = (0x000000000044ff00);
 	asm volatile ("msr MAIR_EL1,%0" :: "r"(mair));
@@ -942,6 +910,7 @@ void mmu_init(uintptr_t memaddr, size_t memsize, uintptr_t firstFreePage, uintpt
 	/* Just assume everything is in use. */
 	frames = (void*)((uintptr_t)KERNEL_HEAP_START);
 	memset((void*)frames, 0x00, bytesOfFrames);
+	buddy_attach(frames, memaddr >> PAGE_SHIFT, nframes);
 
 	/* Set frames as in use... */
 	for (uintptr_t i = memaddr; i < firstFreePage + bytesOfFrames; i+= PAGE_SIZE) {
@@ -953,9 +922,10 @@ void mmu_init(uintptr_t memaddr, size_t memsize, uintptr_t firstFreePage, uintpt
 		mmu_frame_set(aarch64_kernel_phys_base + i);
 	}
 
+	buddy_initialize();
+
 	heapStart = (char*)KERNEL_HEAP_START + bytesOfFrames;
 
-	lowest_available = (firstFreePage + bytesOfFrames) - memaddr;
 	module_base_address = endOfRamDisk + MODULE_BASE_START;
 	if (module_base_address & PAGE_LOW_MASK) {
 		module_base_address = (module_base_address & PAGE_SIZE_MASK) + PAGE_SIZE;
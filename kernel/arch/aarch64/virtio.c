@@ -2,6 +2,10 @@
  * @file  kernel/arch/aarch64/virtio.c
  * @brief Rudimentary, hacky implementations of virtio input devices.
  *
+ * The transport and event queues are handled by kernel/misc/virtio.c;
+ * what's left here is assigning BARs, which nothing else does for us
+ * on this platform, and translating events.
+ *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
@@ -17,6 +21,7 @@
 #include <kernel/video.h>
 #include <kernel/mouse.h>
 #include <kernel/time.h>
+#include <kernel/virtio.h>
 
 #include <kernel/arch/aarch64/gic.h>
 
@@ -41,60 +46,6 @@ struct virtio_device_cfg {
 	} data;
 };
 
-struct virtio_common_cfg {
-	volatile uint32_t dev_feature_select;
-	volatile uint32_t dev_feature;
-	volatile uint32_t guest_feature_select;
-	volatile uint32_t guest_feature;
-	volatile uint16_t msix;
-	volatile uint16_t queues;
-	volatile uint8_t  device_status;
-	volatile uint8_t  config_generation;
-
-	volatile uint16_t queue_select;
-	volatile uint16_t queue_size;
-	volatile uint16_t queue_msix_vector;
-	volatile uint16_t queue_enable;
-	volatile uint16_t queue_notify_off;
-	/* queue stuff */
-
-	volatile uint64_t queue_desc;
-	volatile uint64_t queue_avail;
-	volatile uint64_t queue_used;
-};
-
-struct virtio_buffer {
-	uint64_t  addr;
-	uint32_t  length;
-	uint16_t  flags;
-	uint16_t  next;
-};
-
-struct virtio_avail {
-	uint16_t flags;
-	volatile uint16_t index;
-	uint16_t ring[64];
-	uint16_t int_index;
-};
-
-struct virtio_ring {
-	uint32_t index;
-	uint32_t length;
-};
-
-struct virtio_used {
-	uint16_t flags;
-	volatile uint16_t index;
-	struct virtio_ring ring[64];
-	uint16_t int_index;
-};
-
-struct virtio_queue {
-	struct virtio_buffer buffers[64];
-	struct virtio_avail  available;
-	struct virtio_used   used;
-};
-
 struct virtio_input_event {
 	uint16_t type;
 	uint16_t code;
@@ -130,30 +81,77 @@ static void try_to_get_boot_processor(void) {
 	}
 }
 
-static void virtio_tablet_thread(void * data) {
-	try_to_get_boot_processor();
+/**
+ * Put the device's registers at @p bar, find its configuration through
+ * the virtio transport, and fill its event queue with buffers.
+ */
+static struct virtq * virtio_input_setup(struct virtio_device * dev, uint32_t device, uintptr_t bar, const char * name,
+		int (*responder)(process_t *, int, void *), volatile struct virtio_input_event ** buffers, uintptr_t * buffers_phys) {
+	pci_write_field(device, PCI_BAR4, 4, bar|8);
+	asm volatile ("isb" ::: "memory");
 
-	uint32_t device = (uintptr_t)data;
-	uintptr_t t = 0x12000000;
-	pci_write_field(device, PCI_BAR4, 4, t|8);
-	pci_write_field(device, PCI_COMMAND, 2, 4|2|1);
+	if (virtio_pci_init(dev, device) || !dev->device_cfg) {
+		dprintf("%s: no virtio configuration found\n", name);
+		return NULL;
+	}
 
-	struct virtio_device_cfg * cfg = (void*)((char*)mmu_map_mmio_region(t + 0x2000, 0x1000));
-	cfg->select = 1; /* ask for name */
-	cfg->subsel = 0;
-	asm volatile ("isb" ::: "memory");
+	virtio_reset(dev);
+	if (virtio_negotiate(dev, 0)) {
+		dprintf("%s: feature negotiation failed\n", name);
+		return NULL;
+	}
 
-	void * irq_region = mmu_map_mmio_region(t + 0x1000, 0x1000);
 	int irq;
-	gic_map_pci_interrupt("virtio-tablet", device, &irq, virtio_tablet_responder, irq_region);
+	gic_map_pci_interrupt(name, device, &irq, responder, (void*)dev->isr);
+
+	struct virtq * queue = virtq_create(dev, 0, 64);
+	if (!queue) return NULL;
+
+	*buffers = virtio_alloc(queue->size * sizeof(struct virtio_input_event), buffers_phys);
+	for (int i = 0; i < queue->size; ++i) {
+		struct virtq_sg sg = { *buffers_phys + i * sizeof(struct virtio_input_event), sizeof(struct virtio_input_event) };
+		virtq_add(queue, &sg, 0, 1, (void*)&(*buffers)[i]);
+	}
+
+	virtio_driver_ok(dev);
+	virtq_kick(queue);
+	return queue;
+}
+
+/**
+ * Wait for the next event and hand its buffer straight back to the device.
+ */
+static struct virtio_input_event virtio_input_next(struct virtq * queue, volatile struct virtio_input_event * buffers, uintptr_t buffers_phys) {
+	volatile struct virtio_input_event * slot;
+	while (!(slot = virtq_get(queue, NULL))) {
+		virtq_kick(queue);
+		switch_task(0);
+	}
+
+	struct virtio_input_event evt = *slot;
+	struct virtq_sg sg = { buffers_phys + (slot - buffers) * sizeof(struct virtio_input_event), sizeof(struct virtio_input_event) };
+	virtq_add(queue, &sg, 0, 1, (void*)slot);
+	return evt;
+}
+
+static void virtio_tablet_thread(void * data) {
+	try_to_get_boot_processor();
+
+	uint32_t device = (uintptr_t)data;
+	struct virtio_device dev;
+	volatile struct virtio_input_event * buffers;
+	uintptr_t buffers_phys;
+	struct virtq * queue = virtio_input_setup(&dev, device, 0x12000000, "virtio-tablet", virtio_tablet_responder, &buffers, &buffers_phys);
+	if (!queue) task_exit(1);
 
 	/* figure out range values */
+	volatile struct virtio_device_cfg * cfg = dev.device_cfg;
 	cfg->select = 0x12;
 	cfg->subsel = 0; /* X */
 	asm volatile ("isb" ::: "memory");
 	uint32_t max_x = cfg->data.tablet_data.max;
 	cfg->select = 0x12;
-	cfg->subsel = 1; /* X */
+	cfg->subsel = 1; /* Y */
 	asm volatile ("isb" ::: "memory");
 	uint32_t max_y = cfg->data.tablet_data.max;
 
@@ -161,47 +159,6 @@ static void virtio_tablet_thread(void * data) {
 	cfg->subsel = 0;
 	asm volatile ("isb" ::: "memory");
 
-	struct virtio_common_cfg * common = (void*)((char*)mmu_map_mmio_region(t, 0x1000));
-
-	common->device_status = 0;
-	asm volatile ("isb" ::: "memory");
-
-	int queue_size = common->queue_size;
-
-	/* get us one page */
-	size_t queue_phys = mmu_allocate_a_frame() << 12;
-	struct virtio_queue * queue = mmu_map_mmio_region(queue_phys, 4096);
-	asm volatile ("isb" ::: "memory");
-	memset(queue, 0, sizeof(struct virtio_queue));
-	asm volatile ("isb" ::: "memory");
-
-	common->queue_select = 0;
-	common->queue_desc = queue_phys;
-	common->queue_avail = (queue_phys) + offsetof(struct virtio_queue, available);
-	common->queue_used = (queue_phys) + offsetof(struct virtio_queue, used);
-	asm volatile ("isb" ::: "memory");
-
-	size_t buffers_base = mmu_allocate_a_frame() << 12;
-	volatile struct virtio_input_event * buffers = mmu_map_mmio_region(buffers_base, 4096);
-	mmu_get_page((uintptr_t)buffers, 0)->bits.attrindx = 2;
-
-	for (int i = 0; i < queue_size; ++i) {
-		queue->buffers[i].addr = buffers_base + i * sizeof(struct virtio_input_event);
-		queue->buffers[i].length = sizeof(struct virtio_input_event);
-		queue->buffers[i].flags = 2;
-		queue->buffers[i].next = 0;
-		queue->available.ring[i] = i;
-	}
-
-	queue->available.index = 0;
-	asm volatile ("isb" ::: "memory");
-	common->queue_enable = 1;
-	asm volatile ("isb" ::: "memory");
-	common->device_status = 4;
-	asm volatile ("isb" ::: "memory");
-
-	uint16_t index = 0;
-
 	uint32_t x = 0;
 	uint32_t y = 0;
 	int button_left = 0;
@@ -210,72 +167,50 @@ static void virtio_tablet_thread(void * data) {
 	int button_scroll_down = 0;
 	int button_scroll_up = 0;
 
-	queue->available.index = queue_size-1;
-
 	while (1) {
-		/* Inform the device we have room */
-		while (queue->used.index == index) {
-			switch_task(0);
-			asm volatile ("dc ivac, %0\ndsb sy" :: "r"(&queue->used) : "memory");
-		}
-
-		uint16_t them = queue->used.index;
-
-		for (; index != them; index++) {
-			asm volatile ("dc ivac, %0\ndsb sy" :: "r"(&buffers[index%queue_size]) : "memory");
-			struct virtio_input_event evt = buffers[index%queue_size];
-			while (evt.type == 0xFF) {
-				evt = buffers[index%queue_size];
-				dprintf("virtio-tablet: bad packet %d (them=%d)\n", index, them);
+		struct virtio_input_event evt = virtio_input_next(queue, buffers, buffers_phys);
+		if (evt.type == 3) {
+			/* movement */
+			if (evt.code == 0) {
+				x = (evt.value * lfb_resolution_x) / max_x;
+			} else if (evt.code == 1) {
+				y = (evt.value * lfb_resolution_y) / max_y;
+			}
+		} else if (evt.type == 1) {
+			/* button */
+			if (evt.code == 0x110) {
+				button_left = evt.value;
+			} else if (evt.code == 0x111) {
+				button_right = evt.value;
+			} else if (evt.code == 0x112) {
+				button_middle = evt.value;
+			} else if (evt.code == 0x150) {
+				button_scroll_down = 1;
+			} else if (evt.code == 0x151) {
+				button_scroll_up = 1;
 			}
-			buffers[index%queue_size].type = 0xFF;
-			asm volatile ("isb\ndsb sy" :: "r"(buffers) : "memory");
-			if (evt.type == 3) {
-				/* movement */
-				if (evt.code == 0) {
-					x = (evt.value * lfb_resolution_x) / max_x;
-				} else if (evt.code == 1) {
-					y = (evt.value * lfb_resolution_y) / max_y;
-				}
-			} else if (evt.type == 1) {
-				/* button */
-				if (evt.code == 0x110) {
-					button_left = evt.value;
-				} else if (evt.code == 0x111) {
-					button_right = evt.value;
-				} else if (evt.code == 0x112) {
-					button_middle = evt.value;
-				} else if (evt.code == 0x150) {
-					button_scroll_down = 1;
-				} else if (evt.code == 0x151) {
-					button_scroll_up = 1;
-				}
 
-			} else if (evt.type == 0) {
+		} else if (evt.type == 0) {
 #define DISCARD_POINT 32
-				mouse_device_packet_t packet;
-				packet.magic = MOUSE_MAGIC;
-				packet.x_difference = x;
-				packet.y_difference = y;
-				packet.buttons =
-					(button_left ? LEFT_CLICK : 0) |
-					(button_right ? RIGHT_CLICK : 0) |
-					(button_middle ? MIDDLE_CLICK : 0) |
-					(button_scroll_down ? MOUSE_SCROLL_DOWN : 0) |
-					(button_scroll_up ? MOUSE_SCROLL_UP : 0);
-
-				button_scroll_down = 0;
-				button_scroll_up = 0;
-
-				mouse_device_packet_t bitbucket;
-				while (pipe_size(vmmouse_pipe) > (int)(DISCARD_POINT * sizeof(packet))) {
-					read_fs(vmmouse_pipe, 0, sizeof(packet), (uint8_t *)&bitbucket);
-				}
-				write_fs(vmmouse_pipe, 0, sizeof(packet), (uint8_t *)&packet);
+			mouse_device_packet_t packet;
+			packet.magic = MOUSE_MAGIC;
+			packet.x_difference = x;
+			packet.y_difference = y;
+			packet.buttons =
+				(button_left ? LEFT_CLICK : 0) |
+				(button_right ? RIGHT_CLICK : 0) |
+				(button_middle ? MIDDLE_CLICK : 0) |
+				(button_scroll_down ? MOUSE_SCROLL_DOWN : 0) |
+				(button_scroll_up ? MOUSE_SCROLL_UP : 0);
+
+			button_scroll_down = 0;
+			button_scroll_up = 0;
+
+			mouse_device_packet_t bitbucket;
+			while (pipe_size(vmmouse_pipe) > (int)(DISCARD_POINT * sizeof(packet))) {
+				read_fs(vmmouse_pipe, 0, sizeof(packet), (uint8_t *)&bitbucket);
 			}
-			//buffers[index%queue_size].type = 0xFF;
-			asm volatile ("isb" ::: "memory");
-			queue->available.index++;
+			write_fs(vmmouse_pipe, 0, sizeof(packet), (uint8_t *)&packet);
 		}
 	}
 }
@@ -297,109 +232,37 @@ static void virtio_keyboard_thread(void * data) {
 	try_to_get_boot_processor();
 
 	uint32_t device = (uintptr_t)data;
-	uintptr_t t = 0x12100000;
-	pci_write_field(device, PCI_BAR4, 4, t|8);
-	pci_write_field(device, PCI_COMMAND, 2, 4|2|1);
-	struct virtio_device_cfg * cfg = (void*)((char*)mmu_map_mmio_region(t + 0x2000, 0x1000));
-	cfg->select = 1; /* ask for name */
-	cfg->subsel = 0;
-	asm volatile ("isb" ::: "memory");
-
-	void * irq_region = mmu_map_mmio_region(t + 0x1000, 0x1000);
-	int irq;
-	gic_map_pci_interrupt("virtio-keyboard", device, &irq, virtio_keyboard_responder, irq_region);
-
-	cfg->select = 0;
-	cfg->subsel = 0;
-	asm volatile ("isb" ::: "memory");
-
-	struct virtio_common_cfg * common = (void*)((char*)mmu_map_mmio_region(t, 0x1000));
-
-	common->device_status = 0;
-	asm volatile ("isb" ::: "memory");
-
-	int queue_size = common->queue_size;
-
-	/* get us one page */
-	size_t queue_phys = mmu_allocate_a_frame() << 12;
-	struct virtio_queue * queue = mmu_map_mmio_region(queue_phys, 4096);
-	asm volatile ("isb" ::: "memory");
-	memset(queue, 0, sizeof(struct virtio_queue));
-	asm volatile ("isb" ::: "memory");
-
-	common->queue_select = 0;
-	common->queue_desc = queue_phys;
-	common->queue_avail = (queue_phys) + offsetof(struct virtio_queue, available);
-	common->queue_used = (queue_phys) + offsetof(struct virtio_queue, used);
-	asm volatile ("isb" ::: "memory");
-
-	size_t buffers_base = mmu_allocate_a_frame() << 12;
-	volatile struct virtio_input_event * buffers = mmu_map_mmio_region(buffers_base, 4096);
-	mmu_get_page((uintptr_t)buffers, 0)->bits.attrindx = 2;
-
-	for (int i = 0; i < queue_size; ++i) {
-		queue->buffers[i].addr = buffers_base + i * sizeof(struct virtio_input_event);
-		queue->buffers[i].length = sizeof(struct virtio_input_event);
-		queue->buffers[i].flags = 2;
-		queue->buffers[i].next = 0;
-		queue->available.ring[i] = i;
-	}
-
-	queue->available.index = 0;
-	asm volatile ("isb" ::: "memory");
-	common->queue_enable = 1;
-	asm volatile ("isb" ::: "memory");
-	common->device_status = 4;
-	asm volatile ("isb" ::: "memory");
-
-	uint16_t index = 0;
-
-	queue->available.index = queue_size-1;
+	struct virtio_device dev;
+	volatile struct virtio_input_event * buffers;
+	uintptr_t buffers_phys;
+	struct virtq * queue = virtio_input_setup(&dev, device, 0x12100000, "virtio-keyboard", virtio_keyboard_responder, &buffers, &buffers_phys);
+	if (!queue) task_exit(1);
 
 	while (1) {
-		/* Inform the device we have room */
-		while (queue->used.index == index) {
-			switch_task(0);
-			asm volatile ("dc ivac, %0\ndsb sy" :: "r"(&queue->used) : "memory");
-		}
-
-		uint16_t them = queue->used.index;
-
-		for (; index != them; index++) {
-			asm volatile ("dc ivac, %0\ndsb sy" :: "r"(&buffers[index%queue_size]) : "memory");
-			struct virtio_input_event evt = buffers[index%queue_size];
-			while (evt.type == 0xFF) {
-				evt = buffers[index%queue_size];
-				dprintf("virtio-tablet: bad packet %d (them=%d)\n", index, them);
-			}
-			buffers[index%queue_size].type = 0xFF;
-			asm volatile ("isb\ndsb sy" :: "r"(buffers) : "memory");
-			if (evt.type == 1) {
-				/* need to back-convert which is a pain in the ass */
-				if (evt.code < 0x49) {
-					uint8_t scancode = evt.code;
-					if (evt.value == 0) {
-						scancode |= 0x80;
-					}
-					uint8_t bitbucket;
-					while (pipe_size(keyboard_pipe) > (int)(DISCARD_POINT)) {
-						read_fs(keyboard_pipe, 0, 1, (uint8_t *)&bitbucket);
-					}
-					write_fs(keyboard_pipe, 0, 1, (uint8_t *)&scancode);
-				} else if (ext_key_map[evt.code]) {
-					uint8_t data[] = {0xE0, 0};
-					data[1] = ext_key_map[evt.code] | ((evt.value == 0) ? 0x80 : 0);
-					uint8_t bitbucket;
-					while (pipe_size(keyboard_pipe) > (int)(DISCARD_POINT)) {
-						read_fs(keyboard_pipe, 0, 1, (uint8_t *)&bitbucket);
-					}
-					write_fs(keyboard_pipe, 0, 2, (uint8_t *)data);
-				} else {
-					dprintf("virtio: unmapped keycode %d\n", evt.code);
+		struct virtio_input_event evt = virtio_input_next(queue, buffers, buffers_phys);
+		if (evt.type == 1) {
+			/* need to back-convert which is a pain in the ass */
+			if (evt.code < 0x49) {
+				uint8_t scancode = evt.code;
+				if (evt.value == 0) {
+					scancode |= 0x80;
+				}
+				uint8_t bitbucket;
+				while (pipe_size(keyboard_pipe) > (int)(DISCARD_POINT)) {
+					read_fs(keyboard_pipe, 0, 1, (uint8_t *)&bitbucket);
+				}
+				write_fs(keyboard_pipe, 0, 1, (uint8_t *)&scancode);
+			} else if (ext_key_map[evt.code]) {
+				uint8_t data[] = {0xE0, 0};
+				data[1] = ext_key_map[evt.code] | ((evt.value == 0) ? 0x80 : 0);
+				uint8_t bitbucket;
+				while (pipe_size(keyboard_pipe) > (int)(DISCARD_POINT)) {
+					read_fs(keyboard_pipe, 0, 1, (uint8_t *)&bitbucket);
 				}
+				write_fs(keyboard_pipe, 0, 2, (uint8_t *)data);
+			} else {
+				dprintf("virtio: unmapped keycode %d\n", evt.code);
 			}
-			asm volatile ("isb" ::: "memory");
-			queue->available.index++;
 		}
 	}
 }
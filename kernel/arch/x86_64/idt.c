@@ -25,6 +25,7 @@
 #include <kernel/ksym.h>
 #include <kernel/mmu.h>
 #include <kernel/syscall.h>
+#include <kernel/mman.h>
 
 #include <sys/time.h>
 #include <sys/utsname.h>
@@ -110,7 +111,7 @@ void idt_install(void) {
 	idt_set_gate(47, _irq15, 0x08, 0x8E, 0);
 
 	idt_set_gate(123, _isr123, 0x08, 0x8E, 0); /* Clock interrupt for other processors */
-	idt_set_gate(124, _isr124, 0x08, 0x8E, 0); /* Bad TLB shootdown. */
+	idt_set_gate(124, _isr124, 0x08, 0x8E, 0); /* TLB shootdown. */
 	idt_set_gate(125, _isr125, 0x08, 0x8E, 0); /* Halts everyone. */
 	idt_set_gate(126, _isr126, 0x08, 0x8E, 0); /* Does nothing, used to exit wait-for-interrupt sleep. */
 
@@ -492,6 +493,11 @@ static void _page_fault(struct regs * r) {
 		return;
 	}
 
+	if (!(r->err_code & 1) && faulting_address < 0x800000000000 && this_core->current_process) {
+		/* Not present; maybe a file mapping that hasn't been filled in yet. */
+		if (generic_page_fault(faulting_address, (r->err_code & 2) ? MMU_PTR_WRITE : 0)) return;
+	}
+
 	if ((r->err_code & 3) == 3) {
 		/* This is probably a COW page? */
 		extern int mmu_copy_on_write(uintptr_t address);
@@ -517,15 +523,19 @@ static void _page_fault(struct regs * r) {
 /**
  * @brief AP-local timer signal.
  *
- * Update clocks and switch task gracefully.
+ * Update clocks and switch task gracefully. The timer is one-shot,
+ * so if we interrupted the kernel and are not switching away, arm
+ * it again for the rest of this slice or the next sleeper.
  *
  * @param r Interrupt register context
  * @return Register state after resume from task task switch.
  */
 static void _local_timer(struct regs * r) {
 	extern void arch_update_clock(void);
+	this_core->timer_interrupts++;
 	arch_update_clock();
 	if (r->cs != 0x08) switch_task(1);
+	else sched_arm_timer();
 }
 
 /**
@@ -614,9 +624,9 @@ void isr_handler_inner(struct regs * r) {
 
 		/* Local interrupts that make it here. */
 		case 123: _local_timer(r); return;
+		case 124: arch_tlb_shootdown_handler(); return;
 
 		/* Other interrupts that don't make it here:
-		 *   124: TLB shootdown, we just reload CR3 in the handler.
 		 *   125: Fatal signal, jumps straight to a cli/hlt loop, though I think this just yields an NMI instead?
 		 *   126: Quiet wakeup, do we even use this anymore?
 		 */
@@ -624,7 +634,7 @@ void isr_handler_inner(struct regs * r) {
 		default: panic("Unexpected interrupt",r,0);
 	}
 
-	if (this_core->current_process == this_core->kernel_idle_task && process_queue && process_queue->head) {
+	if (this_core->current_process == this_core->kernel_idle_task && ready_process_available()) {
 		/* If this is kidle and we got here, instead of finishing the interrupt
 		 * we can just switch task and there will probably be something else
 		 * to run that was awoken by the interrupt. */
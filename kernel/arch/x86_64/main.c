@@ -46,6 +46,7 @@ extern void serial_initialize(void);
 extern void fbterm_initialize(void);
 extern void pci_remap(void);
 extern void mmu_init(size_t memsize, uintptr_t firstFreePage);
+extern void mmu_pcid_initialize(void);
 
 struct multiboot * mboot_struct = NULL;
 int mboot_is_2 = 0;
@@ -511,6 +512,7 @@ static int kmain_rel(struct multiboot * mboot, uint32_t mboot_mag, void* esp, ui
 
 	/* With the MMU initialized, set up things required for the scheduler. */
 	pat_initialize();
+	mmu_pcid_initialize();
 	symbols_install(base);
 	gdt_install();
 	idt_install();
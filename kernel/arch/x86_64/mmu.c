@@ -17,17 +17,22 @@
 #include <kernel/spinlock.h>
 #include <kernel/misc.h>
 #include <kernel/mmu.h>
+#include <kernel/mman.h>
+#include <kernel/buddy.h>
 #include <kernel/arch/x86_64/pml.h>
 
-extern void arch_tlb_shootdown(uintptr_t);
+extern void arch_tlb_shootdown(union PML * pml, uintptr_t start, uintptr_t end);
+extern void arch_tlb_shootdown_mark(uint64_t * marks);
+extern int arch_tlb_shootdown_complete(const uint64_t * marks);
+static void mmu_pcid_mark_stale(union PML * pml);
+static void mmu_invalidate_range(union PML * pml, uintptr_t start, uintptr_t end);
 
 /**
- * bitmap page allocator for 4KiB pages
+ * bitmap of 4KiB pages in use, managed by the buddy allocator
  */
 static volatile uint32_t *frames;
 static size_t nframes;
 static size_t total_memory = 0;
-static size_t unavailable_memory = 0;
 static uint8_t * mem_refcounts = NULL;
 
 #define PAGE_SHIFT     12
@@ -35,12 +40,17 @@ static uint8_t * mem_refcounts = NULL;
 #define PAGE_SIZE_MASK 0xFFFFffffFFFFf000UL
 #define PAGE_LOW_MASK  0x0000000000000FFFUL
 
-#define LARGE_PAGE_SIZE 0x200000UL
+#define LARGE_PAGE_SIZE  0x200000UL
+#define LARGE_PAGE_ORDER 9
 
 #define   USER_PML_ACCESS 0x07
 #define KERNEL_PML_ACCESS 0x03
 #define    LARGE_PAGE_BIT 0x80
 
+/* In a 2MiB entry, the low bit of the frame number is the PAT bit */
+#define LARGE_PAGE_PAT 0x1
+#define LARGE_PAGE_FRAME(e) ((e).bits.page & ~(uint64_t)ENTRY_MASK)
+
 #define PDP_MASK 0x3fffffffUL
 #define  PD_MASK 0x1fffffUL
 #define  PT_MASK PAGE_LOW_MASK
@@ -49,45 +59,45 @@ static uint8_t * mem_refcounts = NULL;
 #define PHYS_MASK 0x7fffffffffUL
 #define CANONICAL_MASK 0xFFFFffffFFFFUL
 
+/* Addresses from here up are mapped identically in every directory. */
+#define KERNEL_HALF_START 0xFFFF800000000000UL
+
+#define CR3_NOFLUSH (1UL << 63)
+#define PCID_SLOTS  (sizeof(this_core->pcid_owner) / sizeof(*this_core->pcid_owner))
+
+/* Past this many pages, flushing the whole TLB is cheaper than INVLPG on each one. */
+#define TLB_FLUSH_CEILING 32
+
 #define INDEX_FROM_BIT(b)  ((b) >> 5)
 #define OFFSET_FROM_BIT(b) ((b) & 0x1F)
 
 /**
  * @brief Mark a physical page frame as in use.
  *
- * Sets the bitmap allocator bit for a frame.
+ * Sets the bitmap allocator bit for a frame, pulling it out of
+ * the free lists if it was free.
  *
  * @param frame_addr Address of the frame (not index!)
  */
 void mmu_frame_set(uintptr_t frame_addr) {
 	/* If the frame is within bounds... */
 	if (frame_addr < nframes * PAGE_SIZE) {
-		uint64_t frame  = frame_addr >> 12;
-		uint64_t index  = INDEX_FROM_BIT(frame);
-		uint32_t offset = OFFSET_FROM_BIT(frame);
-		frames[index]  |= ((uint32_t)1 << offset);
-		asm ("" ::: "memory");
+		buddy_reserve(frame_addr >> PAGE_SHIFT);
 	}
 }
 
-static uintptr_t lowest_available = 0;
-
 /**
  * @brief Mark a physical page frame as available.
  *
- * Clears the bitmap allocator bit for a frame.
+ * Clears the bitmap allocator bit for a frame and returns it
+ * to this core's free frame cache.
  *
  * @param frame_addr Address of the frame (not index!)
  */
 void mmu_frame_clear(uintptr_t frame_addr) {
 	/* If the frame is within bounds... */
 	if (frame_addr < nframes * PAGE_SIZE) {
-		uint64_t frame  = frame_addr >> PAGE_SHIFT;
-		uint64_t index  = INDEX_FROM_BIT(frame);
-		uint32_t offset = OFFSET_FROM_BIT(frame);
-		frames[index]  &= ~((uint32_t)1 << offset);
-		asm ("" ::: "memory");
-		if (frame < lowest_available) lowest_available = frame;
+		buddy_release(frame_addr >> PAGE_SHIFT);
 	}
 }
 
@@ -99,11 +109,7 @@ void mmu_frame_clear(uintptr_t frame_addr) {
  */
 int mmu_frame_test(uintptr_t frame_addr) {
 	if (!(frame_addr < nframes * PAGE_SIZE)) return 1;
-	uint64_t frame  = frame_addr >> PAGE_SHIFT;
-	uint64_t index  = INDEX_FROM_BIT(frame);
-	uint32_t offset = OFFSET_FROM_BIT(frame);
-	asm ("" ::: "memory");
-	return !!(frames[index] & ((uint32_t)1 << offset));
+	return buddy_test(frame_addr >> PAGE_SHIFT);
 }
 
 static spin_lock_t frame_alloc_lock = { 0 };
@@ -112,59 +118,21 @@ static spin_lock_t mmio_space_lock = { 0 };
 static spin_lock_t module_space_lock = { 0 };
 
 void mmu_frame_release(uintptr_t frame_addr) {
-	spin_lock(frame_alloc_lock);
 	mmu_frame_clear(frame_addr);
-	spin_unlock(frame_alloc_lock);
 }
 
 /**
- * @brief Find the first range of @p n contiguous frames.
- *
- * If a large enough region could not be found, results are fatal.
+ * @brief Out of physical memory; results are fatal.
  */
-uintptr_t mmu_first_n_frames(int n) {
-	for (uint64_t i = 0; i < nframes * PAGE_SIZE; i += PAGE_SIZE) {
-		int bad = 0;
-		for (int j = 0; j < n; ++j) {
-			if (mmu_frame_test(i + PAGE_SIZE * j)) {
-				bad = j + 1;
-			}
-		}
-		if (!bad) {
-			return i / PAGE_SIZE;
-		}
-	}
-
+static void mmu_out_of_memory(int n) {
 	arch_fatal_prepare();
-	dprintf("Failed to allocate %d contiguous frames.\n", n);
-	arch_dump_traceback();
-	arch_fatal();
-	return (uintptr_t)-1;
-}
-
-/**
- * @brief Find the first available frame from the bitmap.
- */
-uintptr_t mmu_first_frame(void) {
-	uintptr_t i, j;
-	for (i = INDEX_FROM_BIT(lowest_available); i < INDEX_FROM_BIT(nframes); ++i) {
-		if (frames[i] != (uint32_t)-1) {
-			for (j = 0; j < (sizeof(uint32_t)*8); ++j) {
-				uint32_t testFrame = (uint32_t)1 << j;
-				if (!(frames[i] & testFrame)) {
-					uintptr_t out = (i << 5) + j;
-					lowest_available = out + 1;
-					return out;
-				}
-			}
-		}
+	if (n == 1) {
+		dprintf("Out of memory.\n");
+	} else {
+		dprintf("Failed to allocate %d contiguous frames.\n", n);
 	}
-
-	arch_fatal_prepare();
-	dprintf("Out of memory.\n");
 	arch_dump_traceback();
 	arch_fatal();
-	return (uintptr_t)-1;
 }
 
 /**
@@ -175,11 +143,7 @@ uintptr_t mmu_first_frame(void) {
  */
 void mmu_frame_allocate(union PML * page, unsigned int flags) {
 	if (page->bits.page == 0) {
-		spin_lock(frame_alloc_lock);
-		uintptr_t index = mmu_first_frame();
-		mmu_frame_set(index << PAGE_SHIFT);
-		page->bits.page     = index;
-		spin_unlock(frame_alloc_lock);
+		page->bits.page = mmu_allocate_a_frame();
 	}
 	page->bits.size     = 0;
 	page->bits.present  = 1;
@@ -222,6 +186,82 @@ void * mmu_map_from_physical(uintptr_t frameaddress) {
 	return (void*)(frameaddress | HIGH_MAP_REGION);
 }
 
+/**
+ * @brief Find the page directory entry covering a virtual address.
+ *
+ * Walks @p root like @ref mmu_get_page, but stops one level early so
+ * the entry can be installed as (or checked for) a 2MiB page. Missing
+ * intermediary levels are allocated with user access bits if @p flags
+ * has @c MMU_GET_MAKE set; otherwise NULL is returned, as it is if the
+ * address is within a 1GiB page.
+ */
+static union PML * mmu_get_pd_entry(union PML * root, uintptr_t virtAddr, int flags) {
+	uintptr_t realBits = virtAddr & CANONICAL_MASK;
+	uintptr_t pageAddr = realBits >> PAGE_SHIFT;
+	unsigned int pml4_entry = (pageAddr >> 27) & ENTRY_MASK;
+	unsigned int pdp_entry  = (pageAddr >> 18) & ENTRY_MASK;
+	unsigned int pd_entry   = (pageAddr >> 9)  & ENTRY_MASK;
+
+	if (!root[pml4_entry].bits.present) {
+		if (!(flags & MMU_GET_MAKE)) return NULL;
+		uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
+		memset(mmu_map_from_physical(newPage), 0, PAGE_SIZE);
+		root[pml4_entry].raw = (newPage) | USER_PML_ACCESS;
+	}
+
+	union PML * pdp = mmu_map_from_physical((uintptr_t)root[pml4_entry].bits.page << PAGE_SHIFT);
+
+	if (!pdp[pdp_entry].bits.present) {
+		if (!(flags & MMU_GET_MAKE)) return NULL;
+		uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
+		memset(mmu_map_from_physical(newPage), 0, PAGE_SIZE);
+		pdp[pdp_entry].raw = (newPage) | USER_PML_ACCESS;
+	}
+
+	if (pdp[pdp_entry].bits.size) return NULL;
+
+	union PML * pd = mmu_map_from_physical((uintptr_t)pdp[pdp_entry].bits.page << PAGE_SHIFT);
+	return (union PML *)&pd[pd_entry];
+}
+
+/**
+ * @brief Break a 2MiB user page into a table of 4KiB pages.
+ *
+ * The new table maps the same frames with the same access and cache
+ * bits, so nothing changes for userspace. Anything that needs to deal
+ * with a single 4KiB piece of a large page - a partial unmap, marking
+ * it for COW, a ptrace poke - splits it first.
+ *
+ * @param root Top-level directory containing @p pde
+ * @param pde  Large page directory entry to replace
+ * @param virtAddr Any address within the large page
+ */
+static void mmu_split_large(union PML * root, union PML * pde, uintptr_t virtAddr) {
+	union PML large = *pde;
+	uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
+	union PML * pt = mmu_map_from_physical(newPage);
+
+	for (size_t i = 0; i < 512; ++i) {
+		pt[i].raw = 0;
+		pt[i].bits.page     = LARGE_PAGE_FRAME(large) + i;
+		pt[i].bits.present  = 1;
+		pt[i].bits.writable = large.bits.writable;
+		pt[i].bits.user     = large.bits.user;
+		pt[i].bits.nocache  = large.bits.nocache;
+		pt[i].bits.writethrough = large.bits.writethrough;
+		pt[i].bits.size     = (large.bits.page & LARGE_PAGE_PAT) ? 1 : 0;
+		pt[i].bits.nx       = large.bits.nx;
+	}
+
+	asm volatile ("" ::: "memory");
+	pde->raw = (newPage) | USER_PML_ACCESS;
+	asm volatile ("" ::: "memory");
+
+	/* One invlpg anywhere in the large page drops its translation */
+	virtAddr &= ~PD_MASK;
+	mmu_invalidate_range(root, virtAddr, virtAddr + PAGE_SIZE);
+}
+
 union PML * mmu_get_page_other(union PML * root, uintptr_t virtAddr) {
 	uintptr_t realBits = virtAddr & CANONICAL_MASK;
 	uintptr_t pageAddr = realBits >> PAGE_SHIFT;
@@ -252,7 +292,8 @@ union PML * mmu_get_page_other(union PML * root, uintptr_t virtAddr) {
 	}
 
 	if (pd[pd_entry].bits.size) {
-		return NULL;
+		if (virtAddr >= KERNEL_HALF_START) return NULL;
+		mmu_split_large(root, &pd[pd_entry], virtAddr);
 	}
 
 	union PML * pt = mmu_map_from_physical((uintptr_t)pd[pd_entry].bits.page << PAGE_SHIFT);
@@ -286,7 +327,7 @@ uintptr_t mmu_map_to_physical(union PML * root, uintptr_t virtAddr) {
 	union PML * pd = mmu_map_from_physical((uintptr_t)pdp[pdp_entry].bits.page << PAGE_SHIFT);
 
 	if (!pd[pd_entry].bits.present) return (uintptr_t)-3;
-	if (pd[pd_entry].bits.size) return ((uintptr_t)pd[pd_entry].bits.page << PAGE_SHIFT) | (virtAddr & PD_MASK);
+	if (pd[pd_entry].bits.size) return ((uintptr_t)LARGE_PAGE_FRAME(pd[pd_entry]) << PAGE_SHIFT) | (virtAddr & PD_MASK);
 
 	union PML * pt = mmu_map_from_physical((uintptr_t)pd[pd_entry].bits.page << PAGE_SHIFT);
 
@@ -302,7 +343,8 @@ uintptr_t mmu_map_to_physical(union PML * root, uintptr_t virtAddr) {
  * need to be allocated and @p flags has @c MMU_GET_MAKE set, they
  * will be allocated with the user access bits set. Otherwise,
  * NULL will be returned. If the requested virtual address is within
- * a large page, NULL will be returned.
+ * a large user page, that page is split into 4KiB pages first; within
+ * a large kernel page, NULL will be returned.
  *
  * @param virtAddr Canonical virtual address offset.
  * @param flags See @c MMU_GET_MAKE
@@ -322,10 +364,7 @@ union PML * mmu_get_page(uintptr_t virtAddr, int flags) {
 	/* Get the PML4 entry for this address */
 	if (!root[pml4_entry].bits.present) {
 		if (!(flags & MMU_GET_MAKE)) goto _noentry;
-		spin_lock(frame_alloc_lock);
-		uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-		mmu_frame_set(newPage);
-		spin_unlock(frame_alloc_lock);
+		uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 		/* zero it */
 		memset(mmu_map_from_physical(newPage), 0, PAGE_SIZE);
 		root[pml4_entry].raw = (newPage) | USER_PML_ACCESS;
@@ -335,10 +374,7 @@ union PML * mmu_get_page(uintptr_t virtAddr, int flags) {
 
 	if (!pdp[pdp_entry].bits.present) {
 		if (!(flags & MMU_GET_MAKE)) goto _noentry;
-		spin_lock(frame_alloc_lock);
-		uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-		mmu_frame_set(newPage);
-		spin_unlock(frame_alloc_lock);
+		uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 		/* zero it */
 		memset(mmu_map_from_physical(newPage), 0, PAGE_SIZE);
 		pdp[pdp_entry].raw = (newPage) | USER_PML_ACCESS;
@@ -353,18 +389,18 @@ union PML * mmu_get_page(uintptr_t virtAddr, int flags) {
 
 	if (!pd[pd_entry].bits.present) {
 		if (!(flags & MMU_GET_MAKE)) goto _noentry;
-		spin_lock(frame_alloc_lock);
-		uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-		mmu_frame_set(newPage);
-		spin_unlock(frame_alloc_lock);
+		uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 		/* zero it */
 		memset(mmu_map_from_physical(newPage), 0, PAGE_SIZE);
 		pd[pd_entry].raw = (newPage) | USER_PML_ACCESS;
 	}
 
 	if (pd[pd_entry].bits.size) {
-		printf("Warning: Tried to get page for a 2MiB page!\n");
-		return NULL;
+		if (virtAddr >= KERNEL_HALF_START) {
+			printf("Warning: Tried to get page for a 2MiB page!\n");
+			return NULL;
+		}
+		mmu_split_large(root, &pd[pd_entry], virtAddr);
 	}
 
 	union PML * pt = mmu_map_from_physical((uintptr_t)pd[pd_entry].bits.page << PAGE_SHIFT);
@@ -375,6 +411,98 @@ _noentry:
 	return NULL;
 }
 
+/**
+ * @brief Point a page directory entry at a 2MiB run of frames.
+ *
+ * @p borrowed marks frames that belong to someone else, eg. shared
+ * memory or a device, which must never go back to the buddy allocator.
+ */
+static void mmu_set_large(union PML * pde, uintptr_t frame, unsigned int flags, int borrowed) {
+	union PML large = { .raw = 0 };
+	large.bits.page     = frame;
+	large.bits.present  = 1;
+	large.bits.size     = 1;
+	large.bits.borrowed = borrowed ? 1 : 0;
+	large.bits.writable = (flags & MMU_FLAG_WRITABLE) ? 1 : 0;
+	large.bits.user     = 1;
+	large.bits.nocache  = (flags & MMU_FLAG_NOCACHE)  ? 1 : 0;
+	large.bits.writethrough  = (flags & MMU_FLAG_WRITETHROUGH)  ? 1 : 0;
+	large.bits.nx       = (flags & MMU_FLAG_NOEXECUTE) ? 1 : 0;
+	if (flags & MMU_FLAG_SPEC) large.bits.page |= LARGE_PAGE_PAT;
+	pde->raw = large.raw;
+}
+
+/**
+ * @brief Map a 2MiB run of physical memory into userspace with one entry.
+ *
+ * Both @p virtAddr and @p physAddr must be 2MiB-aligned, and nothing but
+ * another large page may be mapped in the 2MiB at @p virtAddr - not even an
+ * empty page table. The frames are not referenced or released by the MMU;
+ * shared memory and device mappings are expected to manage them, as they
+ * do for 4KiB pages. The entry is marked borrowed so that unmapping it or
+ * tearing down the directory never hands the frames to the buddy allocator,
+ * wherever in the address space it was put.
+ *
+ * @returns 1 if the large page was mapped, 0 if the caller should fall back
+ *          to mapping 4KiB pages.
+ */
+int mmu_map_large(uintptr_t virtAddr, uintptr_t physAddr, unsigned int flags) {
+	if ((virtAddr | physAddr) & PD_MASK) return 0;
+	if (virtAddr >= KERNEL_HALF_START || (flags & MMU_FLAG_KERNEL)) return 0;
+
+	union PML * pde = mmu_get_pd_entry(this_core->current_pml, virtAddr, MMU_GET_MAKE);
+	if (!pde || (pde->bits.present && !pde->bits.size)) return 0;
+
+	int replaced = pde->bits.present;
+	mmu_set_large(pde, physAddr >> PAGE_SHIFT, flags, 1);
+	if (replaced) mmu_invalidate_range(this_core->current_pml, virtAddr, virtAddr + PAGE_SIZE);
+	return 1;
+}
+
+/**
+ * @brief Back 2MiB of anonymous user memory with one zeroed large page.
+ *
+ * Takes a naturally-aligned block from the buddy allocator. Fails softly,
+ * so the caller can use 4KiB pages instead, if @p virtAddr is not aligned,
+ * if anything is already mapped in its 2MiB, or if physical memory is too
+ * fragmented for a free 2MiB block.
+ *
+ * @returns 1 if the large page was mapped, 0 otherwise.
+ */
+int mmu_allocate_large(uintptr_t virtAddr, unsigned int flags) {
+	if (virtAddr & PD_MASK) return 0;
+	if (virtAddr >= KERNEL_HALF_START || (flags & MMU_FLAG_KERNEL)) return 0;
+
+	union PML * pde = mmu_get_pd_entry(this_core->current_pml, virtAddr, MMU_GET_MAKE);
+	if (!pde || pde->bits.present) return 0;
+
+	uintptr_t frame = buddy_alloc(LARGE_PAGE_ORDER);
+	if (frame == BUDDY_NONE) return 0;
+
+	memset(mmu_map_from_physical(frame << PAGE_SHIFT), 0, LARGE_PAGE_SIZE);
+	mmu_set_large(pde, frame, flags, 0);
+	return 1;
+}
+
+/**
+ * @brief Remove a 2MiB mapping made by @ref mmu_map_large.
+ *
+ * Only the entry is cleared; the frames behind it belong to the caller.
+ *
+ * @returns 1 if there was a large page at @p virtAddr, 0 otherwise.
+ */
+int mmu_unmap_large(uintptr_t virtAddr) {
+	if (virtAddr & PD_MASK) return 0;
+	if (virtAddr >= KERNEL_HALF_START) return 0;
+
+	union PML * pde = mmu_get_pd_entry(this_core->current_pml, virtAddr, 0);
+	if (!pde || !pde->bits.present || !pde->bits.size) return 0;
+
+	pde->raw = 0;
+	mmu_invalidate_range(this_core->current_pml, virtAddr, virtAddr + PAGE_SIZE);
+	return 1;
+}
+
 /**
  * @brief Increment the reference count for a physical page of memory.
  *
@@ -433,6 +561,9 @@ uint8_t refcount_dec(uintptr_t frame) {
  * If a page was already read-only, its reference count will
  * be incremented for the new directory.
  *
+ * Pages made read-only here are not invalidated; @ref mmu_clone
+ * does that once for the whole source directory when it is done.
+ *
  * @param pt_in Existing page table.
  * @param pt_out New directory's page table.
  * @param l Index into both page tables for this page.
@@ -459,7 +590,6 @@ int copy_page_maybe(union PML * pt_in, union PML * pt_out, size_t l, uintptr_t a
 		pt_in[l].bits.cow_pending = 1;
 		pt_out[l].raw = pt_in[l].raw;
 		asm ("" ::: "memory");
-		mmu_invalidate(address);
 		spin_unlock(frame_alloc_lock);
 		return 0;
 	}
@@ -470,8 +600,7 @@ int copy_page_maybe(union PML * pt_in, union PML * pt_out, size_t l, uintptr_t a
 			pt_out[l].raw = pt_in[l].raw;
 		} else if (refcount_inc(pt_in[l].bits.page)) {
 			char * page_in = mmu_map_from_physical((uintptr_t)pt_in[l].bits.page << PAGE_SHIFT);
-			uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-			mmu_frame_set(newPage);
+			uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 			char * page_out = mmu_map_from_physical(newPage);
 			memcpy(page_out,page_in,PAGE_SIZE);
 			assert(mem_refcounts[newPage >> PAGE_SHIFT] == 0);
@@ -486,7 +615,6 @@ int copy_page_maybe(union PML * pt_in, union PML * pt_out, size_t l, uintptr_t a
 			pt_out[l].raw = pt_in[l].raw;
 		}
 		asm ("" ::: "memory");
-		mmu_invalidate(address);
 		spin_unlock(frame_alloc_lock);
 		return 0;
 	}
@@ -495,8 +623,7 @@ int copy_page_maybe(union PML * pt_in, union PML * pt_out, size_t l, uintptr_t a
 	if (refcount_inc(pt_in[l].bits.page)) {
 		/* There are too many references to fit in our refcount table, so just make a new page. */
 		char * page_in = mmu_map_from_physical((uintptr_t)pt_in[l].bits.page << PAGE_SHIFT);
-		uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-		mmu_frame_set(newPage);
+		uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 		char * page_out = mmu_map_from_physical(newPage);
 		memcpy(page_out,page_in,PAGE_SIZE);
 		assert(mem_refcounts[newPage >> PAGE_SHIFT] == 0);
@@ -552,6 +679,54 @@ int free_page_maybe(union PML * pt_in, size_t l, uintptr_t address) {
 	return 0;
 }
 
+/**
+ * @brief Map a frame owned by someone else into a user page, read-only.
+ *
+ * Used by the page cache to hand its frames to file mappings. The owner
+ * holds one reference; each mapping takes another, so the frame outlives
+ * whichever side lets go first. Writable mappings are marked COW so a
+ * write fault gives the process its own copy.
+ *
+ * @param page     Page table entry to fill in.
+ * @param flags    MMU_FLAG_* for the mapping.
+ * @param physAddr Physical address of the shared frame.
+ * @returns 0 on success, 1 if the frame has too many references to share.
+ */
+int mmu_map_shared_frame(union PML * page, unsigned int flags, uintptr_t physAddr) {
+	uintptr_t frame = physAddr >> PAGE_SHIFT;
+	spin_lock(frame_alloc_lock);
+	if (mem_refcounts[frame] == 0) {
+		mem_refcounts[frame] = 2;
+	} else if (refcount_inc(frame)) {
+		spin_unlock(frame_alloc_lock);
+		return 1;
+	}
+	page->raw = 0;
+	page->bits.page = frame;
+	page->bits.present = 1;
+	page->bits.user = 1;
+	page->bits.writable = 0;
+	page->bits.cow_pending = (flags & MMU_FLAG_WRITABLE) ? 1 : 0;
+	page->bits.nx = (flags & MMU_FLAG_NOEXECUTE) ? 1 : 0;
+	spin_unlock(frame_alloc_lock);
+	return 0;
+}
+
+/**
+ * @brief Drop the owner's reference to a frame from mmu_map_shared_frame.
+ *
+ * The frame is freed if it was never mapped, or once the last mapping
+ * referencing it is gone.
+ */
+void mmu_release_shared_frame(uintptr_t physAddr) {
+	uintptr_t frame = physAddr >> PAGE_SHIFT;
+	spin_lock(frame_alloc_lock);
+	if (mem_refcounts[frame] == 0 || refcount_dec(frame) == 0) {
+		mmu_frame_clear(physAddr);
+	}
+	spin_unlock(frame_alloc_lock);
+}
+
 /**
  * @brief Create a new address space with the same contents of an existing one.
  *
@@ -568,10 +743,7 @@ union PML * mmu_clone(union PML * from) {
 	if (!from) from = this_core->current_pml;
 
 	/* First get a page for ourselves. */
-	spin_lock(frame_alloc_lock);
-	uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-	mmu_frame_set(newPage);
-	spin_unlock(frame_alloc_lock);
+	uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 	union PML * pml4_out = mmu_map_from_physical(newPage);
 
 	/* Zero bottom half */
@@ -580,14 +752,14 @@ union PML * mmu_clone(union PML * from) {
 	/* Copy top half */
 	memcpy(&pml4_out[256], &from[256], 256 * sizeof(union PML));
 
+	/* Whether we made any of the source's pages read-only for COW */
+	int write_protected = 0;
+
 	/* Copy PDPs */
 	for (size_t i = 0; i < 256; ++i) {
 		if (from[i].bits.present) {
 			union PML * pdp_in = mmu_map_from_physical((uintptr_t)from[i].bits.page << PAGE_SHIFT);
-			spin_lock(frame_alloc_lock);
-			uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-			mmu_frame_set(newPage);
-			spin_unlock(frame_alloc_lock);
+			uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 			union PML * pdp_out = mmu_map_from_physical(newPage);
 			memset(pdp_out, 0, 512 * sizeof(union PML));
 			pml4_out[i].raw = (newPage) | USER_PML_ACCESS;
@@ -596,10 +768,7 @@ union PML * mmu_clone(union PML * from) {
 			for (size_t j = 0; j < 512; ++j) {
 				if (pdp_in[j].bits.present) {
 					union PML * pd_in = mmu_map_from_physical((uintptr_t)pdp_in[j].bits.page << PAGE_SHIFT);
-					spin_lock(frame_alloc_lock);
-					uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-					mmu_frame_set(newPage);
-					spin_unlock(frame_alloc_lock);
+					uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 					union PML * pd_out = mmu_map_from_physical(newPage);
 					memset(pd_out, 0, 512 * sizeof(union PML));
 					pdp_out[j].raw = (newPage) | USER_PML_ACCESS;
@@ -607,11 +776,19 @@ union PML * mmu_clone(union PML * from) {
 					/* Now copy the PTs */
 					for (size_t k = 0; k < 512; ++k) {
 						if (pd_in[k].bits.present) {
+							if (pd_in[k].bits.size) {
+								uintptr_t address = ((i << (9 * 3 + 12)) | (j << (9*2 + 12)) | (k << (9 + 12)));
+								if (address >= USER_DEVICE_MAP && address <= USER_SHM_HIGH) continue;
+								if (pd_in[k].bits.borrowed) {
+									/* Someone else's frames; the child just maps them too. */
+									pd_out[k].raw = pd_in[k].raw;
+									continue;
+								}
+								/* Private large pages are shared as COW 4KiB pages. */
+								mmu_split_large(from, &pd_in[k], address);
+							}
 							union PML * pt_in = mmu_map_from_physical((uintptr_t)pd_in[k].bits.page << PAGE_SHIFT);
-							spin_lock(frame_alloc_lock);
-							uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-							mmu_frame_set(newPage);
-							spin_unlock(frame_alloc_lock);
+							uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 							union PML * pt_out = mmu_map_from_physical(newPage);
 							memset(pt_out, 0, 512 * sizeof(union PML));
 							pd_out[k].raw = (newPage) | USER_PML_ACCESS;
@@ -622,6 +799,7 @@ union PML * mmu_clone(union PML * from) {
 								if (address >= USER_DEVICE_MAP && address <= USER_SHM_HIGH) continue;
 								if (pt_in[l].bits.present) {
 									if (pt_in[l].bits.user) {
+										if (pt_in[l].bits.writable) write_protected = 1;
 										copy_page_maybe(pt_in, pt_out, l, address);
 									} else {
 										/* If it's not a user page, just copy directly */
@@ -636,6 +814,9 @@ union PML * mmu_clone(union PML * from) {
 		}
 	}
 
+	/* One flush for the source directory, rather than one per page */
+	if (write_protected) mmu_invalidate_range(from, 0, KERNEL_HALF_START);
+
 	return pml4_out;
 }
 
@@ -645,10 +826,8 @@ union PML * mmu_clone(union PML * from) {
  * @returns a frame index, not an address
  */
 uintptr_t mmu_allocate_a_frame(void) {
-	spin_lock(frame_alloc_lock);
-	uintptr_t index = mmu_first_frame();
-	mmu_frame_set(index << PAGE_SHIFT);
-	spin_unlock(frame_alloc_lock);
+	uintptr_t index = buddy_alloc(0);
+	if (index == BUDDY_NONE) mmu_out_of_memory(1);
 	return index;
 }
 
@@ -658,12 +837,8 @@ uintptr_t mmu_allocate_a_frame(void) {
  * @returns a frame index, not an address
  */
 uintptr_t mmu_allocate_n_frames(int n) {
-	spin_lock(frame_alloc_lock);
-	uintptr_t index = mmu_first_n_frames(n);
-	for (int i = 0; i < n; ++i) {
-		mmu_frame_set((index+i) << PAGE_SHIFT);
-	}
-	spin_unlock(frame_alloc_lock);
+	uintptr_t index = buddy_alloc_frames(n);
+	if (index == BUDDY_NONE) mmu_out_of_memory(n);
 	return index;
 }
 
@@ -693,6 +868,11 @@ size_t mmu_count_user(union PML * from) {
 					union PML * pd_in = mmu_map_from_physical((uintptr_t)pdp_in[j].bits.page << PAGE_SHIFT);
 					for (size_t k = 0; k < 512; ++k) {
 						if (pd_in[k].bits.present) {
+							if (pd_in[k].bits.size) {
+								uintptr_t address = ((i << (9 * 3 + 12)) | (j << (9*2 + 12)) | (k << (9 + 12)));
+								if ((address < USER_DEVICE_MAP || address > USER_SHM_HIGH) && !pd_in[k].bits.borrowed) out += 512;
+								continue;
+							}
 							out++;
 							union PML * pt_in = mmu_map_from_physical((uintptr_t)pd_in[k].bits.page << PAGE_SHIFT);
 							for (size_t l = 0; l < 512; ++l) {
@@ -733,6 +913,11 @@ size_t mmu_count_shm(union PML * from) {
 					union PML * pd_in = mmu_map_from_physical((uintptr_t)pdp_in[j].bits.page << PAGE_SHIFT);
 					for (size_t k = 0; k < 512; ++k) {
 						if (pd_in[k].bits.present) {
+							if (pd_in[k].bits.size) {
+								uintptr_t address = ((i << (9 * 3 + 12)) | (j << (9*2 + 12)) | (k << (9 + 12)));
+								if (address >= USER_DEVICE_MAP && address <= USER_SHM_HIGH) out += 512;
+								continue;
+							}
 							union PML * pt_in = mmu_map_from_physical((uintptr_t)pd_in[k].bits.page << PAGE_SHIFT);
 							for (size_t l = 0; l < 512; ++l) {
 								/* Calculate final address to skip SHM */
@@ -765,23 +950,13 @@ size_t mmu_total_memory(void) {
 /**
  * @brief Return the amount of used memory.
  *
- * Calculates the number of pages currently marked as allocated.
- * Multiplies it by 4 because pages are 4KiB.
+ * Everything usable that the buddy allocator does not consider free.
+ * Multiplies by 4 because pages are 4KiB.
  *
  * @returns the amount of memory in use in KiB.
  */
 size_t mmu_used_memory(void) {
-	size_t ret = 0;
-	size_t i, j;
-	for (i = 0; i < INDEX_FROM_BIT(nframes); ++i) {
-		for (j = 0; j < 32; ++j) {
-			uint32_t testFrame = (uint32_t)0x1 << j;
-			if (frames[i] & testFrame) {
-				ret++;
-			}
-		}
-	}
-	return ret * 4 - unavailable_memory;
+	return total_memory - buddy_free_frames() * 4;
 }
 
 /**
@@ -798,6 +973,10 @@ void mmu_free(union PML * from) {
 		return;
 	}
 
+	/* If this page gets reused for another directory, cores that gave
+	 * this one a PCID must not think they still have its translations. */
+	mmu_pcid_mark_stale(from);
+
 	spin_lock(frame_alloc_lock);
 	for (size_t i = 0; i < 256; ++i) {
 		if (from[i].bits.present) {
@@ -807,6 +986,15 @@ void mmu_free(union PML * from) {
 					union PML * pd_in = mmu_map_from_physical((uintptr_t)pdp_in[j].bits.page << PAGE_SHIFT);
 					for (size_t k = 0; k < 512; ++k) {
 						if (pd_in[k].bits.present) {
+							if (pd_in[k].bits.size) {
+								/* Large pages outside of shared mappings are whole buddy blocks we allocated,
+								 * unless they were mapped over someone else's frames. */
+								uintptr_t address = ((i << (9 * 3 + 12)) | (j << (9*2 + 12)) | (k << (9 + 12)));
+								if ((address < USER_DEVICE_MAP || address > USER_SHM_HIGH) && !pd_in[k].bits.borrowed) {
+									buddy_free(LARGE_PAGE_FRAME(pd_in[k]), LARGE_PAGE_ORDER);
+								}
+								continue;
+							}
 							union PML * pt_in = mmu_map_from_physical((uintptr_t)pd_in[k].bits.page << PAGE_SHIFT);
 							for (size_t l = 0; l < 512; ++l) {
 								uintptr_t address = ((i << (9 * 3 + 12)) | (j << (9*2 + 12)) | (k << (9 + 12)) | (l << PAGE_SHIFT));
@@ -837,13 +1025,142 @@ union PML * mmu_get_kernel_directory(void) {
 	return (union PML*)&init_page_region[0];
 }
 
+static int mmu_pcid_enabled = 0; /**< Whether CR4.PCIDE is set on every core */
+static int mmu_has_invpcid = 0;  /**< Whether we can use INVPCID to flush all PCIDs */
+
+/**
+ * @brief Enable process-context identifiers on this core.
+ *
+ * With PCIDs, loading CR3 does not have to throw away the TLB entries
+ * of the directory we are switching away from, so a thread that comes
+ * back to a core soon after it left still finds its translations.
+ * The BSP decides whether they are available; APs follow it.
+ */
+void mmu_pcid_initialize(void) {
+	if (this_core->cpu_id == 0) {
+		uint32_t ebx, ecx, _unused;
+		asm volatile ("cpuid" : "=a"(_unused), "=b"(_unused), "=c"(ecx), "=d"(_unused) : "a"(1));
+		if (!(ecx & (1 << 17))) return;
+		asm volatile ("cpuid" : "=a"(_unused), "=b"(ebx), "=c"(_unused), "=d"(_unused) : "a"(7), "c"(0));
+		mmu_has_invpcid = !!(ebx & (1 << 10));
+		mmu_pcid_enabled = 1;
+		dprintf("mmu: using PCIDs%s\n", mmu_has_invpcid ? " with INVPCID" : "");
+	}
+
+	if (!mmu_pcid_enabled) return;
+
+	uintptr_t cr4;
+	asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+	asm volatile ("mov %0, %%cr4" : : "r"(cr4 | (1 << 17)));
+}
+
+/**
+ * @brief Flush every translation on this core, for all PCIDs.
+ *
+ * Kernel mappings are not global and are cached under every PCID,
+ * so changes to them need this rather than INVLPG.
+ */
+static void mmu_flush_all_contexts(void) {
+	if (!mmu_pcid_enabled) {
+		uintptr_t cr3;
+		asm volatile ("mov %%cr3, %0" : "=r"(cr3));
+		asm volatile ("mov %0, %%cr3" : : "r"(cr3) : "memory");
+	} else if (mmu_has_invpcid) {
+		struct { uint64_t pcid, addr; } desc = {0, 0};
+		asm volatile ("invpcid %0, %1" : : "m"(desc), "r"(2UL) : "memory");
+	} else {
+		/* Toggling CR4.PGE flushes everything, for all PCIDs. */
+		uintptr_t cr4;
+		asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+		asm volatile ("mov %0, %%cr4" : : "r"(cr4 ^ 0x80) : "memory");
+		asm volatile ("mov %0, %%cr4" : : "r"(cr4) : "memory");
+	}
+}
+
+/**
+ * @brief Flush the translations of the current directory on this core.
+ */
+static void mmu_flush_context(void) {
+	uintptr_t cr3;
+	asm volatile ("mov %%cr3, %0" : "=r"(cr3));
+	asm volatile ("mov %0, %%cr3" : : "r"(cr3 & ~CR3_NOFLUSH) : "memory");
+}
+
+/**
+ * @brief Invalidate a range of addresses on this core only.
+ *
+ * Called both by the initiator of a change and by the targets
+ * of a shootdown, see @ref arch_tlb_shootdown.
+ */
+void mmu_invalidate_local(uintptr_t start, uintptr_t end, int kernel) {
+	if (kernel && mmu_pcid_enabled) {
+		mmu_flush_all_contexts();
+	} else if ((end - start) >> PAGE_SHIFT > TLB_FLUSH_CEILING) {
+		if (kernel) mmu_flush_all_contexts();
+		else mmu_flush_context();
+	} else {
+		for (uintptr_t a = start; a < end; a += PAGE_SIZE) {
+			asm volatile ("invlpg (%0)" : : "r"(a) : "memory");
+		}
+	}
+}
+
+/**
+ * @brief Mark every PCID that holds @p pml as stale, on every core.
+ *
+ * Cores that do not have @p pml loaded right now do not get an IPI;
+ * instead they flush its PCID the next time they switch to it. This
+ * has to happen before we look at which cores have it loaded, and
+ * @ref mmu_pcid_select sets current_pml before it checks these bits,
+ * so one side or the other always notices the change.
+ */
+static void mmu_pcid_mark_stale(union PML * pml) {
+	if (!mmu_pcid_enabled) return;
+	for (int i = 0; i < processor_count; ++i) {
+		/* We already invalidated our own copy if it is the one we are using. */
+		if (i == this_core->cpu_id && pml == this_core->current_pml) continue;
+		for (unsigned int slot = 0; slot < PCID_SLOTS; ++slot) {
+			if (processor_local_data[i].pcid_owner[slot] == pml) {
+				__sync_or_and_fetch(&processor_local_data[i].pcid_stale, 1U << slot);
+			}
+		}
+	}
+	asm volatile ("mfence" ::: "memory");
+}
+
+/**
+ * @brief Pick the PCID to load @p pml with on this core.
+ *
+ * Reuses this core's slot for @p pml if it has one and nothing changed
+ * the directory while it was away; otherwise the returned value lacks
+ * @c CR3_NOFLUSH and loading it discards that PCID's old translations.
+ * New directories take slots round-robin from whatever held them.
+ */
+static uintptr_t mmu_pcid_select(union PML * pml) {
+	struct ProcessorLocal * me = &processor_local_data[this_core->cpu_id];
+
+	asm volatile ("mfence" ::: "memory");
+	for (unsigned int slot = 0; slot < PCID_SLOTS; ++slot) {
+		if (me->pcid_owner[slot] == pml) {
+			if (__sync_fetch_and_and(&me->pcid_stale, ~(1U << slot)) & (1U << slot)) return slot + 1;
+			return (slot + 1) | CR3_NOFLUSH;
+		}
+	}
+
+	unsigned int slot = me->pcid_next;
+	me->pcid_next = (slot + 1) % PCID_SLOTS;
+	me->pcid_owner[slot] = pml;
+	__sync_and_and_fetch(&me->pcid_stale, ~(1U << slot));
+	return slot + 1;
+}
+
 /**
  * @brief Switch the active page directory for this core.
  *
  * Generally called during task creation and switching to change
  * the active page directory of a core. Updates @c this_core->current_pml.
  *
- * x86-64: Loads a given PML into CR3.
+ * x86-64: Loads a given PML into CR3, tagged with a PCID if we have them.
  *
  * @param new_pml Either the physical address or the shadow mapping virtual address
  *                of the new PML4 directory to switch into, general obtained from
@@ -855,12 +1172,35 @@ void mmu_set_directory(union PML * new_pml) {
 	this_core->current_pml = new_pml;
 
 	uintptr_t pml_phys = mmu_map_to_physical(new_pml, (uintptr_t)new_pml);
+	if (mmu_pcid_enabled) pml_phys |= mmu_pcid_select(new_pml);
 
 	asm volatile (
 		"movq %0, %%cr3"
 		: : "r"((uintptr_t)pml_phys));
 }
 
+/**
+ * @brief Invalidate a range of addresses on every core that may have them cached.
+ *
+ * Kernel addresses are the same in every directory and go to every core.
+ * User addresses only go to the cores that have @p pml loaded right now;
+ * see @ref mmu_pcid_mark_stale for the rest.
+ *
+ * @param pml   Directory the user addresses were changed in.
+ * @param start Page-aligned start of the range.
+ * @param end   End of the range.
+ */
+static void mmu_invalidate_range(union PML * pml, uintptr_t start, uintptr_t end) {
+	if (start >= KERNEL_HALF_START) {
+		mmu_invalidate_local(start, end, 1);
+		arch_tlb_shootdown(NULL, start, end);
+	} else {
+		if (pml == this_core->current_pml) mmu_invalidate_local(start, end, 0);
+		mmu_pcid_mark_stale(pml);
+		arch_tlb_shootdown(pml, start, end);
+	}
+}
+
 /**
  * @brief Mark a virtual address's mappings as invalid in the TLB.
  *
@@ -871,10 +1211,8 @@ void mmu_set_directory(union PML * new_pml) {
  * @param addr Virtual address in the current address space to invalidate.
  */
 void mmu_invalidate(uintptr_t addr) {
-	asm volatile (
-		"invlpg (%0)"
-		: : "r"(addr));
-	arch_tlb_shootdown(addr);
+	addr &= PAGE_SIZE_MASK;
+	mmu_invalidate_range(this_core->current_pml, addr, addr + PAGE_SIZE);
 }
 
 void mmu_flush(char * addr) {
@@ -905,6 +1243,10 @@ int mmu_get_page_deep(uintptr_t virtAddr, union PML ** pml4_out, union PML ** pd
 	union PML * pd = mmu_map_from_physical((uintptr_t)pdp[pdp_entry].bits.page << PAGE_SHIFT);
 	*pd_out = (union PML *)&pd[pd_entry];
 	if (!pd[pd_entry].bits.present) goto _noentry;
+	if (pd[pd_entry].bits.size) {
+		if (virtAddr >= KERNEL_HALF_START) goto _noentry;
+		mmu_split_large(root, &pd[pd_entry], virtAddr);
+	}
 	union PML * pt = mmu_map_from_physical((uintptr_t)pd[pd_entry].bits.page << PAGE_SHIFT);
 	*pt_out = (union PML *)&pt[pt_entry];
 
@@ -935,10 +1277,32 @@ static int maybe_release_directory(union PML * parent, union PML * child) {
 }
 
 void mmu_unmap_user(uintptr_t addr, size_t size) {
+	/* Range of pages we actually unmapped, to invalidate all at once */
+	uintptr_t first = 0, last = 0;
+
 	for (uintptr_t a = addr; a < addr + size; a += PAGE_SIZE) {
 		union PML * pml4, * pdp, * pd, * pt;
 
 		if (a >= USER_DEVICE_MAP && a <= USER_SHM_HIGH) continue;
+
+		/* Whole large pages go back in one piece; partial ones get split below. */
+		if (!(a & PD_MASK) && a + LARGE_PAGE_SIZE <= addr + size) {
+			spin_lock(frame_alloc_lock);
+			union PML * pde = mmu_get_pd_entry(this_core->current_pml, a, 0);
+			int was_large = pde && pde->bits.present && pde->bits.size;
+			if (was_large) {
+				if (!pde->bits.borrowed) buddy_free(LARGE_PAGE_FRAME(*pde), LARGE_PAGE_ORDER);
+				pde->raw = 0;
+				if (!last) first = a;
+				last = a + LARGE_PAGE_SIZE;
+			}
+			spin_unlock(frame_alloc_lock);
+			if (was_large) {
+				a += LARGE_PAGE_SIZE - PAGE_SIZE;
+				continue;
+			}
+		}
+
 		if (mmu_get_page_deep(a, &pml4, &pdp, &pd, &pt)) continue;
 
 		spin_lock(frame_alloc_lock);
@@ -961,11 +1325,14 @@ void mmu_unmap_user(uintptr_t addr, size_t size) {
 				}
 			}
 
-			mmu_invalidate(a);
+			if (!last) first = a;
+			last = a + PAGE_SIZE;
 		}
 
 		spin_unlock(frame_alloc_lock);
 	}
+
+	if (last) mmu_invalidate_range(this_core->current_pml, first, last);
 }
 
 
@@ -1056,7 +1423,7 @@ void mmu_populate_low(uintptr_t page) {
  * @brief Prepare virtual page mappings for use by the kernel.
  *
  * Called during early boot to switch from the loader/bootstrap mappings
- * to ones suitable for general use. Sets up the bitmap allocator, high
+ * to ones suitable for general use. Sets up the frame allocator, high
  * identity mapping, kernel heap, and various mid-level structures to
  * ensure that future kernelspace mappings apply to all kernel threads.
  *
@@ -1120,31 +1487,31 @@ void mmu_init(size_t memsize, uintptr_t firstFreePage) {
 	/* We are now in the new stuff. */
 	frames = (void*)((uintptr_t)KERNEL_HEAP_START);
 	memset((void*)frames, 0xFF, bytesOfFrames);
+	buddy_attach(frames, 0, nframes);
 
 	extern void mboot_unmark_valid_memory(void);
 	mboot_unmark_valid_memory();
 
+	/* Free blocks are linked through the identity map, so nothing past it can be used. */
+	for (uintptr_t i = 64UL << 30; i < nframes * PAGE_SIZE; i += PAGE_SIZE) {
+		mmu_frame_set(i);
+	}
+
 	/* Don't trust anything but our own bitmap... */
-	size_t unavail = 0, avail = 0;
-	for (size_t i = 0; i < INDEX_FROM_BIT(nframes); ++i) {
-		for (size_t j = 0; j < 32; ++j) {
-			uint32_t testFrame = (uint32_t)0x1 << j;
-			if (frames[i] & testFrame) {
-				unavail++;
-			} else {
-				avail++;
-			}
-		}
+	size_t avail = 0;
+	for (size_t i = 0; i < nframes; ++i) {
+		if (!mmu_frame_test(i << PAGE_SHIFT)) avail++;
 	}
 
 	total_memory = avail * 4;
-	unavailable_memory = unavail * 4;
 
 	/* Now mark everything up to (firstFreePage + bytesOfFrames) as in use */
 	for (uintptr_t i = 0; i < firstFreePage + bytesOfFrames; i += PAGE_SIZE) {
 		mmu_frame_set(i);
 	}
 
+	buddy_initialize();
+
 	heapStart = (char*)KERNEL_HEAP_START + bytesOfFrames;
 
 	/* Then, uh, make a bunch of space for page counts? */
@@ -1205,6 +1572,119 @@ void * sbrk(size_t bytes) {
 	return out;
 }
 
+/* Released heap ranges whose frames wait for other cores to drop their translations */
+#define HEAP_RETIRED_SLOTS 32
+
+static struct heap_retired {
+	uintptr_t start;
+	uintptr_t end;      /**< End of the range, or 0 if the slot is free */
+	uint64_t marks[32]; /**< Shootdowns each core has to finish first, see @ref arch_tlb_shootdown_mark */
+} heap_retired[HEAP_RETIRED_SLOTS];
+
+/**
+ * @brief Whether a retired range other than @p r also covers @p p.
+ */
+static int mmu_heap_retired_elsewhere(struct heap_retired * r, uintptr_t p) {
+	for (int i = 0; i < HEAP_RETIRED_SLOTS; ++i) {
+		if (&heap_retired[i] != r && heap_retired[i].end && p >= heap_retired[i].start && p < heap_retired[i].end) return 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Free the frames of retired heap ranges every core has stopped using.
+ *
+ * A retired page keeps its frame number with the present bit clear, so
+ * a page that was committed again in the meantime is simply skipped. A
+ * page that was committed and then retired again by a later range is
+ * left for that range. Called with kheap_lock held.
+ */
+static void mmu_heap_reap(void) {
+	for (int i = 0; i < HEAP_RETIRED_SLOTS; ++i) {
+		struct heap_retired * r = &heap_retired[i];
+		if (!r->end || !arch_tlb_shootdown_complete(r->marks)) continue;
+		for (uintptr_t p = r->start; p < r->end; p += PAGE_SIZE) {
+			union PML * page = mmu_get_page(p, 0);
+			if (!page || page->bits.present || !page->bits.page) continue;
+			if (mmu_heap_retired_elsewhere(r, p)) continue;
+			mmu_frame_release((uintptr_t)page->bits.page << PAGE_SHIFT);
+			page->raw = 0;
+		}
+		r->end = 0;
+	}
+}
+
+/**
+ * @brief Return the frames backing part of the kernel heap.
+ *
+ * The heap allocator calls this for the middle of large free blocks.
+ * The address range stays part of the heap; pages that were already
+ * released are skipped, and @ref mmu_heap_commit backs them again.
+ *
+ * Other cores may still have the pages in their TLBs, and we can't
+ * wait for them here as the heap lock is held, so the frames are only
+ * returned by a later call, once every core has taken the shootdown.
+ * If too many ranges are waiting, the pages are simply left mapped.
+ *
+ * @param start Page-aligned start of the range.
+ * @param size Size of the range, a multiple of PAGE_SIZE.
+ */
+void mmu_heap_release(uintptr_t start, size_t size) {
+	int released = 0;
+	spin_lock(kheap_lock);
+	mmu_heap_reap();
+
+	struct heap_retired * r = NULL;
+	for (int i = 0; i < HEAP_RETIRED_SLOTS; ++i) {
+		if (!heap_retired[i].end) {
+			r = &heap_retired[i];
+			break;
+		}
+	}
+	if (!r) {
+		spin_unlock(kheap_lock);
+		return;
+	}
+
+	for (uintptr_t p = start; p < start + size; p += PAGE_SIZE) {
+		union PML * page = mmu_get_page(p, 0);
+		if (!page || !page->bits.present) continue;
+		page->bits.present = 0;
+		released = 1;
+	}
+
+	if (released) {
+		mmu_invalidate_range(NULL, start, start + size);
+		arch_tlb_shootdown_mark(r->marks);
+		r->start = start;
+		r->end = start + size;
+	}
+	spin_unlock(kheap_lock);
+}
+
+/**
+ * @brief Back any released pages in a range of the kernel heap.
+ *
+ * Pages still waiting in @ref heap_retired get their old frames back.
+ *
+ * @param start Page-aligned start of the range.
+ * @param size Size of the range, a multiple of PAGE_SIZE.
+ */
+void mmu_heap_commit(uintptr_t start, size_t size) {
+	spin_lock(kheap_lock);
+	mmu_heap_reap();
+	for (uintptr_t p = start; p < start + size; p += PAGE_SIZE) {
+		union PML * page = mmu_get_page(p, MMU_GET_MAKE);
+		if (page->bits.present) continue;
+		if (page->bits.page) {
+			page->bits.present = 1;
+			continue;
+		}
+		mmu_frame_allocate(page, MMU_FLAG_WRITABLE | MMU_FLAG_KERNEL);
+	}
+	spin_unlock(kheap_lock);
+}
+
 static uintptr_t mmio_base_address = MMIO_BASE_START;
 
 /**
@@ -1315,6 +1795,9 @@ int mmu_copy_on_write(uintptr_t address) {
 
 	/* Was this address pending a cow? */
 	if (!page->bits.cow_pending) {
+		/* Another thread may have finished it while our read-only translation
+		 * was still waiting on a shootdown; the fault itself dropped that. */
+		if (page->bits.present && page->bits.writable) return 0;
 		/* No, go back and trigger and a SIGSEGV */
 		return 1;
 	}
@@ -1335,8 +1818,7 @@ int mmu_copy_on_write(uintptr_t address) {
 
 	/* Allocate a new writable page */
 	uintptr_t faulting_frame = page->bits.page;
-	uintptr_t fresh_frame = mmu_first_frame();
-	mmu_frame_set(fresh_frame << PAGE_SHIFT);
+	uintptr_t fresh_frame = mmu_allocate_a_frame();
 
 	/* Copy the read-only page into the new writable page */
 	char * page_in  = mmu_map_from_physical(faulting_frame << PAGE_SHIFT);
@@ -1356,6 +1838,24 @@ int mmu_copy_on_write(uintptr_t address) {
 	return 0;
 }
 
+/**
+ * @brief Find the entry that maps a user address, without splitting it.
+ *
+ * Returns either a page table entry or, with @p large set, a 2MiB
+ * page directory entry; or NULL if nothing is mapped at @p virtAddr.
+ */
+static union PML * mmu_find_leaf(union PML * root, uintptr_t virtAddr, int * large) {
+	*large = 0;
+	union PML * pde = mmu_get_pd_entry(root, virtAddr, 0);
+	if (!pde || !pde->bits.present) return NULL;
+	if (pde->bits.size) {
+		*large = 1;
+		return pde;
+	}
+	union PML * pt = mmu_map_from_physical((uintptr_t)pde->bits.page << PAGE_SHIFT);
+	return (union PML *)&pt[(virtAddr >> PAGE_SHIFT) & ENTRY_MASK];
+}
+
 /**
  * @brief Check if the current user process can access address space.
  *
@@ -1390,9 +1890,21 @@ int mmu_validate_user_pointer(const void * addr, size_t size, int flags) {
 
 	for (uintptr_t page = page_base; page <= page_end; ++page) {
 		if ((page & 0xffff800000000) != 0 && (page & 0xffff800000000) != 0xffff800000000) return 0;
-		union PML * page_entry = mmu_get_page_other(this_core->current_process->thread.page_directory->directory, page << 12);
-		if (!page_entry) return 0;
-		if (!page_entry->bits.present) return 0;
+		int large;
+		union PML * page_entry = mmu_find_leaf(this_core->current_process->thread.page_directory->directory, page << 12, &large);
+		if (page_entry && page_entry->bits.present && large) {
+			/* Large pages are never COW, so they either allow this or they don't. */
+			if (!page_entry->bits.user) return 0;
+			if (!page_entry->bits.writable && (flags & MMU_PTR_WRITE)) return 0;
+			page |= ENTRY_MASK;
+			continue;
+		}
+		if (!page_entry || !page_entry->bits.present) {
+			/* Fill in file mappings now rather than faulting on them later. */
+			if (!generic_page_fault(page << 12, flags & MMU_PTR_WRITE)) return 0;
+			page_entry = mmu_get_page_other(this_core->current_process->thread.page_directory->directory, page << 12);
+			if (!page_entry || !page_entry->bits.present) return 0;
+		}
 		if (!page_entry->bits.user) return 0;
 		if (!page_entry->bits.writable && (flags & MMU_PTR_WRITE)) {
 			if (mmu_copy_on_write((uintptr_t)(page << 12))) return 0;
@@ -48,6 +48,7 @@ static void pit_set_timer_phase(long hz) {
  */
 int pit_interrupt(struct regs *r) {
 	extern void arch_update_clock(void);
+	this_core->timer_interrupts++;
 	arch_update_clock();
 
 	irq_ack(0);
@@ -99,6 +99,7 @@ extern void arch_set_core_base(uintptr_t base);
 extern void fpu_initialize(void);
 extern void idt_ap_install(void);
 extern void pat_initialize(void);
+extern void mmu_pcid_initialize(void);
 extern process_t * spawn_kidle(int);
 extern void mmu_populate_low(uintptr_t);
 extern void ap_refresh_gdt(void);
@@ -181,25 +182,95 @@ void load_processor_info(void) {
 	asm volatile ("wrmsr" : : "c"(0xC0000084), "d"(0), "a"(0x700));             /* SFMASK: Direction flag, interrupt flag, trap flag are all cleared */
 }
 
+#define LAPIC_TIMER_ONESHOT  0 /**< Count down from a calibrated initial count */
+#define LAPIC_TIMER_DEADLINE 1 /**< Fire when the TSC reaches IA32_TSC_DEADLINE */
+
+static int lapic_timer_mode = -1;           /**< One of the LAPIC_TIMER_ modes, or -1 before the BSP has picked one */
+static uint64_t lapic_counts_per_ms = 0;    /**< Calibrated LAPIC timer counts per millisecond, for one-shot mode */
+
+/**
+ * @brief Set up this core's LAPIC timer.
+ *
+ * The timer is used in one-shot mode and re-armed by the scheduler for
+ * whenever this core next needs to run it. If the processor supports the
+ * TSC deadline mode, we use that, as it needs no calibration and has the
+ * resolution of the TSC; otherwise the countdown timer is timed against
+ * the TSC once on the BSP.
+ */
 static void lapic_timer_initialize(void) {
 	/* Enable our spurious vector register */
 	*((volatile uint32_t*)(lapic_final + 0x0F0)) = 0x127;
-	*((volatile uint32_t*)(lapic_final + 0x320)) = 0x7b;
+
+	if (lapic_timer_mode < 0) {
+		uint32_t ecx, _unused;
+		cpuid(0x1,_unused,_unused,ecx,_unused);
+		if (ecx & (1 << 24)) {
+			lapic_timer_mode = LAPIC_TIMER_DEADLINE;
+		} else {
+			*((volatile uint32_t*)(lapic_final + 0x320)) = 0x7b;
+			*((volatile uint32_t*)(lapic_final + 0x3e0)) = 1;
+
+			/* Time our APIC timer against the TSC */
+			uint64_t before = arch_perf_timer();
+			*((volatile uint32_t*)(lapic_final + 0x380)) = 1000000;
+			while (*((volatile uint32_t*)(lapic_final + 0x390)));
+			uint64_t after = arch_perf_timer();
+
+			uint64_t us = (after-before)/arch_cpu_mhz();
+			lapic_counts_per_ms = 1000000000UL / us;
+			lapic_timer_mode = LAPIC_TIMER_ONESHOT;
+		}
+		dprintf("smp: using %s lapic timer\n", arch_timer_mode());
+	}
+
 	*((volatile uint32_t*)(lapic_final + 0x3e0)) = 1;
+	if (lapic_timer_mode == LAPIC_TIMER_DEADLINE) {
+		*((volatile uint32_t*)(lapic_final + 0x320)) = 0x7b | 0x40000;
+		/* The LVT write must land before the first deadline is set */
+		asm volatile ("mfence" ::: "memory");
+	} else {
+		*((volatile uint32_t*)(lapic_final + 0x320)) = 0x7b;
+	}
 
-	/* Time our APIC timer against the TSC */
-	uint64_t before = arch_perf_timer();
-	*((volatile uint32_t*)(lapic_final + 0x380)) = 1000000;
-	while (*((volatile uint32_t*)(lapic_final + 0x390)));
-	uint64_t after = arch_perf_timer();
+	/* Start with a full time slice; the scheduler re-arms from here. */
+	arch_timer_arm(SCHED_TIME_SLICE);
+}
 
-	uint64_t ms = (after-before)/arch_cpu_mhz();
-	uint64_t target = 10000000000UL / ms;
+/**
+ * @brief Arm this core's timer to fire in @p usecs microseconds.
+ *
+ * A value of zero disarms it. Called by the scheduler every time this
+ * core switches tasks. With the PIT fallback we keep its fixed tick.
+ */
+void arch_timer_arm(unsigned long usecs) {
+	if (!lapic_final || lapic_timer_mode < 0) return;
+
+	if (lapic_timer_mode == LAPIC_TIMER_DEADLINE) {
+		uint64_t deadline = usecs ? read_tsc() + usecs * arch_cpu_mhz() : 0;
+		asm volatile ("wrmsr" : : "c"(0x6e0), "d"((uint32_t)(deadline >> 32)), "a"((uint32_t)deadline));
+	} else {
+		uint64_t count = usecs * lapic_counts_per_ms / 1000;
+		if (usecs && !count) count = 1;
+		if (count > 0xFFFFFFFF) count = 0xFFFFFFFF;
+		*((volatile uint32_t*)(lapic_final + 0x380)) = count;
+	}
+}
 
-	/* Enable our APIC timer to send periodic wakeup signals */
-	*((volatile uint32_t*)(lapic_final + 0x3e0)) = 1;
-	*((volatile uint32_t*)(lapic_final + 0x320)) = 0x7b | 0x20000;
-	*((volatile uint32_t*)(lapic_final + 0x380)) = target;
+/**
+ * @brief Name of the preemption timer mode, for procfs.
+ */
+const char * arch_timer_mode(void) {
+	if (!lapic_final) return "pit periodic";
+	return lapic_timer_mode == LAPIC_TIMER_DEADLINE ? "lapic tsc-deadline" : "lapic one-shot";
+}
+
+/**
+ * @brief Granularity of the preemption timer, in nanoseconds.
+ */
+unsigned long arch_timer_resolution(void) {
+	if (!lapic_final) return 1000000000UL / 100;
+	uint64_t ticks_per_ms = lapic_timer_mode == LAPIC_TIMER_DEADLINE ? arch_cpu_mhz() * 1000 : lapic_counts_per_ms;
+	return ticks_per_ms >= 1000000 ? 1 : 1000000 / ticks_per_ms;
 }
 
 /**
@@ -223,10 +294,11 @@ void ap_main(void) {
 		printf("smp: lapic id does not match\n");
 	}
 
-	/* lidt, initialize local FPU, set up page attributes */
+	/* lidt, initialize local FPU, set up page attributes and PCIDs */
 	idt_ap_install();
 	fpu_initialize();
 	pat_initialize();
+	mmu_pcid_initialize();
 
 	/* Set our pml pointers */
 	this_core->current_pml = &init_page_region[0];
@@ -466,8 +538,7 @@ _pit_fallback:
  * cores if they are busy with other things - we only want it to wake up
  * the HLT in the kernel idle task.
  *
- * TODO We could make this more fine-grained and deliver only to processors
- *      we think are ready, or to specific processors to aid in affinity?
+ * Wakeups with a specific target core use @ref arch_wakeup_core instead.
  */
 void arch_wakeup_others(void) {
 	if (!lapic_final || processor_count < 2) return;
@@ -477,21 +548,118 @@ void arch_wakeup_others(void) {
 	lapic_send_ipi(0, 0x7E | (3 << 18));
 }
 
+/**
+ * @brief Send a soft IPI to one core.
+ *
+ * Used when a process is queued on a specific core's ready queue
+ * and that core is idle, so that it does not have to wait for its
+ * next timer tick to notice.
+ *
+ * @param cpu Index of the core to wake.
+ */
+void arch_wakeup_core(int cpu) {
+	if (!lapic_final || processor_count < 2) return;
+	lapic_send_ipi(processor_local_data[cpu].lapic_id, 0x7E);
+}
+
+/**
+ * @brief Invalidations waiting for one core to take its shootdown IPI.
+ *
+ * Requests made before the target gets around to handling the IPI are
+ * merged into one range, so a burst of invalidations costs one IPI.
+ */
+static struct tlb_request {
+	spin_lock_t lock;
+	uintptr_t start;  /**< Start of the pending range */
+	uintptr_t end;    /**< End of the pending range, or 0 if nothing is pending */
+	int kernel;       /**< Whether the range includes kernel addresses, which need all PCIDs flushed */
+	uint64_t sent;    /**< Number of requests made of this core so far */
+	uint64_t done;    /**< Value of @c sent when it took the last shootdown it has finished */
+} tlb_requests[32];
+
 /**
  * @brief Trigger a TLB shootdown on other cores.
  *
- * XXX This is really dumb; we just send an IPI to everyone else
- *     and they reload CR3...
+ * Changes to kernel addresses, for which @p pml is NULL, go to every
+ * other core. Changes to user addresses go only to the cores that have
+ * @p pml loaded right now; cores that gave it a PCID but are running
+ * something else have already been told to flush it when they return.
  *
- * @param vaddr Should have the address to flush, but not actually used.
+ * This does not wait for the other cores to finish.
+ *
+ * @param pml   Directory that was changed, or NULL for the kernel half.
+ * @param start Start of the changed range.
+ * @param end   End of the changed range.
  */
-void arch_tlb_shootdown(uintptr_t vaddr) {
+void arch_tlb_shootdown(union PML * pml, uintptr_t start, uintptr_t end) {
 	if (!lapic_final || processor_count < 2) return;
 
-	/*
-	 * We should be checking if this address can be sensibly
-	 * mapped somewhere else before IPIing everyone...
-	 */
+	/* The page table changes must be visible before we check who has them loaded;
+	 * a core that loads the directory after this will see the changes. */
+	asm volatile ("mfence" ::: "memory");
+
+	for (int i = 0; i < processor_count; ++i) {
+		if (i == this_core->cpu_id) continue;
+		if (pml && processor_local_data[i].current_pml != pml) continue;
+
+		struct tlb_request * request = &tlb_requests[i];
+		spin_lock(request->lock);
+		int pending = request->end != 0;
+		if (!pending || start < request->start) request->start = start;
+		if (!pending || end > request->end) request->end = end;
+		if (!pml) request->kernel = 1;
+		request->sent++;
+		spin_unlock(request->lock);
+
+		/* If an IPI is already on its way, it will pick this up too */
+		if (!pending) lapic_send_ipi(processor_local_data[i].lapic_id, 0x7C);
+	}
+}
+
+/**
+ * @brief Handle a shootdown IPI by invalidating whatever has been requested.
+ */
+void arch_tlb_shootdown_handler(void) {
+	extern void mmu_invalidate_local(uintptr_t start, uintptr_t end, int kernel);
+	struct tlb_request * request = &tlb_requests[this_core->cpu_id];
+
+	spin_lock(request->lock);
+	uintptr_t start = request->start;
+	uintptr_t end = request->end;
+	int kernel = request->kernel;
+	request->start = 0;
+	request->end = 0;
+	request->kernel = 0;
+	uint64_t taken = request->sent;
+	spin_unlock(request->lock);
+
+	if (end) mmu_invalidate_local(start, end, kernel);
+	__atomic_store_n(&request->done, taken, __ATOMIC_RELEASE);
+}
 
-	lapic_send_ipi(0, 0x7C | (3 << 18));
+/**
+ * @brief Note how many shootdowns each other core has been sent.
+ *
+ * Call after @ref arch_tlb_shootdown; once @ref arch_tlb_shootdown_complete
+ * accepts @p marks, every core has acted on it.
+ *
+ * @param marks Array with room for an entry per core.
+ */
+void arch_tlb_shootdown_mark(uint64_t * marks) {
+	for (int i = 0; i < processor_count; ++i) {
+		marks[i] = __atomic_load_n(&tlb_requests[i].sent, __ATOMIC_ACQUIRE);
+	}
+}
+
+/**
+ * @brief Check whether every core has finished the shootdowns noted in @p marks.
+ *
+ * This never waits: a core that is spinning with interrupts off may be
+ * waiting on a lock our caller holds.
+ */
+int arch_tlb_shootdown_complete(const uint64_t * marks) {
+	for (int i = 0; i < processor_count; ++i) {
+		if (__atomic_load_n(&tlb_requests[i].done, __ATOMIC_ACQUIRE) < marks[i]) return 0;
+	}
+	return 1;
 }
@@ -0,0 +1,528 @@
+/**
+ * @file  kernel/misc/buddy.c
+ * @brief Buddy allocator for physical page frames.
+ *
+ * Free memory is kept in power-of-two blocks of up to 2^(BUDDY_ORDERS-1)
+ * frames, with one free list per order. The list links for a free block
+ * live in its first frame, reached through the physical identity map, so
+ * the only other state is the frame bitmap the MMU code already keeps:
+ * a set bit means the frame is in use.
+ *
+ * Single frames, which is almost everything the kernel asks for, come
+ * from small per-CPU caches that are refilled from and drained to the
+ * free lists in batches, so the common case never takes the global lock
+ * and tends to hand back frames that are still warm in the cache. Cached
+ * frames are clear in the bitmap like any other free frame, but they sit
+ * outside the free lists and are not merged until they are drained.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/string.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/time.h>
+#include <kernel/mmu.h>
+#include <kernel/buddy.h>
+
+#define CACHE_SIZE  64
+#define CACHE_BATCH 16
+
+/**
+ * Header written into the first frame of each free block. The magic
+ * values are mixed with a boot-time timestamp so that headers left in
+ * memory by a previous boot are never mistaken for live ones.
+ */
+struct free_block {
+	uint64_t magic;
+	uintptr_t frame;
+	int order;
+	struct free_block * next;
+	struct free_block * prev;
+};
+
+struct frame_cache {
+	spin_lock_t lock;
+	size_t count;
+	uintptr_t frames[CACHE_SIZE];
+};
+
+static volatile uint32_t * bitmap = NULL;
+static uintptr_t first_frame = 0;
+static uintptr_t end_frame = 0;
+static int ready = 0;
+
+static uint64_t free_magic;
+static uint64_t cached_magic;
+
+static spin_lock_t buddy_lock = { 0 };
+static struct free_block * free_lists[BUDDY_ORDERS];
+static size_t free_blocks[BUDDY_ORDERS];
+static size_t free_frames = 0;
+
+static struct frame_cache caches[BUDDY_CPUS];
+
+#define BIT_INDEX(f)  (((f) - first_frame) >> 5)
+#define BIT_OFFSET(f) (((f) - first_frame) & 0x1F)
+
+static inline struct free_block * block_at(uintptr_t frame) {
+	return mmu_map_from_physical(frame << 12);
+}
+
+static inline int bit_test(uintptr_t frame) {
+	return !!(bitmap[BIT_INDEX(frame)] & ((uint32_t)1 << BIT_OFFSET(frame)));
+}
+
+static void bits_set(uintptr_t frame, size_t count) {
+	while (count) {
+		if (!BIT_OFFSET(frame) && count >= 32) {
+			__atomic_store_n(&bitmap[BIT_INDEX(frame)], 0xFFFFFFFF, __ATOMIC_SEQ_CST);
+			frame += 32;
+			count -= 32;
+		} else {
+			__sync_or_and_fetch(&bitmap[BIT_INDEX(frame)], ((uint32_t)1 << BIT_OFFSET(frame)));
+			frame++;
+			count--;
+		}
+	}
+}
+
+static void bits_clear(uintptr_t frame, size_t count) {
+	while (count) {
+		if (!BIT_OFFSET(frame) && count >= 32) {
+			__atomic_store_n(&bitmap[BIT_INDEX(frame)], 0, __ATOMIC_SEQ_CST);
+			frame += 32;
+			count -= 32;
+		} else {
+			__sync_and_and_fetch(&bitmap[BIT_INDEX(frame)], ~((uint32_t)1 << BIT_OFFSET(frame)));
+			frame++;
+			count--;
+		}
+	}
+}
+
+static void block_push(uintptr_t frame, int order) {
+	struct free_block * b = block_at(frame);
+	b->magic = free_magic;
+	b->frame = frame;
+	b->order = order;
+	b->prev  = NULL;
+	b->next  = free_lists[order];
+	if (b->next) b->next->prev = b;
+	free_lists[order] = b;
+	free_blocks[order]++;
+	free_frames += 1UL << order;
+}
+
+static void block_remove(struct free_block * b) {
+	if (b->prev) b->prev->next = b->next;
+	else free_lists[b->order] = b->next;
+	if (b->next) b->next->prev = b->prev;
+	free_blocks[b->order]--;
+	free_frames -= 1UL << b->order;
+	b->magic = 0;
+}
+
+/**
+ * @brief Is @p frame the head of a free block of exactly @p order?
+ *
+ * A block's buddy can only ever be free as a whole block of the same
+ * order or not at all, so checking its first frame is enough.
+ */
+static int is_free_head(uintptr_t frame, int order) {
+	if (frame < first_frame || frame + (1UL << order) > end_frame) return 0;
+	if (bit_test(frame)) return 0;
+	struct free_block * b = block_at(frame);
+	return b->magic == free_magic && b->frame == frame && b->order == order;
+}
+
+/**
+ * @brief Put a block on the free lists, merging it with its buddies.
+ */
+static void block_insert(uintptr_t frame, int order) {
+	while (order < BUDDY_ORDERS - 1) {
+		uintptr_t buddy = frame ^ (1UL << order);
+		if (!is_free_head(buddy, order)) break;
+		block_remove(block_at(buddy));
+		frame &= ~(1UL << order);
+		order++;
+	}
+	block_push(frame, order);
+}
+
+/**
+ * @brief Free an arbitrary run of frames as the largest aligned blocks that fit.
+ *
+ * The bitmap bits for the run must already be clear.
+ */
+static void insert_range(uintptr_t frame, size_t count, int merge) {
+	while (count) {
+		int order = 0;
+		while (order < BUDDY_ORDERS - 1 && !(frame & (1UL << order)) && (2UL << order) <= count) order++;
+		if (merge) block_insert(frame, order);
+		else block_push(frame, order);
+		frame += 1UL << order;
+		count -= 1UL << order;
+	}
+}
+
+/**
+ * @brief Take a block of @p order off the free lists, splitting a larger one if needed.
+ *
+ * Does not touch the bitmap.
+ */
+static uintptr_t take_block(int order) {
+	int o = order;
+	while (o < BUDDY_ORDERS && !free_lists[o]) o++;
+	if (o == BUDDY_ORDERS) return BUDDY_NONE;
+
+	uintptr_t frame = free_lists[o]->frame;
+	block_remove(free_lists[o]);
+
+	while (o > order) {
+		o--;
+		block_push(frame + (1UL << o), o);
+	}
+
+	return frame;
+}
+
+/**
+ * @brief Find the free block containing @p frame, if it is on the free lists.
+ */
+static struct free_block * find_block(uintptr_t frame) {
+	if (bit_test(frame)) return NULL;
+	for (int order = 0; order < BUDDY_ORDERS; ++order) {
+		uintptr_t head = frame & ~((1UL << order) - 1);
+		if (head < first_frame) break;
+		if (bit_test(head)) continue;
+		struct free_block * b = block_at(head);
+		if (b->magic == free_magic && b->frame == head && b->order >= order) return b;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Mark a run of frames that are all on the free lists as in use.
+ *
+ * Whatever part of each containing block falls outside the run is put back.
+ */
+static void carve_range(uintptr_t start, size_t count) {
+	uintptr_t end = start + count;
+	uintptr_t frame = start;
+	while (frame < end) {
+		struct free_block * b = find_block(frame);
+		if (!b) return;
+		uintptr_t head = b->frame;
+		uintptr_t tail = head + (1UL << b->order);
+		uintptr_t stop = tail < end ? tail : end;
+		block_remove(b);
+		bits_set(frame, stop - frame);
+		if (head < frame) insert_range(head, frame - head, 1);
+		if (tail > stop) insert_range(stop, tail - stop, 1);
+		frame = stop;
+	}
+}
+
+static inline struct frame_cache * local_cache(void) {
+	return &caches[this_core->cpu_id];
+}
+
+/**
+ * @brief Move the @p count oldest frames in a cache back to the free lists.
+ *
+ * Called with the cache locked.
+ */
+static void cache_drain(struct frame_cache * cache, size_t count) {
+	if (!count) return;
+	spin_lock(buddy_lock);
+	for (size_t i = 0; i < count; ++i) {
+		block_insert(cache->frames[i], 0);
+	}
+	spin_unlock(buddy_lock);
+	memmove(cache->frames, cache->frames + count, (cache->count - count) * sizeof(uintptr_t));
+	cache->count -= count;
+}
+
+/**
+ * @brief Fill an empty cache with a batch of frames.
+ *
+ * Called with the cache locked.
+ */
+static void cache_refill(struct frame_cache * cache) {
+	spin_lock(buddy_lock);
+	while (cache->count < CACHE_BATCH) {
+		uintptr_t frame = take_block(0);
+		if (frame == BUDDY_NONE) break;
+		block_at(frame)->magic = cached_magic;
+		cache->frames[cache->count++] = frame;
+	}
+	spin_unlock(buddy_lock);
+}
+
+/**
+ * @brief Return every cached frame to the free lists.
+ *
+ * Used when an allocation fails, since the frames it needs may be
+ * sitting in another CPU's cache.
+ */
+static void drain_caches(void) {
+	for (int i = 0; i < BUDDY_CPUS; ++i) {
+		spin_lock(caches[i].lock);
+		cache_drain(&caches[i], caches[i].count);
+		spin_unlock(caches[i].lock);
+	}
+}
+
+/**
+ * @brief Hand the allocator its frame bitmap.
+ *
+ * Until @c buddy_initialize is called, reserving and releasing frames
+ * only updates the bitmap, which is how early boot describes memory.
+ *
+ * @param map         Bitmap with one bit per frame, set for frames in use.
+ * @param first       Frame index described by bit 0.
+ * @param nframes     Number of frames the bitmap covers.
+ */
+void buddy_attach(volatile uint32_t * map, uintptr_t first, size_t nframes) {
+	bitmap = map;
+	first_frame = first;
+	end_frame = first + nframes;
+	free_magic = 0x4652454542554459UL ^ arch_perf_timer();
+	cached_magic = ~free_magic;
+}
+
+/**
+ * @brief Build the free lists from the bitmap.
+ *
+ * Each run of free frames is maximal, so splitting runs greedily into
+ * aligned blocks already leaves nothing to merge.
+ */
+void buddy_initialize(void) {
+	uintptr_t frame = first_frame;
+	while (frame < end_frame) {
+		if (!BIT_OFFSET(frame) && bitmap[BIT_INDEX(frame)] == 0xFFFFFFFF) {
+			frame += 32;
+			continue;
+		}
+		if (bit_test(frame)) {
+			frame++;
+			continue;
+		}
+		uintptr_t start = frame;
+		while (frame < end_frame && !bit_test(frame)) frame++;
+		insert_range(start, frame - start, 0);
+	}
+
+	for (int i = 0; i < BUDDY_CPUS; ++i) {
+		spin_init(caches[i].lock);
+	}
+
+	ready = 1;
+}
+
+/**
+ * @brief Mark a specific frame as in use, wherever it currently is.
+ */
+void buddy_reserve(uintptr_t frame) {
+	if (frame < first_frame || frame >= end_frame) return;
+	if (!ready) {
+		bits_set(frame, 1);
+		return;
+	}
+	if (bit_test(frame)) return;
+
+	if (block_at(frame)->magic == cached_magic) {
+		for (int i = 0; i < BUDDY_CPUS; ++i) {
+			spin_lock(caches[i].lock);
+			for (size_t j = 0; j < caches[i].count; ++j) {
+				if (caches[i].frames[j] == frame) {
+					caches[i].frames[j] = caches[i].frames[--caches[i].count];
+					bits_set(frame, 1);
+					spin_unlock(caches[i].lock);
+					return;
+				}
+			}
+			spin_unlock(caches[i].lock);
+		}
+	}
+
+	spin_lock(buddy_lock);
+	carve_range(frame, 1);
+	spin_unlock(buddy_lock);
+}
+
+/**
+ * @brief Free a single frame.
+ *
+ * Freeing a frame that is already free is ignored.
+ */
+void buddy_release(uintptr_t frame) {
+	if (frame < first_frame || frame >= end_frame) return;
+	if (!ready) {
+		bits_clear(frame, 1);
+		return;
+	}
+
+	struct frame_cache * cache = local_cache();
+	spin_lock(cache->lock);
+	if (!bit_test(frame)) {
+		spin_unlock(cache->lock);
+		return;
+	}
+
+	/* Tag it before it becomes visible as free */
+	block_at(frame)->magic = cached_magic;
+	bits_clear(frame, 1);
+
+	if (cache->count == CACHE_SIZE) cache_drain(cache, CACHE_BATCH);
+	cache->frames[cache->count++] = frame;
+	spin_unlock(cache->lock);
+}
+
+/**
+ * @brief Determine if a frame is in use.
+ *
+ * @returns 1 if the frame is in use or out of range, 0 if it is free.
+ */
+int buddy_test(uintptr_t frame) {
+	if (frame < first_frame || frame >= end_frame) return 1;
+	return bit_test(frame);
+}
+
+/**
+ * @brief Allocate 2^@p order contiguous, naturally aligned frames.
+ *
+ * @returns the first frame index, or BUDDY_NONE if no block is available.
+ */
+uintptr_t buddy_alloc(int order) {
+	if (order < 0 || order >= BUDDY_ORDERS) return BUDDY_NONE;
+
+	if (order == 0) {
+		struct frame_cache * cache = local_cache();
+		spin_lock(cache->lock);
+		if (!cache->count) cache_refill(cache);
+		if (cache->count) {
+			uintptr_t frame = cache->frames[--cache->count];
+			bits_set(frame, 1);
+			spin_unlock(cache->lock);
+			return frame;
+		}
+		spin_unlock(cache->lock);
+	}
+
+	for (int attempt = 0; attempt < 2; ++attempt) {
+		spin_lock(buddy_lock);
+		uintptr_t frame = take_block(order);
+		if (frame != BUDDY_NONE) bits_set(frame, 1UL << order);
+		spin_unlock(buddy_lock);
+		if (frame != BUDDY_NONE) return frame;
+		drain_caches();
+	}
+
+	return BUDDY_NONE;
+}
+
+/**
+ * @brief Allocate @p n contiguous frames.
+ *
+ * Rounds up to a block and frees the excess. Requests larger than the
+ * biggest block, or that fail because memory is fragmented, fall back
+ * to searching the free lists for a long enough run of adjacent blocks.
+ *
+ * @returns the first frame index, or BUDDY_NONE.
+ */
+uintptr_t buddy_alloc_frames(size_t n) {
+	if (!n) return BUDDY_NONE;
+
+	int order = 0;
+	while (order < BUDDY_ORDERS && (1UL << order) < n) order++;
+
+	if (order < BUDDY_ORDERS) {
+		uintptr_t frame = buddy_alloc(order);
+		if (frame != BUDDY_NONE) {
+			size_t excess = (1UL << order) - n;
+			if (excess) {
+				spin_lock(buddy_lock);
+				bits_clear(frame + n, excess);
+				insert_range(frame + n, excess, 1);
+				spin_unlock(buddy_lock);
+			}
+			return frame;
+		}
+	}
+
+	drain_caches();
+
+	spin_lock(buddy_lock);
+	uintptr_t start = first_frame;
+	size_t run = 0;
+	uintptr_t frame = first_frame;
+	while (frame < end_frame) {
+		struct free_block * b = find_block(frame);
+		if (!b) {
+			frame++;
+			start = frame;
+			run = 0;
+			continue;
+		}
+		uintptr_t tail = b->frame + (1UL << b->order);
+		run += tail - frame;
+		frame = tail;
+		if (run >= n) {
+			carve_range(start, n);
+			spin_unlock(buddy_lock);
+			return start;
+		}
+	}
+	spin_unlock(buddy_lock);
+
+	return BUDDY_NONE;
+}
+
+/**
+ * @brief Free a block from @c buddy_alloc.
+ */
+void buddy_free(uintptr_t frame, int order) {
+	if (order == 0) {
+		buddy_release(frame);
+		return;
+	}
+	if (order < 0 || order >= BUDDY_ORDERS) return;
+	/* Like buddy_release, ignore frames we don't manage, eg. device memory. */
+	if (frame & ((1UL << order) - 1)) return;
+	if (frame < first_frame || frame + (1UL << order) > end_frame) return;
+	spin_lock(buddy_lock);
+	bits_clear(frame, 1UL << order);
+	block_insert(frame, order);
+	spin_unlock(buddy_lock);
+}
+
+/**
+ * @brief Count free frames, including those held in per-CPU caches.
+ */
+size_t buddy_free_frames(void) {
+	size_t out = free_frames;
+	for (int i = 0; i < BUDDY_CPUS; ++i) {
+		out += caches[i].count;
+	}
+	return out;
+}
+
+/**
+ * @brief Snapshot the free list and cache occupancy for procfs.
+ */
+void buddy_get_stats(struct buddy_stats * out) {
+	spin_lock(buddy_lock);
+	memcpy(out->free_blocks, free_blocks, sizeof(free_blocks));
+	out->free_frames = free_frames;
+	spin_unlock(buddy_lock);
+	for (int i = 0; i < BUDDY_CPUS; ++i) {
+		out->cached[i] = caches[i].count;
+		out->free_frames += caches[i].count;
+	}
+}
@@ -288,6 +288,8 @@ static uintptr_t load_from_file(fs_node_t * file, Elf64_Header * header, uintptr
 					uintptr_t pad = mapped_to + pageoffset + phdr.p_filesz;
 					if (pad & 0xFFF) {
 						size_t fill = 0x1000 - (pad & 0xFFF);
+						/* Fault in (and unshare) the page before we write to it. */
+						mmu_validate_user_pointer((void*)pad, fill, MMU_PTR_WRITE);
 						memset((void*)pad, 0, fill);
 					}
 				}
@@ -0,0 +1,70 @@
+/**
+ * @file  kernel/misc/iovec.c
+ * @brief Helpers for moving data in and out of scatter/gather arrays.
+ *
+ * Drivers that build or consume whole packets (sockets, mostly) treat
+ * an iovec array as one stream of bytes and copy a range of it at a
+ * time, so they don't each need their own segment-walking loops.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <kernel/string.h>
+#include <kernel/iovec.h>
+
+/**
+ * @brief Total number of bytes described by an iovec array.
+ */
+size_t iov_length(const struct iovec * iov, size_t iovcnt) {
+	size_t total = 0;
+	for (size_t i = 0; i < iovcnt; ++i) {
+		total += iov[i].iov_len;
+	}
+	return total;
+}
+
+/**
+ * @brief Copy @p size bytes, starting @p offset bytes into the array, out to @p dest.
+ *
+ * @returns how many bytes were copied, which is less than @p size only
+ *          if the array ends first.
+ */
+size_t iov_gather(uint8_t * dest, const struct iovec * iov, size_t iovcnt, size_t offset, size_t size) {
+	size_t done = 0;
+	for (size_t i = 0; i < iovcnt && done < size; ++i) {
+		if (offset >= iov[i].iov_len) {
+			offset -= iov[i].iov_len;
+			continue;
+		}
+		size_t count = iov[i].iov_len - offset;
+		if (count > size - done) count = size - done;
+		memcpy(dest + done, (uint8_t *)iov[i].iov_base + offset, count);
+		done += count;
+		offset = 0;
+	}
+	return done;
+}
+
+/**
+ * @brief Copy @p size bytes from @p src into the array, starting @p offset bytes in.
+ *
+ * @returns how many bytes were copied, which is less than @p size only
+ *          if the array ends first.
+ */
+size_t iov_scatter(const struct iovec * iov, size_t iovcnt, size_t offset, const uint8_t * src, size_t size) {
+	size_t done = 0;
+	for (size_t i = 0; i < iovcnt && done < size; ++i) {
+		if (offset >= iov[i].iov_len) {
+			offset -= iov[i].iov_len;
+			continue;
+		}
+		size_t count = iov[i].iov_len - offset;
+		if (count > size - done) count = size - done;
+		memcpy((uint8_t *)iov[i].iov_base + offset, src + done, count);
+		done += count;
+		offset = 0;
+	}
+	return done;
+}
@@ -11,6 +11,9 @@
 #include <stddef.h>
 #include <kernel/string.h>
 #include <kernel/list.h>
+#include <kernel/slab.h>
+
+static kmem_cache_t node_cache = KMEM_CACHE("node_t", sizeof(node_t));
 
 void list_destroy(list_t * list) {
 	/* Free all of the contents of a list */
@@ -52,7 +55,7 @@ void list_append(list_t * list, node_t * node) {
 
 node_t * list_insert(list_t * list, void * item) {
 	/* Insert an item into a list */
-	node_t * node = malloc(sizeof(node_t));
+	node_t * node = kmem_cache_alloc(&node_cache);
 	node->value = item;
 	node->next  = NULL;
 	node->prev  = NULL;
@@ -89,7 +92,7 @@ void list_append_after(list_t * list, node_t * before, node_t * node) {
 }
 
 node_t * list_insert_after(list_t * list, node_t * before, void * item) {
-	node_t * node = malloc(sizeof(node_t));
+	node_t * node = kmem_cache_alloc(&node_cache);
 	node->value = item;
 	node->next  = NULL;
 	node->prev  = NULL;
@@ -125,7 +128,7 @@ void list_append_before(list_t * list, node_t * after, node_t * node) {
 }
 
 node_t * list_insert_before(list_t * list, node_t * after, void * item) {
-	node_t * node = malloc(sizeof(node_t));
+	node_t * node = kmem_cache_alloc(&node_cache);
 	node->value = item;
 	node->next  = NULL;
 	node->prev  = NULL;
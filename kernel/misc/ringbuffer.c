@@ -15,6 +15,7 @@
 #include <bits/errno.h>
 #include <kernel/types.h>
 #include <kernel/ringbuffer.h>
+#include <kernel/iovec.h>
 #include <kernel/process.h>
 #include <kernel/spinlock.h>
 #include <kernel/string.h>
@@ -22,6 +23,8 @@
 #include <kernel/printf.h>
 #include <kernel/mmu.h>
 
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+
 size_t ring_buffer_unread(ring_buffer_t * ring_buffer) {
 	if (ring_buffer->read_ptr == ring_buffer->write_ptr) {
 		return 0;
@@ -50,18 +53,29 @@ size_t ring_buffer_available(ring_buffer_t * ring_buffer) {
 	}
 }
 
-static inline void ring_buffer_increment_read(ring_buffer_t * ring_buffer) {
-	ring_buffer->read_ptr++;
-	if (ring_buffer->read_ptr == ring_buffer->size) {
-		ring_buffer->read_ptr = 0;
-	}
+/*
+ * Move up to @p size bytes out of or into the buffer with at most two
+ * copies, one up to the end of the storage and one from the start.
+ * Callers hold the lock. Return how many bytes were moved.
+ */
+static size_t ring_buffer_copy_out(ring_buffer_t * ring_buffer, uint8_t * buffer, size_t size) {
+	size_t unread = ring_buffer_unread(ring_buffer);
+	if (size > unread) size = unread;
+	size_t first = MIN(size, ring_buffer->size - ring_buffer->read_ptr);
+	memcpy(buffer, ring_buffer->buffer + ring_buffer->read_ptr, first);
+	memcpy(buffer + first, ring_buffer->buffer, size - first);
+	ring_buffer->read_ptr = (ring_buffer->read_ptr + size) % ring_buffer->size;
+	return size;
 }
 
-static inline void ring_buffer_increment_write(ring_buffer_t * ring_buffer) {
-	ring_buffer->write_ptr++;
-	if (ring_buffer->write_ptr == ring_buffer->size) {
-		ring_buffer->write_ptr = 0;
-	}
+static size_t ring_buffer_copy_in(ring_buffer_t * ring_buffer, const uint8_t * buffer, size_t size) {
+	size_t available = ring_buffer_available(ring_buffer);
+	if (size > available) size = available;
+	size_t first = MIN(size, ring_buffer->size - ring_buffer->write_ptr);
+	memcpy(ring_buffer->buffer + ring_buffer->write_ptr, buffer, first);
+	memcpy(ring_buffer->buffer, buffer + first, size - first);
+	ring_buffer->write_ptr = (ring_buffer->write_ptr + size) % ring_buffer->size;
+	return size;
 }
 
 void ring_buffer_alert_waiters(ring_buffer_t * ring_buffer) {
@@ -92,61 +106,89 @@ void ring_buffer_discard(ring_buffer_t * ring_buffer) {
 	spin_unlock(ring_buffer->lock);
 }
 
-ssize_t ring_buffer_read(ring_buffer_t * ring_buffer, size_t size, uint8_t * buffer) {
-	size_t collected = 0;
-	while (collected == 0) {
-		spin_lock(ring_buffer->lock);
-		while (ring_buffer_unread(ring_buffer) > 0 && collected < size) {
-			buffer[collected] = ring_buffer->buffer[ring_buffer->read_ptr];
-			ring_buffer_increment_read(ring_buffer);
-			collected++;
+/*
+ * Move bytes out of or into the buffer across a list of segments,
+ * stopping at the first segment that could not be filled or drained
+ * completely. @p skip bytes at the start of the list have already
+ * been moved. Callers hold the lock.
+ */
+static size_t ring_buffer_copy_out_iov(ring_buffer_t * ring_buffer, const struct iovec * iov, int iovcnt, size_t skip) {
+	size_t moved = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
 		}
-		wakeup_queue(ring_buffer->wait_queue_writers);
-		if (collected == 0) {
-			if (ring_buffer->internal_stop || ring_buffer->soft_stop) {
-				ring_buffer->soft_stop = 0;
-				spin_unlock(ring_buffer->lock);
-				return 0;
-			}
-			if (sleep_on_unlocking(ring_buffer->wait_queue_readers, &ring_buffer->lock)) {
-				return -ERESTARTSYS;
-			}
-		} else {
+		size_t want = iov[i].iov_len - skip;
+		size_t got = ring_buffer_copy_out(ring_buffer, (uint8_t*)iov[i].iov_base + skip, want);
+		moved += got;
+		skip = 0;
+		if (got < want) break;
+	}
+	return moved;
+}
+
+static size_t ring_buffer_copy_in_iov(ring_buffer_t * ring_buffer, const struct iovec * iov, int iovcnt, size_t skip) {
+	size_t moved = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		size_t want = iov[i].iov_len - skip;
+		size_t got = ring_buffer_copy_in(ring_buffer, (const uint8_t*)iov[i].iov_base + skip, want);
+		moved += got;
+		skip = 0;
+		if (got < want) break;
+	}
+	return moved;
+}
+
+ssize_t ring_buffer_readv(ring_buffer_t * ring_buffer, const struct iovec * iov, int iovcnt) {
+	size_t collected;
+	if (!iov_length(iov, iovcnt)) return 0;
+
+	spin_lock(ring_buffer->lock);
+	while (!(collected = ring_buffer_copy_out_iov(ring_buffer, iov, iovcnt, 0))) {
+		if (ring_buffer->internal_stop || ring_buffer->soft_stop) {
+			ring_buffer->soft_stop = 0;
 			spin_unlock(ring_buffer->lock);
+			return 0;
+		}
+		if (sleep_on_unlocking(ring_buffer->wait_queue_readers, &ring_buffer->lock)) {
+			return -ERESTARTSYS;
 		}
+		spin_lock(ring_buffer->lock);
 	}
+	spin_unlock(ring_buffer->lock);
+
 	wakeup_queue(ring_buffer->wait_queue_writers);
 	return collected;
 }
 
-ssize_t ring_buffer_write(ring_buffer_t * ring_buffer, size_t size, uint8_t * buffer) {
+ssize_t ring_buffer_writev(ring_buffer_t * ring_buffer, const struct iovec * iov, int iovcnt) {
+	size_t size = iov_length(iov, iovcnt);
 	size_t written = 0;
-	while (written < size) {
-		spin_lock(ring_buffer->lock);
 
-		while (ring_buffer_available(ring_buffer) > 0 && written < size) {
-			ring_buffer->buffer[ring_buffer->write_ptr] = buffer[written];
-			ring_buffer_increment_write(ring_buffer);
-			written++;
+	spin_lock(ring_buffer->lock);
+	while (1) {
+		written += ring_buffer_copy_in_iov(ring_buffer, iov, iovcnt, written);
+		if (written == size || ring_buffer->discard) {
+			spin_unlock(ring_buffer->lock);
+			break;
 		}
 
+		/* Full; let readers drain what we have so far before waiting for room. */
 		wakeup_queue(ring_buffer->wait_queue_readers);
 		ring_buffer_alert_waiters(ring_buffer);
-		if (written < size) {
-			if (ring_buffer->discard) {
-				spin_unlock(ring_buffer->lock);
-				break;
-			}
-			if (sleep_on_unlocking(ring_buffer->wait_queue_writers, &ring_buffer->lock)) {
-				if (!written) return -ERESTARTSYS;
-				break;
-			}
-			if (ring_buffer->internal_stop) {
-				break;
-			}
-		} else {
-			spin_unlock(ring_buffer->lock);
+		if (sleep_on_unlocking(ring_buffer->wait_queue_writers, &ring_buffer->lock)) {
+			if (!written) return -ERESTARTSYS;
+			break;
 		}
+		if (ring_buffer->internal_stop) {
+			break;
+		}
+		spin_lock(ring_buffer->lock);
 	}
 
 	wakeup_queue(ring_buffer->wait_queue_readers);
@@ -154,6 +196,16 @@ ssize_t ring_buffer_write(ring_buffer_t * ring_buffer, size_t size, uint8_t * bu
 	return written;
 }
 
+ssize_t ring_buffer_read(ring_buffer_t * ring_buffer, size_t size, uint8_t * buffer) {
+	struct iovec iov = { buffer, size };
+	return ring_buffer_readv(ring_buffer, &iov, 1);
+}
+
+ssize_t ring_buffer_write(ring_buffer_t * ring_buffer, size_t size, uint8_t * buffer) {
+	struct iovec iov = { buffer, size };
+	return ring_buffer_writev(ring_buffer, &iov, 1);
+}
+
 ring_buffer_t * ring_buffer_create(size_t size) {
 	ring_buffer_t * out = malloc(sizeof(ring_buffer_t));
 
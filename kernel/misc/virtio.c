@@ -0,0 +1,375 @@
+/**
+ * @file  kernel/misc/virtio.c
+ * @brief Virtio PCI transport and split virtqueues.
+ *
+ * Device configuration is found through the vendor-specific PCI
+ * capabilities of a "modern" (virtio 1.0) device, so this works
+ * wherever the BARs end up. Queues are split rings with a free list
+ * of descriptors; a request is a chain of descriptors and is
+ * identified by the cookie the driver passed when adding it.
+ *
+ * Drivers can add any number of requests and then kick once. With
+ * VIRTIO_F_RING_EVENT_IDX, the device tells us how far it has read
+ * the available ring and we only notify it if it has caught up to
+ * requests we added since the last notification, and we tell it how
+ * far we have read the used ring so it only interrupts us when it
+ * passes that point.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdint.h>
+#include <bits/errno.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/mmu.h>
+#include <kernel/pci.h>
+#include <kernel/virtio.h>
+
+#define PCI_STATUS_CAP_LIST  0x10
+#define PCI_CAPABILITY_LIST  0x34
+#define PCI_CAP_ID_VNDR      0x09
+
+#define VIRTIO_PCI_CAP_COMMON_CFG  1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG  2
+#define VIRTIO_PCI_CAP_ISR_CFG     3
+#define VIRTIO_PCI_CAP_DEVICE_CFG  4
+
+#if defined(__aarch64__)
+/* Rings are mapped uncached here, but the device must still see our writes in order. */
+#define virtio_wmb() asm volatile ("dsb sy" ::: "memory")
+#define virtio_rmb() asm volatile ("dsb sy" ::: "memory")
+#define virtio_mb()  asm volatile ("dsb sy" ::: "memory")
+#else
+#define virtio_wmb() asm volatile ("" ::: "memory")
+#define virtio_rmb() asm volatile ("" ::: "memory")
+#define virtio_mb()  asm volatile ("mfence" ::: "memory")
+#endif
+
+/**
+ * @brief Allocate zeroed, physically contiguous memory the device can reach.
+ */
+void * virtio_alloc(size_t size, uintptr_t * phys) {
+	size = (size + 0xFFF) & ~0xFFFUL;
+	uintptr_t frames = mmu_allocate_n_frames(size >> 12) << 12;
+	*phys = frames;
+#if defined(__aarch64__)
+	void * virt = mmu_map_mmio_region(frames, size);
+#else
+	void * virt = mmu_map_from_physical(frames);
+#endif
+	memset(virt, 0, size);
+	return virt;
+}
+
+static uintptr_t virtio_bar_address(uint32_t pcidev, int bar) {
+	uint32_t low = pci_read_field(pcidev, PCI_BAR0 + bar * 4, 4);
+	if (low & 1) return 0; /* I/O space; the capabilities we use are all in memory space */
+	uintptr_t addr = low & 0xFFFFFFF0;
+	if ((low & 0x6) == 0x4) {
+		addr |= (uintptr_t)pci_read_field(pcidev, PCI_BAR0 + bar * 4 + 4, 4) << 32;
+	}
+	return addr;
+}
+
+static volatile void * virtio_map(uint32_t pcidev, int bar, uint32_t offset, uint32_t length) {
+	uintptr_t base = virtio_bar_address(pcidev, bar);
+	if (!base) return NULL;
+	uintptr_t start = base + offset;
+	uintptr_t page = start & ~0xFFFUL;
+	size_t size = (start + length - page + 0xFFF) & ~0xFFFUL;
+	return (volatile char *)mmu_map_mmio_region(page, size) + (start - page);
+}
+
+/**
+ * @brief Find and map a device's configuration structures.
+ *
+ * Also turns on memory space decoding and bus mastering, and makes
+ * sure legacy interrupts are not masked.
+ *
+ * @returns 0 on success, -ENODEV if the device is not a modern virtio device.
+ */
+int virtio_pci_init(struct virtio_device * dev, uint32_t pcidev) {
+	memset(dev, 0, sizeof(struct virtio_device));
+	dev->pci = pcidev;
+
+	uint16_t command_reg = pci_read_field(pcidev, PCI_COMMAND, 2);
+	command_reg |= (1 << 2) | (1 << 1);
+	command_reg &= ~(1 << 10);
+	pci_write_field(pcidev, PCI_COMMAND, 2, command_reg);
+
+	if (!(pci_read_field(pcidev, PCI_STATUS, 2) & PCI_STATUS_CAP_LIST)) return -ENODEV;
+
+	int cap = pci_read_field(pcidev, PCI_CAPABILITY_LIST, 1) & 0xFC;
+	for (int limit = 48; cap && limit; limit--) {
+		if (pci_read_field(pcidev, cap, 1) == PCI_CAP_ID_VNDR) {
+			int type = pci_read_field(pcidev, cap + 3, 1);
+			int bar = pci_read_field(pcidev, cap + 4, 1);
+			uint32_t offset = pci_read_field(pcidev, cap + 8, 4);
+			uint32_t length = pci_read_field(pcidev, cap + 12, 4);
+
+			/* The first structure of each type is the preferred one. */
+			if (bar <= 5) switch (type) {
+				case VIRTIO_PCI_CAP_COMMON_CFG:
+					if (!dev->common) dev->common = (void*)virtio_map(pcidev, bar, offset, length);
+					break;
+				case VIRTIO_PCI_CAP_NOTIFY_CFG:
+					if (!dev->notify_base) {
+						dev->notify_base = (uintptr_t)virtio_map(pcidev, bar, offset, length);
+						dev->notify_mul = pci_read_field(pcidev, cap + 16, 4);
+					}
+					break;
+				case VIRTIO_PCI_CAP_ISR_CFG:
+					if (!dev->isr) dev->isr = virtio_map(pcidev, bar, offset, length);
+					break;
+				case VIRTIO_PCI_CAP_DEVICE_CFG:
+					if (!dev->device_cfg) dev->device_cfg = virtio_map(pcidev, bar, offset, length);
+					break;
+			}
+		}
+		cap = pci_read_field(pcidev, cap + 1, 1) & 0xFC;
+	}
+
+	if (!dev->common || !dev->notify_base || !dev->isr) return -ENODEV;
+	return 0;
+}
+
+/**
+ * @brief Reset the device, which also forgets all of its queues.
+ */
+void virtio_reset(struct virtio_device * dev) {
+	dev->common->device_status = 0;
+	virtio_mb();
+	for (int limit = 1000000; dev->common->device_status && limit; limit--);
+}
+
+/**
+ * @brief Acknowledge the device and accept the features we want that it offers.
+ *
+ * The device must offer VIRTIO_F_VERSION_1. The accepted set is left
+ * in dev->features.
+ */
+int virtio_negotiate(struct virtio_device * dev, uint64_t wanted) {
+	struct virtio_pci_common_cfg * common = dev->common;
+
+	common->device_status |= VIRTIO_STATUS_ACKNOWLEDGE;
+	common->device_status |= VIRTIO_STATUS_DRIVER;
+
+	uint64_t offered = 0;
+	for (int i = 0; i < 2; ++i) {
+		common->dev_feature_select = i;
+		virtio_mb();
+		offered |= (uint64_t)common->dev_feature << (32 * i);
+	}
+
+	dev->features = offered & (wanted | VIRTIO_F_VERSION_1);
+	if (!(dev->features & VIRTIO_F_VERSION_1)) {
+		common->device_status |= VIRTIO_STATUS_FAILED;
+		return -ENODEV;
+	}
+
+	for (int i = 0; i < 2; ++i) {
+		common->guest_feature_select = i;
+		virtio_mb();
+		common->guest_feature = dev->features >> (32 * i);
+	}
+
+	common->device_status |= VIRTIO_STATUS_FEATURES_OK;
+	virtio_mb();
+	if (!(common->device_status & VIRTIO_STATUS_FEATURES_OK)) {
+		common->device_status |= VIRTIO_STATUS_FAILED;
+		return -ENODEV;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Tell the device we are done setting up; it may start using its queues.
+ */
+void virtio_driver_ok(struct virtio_device * dev) {
+	virtio_mb();
+	dev->common->device_status |= VIRTIO_STATUS_DRIVER_OK;
+}
+
+/**
+ * @brief Read, and thereby clear, the interrupt status.
+ *
+ * Bit 0 means a queue has new used buffers, bit 1 means the device
+ * configuration changed.
+ */
+uint8_t virtio_isr(struct virtio_device * dev) {
+	return *dev->isr;
+}
+
+/**
+ * @brief Set up and enable one of the device's queues.
+ *
+ * Must be called after virtio_negotiate and before virtio_driver_ok.
+ *
+ * @param max_size Upper bound on the queue size, a power of two, or 0 for the device's maximum.
+ * @returns The queue, or NULL if the device doesn't have one at @p index.
+ */
+struct virtq * virtq_create(struct virtio_device * dev, uint16_t index, uint16_t max_size) {
+	struct virtio_pci_common_cfg * common = dev->common;
+
+	common->queue_select = index;
+	virtio_mb();
+	uint16_t size = common->queue_size;
+	if (!size) return NULL;
+	if (max_size && size > max_size) size = max_size;
+
+	/* Keep the ring we write apart from the one the device writes. */
+	size_t avail_offset = sizeof(struct virtq_desc) * size;
+	size_t used_offset  = (avail_offset + sizeof(struct virtq_avail) + sizeof(uint16_t) * (size + 1) + 63) & ~63UL;
+	size_t total        = used_offset + sizeof(struct virtq_used) + sizeof(struct virtq_used_elem) * size + sizeof(uint16_t);
+
+	uintptr_t phys;
+	char * ring = virtio_alloc(total, &phys);
+
+	struct virtq * q = calloc(1, sizeof(struct virtq));
+	q->dev   = dev;
+	q->index = index;
+	q->size  = size;
+	q->desc  = (void*)ring;
+	q->avail = (void*)(ring + avail_offset);
+	q->used  = (void*)(ring + used_offset);
+	q->used_event  = &q->avail->ring[size];
+	q->avail_event = (volatile uint16_t *)&q->used->ring[size];
+	q->event_idx = !!(dev->features & VIRTIO_F_RING_EVENT_IDX);
+	q->cookies = calloc(size, sizeof(void*));
+	spin_init(q->lock);
+
+	for (uint16_t i = 0; i < size; ++i) {
+		q->desc[i].next = i + 1;
+	}
+	q->free_head = 0;
+	q->num_free = size;
+
+	common->queue_size  = size;
+	common->queue_desc  = phys;
+	common->queue_avail = phys + avail_offset;
+	common->queue_used  = phys + used_offset;
+	q->notify = (volatile uint16_t *)(dev->notify_base + common->queue_notify_off * dev->notify_mul);
+	virtio_mb();
+	common->queue_enable = 1;
+
+	return q;
+}
+
+/**
+ * @brief Make a request available to the device.
+ *
+ * The first @p out entries of @p sg are read by the device, the next
+ * @p in are written by it. The device is not notified; call virtq_kick
+ * once a batch of requests has been added.
+ *
+ * @returns 0, or -ENOSPC if the queue doesn't have enough free descriptors.
+ */
+int virtq_add(struct virtq * q, struct virtq_sg * sg, int out, int in, void * cookie) {
+	int total = out + in;
+	if (!total) return -EINVAL;
+	if (q->num_free < total) return -ENOSPC;
+
+	/* Free descriptors are already chained through their next fields. */
+	uint16_t head = q->free_head;
+	uint16_t i = head;
+	for (int n = 0; n < total; ++n) {
+		volatile struct virtq_desc * d = &q->desc[i];
+		d->addr  = sg[n].phys;
+		d->len   = sg[n].len;
+		d->flags = (n >= out ? VIRTQ_DESC_F_WRITE : 0) | (n + 1 < total ? VIRTQ_DESC_F_NEXT : 0);
+		i = d->next;
+	}
+	q->free_head = i;
+	q->num_free -= total;
+	q->cookies[head] = cookie;
+
+	q->avail->ring[q->avail_idx % q->size] = head;
+	virtio_wmb();
+	q->avail->idx = ++q->avail_idx;
+	return 0;
+}
+
+/**
+ * @brief Decide whether the device needs to be told about new requests.
+ *
+ * Split from virtq_notify so drivers can ring the doorbell, which
+ * costs a VM exit, after dropping their lock.
+ */
+int virtq_kick_prepare(struct virtq * q) {
+	virtio_mb();
+	uint16_t old = q->kicked_idx;
+	uint16_t new = q->avail_idx;
+	q->kicked_idx = new;
+	if (q->event_idx) {
+		return (uint16_t)(new - *q->avail_event - 1) < (uint16_t)(new - old);
+	}
+	return !(q->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+}
+
+void virtq_notify(struct virtq * q) {
+	*q->notify = q->index;
+}
+
+void virtq_kick(struct virtq * q) {
+	if (virtq_kick_prepare(q)) virtq_notify(q);
+}
+
+/**
+ * @brief Take the next completed request from the used ring.
+ *
+ * @param len If not NULL, receives the number of bytes the device wrote.
+ * @returns The request's cookie, or NULL if there are no more.
+ */
+void * virtq_get(struct virtq * q, uint32_t * len) {
+	if (q->last_used == q->used->idx) return NULL;
+	virtio_rmb();
+
+	volatile struct virtq_used_elem * elem = &q->used->ring[q->last_used % q->size];
+	uint16_t head = elem->id;
+	if (len) *len = elem->len;
+	q->last_used++;
+
+	uint16_t i = head;
+	uint16_t count = 1;
+	while (q->desc[i].flags & VIRTQ_DESC_F_NEXT) {
+		i = q->desc[i].next;
+		count++;
+	}
+	q->desc[i].next = q->free_head;
+	q->free_head = head;
+	q->num_free += count;
+
+	void * cookie = q->cookies[head];
+	q->cookies[head] = NULL;
+	return cookie;
+}
+
+/**
+ * @brief Ask the device not to interrupt us for this queue.
+ *
+ * With event indexes this is free: the device only interrupts when the
+ * used index passes the point we last asked for, and we don't move it.
+ */
+void virtq_disable_cb(struct virtq * q) {
+	if (!q->event_idx) q->avail->flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
+}
+
+/**
+ * @brief Ask for an interrupt when the next request completes.
+ *
+ * @returns Non-zero if requests completed while interrupts were off,
+ *          in which case the caller should go back to virtq_get.
+ */
+int virtq_enable_cb(struct virtq * q) {
+	if (q->event_idx) {
+		*q->used_event = q->last_used;
+	} else {
+		q->avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+	}
+	virtio_mb();
+	return q->used->idx != q->last_used;
+}
@@ -53,6 +53,11 @@ hashmap_t * net_arp_cache = NULL;
 void net_arp_cache_add(struct EthernetDevice * iface, uint32_t addr, uint8_t * hwaddr, uint16_t flags) {
 	spin_lock(net_arp_cache_lock);
 	struct ArpCacheEntry * entry = hashmap_get(net_arp_cache, (void*)(uintptr_t)addr);
+	if (entry && entry->iface == iface && entry->flags == flags && !memcmp(entry->hwaddr, hwaddr, 6)) {
+		/* Nothing new; this is the common case, once per received packet. */
+		spin_unlock(net_arp_cache_lock);
+		return;
+	}
 	if (!entry) entry = malloc(sizeof(struct ArpCacheEntry));
 	memcpy(entry->hwaddr, hwaddr, 6);
 	entry->flags = flags;
@@ -28,26 +28,29 @@
 
 extern spin_lock_t net_raw_sockets_lock;
 extern list_t * net_raw_sockets_list;
-extern void net_ipv4_handle(void * packet, fs_node_t * nic, size_t);
+extern void net_ipv4_handle(net_buffer_t * buf, void * packet, fs_node_t * nic, size_t);
 extern void net_arp_handle(void * packet, fs_node_t * nic);
 
-void net_eth_handle(struct ethernet_packet * frame, fs_node_t * nic, size_t size) {
+/**
+ * @brief Deliver a frame that is already in a receive buffer.
+ *
+ * The caller keeps its reference to @p buf and must have checked
+ * that it holds at least an Ethernet header.
+ */
+void net_eth_receive(net_buffer_t * buf, fs_node_t * nic) {
 	struct EthernetDevice * nic_eth = nic->device;
+	struct ethernet_packet * frame = (struct ethernet_packet *)buf->data;
 
-	if (size < sizeof(struct ethernet_packet)) {
-		dprintf("eth: %s: invalid ethernet frame (too small)\n",
-			nic_eth->if_name);
-		return;
-	}
-
-	spin_lock(net_raw_sockets_lock);
-	foreach(node, net_raw_sockets_list) {
-		sock_t * sock = node->value;
-		if (!sock->_fnode.device || sock->_fnode.device == nic) {
-			net_sock_add(sock, frame, size);
+	if (net_raw_sockets_list->length) {
+		spin_lock(net_raw_sockets_lock);
+		foreach(node, net_raw_sockets_list) {
+			sock_t * sock = node->value;
+			if (!sock->_fnode.device || sock->_fnode.device == nic) {
+				net_sock_add(sock, buf, frame, buf->size);
+			}
 		}
+		spin_unlock(net_raw_sockets_lock);
 	}
-	spin_unlock(net_raw_sockets_lock);
 
 	if (!memcmp(frame->destination, nic_eth->mac, 6) || !memcmp(frame->destination, ETHERNET_BROADCAST_MAC, 6)) {
 		/* Now pass the frame to the appropriate handler... */
@@ -61,20 +64,59 @@ void net_eth_handle(struct ethernet_packet * frame, fs_node_t * nic, size_t size
 				if (packet->source != 0xFFFFFFFF) {
 					net_arp_cache_add(nic->device, packet->source, frame->source, 0);
 				}
-				net_ipv4_handle(packet, nic, size - sizeof(struct ethernet_packet));
+				net_ipv4_handle(buf, packet, nic, buf->size - sizeof(struct ethernet_packet));
 				break;
 			}
 		}
 	}
 }
 
-void net_eth_send(struct EthernetDevice * nic, size_t len, void* data, uint16_t type, uint8_t * dest) {
-	size_t total_size = sizeof(struct ethernet_packet) + len;
-	struct ethernet_packet * packet = malloc(total_size);
+/**
+ * @brief Hand a received frame to the network stack.
+ *
+ * The frame is copied once, into a shared receive buffer; the
+ * caller keeps ownership of @p frame. @p flags are NET_BUFFER_*
+ * flags for the buffer, eg. to say the NIC verified its checksum.
+ */
+void net_eth_handle(struct ethernet_packet * frame, fs_node_t * nic, size_t size, int flags) {
+	struct EthernetDevice * nic_eth = nic->device;
+
+	if (size < sizeof(struct ethernet_packet)) {
+		dprintf("eth: %s: invalid ethernet frame (too small)\n",
+			nic_eth->if_name);
+		return;
+	}
+
+	net_buffer_t * buf = net_buffer_alloc(size);
+	buf->flags = flags;
+	memcpy(buf->data, frame, size);
+	net_eth_receive(buf, nic);
+	net_buffer_release(buf);
+}
+
+static struct ethernet_packet * eth_frame(struct EthernetDevice * nic, size_t len, void * data, uint16_t type, uint8_t * dest) {
+	struct ethernet_packet * packet = net_packet_alloc(sizeof(struct ethernet_packet) + len);
 	memcpy(packet->payload, data, len);
 	memcpy(packet->destination, dest, 6);
 	memcpy(packet->source, nic->mac, 6);
 	packet->type = htons(type);
-	write_fs(nic->device_node, 0, total_size, (uint8_t*)packet);
+	return packet;
+}
+
+void net_eth_send(struct EthernetDevice * nic, size_t len, void* data, uint16_t type, uint8_t * dest) {
+	struct ethernet_packet * packet = eth_frame(nic, len, data, type, dest);
+	write_fs(nic->device_node, 0, sizeof(struct ethernet_packet) + len, (uint8_t*)packet);
+	free(packet);
+}
+
+/**
+ * @brief Send a frame whose checksum the NIC will finish.
+ *
+ * @p csum_start and @p csum_offset are relative to @p data, and
+ * @p nic must have a send_partial method.
+ */
+void net_eth_send_partial(struct EthernetDevice * nic, size_t len, void* data, uint16_t type, uint8_t * dest, size_t csum_start, size_t csum_offset) {
+	struct ethernet_packet * packet = eth_frame(nic, len, data, type, dest);
+	nic->send_partial(nic, packet, sizeof(struct ethernet_packet) + len, sizeof(struct ethernet_packet) + csum_start, csum_offset);
 	free(packet);
 }
@@ -1,6 +1,6 @@
 /**
  * @file  kernel/net/ipv4.c
- * @brief IPv4, TCP, UDP protocol implementation.
+ * @brief IPv4, ICMP, UDP protocol implementation.
  *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
@@ -14,6 +14,7 @@
 #include <kernel/syscall.h>
 #include <kernel/hashmap.h>
 #include <kernel/vfs.h>
+#include <kernel/iovec.h>
 #include <kernel/time.h>
 #include <kernel/misc.h>
 #include <kernel/assert.h>
@@ -30,131 +31,30 @@
 //#define printf(...)
 #endif
 
-#define DEFAULT_TCP_WINDOW_SIZE 65535
-
 /* priv slots */
 #define SOCK_PRIV_IPV4_PORT  0
-#define SOCK_PRIV_TCP_STATE  1
-#define SOCK_PRIV_TCP_IDENT  2
 
 /* priv32 slots */
 #define SOCK_PRIV32_ICMP_IDENT 0
 
-#define SOCK_PRIV32_TCP_SEQ_NUM 0
-#define SOCK_PRIV32_TCP_ACK_NUM 1
-
 #define SOCK_PRIV32_IPV4_TTL 2 /* Shared */
 
-enum {
-	TCP_STATE_NONE, /* Not doing anything. */
-	TCP_STATE_WAITING, /* Sent SYN, waiting on response */
-	TCP_STATE_ACKED, /* Received ACK for SYN */
-	TCP_STATE_FIN, /* Received FIN, shut down */
-
-	TCP_STATE_BOUND, /* Socket is bound and waiting to listen */
-};
-
 static int _debug __attribute__((unused)) = 0;
 
-static void ip_ntoa(const uint32_t src_addr, char * out) {
-	snprintf(out, 16, "%d.%d.%d.%d",
-		(src_addr & 0xFF000000) >> 24,
-		(src_addr & 0xFF0000) >> 16,
-		(src_addr & 0xFF00) >> 8,
-		(src_addr & 0xFF));
-}
-
-static uint16_t icmp_checksum(struct ipv4_packet * packet) {
-	uint32_t sum = 0;
-	uint16_t * s = (uint16_t *)packet->payload;
-	for (int i = 0; i < (ntohs(packet->length) - 20) / 2; ++i) {
-		sum += ntohs(s[i]);
-	}
-	if (sum > 0xFFFF) {
-		sum = (sum >> 16) + (sum & 0xFFFF);
-	}
-	return ~(sum & 0xFFFF) & 0xFFFF;
-}
-
-uint16_t calculate_ipv4_checksum(struct ipv4_packet * p) {
-	uint32_t sum = 0;
-	uint16_t * s = (uint16_t *)p;
-
-	/* TODO: Checksums for options? */
-	for (int i = 0; i < 10; ++i) {
-		sum += ntohs(s[i]);
-		if (sum > 0xFFFF) {
-			sum = (sum >> 16) + (sum & 0xFFFF);
-		}
-	}
-
-
-	return ~(sum & 0xFFFF) & 0xFFFF;
-}
-
-uint16_t calculate_tcp_checksum(void * p, void * h, void * d, size_t payload_size) {
-	uint32_t sum = 0;
-
-	/* TODO: Checksums for options? */
-	for (int i = 0; i < 6; ++i) {
-		uint16_t _s;
-		memcpy(&_s, ((char*)p) + (i * 2), 2);
-		sum += ntohs(_s);
-		if (sum > 0xFFFF) {
-			sum = (sum >> 16) + (sum & 0xFFFF);
-		}
-	}
-
-	for (int i = 0; i < 10; ++i) {
-		uint16_t _s;
-		memcpy(&_s, ((char*)h) + (i * 2), 2);
-		sum += ntohs(_s);
-		if (sum > 0xFFFF) {
-			sum = (sum >> 16) + (sum & 0xFFFF);
-		}
-	}
-
-	if (d) {
-		uint16_t d_words = payload_size / 2;
-
-		for (unsigned int i = 0; i < d_words; ++i) {
-			uint16_t _s;
-			memcpy(&_s, ((char*)d) + (i * 2), 2);
-			sum += ntohs(_s);
-			if (sum > 0xFFFF) {
-				sum = (sum >> 16) + (sum & 0xFFFF);
-			}
-		}
-
-		if (d_words * 2 != payload_size) {
-			uint8_t * t = (uint8_t *)d;
-			uint8_t tmp[2];
-			tmp[0] = t[d_words * sizeof(uint16_t)];
-			tmp[1] = 0;
-
-			uint16_t * f = (uint16_t *)tmp;
-
-			sum += ntohs(f[0]);
-			if (sum > 0xFFFF) {
-				sum = (sum >> 16) + (sum & 0xFFFF);
-			}
-		}
-	}
-
-	return ~(sum & 0xFFFF) & 0xFFFF;
-}
-
 static hashmap_t * udp_sockets = NULL;
-static hashmap_t * tcp_sockets = NULL;
 static hashmap_t * icmp_sockets = NULL;
 
+extern void net_tcp_install(void);
+extern void net_tcp_handle(net_buffer_t * buf, struct ipv4_packet * packet, fs_node_t * nic, size_t size);
+extern long net_tcp_socket(int flags, int nb);
+
 void ipv4_install(void) {
 	udp_sockets = hashmap_create_int(10);
-	tcp_sockets = hashmap_create_int(10);
 	icmp_sockets = hashmap_create_int(10);
+	net_tcp_install();
 }
 
-int net_ipv4_send(struct ipv4_packet * response, fs_node_t * nic) {
+static int ipv4_send(struct ipv4_packet * response, fs_node_t * nic, size_t csum_start, size_t csum_offset) {
 	/* TODO: This should be routing, with a _hint_ about the interface, not the actual nic to send from! */
 	struct EthernetDevice * enic = nic->device;
 
@@ -184,11 +84,59 @@ int net_ipv4_send(struct ipv4_packet * response, fs_node_t * nic) {
 
 
 	/* Pass the packet to the next stage */
-	net_eth_send(enic, ntohs(response->length), response, ETHERNET_TYPE_IPV4, resp ? resp->hwaddr : ETHERNET_BROADCAST_MAC);
+	uint8_t * hwaddr = resp ? resp->hwaddr : ETHERNET_BROADCAST_MAC;
+	if (csum_start) {
+		net_eth_send_partial(enic, ntohs(response->length), response, ETHERNET_TYPE_IPV4, hwaddr, csum_start, csum_offset);
+	} else {
+		net_eth_send(enic, ntohs(response->length), response, ETHERNET_TYPE_IPV4, hwaddr);
+	}
 
 	return 0;
 }
 
+int net_ipv4_send(struct ipv4_packet * response, fs_node_t * nic) {
+	return ipv4_send(response, nic, 0, 0);
+}
+
+/**
+ * @brief Send a TCP or UDP packet, filling in its checksum.
+ *
+ * @p csum_offset is the offset of the checksum field in the
+ * transport header. If the NIC can finish the checksum itself, we
+ * only supply the pseudo-header sum and leave the rest to it.
+ */
+int net_ipv4_send_csum(struct ipv4_packet * response, fs_node_t * nic, size_t csum_offset) {
+	struct EthernetDevice * enic = nic->device;
+	size_t ihl = (response->version_ihl & 0xF) * 4;
+	size_t length = ntohs(response->length) - ihl;
+	uint8_t * segment = (uint8_t *)response + ihl;
+	uint16_t * csum = (uint16_t *)(segment + csum_offset);
+	uint32_t sum = net_checksum_pseudo(response->source, response->destination, response->protocol, length);
+
+	if (enic->send_partial) {
+		*csum = net_checksum_fold(sum);
+		return ipv4_send(response, nic, ihl, csum_offset);
+	}
+
+	*csum = 0;
+	*csum = net_checksum_finish(net_checksum_add(segment, length, sum));
+	/* A zero UDP checksum means there isn't one. */
+	if (!*csum && response->protocol == IPV4_PROT_UDP) *csum = 0xFFFF;
+	return ipv4_send(response, nic, 0, 0);
+}
+
+/**
+ * @brief Check the TCP or UDP checksum of a received packet.
+ *
+ * Trusts the NIC if it already checked, or if the packet came from
+ * ourselves with the checksum left unfinished.
+ */
+int net_ipv4_checksum_ok(net_buffer_t * buf, struct ipv4_packet * packet, void * segment, size_t length) {
+	if (buf->flags & NET_BUFFER_CSUM_OK) return 1;
+	uint32_t sum = net_checksum_pseudo(packet->source, packet->destination, packet->protocol, length);
+	return net_checksum_finish(net_checksum_add(segment, length, sum)) == 0;
+}
+
 static void sock_ipv4_control_common(sock_t * sock, struct msghdr * msg, struct ipv4_packet * src, int proto) {
 	/* TODO Other options; priv32[2] should be for flags? */
 	if (sock->priv32[SOCK_PRIV32_IPV4_TTL] && msg->msg_controllen > sizeof(struct cmsghdr) + 1) {
@@ -203,19 +151,18 @@ static void sock_ipv4_control_common(sock_t * sock, struct msghdr * msg, struct
 	}
 }
 
-static void icmp_handle(struct ipv4_packet * packet, const char * src, const char * dest, fs_node_t * nic) {
+static void icmp_handle(net_buffer_t * buf, struct ipv4_packet * packet, fs_node_t * nic) {
 	struct icmp_header * header = (void*)&packet->payload;
 
 	/* Is this a PING request? */
 	if (header->type == 8 && header->code == 0) {
 		printf("net: ping with %d bytes of payload\n", ntohs(packet->length));
-		if (ntohs(packet->length) & 1) {
-			packet->length = htons(ntohs(packet->length) + 1);
-		}
-
-		struct ipv4_packet * response = malloc(ntohs(packet->length));
-		memcpy(response, packet, ntohs(packet->length));
-		response->length = packet->length;
+		/* The request may be shared with raw sockets, so pad the reply, not the request. */
+		size_t length = ntohs(packet->length);
+		struct ipv4_packet * response = calloc(length + 1, 1);
+		memcpy(response, packet, length);
+		if (length & 1) length++;
+		response->length = htons(length);
 		response->destination = packet->source;
 		response->source = ((struct EthernetDevice*)nic->device)->ipv4_addr;
 		response->ttl = 64;
@@ -225,12 +172,12 @@ static void icmp_handle(struct ipv4_packet * packet, const char * src, const cha
 		response->version_ihl = 0x45;
 		response->dscp_ecn = 0;
 		response->checksum = 0;
-		response->checksum = htons(calculate_ipv4_checksum(response));
+		response->checksum = net_checksum(response, sizeof(struct ipv4_packet));
 
 		struct icmp_header * ping_reply = (void*)&response->payload;
 		ping_reply->csum = 0;
 		ping_reply->type = 0;
-		ping_reply->csum = htons(icmp_checksum(response));
+		ping_reply->csum = net_checksum(ping_reply, length - sizeof(struct ipv4_packet));
 
 		/* send ipv4... */
 		net_ipv4_send(response,nic);
@@ -239,10 +186,11 @@ static void icmp_handle(struct ipv4_packet * packet, const char * src, const cha
 		/* Did we have a client waiting for this? */
 		sock_t * handler = hashmap_get(icmp_sockets, (void*)(uintptr_t)ntohs(header->identifier));
 		if (handler) {
-			net_sock_add(handler, packet, ntohs(packet->length));
+			net_sock_add(handler, buf, packet, ntohs(packet->length));
 		}
 	} else {
-		printf("net: ipv4: %s: %s -> %s ICMP %d (code = %d)\n", nic->name, src, dest, header->type, header->code);
+		printf("net: ipv4: %s: " IPV4_FORMAT " -> " IPV4_FORMAT " ICMP %d (code = %d)\n", nic->name,
+			FORMAT_IPV4(packet->source), FORMAT_IPV4(packet->destination), header->type, header->code);
 	}
 }
 
@@ -251,22 +199,20 @@ static void sock_icmp_close(sock_t * sock) {
 }
 
 static long sock_icmp_recv(sock_t * sock, struct msghdr * msg, int flags) {
-	if (msg->msg_iovlen > 1) {
-		return -ENOTSUP;
-	}
 	if (msg->msg_iovlen == 0) return 0;
+	size_t space = iov_length(msg->msg_iov, msg->msg_iovlen);
 
 	if (!sock->rx_queue->length && sock->nonblocking) return -EAGAIN;
 
-	char * packet = net_sock_get(sock);
+	sock_packet_t * packet = net_sock_get(sock);
 	if (!packet) return -EINTR;
-	size_t packet_size = *(size_t*)packet - sizeof(struct ipv4_packet);
+	size_t packet_size = packet->size - sizeof(struct ipv4_packet);
 
-	struct ipv4_packet * src = (struct ipv4_packet*)(packet + sizeof(size_t));
+	struct ipv4_packet * src = packet->data;
 
-	if (packet_size > msg->msg_iov[0].iov_len) {
+	if (packet_size > space) {
 		dprintf("ICMP recv too big for vector\n");
-		packet_size = msg->msg_iov[0].iov_len;
+		packet_size = space;
 	}
 
 	if (msg->msg_namelen == sizeof(struct sockaddr_in)) {
@@ -279,25 +225,26 @@ static long sock_icmp_recv(sock_t * sock, struct msghdr * msg, int flags) {
 
 	sock_ipv4_control_common(sock,msg,src,IPPROTO_ICMP);
 
-	memcpy(msg->msg_iov[0].iov_base, src->payload, packet_size);
-	free(packet);
+	iov_scatter(msg->msg_iov, msg->msg_iovlen, 0, (uint8_t*)src->payload, packet_size);
+	net_sock_packet_free(packet);
 	return packet_size;
 }
 
 static long sock_icmp_send(sock_t * sock, const struct msghdr *msg, int flags) {
-	if (msg->msg_iovlen > 1) return -ENOTSUP;
 	if (msg->msg_iovlen == 0) return 0;
 	if (msg->msg_namelen != sizeof(struct sockaddr_in)) return -EINVAL;
-	if (msg->msg_iov[0].iov_len < sizeof(struct icmp_header)) return -EINVAL;
+	size_t payload_length = iov_length(msg->msg_iov, msg->msg_iovlen);
+	if (payload_length < sizeof(struct icmp_header)) return -EINVAL;
 
-	struct icmp_header * icmp = msg->msg_iov[0].iov_base;
-	if (icmp->type != 8 || icmp->code != 0) return -EINVAL;
-	if (icmp->identifier != 0) return -EINVAL;
+	struct icmp_header icmp;
+	iov_gather((uint8_t*)&icmp, msg->msg_iov, msg->msg_iovlen, 0, sizeof(struct icmp_header));
+	if (icmp.type != 8 || icmp.code != 0) return -EINVAL;
+	if (icmp.identifier != 0) return -EINVAL;
 
 	struct sockaddr_in * name = msg->msg_name;
 	fs_node_t * nic = net_if_route(name->sin_addr.s_addr);
 	if (!nic) return -ENONET;
-	size_t total_length = sizeof(struct ipv4_packet) + msg->msg_iov[0].iov_len;
+	size_t total_length = sizeof(struct ipv4_packet) + payload_length;
 
 	struct ipv4_packet * response = malloc(total_length);
 	response->length = htons(total_length);
@@ -310,13 +257,13 @@ static long sock_icmp_send(sock_t * sock, const struct msghdr *msg, int flags) {
 	response->version_ihl = 0x45;
 	response->dscp_ecn = 0;
 	response->checksum = 0;
-	response->checksum = htons(calculate_ipv4_checksum(response));
+	response->checksum = net_checksum(response, sizeof(struct ipv4_packet));
 
-	memcpy(response->payload, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len);
+	iov_gather(response->payload, msg->msg_iov, msg->msg_iovlen, 0, payload_length);
 	struct icmp_header * micmp = (struct icmp_header*)response->payload;
 	micmp->identifier = htons(sock->priv32[SOCK_PRIV32_ICMP_IDENT]);
 	micmp->csum = 0;
-	micmp->csum = htons(icmp_checksum(response));
+	micmp->csum = net_checksum(micmp, payload_length);
 
 	net_ipv4_send(response,nic);
 	free(response);
@@ -337,177 +284,38 @@ static int icmp_socket(int flags, int nb) {
 	return process_append_fd((process_t *)this_core->current_process, (fs_node_t *)sock, flags | PROC_FD_MODE__RW);
 }
 
-#define TCP_FLAGS_FIN (1 << 0)
-#define TCP_FLAGS_SYN (1 << 1)
-#define TCP_FLAGS_RST (1 << 2)
-#define TCP_FLAGS_PSH (1 << 3)
-#define TCP_FLAGS_ACK (1 << 4)
-#define TCP_FLAGS_URG (1 << 5)
-#define TCP_FLAGS_ECE (1 << 6)
-#define TCP_FLAGS_CWR (1 << 7)
-#define TCP_FLAGS_NS  (1 << 8)
-#define DATA_OFFSET_5 (0x5 << 12)
-
-static int tcp_ack(fs_node_t * nic, sock_t * sock, struct ipv4_packet * packet, int isSynAck, size_t payload_len) {
-	struct tcp_header * tcp = (struct tcp_header*)&packet->payload;
-	int retval = 1;
-	int window_size = DEFAULT_TCP_WINDOW_SIZE;
-	int send_thrice = 0;
-
-#if 0
-	/* XXX: This means the header is bigger than we expect... */
-	if ((ntohs(tcp->flags) & 0xF000) != 0x5000) {
-		int _debug __attribute__((unused)) = 1;
-		printf("tcp: uh, weird flags? %#4x\n", ntohs(tcp->flags));
-	}
-#endif
-
-	if (sock->priv32[SOCK_PRIV32_TCP_ACK_NUM] != 0 && !isSynAck &&
-		sock->priv32[SOCK_PRIV32_TCP_ACK_NUM] != ntohl(tcp->seq_number)) {
-#if 0
-		int _debug __attribute__((unused)) = 1;
-		printf("tcp: suspicious of their seq number?\n");
-		printf("tcp: their seq = %u our ack = %u\n",
-			ntohl(tcp->seq_number), sock->priv32[1]);
-#endif
-		//window_size = 300;
-		
-		retval = 0;
-		send_thrice = 1;
-	} else {
-		sock->priv32[SOCK_PRIV32_TCP_SEQ_NUM] = isSynAck ? 1 : sock->priv32[SOCK_PRIV32_TCP_SEQ_NUM];
-		sock->priv32[SOCK_PRIV32_TCP_ACK_NUM] = (ntohl(tcp->seq_number) + payload_len) & 0xFFFFFFFF;
-		sock->priv[SOCK_PRIV_TCP_STATE] = TCP_STATE_ACKED; /* received ack for syn */
-	}
-
-	sock->priv[SOCK_PRIV_TCP_IDENT]++;
-
-#if 0
-	printf("tcp: their ack = %u our seq = %u\n",
-		ntohl(tcp->ack_number), sock->priv32[0]);
-	printf("tcp: their seq = %u our ack = %u\n",
-		ntohl(tcp->seq_number), sock->priv32[1]);
-#endif
-
-
-	size_t total_length = sizeof(struct ipv4_packet) + sizeof(struct tcp_header);
-
-	struct ipv4_packet * response = malloc(total_length);
-	response->length = htons(total_length);
-	response->destination = packet->source;
-	response->source = ((struct EthernetDevice*)nic->device)->ipv4_addr;
-	response->ttl = 64;
-	response->protocol = IPV4_PROT_TCP;
-	response->ident = htons(sock->priv[SOCK_PRIV_TCP_IDENT]);
-	response->flags_fragment = htons(0x0);
-	response->version_ihl = 0x45;
-	response->dscp_ecn = 0;
-	response->checksum = 0;
-	response->checksum = htons(calculate_ipv4_checksum(response));
-
-	int flags = TCP_FLAGS_ACK;
-	if (ntohs(tcp->flags) & TCP_FLAGS_FIN) {
-		/* Other side is closed now */
-		sock->priv32[SOCK_PRIV32_TCP_ACK_NUM]++;
-		sock->priv[SOCK_PRIV_TCP_STATE] = TCP_STATE_FIN;
-	}
-
-	/* Stick TCP header into payload */
-	struct tcp_header * tcp_header = (struct tcp_header*)&response->payload;
-	tcp_header->source_port = htons(sock->priv[SOCK_PRIV_IPV4_PORT]);
-	tcp_header->destination_port = tcp->source_port;
-	tcp_header->seq_number = htonl(sock->priv32[SOCK_PRIV32_TCP_SEQ_NUM]);
-	tcp_header->ack_number = htonl(sock->priv32[SOCK_PRIV32_TCP_ACK_NUM]);
-	tcp_header->flags = htons(flags | 0x5000);
-	tcp_header->window_size = htons(window_size);
-	tcp_header->checksum = 0;
-	tcp_header->urgent = 0;
-
-	/* Calculate checksum */
-	struct tcp_check_header check_hd = {
-		.source = response->source,
-		.destination = response->destination,
-		.zeros = 0,
-		.protocol = IPV4_PROT_TCP,
-		.tcp_len = htons(sizeof(struct tcp_header)),
-	};
-
-	tcp_header->checksum = htons(calculate_tcp_checksum(&check_hd, tcp_header, NULL, 0));
-	net_ipv4_send(response,nic);
-	if (send_thrice) {
-		net_ipv4_send(response,nic);
-		net_ipv4_send(response,nic);
-	}
-	free(response);
-	return retval;
-}
-
-void net_ipv4_handle(struct ipv4_packet * packet, fs_node_t * nic, size_t size) {
+void net_ipv4_handle(net_buffer_t * buf, struct ipv4_packet * packet, fs_node_t * nic, size_t size) {
 
 	if (size < sizeof(struct ipv4_packet)) {
 		dprintf("ipv4: Incoming packet is too small.\n");
 	}
 
-	char dest[16];
-	char src[16];
-
-	ip_ntoa(ntohl(packet->destination), dest);
-	ip_ntoa(ntohl(packet->source), src);
-
 	switch (packet->protocol) {
 		case 1:
-			icmp_handle(packet, src, dest, nic);
+			icmp_handle(buf, packet, nic);
 			break;
 		case IPV4_PROT_UDP: {
-			uint16_t dest_port = ntohs(((uint16_t*)&packet->payload)[1]);
-			printf("net: ipv4: %s: %s -> %s udp %d to %d\n", nic->name, src, dest, ntohs(((uint16_t*)&packet->payload)[0]), dest_port);
-			if (hashmap_has(udp_sockets, (void*)(uintptr_t)dest_port)) {
-				printf("net: udp: received and have a waiting endpoint!\n");
-				sock_t * sock = hashmap_get(udp_sockets, (void*)(uintptr_t)dest_port);
-				net_sock_add(sock, packet, ntohs(packet->length));
+			struct udp_packet * udp = (struct udp_packet *)&packet->payload;
+			size_t udp_length = ntohs(udp->length);
+			if (size < sizeof(struct ipv4_packet) + sizeof(struct udp_packet) ||
+				udp_length < sizeof(struct udp_packet) || udp_length > size - sizeof(struct ipv4_packet)) break;
+			if (udp->checksum && !net_ipv4_checksum_ok(buf, packet, udp, udp_length)) {
+				printf("net: udp: bad checksum from " IPV4_FORMAT "\n", FORMAT_IPV4(packet->source));
+				break;
 			}
-			break;
-		}
-		case IPV4_PROT_TCP: {
 			uint16_t dest_port = ntohs(((uint16_t*)&packet->payload)[1]);
-			printf("net: ipv4: %s: %s -> %s tcp %d to %d\n", nic->name, src, dest, ntohs(((uint16_t*)&packet->payload)[0]), dest_port);
-			sock_t * sock = hashmap_get(tcp_sockets, (void*)(uintptr_t)dest_port);
+			printf("net: ipv4: %s: " IPV4_FORMAT " -> " IPV4_FORMAT " udp %d to %d\n", nic->name,
+				FORMAT_IPV4(packet->source), FORMAT_IPV4(packet->destination), ntohs(((uint16_t*)&packet->payload)[0]), dest_port);
+			sock_t * sock = hashmap_get(udp_sockets, (void*)(uintptr_t)dest_port);
 			if (sock) {
-				printf("net: tcp: received and have a waiting endpoint!\n");
-				/* What kind of packet is this? Is it something we were expecting? */
-				struct tcp_header * tcp = (struct tcp_header*)&packet->payload;
-
-				if (sock->priv[SOCK_PRIV_TCP_STATE] == TCP_STATE_WAITING) {
-					/* Awaiting SYN ACK, is this one? */
-					if ((ntohs(tcp->flags) & (TCP_FLAGS_SYN | TCP_FLAGS_ACK)) == (TCP_FLAGS_SYN | TCP_FLAGS_ACK)) {
-						printf("tcp: synack\n");
-						if (tcp_ack(nic, sock, packet, 1, 1)) {
-							net_sock_add(sock, packet, ntohs(packet->length));
-						}
-					} else if ((ntohs(tcp->flags) & (TCP_FLAGS_RST))) {
-						sock->priv[SOCK_PRIV_TCP_STATE] = 0;
-						net_sock_alert(sock);
-					}
-				} else if (sock->priv[SOCK_PRIV_TCP_STATE] == TCP_STATE_ACKED) {
-					size_t packet_len = ntohs(packet->length) - sizeof(struct ipv4_packet);
-					size_t hlen = ((ntohs(tcp->flags) & 0xF000) >> 12) * 4;
-					size_t payload_len = packet_len - hlen;
-					if (payload_len) {
-						printf("tcp: acking because payload_len = %zu (hlen=%zu, packet_len=%zu)\n", payload_len, hlen, packet_len);
-						if (tcp_ack(nic, sock, packet, 0, payload_len)) {
-							net_sock_add(sock, packet, ntohs(packet->length));
-						}
-					} else if (ntohs(tcp->flags) & TCP_FLAGS_FIN) {
-						tcp_ack(nic, sock, packet, 0, 0);
-					}
-				} else if (sock->priv[SOCK_PRIV_TCP_STATE] == TCP_STATE_BOUND) {
-					/* Bound socket, need to see if we have something for this client... */
-					dprintf("hit to bound tcp socket\n");
-
-				}
+				printf("net: udp: received and have a waiting endpoint!\n");
+				net_sock_add(sock, buf, packet, ntohs(packet->length));
 			}
 			break;
 		}
+		case IPV4_PROT_TCP:
+			net_tcp_handle(buf, packet, nic, size);
+			break;
 	}
 }
 
@@ -537,10 +345,6 @@ long sock_udp_getsockname(sock_t * sock, struct sockaddr *addr, socklen_t * addr
 
 static long sock_udp_send(sock_t * sock, const struct msghdr *msg, int flags) {
 	printf("udp: send called\n");
-	if (msg->msg_iovlen > 1) {
-		printf("net: todo: can't send multiple iovs\n");
-		return -ENOTSUP;
-	}
 	if (msg->msg_iovlen == 0) return 0;
 	if (msg->msg_namelen != sizeof(struct sockaddr_in)) {
 		printf("udp: invalid destination address size %ld\n", msg->msg_namelen);
@@ -557,15 +361,16 @@ static long sock_udp_send(sock_t * sock, const struct msghdr *msg, int flags) {
 	}
 
 
-	char dest[16];
-	ip_ntoa(ntohl(name->sin_addr.s_addr), dest);
-	printf("udp: want to send to %s\n", dest);
+	printf("udp: want to send to " IPV4_FORMAT "\n", FORMAT_IPV4(name->sin_addr.s_addr));
 
 	/* Routing: We need a device to send this on... */
 	fs_node_t * nic = net_if_route(name->sin_addr.s_addr);
 	if (!nic) return 0;
 
-	size_t total_length = sizeof(struct ipv4_packet) + msg->msg_iov[0].iov_len + sizeof(struct udp_packet);
+	size_t payload_length = iov_length(msg->msg_iov, msg->msg_iovlen);
+	if (payload_length > 0xFFFF - sizeof(struct ipv4_packet) - sizeof(struct udp_packet)) return -EMSGSIZE;
+
+	size_t total_length = sizeof(struct ipv4_packet) + payload_length + sizeof(struct udp_packet);
 
 	struct ipv4_packet * response = malloc(total_length);
 	response->length = htons(total_length);
@@ -578,20 +383,20 @@ static long sock_udp_send(sock_t * sock, const struct msghdr *msg, int flags) {
 	response->version_ihl = 0x45;
 	response->dscp_ecn = 0;
 	response->checksum = 0;
-	response->checksum = htons(calculate_ipv4_checksum(response));
+	response->checksum = net_checksum(response, sizeof(struct ipv4_packet));
 
 	/* Stick UDP header into payload */
 	struct udp_packet * udp_packet = (struct udp_packet*)&response->payload;
 	udp_packet->source_port = htons(sock->priv[SOCK_PRIV_IPV4_PORT]);
 	udp_packet->destination_port = name->sin_port;
-	udp_packet->length = htons(sizeof(struct udp_packet) + msg->msg_iov[0].iov_len);
+	udp_packet->length = htons(sizeof(struct udp_packet) + payload_length);
 	udp_packet->checksum = 0;
 
-	memcpy(response->payload + sizeof(struct udp_packet), msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len);
-	net_ipv4_send(response,nic);
+	iov_gather(response->payload + sizeof(struct udp_packet), msg->msg_iov, msg->msg_iovlen, 0, payload_length);
+	net_ipv4_send_csum(response, nic, offsetof(struct udp_packet, checksum));
 	free(response);
 
-	return msg->msg_iov[0].iov_len;
+	return payload_length;
 }
 
 static long sock_udp_recv(sock_t * sock, struct msghdr * msg, int flags) {
@@ -601,22 +406,20 @@ static long sock_udp_recv(sock_t * sock, struct msghdr * msg, int flags) {
 		return -EINVAL;
 	}
 
-	if (msg->msg_iovlen > 1) {
-		printf("net: todo: can't recv multiple iovs\n");
-		return -ENOTSUP;
-	}
 	if (msg->msg_iovlen == 0) return 0;
 
 	if (!sock->rx_queue->length && sock->nonblocking) return -EAGAIN;
 
-	char * packet = net_sock_get(sock);
+	sock_packet_t * packet = net_sock_get(sock);
 	if (!packet) return -EINTR;
-	struct ipv4_packet * data = (struct ipv4_packet*)(packet + sizeof(size_t));
+	struct ipv4_packet * data = packet->data;
 	struct udp_packet * udp_packet = (struct udp_packet*)&data->payload;
 
 	printf("udp: got response, size is %u - sizeof(ipv4) - sizeof(udp) = %lu\n",
 		ntohs(data->length), ntohs(data->length) - sizeof(struct ipv4_packet) - sizeof(struct udp_packet));
-	memcpy(msg->msg_iov[0].iov_base, udp_packet->payload, ntohs(data->length) - sizeof(struct ipv4_packet) - sizeof(struct udp_packet));
+	/* Datagrams larger than the vector are truncated, as with recvmsg elsewhere. */
+	size_t copied = iov_scatter(msg->msg_iov, msg->msg_iovlen, 0, udp_packet->payload,
+		ntohs(data->length) - sizeof(struct ipv4_packet) - sizeof(struct udp_packet));
 
 	if (msg->msg_namelen == sizeof(struct sockaddr_in)) {
 		if (msg->msg_name) {
@@ -628,11 +431,8 @@ static long sock_udp_recv(sock_t * sock, struct msghdr * msg, int flags) {
 
 	sock_ipv4_control_common(sock,msg,data,IPPROTO_UDP);
 
-	printf("udp: data copied to iov 0, return length?\n");
-
-	long resp = ntohs(data->length) - sizeof(struct ipv4_packet) - sizeof(struct udp_packet);
-	free(packet);
-	return resp;
+	net_sock_packet_free(packet);
+	return copied;
 }
 
 static void sock_udp_close(sock_t * sock) {
@@ -689,516 +489,6 @@ static int udp_socket(int flags, int nb) {
 	return process_append_fd((process_t *)this_core->current_process, (fs_node_t *)sock, flags | PROC_FD_MODE__RW);
 }
 
-static spin_lock_t tcp_port_lock = {0};
-static void sock_tcp_close(sock_t * sock) {
-	if (sock->priv[SOCK_PRIV_IPV4_PORT]) {
-		printf("tcp: removing port %d from bound map\n", sock->priv[SOCK_PRIV_IPV4_PORT]);
-		spin_lock(tcp_port_lock);
-		hashmap_remove(tcp_sockets, (void*)(uintptr_t)sock->priv[SOCK_PRIV_IPV4_PORT]);
-		spin_unlock(tcp_port_lock);
-
-		size_t total_length = sizeof(struct ipv4_packet) + sizeof(struct tcp_header);
-		fs_node_t * nic = net_if_route(((struct sockaddr_in*)&sock->dest)->sin_addr.s_addr);
-		if (!nic) return;
-
-		struct ipv4_packet * response = malloc(total_length);
-		response->length = htons(total_length);
-		response->destination = ((struct sockaddr_in*)&sock->dest)->sin_addr.s_addr;
-		response->source = ((struct EthernetDevice*)nic->device)->ipv4_addr;
-		response->ttl = 64;
-		response->protocol = IPV4_PROT_TCP;
-		sock->priv[SOCK_PRIV_TCP_IDENT]++;
-		response->ident = htons(sock->priv[SOCK_PRIV_TCP_IDENT]);
-		response->flags_fragment = htons(0x0);
-		response->version_ihl = 0x45;
-		response->dscp_ecn = 0;
-		response->checksum = 0;
-		response->checksum = htons(calculate_ipv4_checksum(response));
-
-		/* Stick TCP header into payload */
-		struct tcp_header * tcp_header = (struct tcp_header*)&response->payload;
-		tcp_header->source_port = htons(sock->priv[SOCK_PRIV_IPV4_PORT]);
-		tcp_header->destination_port = ((struct sockaddr_in*)&sock->dest)->sin_port;
-		tcp_header->seq_number = htonl(sock->priv32[SOCK_PRIV32_TCP_SEQ_NUM]);
-		tcp_header->ack_number = htonl(sock->priv32[SOCK_PRIV32_TCP_ACK_NUM]);
-		tcp_header->flags = htons(TCP_FLAGS_FIN | TCP_FLAGS_ACK | 0x5000);
-		tcp_header->window_size = htons(DEFAULT_TCP_WINDOW_SIZE);
-		tcp_header->checksum = 0;
-		tcp_header->urgent = 0;
-
-		/* Calculate checksum */
-		struct tcp_check_header check_hd = {
-			.source = response->source,
-			.destination = response->destination,
-			.zeros = 0,
-			.protocol = IPV4_PROT_TCP,
-			.tcp_len = htons(sizeof(struct tcp_header)),
-		};
-
-		tcp_header->checksum = htons(calculate_tcp_checksum(&check_hd, tcp_header, tcp_header->payload, 0));
-		net_ipv4_send(response,nic);
-		free(response);
-	}
-}
-
-static int next_tcp_port = 49152;
-static int tcp_get_port(sock_t * sock) {
-	spin_lock(tcp_port_lock);
-	int out = next_tcp_port++;
-	hashmap_set(tcp_sockets, (void*)(uintptr_t)out, sock);
-	sock->priv[SOCK_PRIV_IPV4_PORT] = out;
-	spin_unlock(tcp_port_lock);
-	return out;
-}
-
-static long sock_tcp_recv(sock_t * sock, struct msghdr * msg, int flags) {
-	if (!sock->priv[SOCK_PRIV_IPV4_PORT]) {
-		printf("tcp: recv() but socket has no port\n");
-		return -EINVAL;
-	}
-
-	if (msg->msg_iovlen > 1) {
-		printf("net: todo: can't recv multiple iovs\n");
-		return -ENOTSUP;
-	}
-	if (msg->msg_iovlen == 0) return 0;
-
-	if (sock->unread) {
-		if (sock->unread > msg->msg_iov[0].iov_len) {
-			unsigned long out = msg->msg_iov[0].iov_len;
-			sock->unread -= out;
-			memcpy(msg->msg_iov[0].iov_base, sock->buf, out);
-			char * x = malloc(sock->unread);
-			memcpy(x, sock->buf + out, sock->unread);
-			free(sock->buf);
-			sock->buf = x;
-			return out;
-		} else {
-			unsigned long out = sock->unread;
-			sock->unread = 0;
-			memcpy(msg->msg_iov[0].iov_base, sock->buf, out);
-			free(sock->buf);
-			sock->buf = NULL;
-			return out;
-		}
-	}
-
-	if (!sock->rx_queue->length && sock->priv[SOCK_PRIV_TCP_STATE] == TCP_STATE_FIN) {
-		return 0; /* EOF */
-	}
-
-	if (!sock->rx_queue->length && sock->nonblocking) return -EAGAIN;
-
-	unsigned long s = 0, ss = 0;
-	unsigned long ns = 0, nss = 0;
-
-	if (sock->timeout_s || sock->timeout_us) {
-		relative_time(sock->timeout_s,sock->timeout_us,&s,&ss);
-	}
-
-	while (!sock->rx_queue->length) {
-		int r = process_wait_nodes((process_t *)this_core->current_process, (fs_node_t*[]){(fs_node_t*)sock,NULL}, 200);
-		if (r > 0 && (s || ss)) {
-			relative_time(0,0,&ns,&nss);
-			if (ns > s || (ns == s && nss > ss)) {
-				return -EAGAIN;
-			}
-		}
-		if (r == -EINTR) return -ERESTARTSYS;
-		if (!sock->rx_queue->length) {
-			if (sock->priv[SOCK_PRIV_TCP_STATE] == TCP_STATE_FIN) {
-				/* Socket was closed while waiting */
-				return 0;
-			}
-		}
-	}
-
-	char * packet = net_sock_get(sock);
-	if (!packet) return -EINTR;
-	struct ipv4_packet * data = (struct ipv4_packet*)(packet + sizeof(size_t));
-	size_t packet_size = *(size_t*)packet;
-	unsigned long resp = ntohs(data->length);
-
-	if (resp != packet_size) {
-		dprintf("packet size does not match: %zu %zu\n", resp, packet_size);
-		resp = packet_size;
-	}
-
-	if (resp < sizeof(struct ipv4_packet) + sizeof(struct tcp_header)) {
-		dprintf("Invalid receive data?\n");
-		assert(0);
-	}
-
-	resp -=  sizeof(struct ipv4_packet) + sizeof(struct tcp_header);
-
-	if (resp > (unsigned long)msg->msg_iov[0].iov_len) {
-		memcpy(msg->msg_iov[0].iov_base, data->payload + sizeof(struct tcp_header),msg->msg_iov[0].iov_len);
-		resp -= msg->msg_iov[0].iov_len;
-		if (resp == 0xFFFFffffFFFFffff) printf("what\n");
-		sock->unread = resp;
-		sock->buf = malloc(resp);
-		memcpy(sock->buf, data->payload + sizeof(struct tcp_header) + msg->msg_iov[0].iov_len, resp);
-		free(packet);
-		return msg->msg_iov[0].iov_len;
-	}
-
-	memcpy(msg->msg_iov[0].iov_base, data->payload + sizeof(struct tcp_header), resp);
-	free(packet);
-	return resp;
-}
-
-extern uint32_t rand(void);
-
-static long sock_tcp_connect(sock_t * sock, const struct sockaddr *addr, socklen_t addrlen) {
-	const struct sockaddr_in * dest = (const struct sockaddr_in *)addr;
-	char deststr[16];
-	ip_ntoa(ntohl(dest->sin_addr.s_addr), deststr);
-	printf("tcp: connect requested to %s port %d\n", deststr, ntohs(dest->sin_port));
-
-	if (sock->priv[SOCK_PRIV_TCP_STATE] != TCP_STATE_NONE) {
-		printf("tcp: socket is already connected?\n");
-		return -EINVAL;
-	}
-
-	if (!dest->sin_port) return -EADDRNOTAVAIL; /* 0 is still 0 in both endians */
-
-	/* Get a port */
-	tcp_get_port(sock);
-	printf("tcp: connecting from ephemeral port %d\n", (int)sock->priv[SOCK_PRIV_IPV4_PORT]);
-
-	/* Mark as awaiting connection, send initial SYN */
-	sock->priv[SOCK_PRIV_TCP_STATE] = TCP_STATE_WAITING;
-
-	memcpy(&sock->dest, addr, addrlen);
-
-	fs_node_t * nic = net_if_route(dest->sin_addr.s_addr);
-	if (!nic) return -ENONET;
-
-	size_t total_length = sizeof(struct ipv4_packet) + sizeof(struct tcp_header);
-
-	struct ipv4_packet * response = malloc(total_length);
-	response->length = htons(total_length);
-	response->destination = dest->sin_addr.s_addr;
-	response->source = ((struct EthernetDevice*)nic->device)->ipv4_addr;
-	response->ttl = 64;
-	response->protocol = IPV4_PROT_TCP;
-	sock->priv[SOCK_PRIV_TCP_IDENT] = rand();
-	response->ident = htons(sock->priv[SOCK_PRIV_TCP_IDENT]);
-	response->flags_fragment = htons(0x0);
-	response->version_ihl = 0x45;
-	response->dscp_ecn = 0;
-	response->checksum = 0;
-	response->checksum = htons(calculate_ipv4_checksum(response));
-
-	/* Stick TCP header into payload */
-	struct tcp_header * tcp_header = (struct tcp_header*)&response->payload;
-	tcp_header->source_port = htons(sock->priv[SOCK_PRIV_IPV4_PORT]);
-	tcp_header->destination_port = dest->sin_port;
-	tcp_header->seq_number = 0;
-	tcp_header->ack_number = 0;
-	tcp_header->flags = htons((1 << 1) | 0x5000);
-	tcp_header->window_size = htons(DEFAULT_TCP_WINDOW_SIZE);
-	tcp_header->checksum = 0;
-	tcp_header->urgent = 0;
-
-	/* Calculate checksum */
-	struct tcp_check_header check_hd = {
-		.source = response->source,
-		.destination = response->destination,
-		.zeros = 0,
-		.protocol = IPV4_PROT_TCP,
-		.tcp_len = htons(sizeof(struct tcp_header)),
-	};
-
-	tcp_header->checksum = htons(calculate_tcp_checksum(&check_hd, tcp_header, NULL, 0));
-
-	net_ipv4_send(response,nic);
-
-	//int _debug __attribute__((unused)) = 1;
-	printf("tcp: waiting for connect to finish; queue = %ld\n", sock->rx_queue->length);
-
-	unsigned long s, ss;
-	unsigned long ns, nss;
-	relative_time(1,0,&s,&ss);
-	int attempts = 0;
-
-	while (!sock->rx_queue->length) {
-		int result = process_wait_nodes((process_t *)this_core->current_process, (fs_node_t*[]){(fs_node_t*)sock,NULL}, 200);
-		if (result == -EINTR) {
-			free(response);
-			return -EINTR;
-		}
-		relative_time(0,0,&ns,&nss);
-		if (sock->priv[SOCK_PRIV_TCP_STATE] == TCP_STATE_NONE) {
-			free(response);
-			return -ECONNREFUSED;
-		}
-		if (result != 0 && (ns > s || (ns == s && nss > ss))) {
-			if (attempts++ == 3) {
-				printf("tcp: connect timed out\n");
-				free(response);
-				return -ETIMEDOUT;
-			}
-			printf("tcp: retrying...\n");
-			net_ipv4_send(response,nic);
-			relative_time(1,0,&s,&ss);
-		}
-	}
-
-	free(response);
-
-	printf("tcp: queue should have data now (len = %lu), trying to read\n", sock->rx_queue->length);
-
-	/* wait for signal that we connected or timed out */
-	char * packet = net_sock_get(sock);
-	if (!packet) return -EINTR;
-	//struct ipv4_packet * data = packet + sizeof(size_t);
-	printf("tcp: connect complete\n");
-	free(packet);
-
-	return 0;
-}
-
-ssize_t sock_tcp_read(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
-	printf("tcp: read into buffer of %zu bytes\n", size);
-	struct iovec _iovec = {
-		buffer, size
-	};
-	struct msghdr _header = {
-		.msg_name = NULL,
-		.msg_namelen = 0,
-		.msg_iov = &_iovec,
-		.msg_iovlen = 1,
-		.msg_control = NULL,
-		.msg_controllen = 0,
-		.msg_flags = 0,
-	};
-	return sock_tcp_recv((sock_t*)node, &_header, 0);
-}
-
-static void delay_yield(size_t subticks) {
-	unsigned long s, ss;
-	relative_time(0, subticks, &s, &ss);
-	sleep_until((process_t *)this_core->current_process, s, ss);
-	switch_task(0);
-}
-
-static long sock_tcp_send(sock_t * sock, const struct msghdr *msg, int flags) {
-	printf("tcp: send called\n");
-	if (msg->msg_iovlen > 1) {
-		printf("net: todo: can't send multiple iovs\n");
-		return -ENOTSUP;
-	}
-	if (msg->msg_iovlen == 0) return 0;
-
-	size_t size_into = 0;
-	size_t size_remaining = msg->msg_iov[0].iov_len;
-
-	size_t last = arch_perf_timer();
-	while (size_remaining) {
-		size_t size_to_send = size_remaining > 1024 ? 1024 : size_remaining;
-		size_t total_length = sizeof(struct ipv4_packet) + sizeof(struct tcp_header) + size_to_send;
-
-		fs_node_t * nic = net_if_route(((struct sockaddr_in*)&sock->dest)->sin_addr.s_addr);
-		if (!nic) return -ENONET;
-
-		struct ipv4_packet * response = malloc(total_length);
-		response->length = htons(total_length);
-		response->destination = ((struct sockaddr_in*)&sock->dest)->sin_addr.s_addr;
-		response->source = ((struct EthernetDevice*)nic->device)->ipv4_addr;
-		response->ttl = 64;
-		response->protocol = IPV4_PROT_TCP;
-		sock->priv[SOCK_PRIV_TCP_IDENT]++;
-		response->ident = htons(sock->priv[SOCK_PRIV_TCP_IDENT]);
-		response->flags_fragment = htons(0x0);
-		response->version_ihl = 0x45;
-		response->dscp_ecn = 0;
-		response->checksum = 0;
-		response->checksum = htons(calculate_ipv4_checksum(response));
-
-		/* Stick TCP header into payload */
-		struct tcp_header * tcp_header = (struct tcp_header*)&response->payload;
-		tcp_header->source_port = htons(sock->priv[SOCK_PRIV_IPV4_PORT]);
-		tcp_header->destination_port = ((struct sockaddr_in*)&sock->dest)->sin_port;
-		tcp_header->seq_number = htonl(sock->priv32[SOCK_PRIV32_TCP_SEQ_NUM]);
-		tcp_header->ack_number = htonl(sock->priv32[SOCK_PRIV32_TCP_ACK_NUM]);
-		tcp_header->flags = htons(TCP_FLAGS_PSH | TCP_FLAGS_ACK | 0x5000);
-		tcp_header->window_size = htons(DEFAULT_TCP_WINDOW_SIZE);
-		tcp_header->checksum = 0;
-		tcp_header->urgent = 0;
-
-		sock->priv32[SOCK_PRIV32_TCP_SEQ_NUM] += size_to_send;
-
-		/* Calculate checksum */
-		struct tcp_check_header check_hd = {
-			.source = response->source,
-			.destination = response->destination,
-			.zeros = 0,
-			.protocol = IPV4_PROT_TCP,
-			.tcp_len = htons(sizeof(struct tcp_header) + size_to_send),
-		};
-
-		memcpy(tcp_header->payload, (char*)msg->msg_iov[0].iov_base + size_into, size_to_send);
-		tcp_header->checksum = htons(calculate_tcp_checksum(&check_hd, tcp_header, tcp_header->payload, size_to_send));
-		net_ipv4_send(response,nic);
-		free(response);
-
-		size_remaining -= size_to_send;
-		size_into += size_to_send;
-
-		if (size_remaining) {
-			/* Keep us away from the BSP... */
-			if (processor_count > 1) {
-				if (this_core->cpu_id == 0) {
-					delay_yield(0);
-				}
-			} else {
-				if (arch_perf_timer() - last > 10000UL * arch_cpu_mhz()) {
-					delay_yield(0);
-					last = arch_perf_timer();
-				}
-			}
-		}
-	}
-
-	return size_into;
-}
-
-ssize_t sock_tcp_write(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
-	printf("tcp: write of %zu bytes\n", size);
-	struct iovec _iovec = {
-		(void*)buffer, size
-	};
-	struct msghdr _header = {
-		.msg_name = NULL,
-		.msg_namelen = 0,
-		.msg_iov = &_iovec,
-		.msg_iovlen = 1,
-		.msg_control = NULL,
-		.msg_controllen = 0,
-		.msg_flags = 0,
-	};
-	return sock_tcp_send((sock_t*)node, &_header, 0);
-}
-
-static long sock_tcp_getsockname(sock_t * sock, struct sockaddr *addr, socklen_t * addrlen) {
-	in_addr_t ip4_addr = 0;
-	fs_node_t * nic = net_if_route(((struct sockaddr_in*)&sock->dest)->sin_addr.s_addr);
-	if (nic) {
-		ip4_addr = ((struct EthernetDevice*)nic->device)->ipv4_addr;
-	}
-
-	struct sockaddr_in out = {
-		AF_INET, htons(sock->priv[SOCK_PRIV_IPV4_PORT]), { ip4_addr }, {0},
-	};
-
-	memcpy(addr, &out, *addrlen < sizeof(struct sockaddr_in) ? *addrlen : sizeof(struct sockaddr_in));
-	if (*addrlen < sizeof(struct sockaddr_in)) *addrlen = sizeof(struct sockaddr_in);
-	return 0;
-}
-
-static long sock_tcp_getpeername(sock_t * sock, struct sockaddr *addr, socklen_t * addrlen) {
-	in_addr_t ip4_addr = ((struct sockaddr_in*)&sock->dest)->sin_addr.s_addr;
-	struct sockaddr_in out = {
-		AF_INET, ((struct sockaddr_in*)&sock->dest)->sin_port, { ip4_addr }, {0},
-	};
-	memcpy(addr, &out, *addrlen < sizeof(struct sockaddr_in) ? *addrlen : sizeof(struct sockaddr_in));
-	if (*addrlen < sizeof(struct sockaddr_in)) *addrlen = sizeof(struct sockaddr_in);
-	return 0;
-}
-
-static long sock_tcp_bind(sock_t * sock, const struct sockaddr *addr, socklen_t addrlen) {
-	const struct sockaddr_in * addr_in = (const struct sockaddr_in*)addr;
-	dprintf("tcp_bind({port=%u})\n", ntohs(addr_in->sin_port));
-
-	if (sock->priv[SOCK_PRIV_IPV4_PORT]) return -EINVAL; /* Already bound */
-	unsigned short port = ntohs(addr_in->sin_port);
-
-	if (port == 0) return -EINVAL; /* No ephemeral binds for now */
-	if (port < 1024 && this_core->current_process->user != 0) return -EACCES;
-
-	spin_lock(tcp_port_lock);
-	if (hashmap_has(tcp_sockets, (void*)(uintptr_t)port)) {
-		spin_unlock(tcp_port_lock);
-		return -EADDRINUSE;
-	}
-
-	sock->priv[SOCK_PRIV_IPV4_PORT] = port;
-	sock->priv[SOCK_PRIV_TCP_STATE] = TCP_STATE_BOUND; /* needs an enum */
-	hashmap_set(tcp_sockets, (void*)(uintptr_t)port, sock);
-
-	spin_unlock(tcp_port_lock);
-
-	return 0;
-}
-
-static long sock_tcp_listen(sock_t * sock, int backlog) {
-	if (!sock->priv[SOCK_PRIV_IPV4_PORT]) return -EINVAL; /* Not a bound socket. */
-
-	return 0;
-}
-
-static long sock_tcp_accept(sock_t * sock, struct sockaddr *addr, socklen_t *addrlen) {
-	if (!sock->priv[SOCK_PRIV_IPV4_PORT]) return -EINVAL; /* Not a bound socket. */
-
-	// spin_lock(...)
-
-	// if backlog, pull from backlog...
-	unsigned long s = 0, ss = 0;
-	unsigned long ns = 0, nss = 0;
-
-	if (sock->timeout_s || sock->timeout_us) {
-		relative_time(sock->timeout_s,sock->timeout_us,&s,&ss);
-	}
-
-	while (!sock->rx_queue->length) {
-		int r = process_wait_nodes((process_t *)this_core->current_process, (fs_node_t*[]){(fs_node_t*)sock,NULL}, 200);
-		if (r > 0 && (s || ss)) {
-			relative_time(0,0,&ns,&nss);
-			if (ns > s || (ns == s && nss > ss)) {
-				return -EAGAIN;
-			}
-		}
-		if (r == -EINTR) return -ERESTARTSYS;
-		if (!sock->rx_queue->length) {
-			if (sock->priv[SOCK_PRIV_TCP_STATE] == TCP_STATE_FIN) {
-				/* Socket was closed while waiting */
-				return 0;
-			}
-		}
-	}
-
-	char * connect_request = net_sock_get(sock); /* connection request */
-
-	if (!connect_request) return -ECONNABORTED; /* I think? */
-
-	/* need to create a socket, add it to the list, etc. */
-
-	// otherwise sleep until something is available, just like with recv?
-
-	// spin_unlock(...)
-
-	return -EINVAL;
-}
-
-static int tcp_socket(int flags, int nb) {
-	printf("tcp socket...\n");
-	sock_t * sock = net_sock_create();
-	sock->sock_recv = sock_tcp_recv;
-	sock->sock_send = sock_tcp_send;
-	sock->sock_close = sock_tcp_close;
-	sock->sock_connect = sock_tcp_connect;
-	sock->sock_getsockname = sock_tcp_getsockname;
-	sock->sock_getpeername = sock_tcp_getpeername;
-	sock->sock_bind = sock_tcp_bind;
-	sock->sock_listen = sock_tcp_listen;
-	sock->sock_accept = sock_tcp_accept;
-	sock->_fnode.read = sock_tcp_read;
-	sock->_fnode.write = sock_tcp_write;
-
-	return process_append_fd((process_t *)this_core->current_process, (fs_node_t *)sock, flags | PROC_FD_MODE__RW);
-}
-
 long net_ipv4_socket(int type, int protocol, int flags, int nb) {
 	/* Ignore protocol, make socket for 'type' only... */
 	switch (type) {
@@ -1209,7 +499,7 @@ long net_ipv4_socket(int type, int protocol, int flags, int nb) {
 				return icmp_socket(flags, nb);
 			return -EINVAL;
 		case SOCK_STREAM:
-			return tcp_socket(flags, nb);
+			return net_tcp_socket(flags, nb);
 		default:
 			return -EINVAL;
 	}
@@ -15,11 +15,14 @@
 #include <kernel/printf.h>
 #include <kernel/spinlock.h>
 #include <kernel/hashmap.h>
+#include <kernel/slab.h>
+#include <kernel/process.h>
 #include <kernel/net/netif.h>
 
 #include <bits/errno.h>
 
 static hashmap_t * interfaces = NULL;
+kmem_cache_t net_packet_cache = KMEM_CACHE("net_packet", NET_PACKET_SIZE);
 extern list_t * net_raw_sockets_list;
 static fs_node_t * _if_first = NULL;
 static fs_node_t * _if_loop = NULL;
@@ -29,7 +32,97 @@ extern hashmap_t * net_arp_cache;
 
 extern fs_node_t * loopbook_install(void);
 
+/**
+ * @brief Allocate a buffer for a frame, from the packet cache if it fits.
+ *
+ * Either way, the result is released with free().
+ */
+void * net_packet_alloc(size_t size) {
+	if (size <= NET_PACKET_SIZE) return kmem_cache_alloc(&net_packet_cache);
+	return malloc(size);
+}
+
+/**
+ * @brief Get a receive buffer with room for @p size bytes, holding one reference.
+ */
+net_buffer_t * net_buffer_alloc(size_t size) {
+	net_buffer_t * buf = net_packet_alloc(sizeof(net_buffer_t) + size);
+	buf->refcount = 1;
+	buf->flags = 0;
+	buf->size = size;
+	return buf;
+}
+
+net_buffer_t * net_buffer_ref(net_buffer_t * buf) {
+	__sync_add_and_fetch(&buf->refcount, 1);
+	return buf;
+}
+
+void net_buffer_release(net_buffer_t * buf) {
+	if (__sync_sub_and_fetch(&buf->refcount, 1) == 0) {
+		free(buf);
+	}
+}
+
+static void net_buffer_preload(void) {
+	void * bufs[NET_BUFFER_PRELOAD];
+	for (int i = 0; i < NET_BUFFER_PRELOAD; ++i) bufs[i] = kmem_cache_alloc(&net_packet_cache);
+	for (int i = 0; i < NET_BUFFER_PRELOAD; ++i) kmem_cache_free(&net_packet_cache, bufs[i]);
+}
+
+static void net_poll_worker(void * data) {
+	struct net_poll * poll = data;
+
+	while (1) {
+		if (poll->poll(poll, NET_POLL_BUDGET) == NET_POLL_BUDGET) {
+			/* Still busy; let everyone else have a turn before the next batch. */
+			switch_task(1);
+			continue;
+		}
+
+		spin_lock(poll->lock);
+		poll->scheduled = 0;
+		spin_unlock(poll->lock);
+
+		if (poll->enable(poll)) continue;
+
+		spin_lock(poll->lock);
+		while (!poll->scheduled) {
+			sleep_on_unlocking(poll->wait, &poll->lock);
+			spin_lock(poll->lock);
+		}
+		spin_unlock(poll->lock);
+	}
+}
+
+/**
+ * @brief Start the receive worker for a NIC.
+ *
+ * The device's receive interrupts should be masked until this returns.
+ */
+void net_poll_start(struct net_poll * poll, const char * name, void * device,
+	int (*poll_func)(struct net_poll *, int), int (*enable)(struct net_poll *)) {
+	poll->wait = list_create("net poll wait", poll);
+	poll->poll = poll_func;
+	poll->enable = enable;
+	poll->device = device;
+	poll->scheduled = 1;
+	spawn_worker_thread(net_poll_worker, name, poll);
+}
+
+/**
+ * @brief Wake a NIC's receive worker; called from its interrupt handler.
+ */
+void net_poll_schedule(struct net_poll * poll) {
+	spin_lock(poll->lock);
+	poll->scheduled = 1;
+	wakeup_queue(poll->wait);
+	spin_unlock(poll->lock);
+}
+
 void net_install(void) {
+	net_buffer_preload();
+
 	/* Set up virtual devices */
 	map_vfs_directory("/dev/net");
 	interfaces = hashmap_create(10);
@@ -17,6 +17,8 @@
 #include <kernel/syscall.h>
 #include <kernel/vfs.h>
 #include <kernel/mmu.h>
+#include <kernel/iovec.h>
+#include <kernel/slab.h>
 
 #include <kernel/net/netif.h>
 
@@ -47,18 +49,29 @@ void net_sock_alert(sock_t * sock) {
 	spin_unlock(sock->alert_lock);
 }
 
-void net_sock_add(sock_t * sock, void * frame, size_t size) {
+static kmem_cache_t sock_packet_cache = KMEM_CACHE("sock_packet", sizeof(sock_packet_t));
+
+/**
+ * @brief Queue part of a received buffer on a socket.
+ *
+ * The socket takes its own reference to @p buf, so the frame is
+ * shared by everyone it is delivered to rather than copied.
+ */
+void net_sock_add(sock_t * sock, net_buffer_t * buf, void * data, size_t size) {
+	sock_packet_t * packet = kmem_cache_alloc(&sock_packet_cache);
+	packet->node.value = packet;
+	packet->buf = net_buffer_ref(buf);
+	packet->data = data;
+	packet->size = size;
+
 	spin_lock(sock->rx_lock);
-	char * bleh = malloc(size + sizeof(size_t));
-	*(size_t*)bleh = size;
-	memcpy(bleh + sizeof(size_t), frame, size);
-	list_insert(sock->rx_queue, bleh);
+	list_append(sock->rx_queue, &packet->node);
 	wakeup_queue(sock->rx_wait);
 	net_sock_alert(sock);
 	spin_unlock(sock->rx_lock);
 }
 
-void * net_sock_get(sock_t * sock) {
+sock_packet_t * net_sock_get(sock_t * sock) {
 	while (!sock->rx_queue->length) {
 		if (sleep_on(sock->rx_wait)) {
 			if (!sock->rx_queue->length)
@@ -68,11 +81,14 @@ void * net_sock_get(sock_t * sock) {
 
 	spin_lock(sock->rx_lock);
 	node_t * n = list_dequeue(sock->rx_queue);
-	void* value = n->value;
-	free(n);
 	spin_unlock(sock->rx_lock);
 
-	return value;
+	return n->value;
+}
+
+void net_sock_packet_free(sock_packet_t * packet) {
+	net_buffer_release(packet->buf);
+	kmem_cache_free(&sock_packet_cache, packet);
 }
 
 int sock_generic_check(fs_node_t *node) {
@@ -99,8 +115,7 @@ void sock_generic_close(fs_node_t *node) {
 	sock->sock_close(sock);
 	while (sock->rx_queue->length) {
 		node_t * n = list_dequeue(sock->rx_queue);
-		free(n->value);
-		free(n);
+		net_sock_packet_free(n->value);
 	}
 	printf("net: socket closed\n");
 }
@@ -138,31 +153,30 @@ list_t * net_raw_sockets_list = NULL;
 
 static long sock_raw_recv(sock_t * sock, struct msghdr * msg, int flags) {
 	if (!sock->_fnode.device) return -EINVAL;
-	if (msg->msg_iovlen > 1) {
-		printf("net: todo: can't recv multiple iovs\n");
-		return -ENOTSUP;
-	}
 	if (msg->msg_iovlen == 0) return 0;
-	char * data = net_sock_get(sock);
-	if (!data) return -EINTR;
-	size_t packet_size = *(size_t*)data;
-	if (msg->msg_iov[0].iov_len < packet_size) {
-		free(data);
+	sock_packet_t * packet = net_sock_get(sock);
+	if (!packet) return -EINTR;
+	if (iov_length(msg->msg_iov, msg->msg_iovlen) < packet->size) {
+		net_sock_packet_free(packet);
 		return -EINVAL;
 	}
-	memcpy(msg->msg_iov[0].iov_base, data + sizeof(size_t), packet_size);
-	free(data);
+	iov_scatter(msg->msg_iov, msg->msg_iovlen, 0, packet->data, packet->size);
+	net_sock_packet_free(packet);
 	return 4096;
 }
 
 static long sock_raw_send(sock_t * sock, const struct msghdr *msg, int flags) {
 	if (!sock->_fnode.device) return -EINVAL;
-	if (msg->msg_iovlen > 1) {
-		printf("net: todo: can't send multiple iovs\n");
-		return -ENOTSUP;
-	}
 	if (msg->msg_iovlen == 0) return 0;
-	return write_fs(sock->_fnode.device, 0, msg->msg_iov[0].iov_len, msg->msg_iov[0].iov_base);
+	if (msg->msg_iovlen == 1) return write_fs(sock->_fnode.device, 0, msg->msg_iov[0].iov_len, msg->msg_iov[0].iov_base);
+
+	/* Frames go to the device whole, so gather the segments first. */
+	size_t size = iov_length(msg->msg_iov, msg->msg_iovlen);
+	uint8_t * frame = malloc(size);
+	iov_gather(frame, msg->msg_iov, msg->msg_iovlen, 0, size);
+	long out = write_fs(sock->_fnode.device, 0, size, frame);
+	free(frame);
+	return out;
 }
 
 static void sock_raw_close(sock_t * sock) {
@@ -292,6 +306,7 @@ long net_bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 
 long net_accept(int sockfd, struct sockaddr * addr, socklen_t * addrlen) {
 	CHECK_SOCK(sockfd);
+	if (addr) CHECK_ADDR_ADDRLEN(addr,addrlen,ADDR_WR_ADDR|ADDR_WR_LEN);
 	sock_t * node = (sock_t*)FD_ENTRY(sockfd);
 	if (!node->sock_accept) return -EINVAL;
 	return node->sock_accept(node, addr, addrlen);
@@ -0,0 +1,1872 @@
+/**
+ * @file  kernel/net/tcp.c
+ * @brief Transmission Control Protocol
+ *
+ * Each connection has a control block holding its send and receive
+ * buffers and the state of the sliding window. Data written to a
+ * socket is copied into the send buffer and stays there until the
+ * peer acknowledges it, so it can be retransmitted; segments are cut
+ * from it at the negotiated MSS as the peer's window and the
+ * congestion window allow. Received data goes into the receive
+ * buffer, whose free space is the window we advertise.
+ *
+ * Retransmission follows RFC 6298 (RTT estimation, Karn's rule and
+ * exponential backoff) and congestion control is NewReno (RFC 5681,
+ * RFC 6582). ACKs are delayed until every second segment or 40ms,
+ * and window scaling (RFC 7323) is used when the peer offers it.
+ *
+ * Segments are built under the connection's lock but only sent once
+ * it has been released, so a packet to ourselves over the loopback
+ * interface can never find its way back into a lock we already hold.
+ * Timers are handled by a single worker thread.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021-2026 K. Lange
+ */
+#include <bits/errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/syscall.h>
+#include <kernel/hashmap.h>
+#include <kernel/vfs.h>
+#include <kernel/iovec.h>
+#include <kernel/time.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/list.h>
+
+#include <kernel/net/netif.h>
+#include <kernel/net/eth.h>
+#include <kernel/net/ipv4.h>
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#ifndef MISAKA_DEBUG_NET
+#define printf(...) if (_debug) printf(__VA_ARGS__)
+#endif
+
+static int _debug __attribute__((unused)) = 0;
+
+extern int net_ipv4_send_csum(struct ipv4_packet * response, fs_node_t * nic, size_t csum_offset);
+extern int net_ipv4_checksum_ok(net_buffer_t * buf, struct ipv4_packet * packet, void * segment, size_t length);
+extern uint32_t rand(void);
+
+#define TCP_FLAGS_FIN (1 << 0)
+#define TCP_FLAGS_SYN (1 << 1)
+#define TCP_FLAGS_RST (1 << 2)
+#define TCP_FLAGS_PSH (1 << 3)
+#define TCP_FLAGS_ACK (1 << 4)
+#define TCP_FLAGS_URG (1 << 5)
+
+#define TCP_OPT_END    0
+#define TCP_OPT_NOP    1
+#define TCP_OPT_MSS    2
+#define TCP_OPT_WSCALE 3
+
+#define TCP_SNDBUF      (256 * 1024)
+#define TCP_RCVBUF      (256 * 1024)
+#define TCP_WSCALE      3  /* TCP_RCVBUF >> TCP_WSCALE must fit in 16 bits */
+#define TCP_DEFAULT_MSS 536
+
+/* Timers, in milliseconds */
+#define TCP_RTO_INITIAL 1000
+#define TCP_RTO_MIN     200
+#define TCP_RTO_MAX     60000
+#define TCP_DELACK      40
+#define TCP_TIME_WAIT_TIMEOUT  30000
+#define TCP_FIN_WAIT_2_TIMEOUT 60000
+
+#define TCP_SYN_RETRIES 5
+#define TCP_RETRIES     12
+#define TCP_OOO_MAX     32
+#define TCP_BACKLOG_MAX 128
+
+#define TCP_EPHEMERAL_FIRST 49152
+#define TCP_EPHEMERAL_LAST  65535
+
+/* Sequence number comparisons, modulo 2^32 */
+#define SEQ_LT(a,b)  ((int32_t)((uint32_t)(a) - (uint32_t)(b)) < 0)
+#define SEQ_LEQ(a,b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) <= 0)
+#define SEQ_GT(a,b)  SEQ_LT(b,a)
+#define SEQ_GEQ(a,b) SEQ_LEQ(b,a)
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+enum tcp_state {
+	TCP_CLOSED,
+	TCP_LISTEN,
+	TCP_SYN_SENT,
+	TCP_SYN_RECEIVED,
+	TCP_ESTABLISHED,
+	TCP_FIN_WAIT_1,
+	TCP_FIN_WAIT_2,
+	TCP_CLOSE_WAIT,
+	TCP_CLOSING,
+	TCP_LAST_ACK,
+	TCP_TIME_WAIT,
+};
+
+struct tcp_ring {
+	uint8_t * data;
+	size_t size;
+	size_t head;
+	size_t len;
+};
+
+/* A segment that arrived ahead of a hole in the sequence space. */
+struct tcp_ooo {
+	struct tcp_ooo * next;
+	uint32_t seq;
+	size_t len;
+	uint8_t data[];
+};
+
+/* A packet built under the connection lock, waiting to be sent. */
+struct tcp_xmit {
+	struct tcp_xmit * next;
+	fs_node_t * nic;
+	uint8_t packet[];
+};
+
+struct tcp_pcb {
+	spin_lock_t lock;
+	volatile int refcount;
+	int state;
+	sock_t * sock;
+	int error;
+
+	uint32_t local_addr, remote_addr;
+	uint16_t local_port, remote_port;
+	fs_node_t * nic;
+	uint16_t ident;
+
+	/* Send side; snd holds everything from snd_una onwards */
+	uint32_t iss, snd_una, snd_nxt, snd_max, snd_wnd, snd_wl1, snd_wl2;
+	int snd_wscale, rcv_wscale, wscale_offer;
+	uint16_t mss, our_mss;
+	struct tcp_ring snd;
+	int fin_queued;
+
+	/* Receive side */
+	uint32_t irs, rcv_nxt, rcv_adv;
+	struct tcp_ring rcv;
+	struct tcp_ooo * ooo;
+	int ooo_count;
+	int fin_received;
+	int ack_pending, ack_now;
+
+	/* RFC 6298 estimator, in milliseconds; srtt8 is 8*SRTT and rttvar4 is 4*RTTVAR */
+	int rtt_valid;
+	uint32_t srtt8, rttvar4, rto;
+	int rtt_timing;
+	uint32_t rtt_seq;
+	uint64_t rtt_start;
+	int retries;
+
+	/* NewReno */
+	uint32_t cwnd, cwnd_acc, ssthresh, recover;
+	int dupacks, in_recovery;
+
+	/* Absolute deadlines in milliseconds, 0 when not armed */
+	uint64_t rto_deadline, delack_deadline, persist_deadline, timewait_deadline;
+
+	struct tcp_xmit * xmit_head, * xmit_tail;
+	int xmit_busy;
+
+	struct tcp_pcb * listener;
+	list_t * accept_queue;
+	int backlog;
+	int syn_pending; /* Children still in SYN_RECEIVED; they count against the backlog */
+	int orphaned;
+
+	list_t * tx_wait;
+
+	node_t list_node;
+	int listed, bound, connected;
+};
+
+/* Protects the tables below; never held while taking a connection's lock. */
+static spin_lock_t tcp_lock = {0};
+static hashmap_t * tcp_bound = NULL; /* local port -> pcb */
+static hashmap_t * tcp_conns = NULL; /* remote addr, remote port, local port -> pcb */
+static list_t * tcp_pcbs = NULL;     /* everything the timer needs to look at */
+static int tcp_next_port = TCP_EPHEMERAL_FIRST;
+
+static spin_lock_t tcp_timer_lock = {0};
+static list_t * tcp_timer_wait = NULL;
+static volatile uint64_t tcp_timer_next = 0;
+static volatile int tcp_timer_kicked = 0;
+static volatile int tcp_timer_started = 0;
+
+static uint64_t tcp_now(void) {
+	unsigned long s, ss;
+	relative_time(0, 0, &s, &ss);
+	return (uint64_t)s * 1000 + ss / 1000;
+}
+
+static uintptr_t tcp_conn_key(uint32_t raddr, uint16_t rport, uint16_t lport) {
+	return ((uintptr_t)raddr << 32) | ((uintptr_t)rport << 16) | lport;
+}
+
+/* Ring buffers */
+
+static void tcp_ring_init(struct tcp_ring * ring, size_t size) {
+	if (ring->data && ring->size != size) {
+		free(ring->data);
+		ring->data = NULL;
+	}
+	if (!ring->data) ring->data = malloc(size);
+	ring->size = size;
+	ring->head = 0;
+	ring->len = 0;
+}
+
+static void tcp_ring_append(struct tcp_ring * ring, const uint8_t * data, size_t len) {
+	size_t tail = (ring->head + ring->len) % ring->size;
+	size_t first = MIN(ring->size - tail, len);
+	memcpy(ring->data + tail, data, first);
+	memcpy(ring->data, data + first, len - first);
+	ring->len += len;
+}
+
+static void tcp_ring_append_iov(struct tcp_ring * ring, const struct iovec * iov, size_t iovcnt, size_t offset, size_t len) {
+	size_t tail = (ring->head + ring->len) % ring->size;
+	size_t first = MIN(ring->size - tail, len);
+	iov_gather(ring->data + tail, iov, iovcnt, offset, first);
+	if (len > first) iov_gather(ring->data, iov, iovcnt, offset + first, len - first);
+	ring->len += len;
+}
+
+static void tcp_ring_peek(struct tcp_ring * ring, size_t offset, uint8_t * out, size_t len) {
+	size_t start = (ring->head + offset) % ring->size;
+	size_t first = MIN(ring->size - start, len);
+	memcpy(out, ring->data + start, first);
+	memcpy(out + first, ring->data, len - first);
+}
+
+static void tcp_ring_consume(struct tcp_ring * ring, size_t len) {
+	ring->head = (ring->head + len) % ring->size;
+	ring->len -= len;
+}
+
+static void tcp_ring_read_iov(struct tcp_ring * ring, const struct iovec * iov, size_t iovcnt, size_t len) {
+	size_t first = MIN(ring->size - ring->head, len);
+	iov_scatter(iov, iovcnt, 0, ring->data + ring->head, first);
+	if (len > first) iov_scatter(iov, iovcnt, first, ring->data, len - first);
+	tcp_ring_consume(ring, len);
+}
+
+/* Control blocks */
+
+static struct tcp_pcb * tcp_pcb_create(void) {
+	struct tcp_pcb * pcb = calloc(1, sizeof(struct tcp_pcb));
+	pcb->refcount = 1;
+	pcb->state = TCP_CLOSED;
+	pcb->rto = TCP_RTO_INITIAL;
+	pcb->mss = TCP_DEFAULT_MSS;
+	pcb->our_mss = TCP_DEFAULT_MSS;
+	pcb->ssthresh = 0x7FFFFFFF;
+	pcb->ident = rand();
+	pcb->tx_wait = list_create("tcp send wait", pcb);
+	pcb->list_node.value = pcb;
+	return pcb;
+}
+
+static struct tcp_pcb * tcp_pcb_ref(struct tcp_pcb * pcb) {
+	__sync_add_and_fetch(&pcb->refcount, 1);
+	return pcb;
+}
+
+static void tcp_pcb_unref(struct tcp_pcb * pcb) {
+	if (__sync_sub_and_fetch(&pcb->refcount, 1)) return;
+
+	while (pcb->ooo) {
+		struct tcp_ooo * o = pcb->ooo;
+		pcb->ooo = o->next;
+		free(o);
+	}
+	if (pcb->snd.data) free(pcb->snd.data);
+	if (pcb->rcv.data) free(pcb->rcv.data);
+	if (pcb->accept_queue) {
+		list_free(pcb->accept_queue);
+		free(pcb->accept_queue);
+	}
+	list_free(pcb->tx_wait);
+	free(pcb->tx_wait);
+	free(pcb);
+}
+
+/**
+ * Size the buffers and MSS for the interface the connection will use.
+ */
+static void tcp_pcb_attach(struct tcp_pcb * pcb, fs_node_t * nic, uint32_t local_addr) {
+	size_t mtu = ((struct EthernetDevice *)nic->device)->mtu;
+	if (mtu > 65535) mtu = 65535;
+	pcb->nic = nic;
+	pcb->local_addr = local_addr;
+	pcb->our_mss = mtu - sizeof(struct ipv4_packet) - sizeof(struct tcp_header);
+	pcb->mss = MIN(pcb->our_mss, TCP_DEFAULT_MSS);
+	tcp_ring_init(&pcb->snd, TCP_SNDBUF);
+	tcp_ring_init(&pcb->rcv, TCP_RCVBUF);
+}
+
+/* Called with tcp_lock held. */
+static void tcp_list_add(struct tcp_pcb * pcb) {
+	if (pcb->listed) return;
+	list_append(tcp_pcbs, &pcb->list_node);
+	pcb->listed = 1;
+	tcp_pcb_ref(pcb);
+}
+
+/* Called with tcp_lock held. */
+static int tcp_port_alloc(struct tcp_pcb * pcb) {
+	for (int i = 0; i <= TCP_EPHEMERAL_LAST - TCP_EPHEMERAL_FIRST; ++i) {
+		int port = tcp_next_port++;
+		if (tcp_next_port > TCP_EPHEMERAL_LAST) tcp_next_port = TCP_EPHEMERAL_FIRST;
+		if (hashmap_has(tcp_bound, (void*)(uintptr_t)port)) continue;
+		hashmap_set(tcp_bound, (void*)(uintptr_t)port, pcb);
+		pcb->local_port = port;
+		pcb->bound = 1;
+		tcp_list_add(pcb);
+		return 0;
+	}
+	return -EADDRINUSE;
+}
+
+/* Called with tcp_lock held. */
+static int tcp_hash_conn(struct tcp_pcb * pcb) {
+	void * key = (void*)tcp_conn_key(pcb->remote_addr, pcb->remote_port, pcb->local_port);
+	if (hashmap_has(tcp_conns, key)) return -EADDRINUSE;
+	hashmap_set(tcp_conns, key, pcb);
+	pcb->connected = 1;
+	tcp_list_add(pcb);
+	return 0;
+}
+
+/**
+ * Take a connection out of every table; it will receive no more segments.
+ * The caller must hold a reference of its own.
+ */
+static void tcp_unhash(struct tcp_pcb * pcb) {
+	int listed;
+
+	spin_lock(tcp_lock);
+	if (pcb->connected) {
+		void * key = (void*)tcp_conn_key(pcb->remote_addr, pcb->remote_port, pcb->local_port);
+		if (hashmap_get(tcp_conns, key) == pcb) hashmap_remove(tcp_conns, key);
+		pcb->connected = 0;
+	}
+	if (pcb->bound) {
+		void * key = (void*)(uintptr_t)pcb->local_port;
+		if (hashmap_get(tcp_bound, key) == pcb) hashmap_remove(tcp_bound, key);
+		pcb->bound = 0;
+	}
+	listed = pcb->listed;
+	if (listed) {
+		list_delete(tcp_pcbs, &pcb->list_node);
+		pcb->listed = 0;
+	}
+	spin_unlock(tcp_lock);
+
+	if (listed) tcp_pcb_unref(pcb);
+}
+
+/**
+ * Find the connection for an incoming segment, falling back to a
+ * listener on the port. Returns a new reference.
+ */
+static struct tcp_pcb * tcp_lookup(uint32_t raddr, uint16_t rport, uint16_t lport) {
+	spin_lock(tcp_lock);
+	struct tcp_pcb * pcb = hashmap_get(tcp_conns, (void*)tcp_conn_key(raddr, rport, lport));
+	if (!pcb) {
+		pcb = hashmap_get(tcp_bound, (void*)(uintptr_t)lport);
+		if (pcb && pcb->state != TCP_LISTEN) pcb = NULL;
+	}
+	if (pcb) tcp_pcb_ref(pcb);
+	spin_unlock(tcp_lock);
+	return pcb;
+}
+
+/* Timers */
+
+static void tcp_timer_kick(uint64_t deadline) {
+	__sync_synchronize();
+	if (deadline >= tcp_timer_next) return;
+	spin_lock(tcp_timer_lock);
+	if (deadline < tcp_timer_next) {
+		tcp_timer_next = deadline;
+		tcp_timer_kicked = 1;
+		wakeup_queue(tcp_timer_wait);
+	}
+	spin_unlock(tcp_timer_lock);
+}
+
+static void tcp_set_timer(uint64_t * timer, uint64_t deadline) {
+	*timer = deadline;
+	tcp_timer_kick(deadline);
+}
+
+static void tcp_rto_start(struct tcp_pcb * pcb) {
+	tcp_set_timer(&pcb->rto_deadline, tcp_now() + pcb->rto);
+}
+
+static void tcp_rtt_sample(struct tcp_pcb * pcb, uint32_t rtt) {
+	if (!pcb->rtt_valid) {
+		pcb->srtt8 = rtt << 3;
+		pcb->rttvar4 = rtt << 1;
+		pcb->rtt_valid = 1;
+	} else {
+		int32_t delta = (int32_t)rtt - (int32_t)(pcb->srtt8 >> 3);
+		pcb->srtt8 += delta;
+		if (delta < 0) delta = -delta;
+		pcb->rttvar4 += delta - (int32_t)(pcb->rttvar4 >> 2);
+	}
+	uint32_t rto = (pcb->srtt8 >> 3) + MAX(pcb->rttvar4, 1);
+	pcb->rto = MIN(MAX(rto, TCP_RTO_MIN), TCP_RTO_MAX);
+}
+
+/* Wake anything blocked reading, accepting or connecting. */
+static void tcp_wake_readers(struct tcp_pcb * pcb) {
+	if (!pcb->sock) return;
+	wakeup_queue(pcb->sock->rx_wait);
+	net_sock_alert(pcb->sock);
+}
+
+static void tcp_wake_writers(struct tcp_pcb * pcb) {
+	wakeup_queue(pcb->tx_wait);
+}
+
+/* Output */
+
+static uint32_t tcp_rcv_window(struct tcp_pcb * pcb) {
+	return pcb->rcv.size - pcb->rcv.len;
+}
+
+/**
+ * Build a segment and queue it to be sent when the lock is dropped.
+ * @p len bytes of data are taken from the send buffer at @p offset
+ * bytes past snd_una.
+ */
+static void tcp_emit(struct tcp_pcb * pcb, uint32_t seq, int flags, size_t offset, size_t len) {
+	uint8_t options[8];
+	size_t optlen = 0;
+
+	if (flags & TCP_FLAGS_SYN) {
+		options[0] = TCP_OPT_MSS;
+		options[1] = 4;
+		options[2] = pcb->our_mss >> 8;
+		options[3] = pcb->our_mss & 0xFF;
+		optlen = 4;
+		if (pcb->wscale_offer) {
+			options[4] = TCP_OPT_NOP;
+			options[5] = TCP_OPT_WSCALE;
+			options[6] = 3;
+			options[7] = TCP_WSCALE;
+			optlen = 8;
+		}
+	}
+
+	if (pcb->state != TCP_SYN_SENT) flags |= TCP_FLAGS_ACK;
+
+	size_t tcp_length = sizeof(struct tcp_header) + optlen + len;
+	size_t total_length = sizeof(struct ipv4_packet) + tcp_length;
+
+	struct tcp_xmit * x = malloc(sizeof(struct tcp_xmit) + total_length);
+	x->next = NULL;
+	x->nic = pcb->nic;
+
+	struct ipv4_packet * packet = (struct ipv4_packet *)x->packet;
+	packet->version_ihl = 0x45;
+	packet->dscp_ecn = 0;
+	packet->length = htons(total_length);
+	packet->ident = htons(pcb->ident);
+	pcb->ident++;
+	packet->flags_fragment = htons(0x4000); /* Don't fragment */
+	packet->ttl = 64;
+	packet->protocol = IPV4_PROT_TCP;
+	packet->checksum = 0;
+	packet->source = pcb->local_addr;
+	packet->destination = pcb->remote_addr;
+	packet->checksum = net_checksum(packet, sizeof(struct ipv4_packet));
+
+	/* SYNs always carry an unscaled window */
+	uint32_t window = tcp_rcv_window(pcb);
+	if (!(flags & TCP_FLAGS_SYN)) window >>= pcb->rcv_wscale;
+	if (window > 65535) window = 65535;
+
+	struct tcp_header * tcp = (struct tcp_header *)&packet->payload;
+	tcp->source_port = htons(pcb->local_port);
+	tcp->destination_port = htons(pcb->remote_port);
+	tcp->seq_number = htonl(seq);
+	tcp->ack_number = (flags & TCP_FLAGS_ACK) ? htonl(pcb->rcv_nxt) : 0;
+	tcp->flags = htons(flags | (((sizeof(struct tcp_header) + optlen) / 4) << 12));
+	tcp->window_size = htons(window);
+	tcp->checksum = 0;
+	tcp->urgent = 0;
+	memcpy(tcp->payload, options, optlen);
+	if (len) tcp_ring_peek(&pcb->snd, offset, tcp->payload + optlen, len);
+
+	if (pcb->xmit_tail) pcb->xmit_tail->next = x;
+	else pcb->xmit_head = x;
+	pcb->xmit_tail = x;
+
+	if (flags & TCP_FLAGS_ACK) {
+		uint32_t adv = pcb->rcv_nxt + (flags & TCP_FLAGS_SYN ? window : window << pcb->rcv_wscale);
+		if (SEQ_GT(adv, pcb->rcv_adv)) pcb->rcv_adv = adv;
+		pcb->ack_pending = 0;
+		pcb->ack_now = 0;
+	}
+}
+
+/**
+ * Release a connection's lock and send whatever was queued under it.
+ * Only one caller sends at a time so segments leave in order; anyone
+ * else just leaves theirs on the queue for it.
+ */
+static void tcp_unlock(struct tcp_pcb * pcb) {
+	if (pcb->xmit_busy) {
+		spin_unlock(pcb->lock);
+		return;
+	}
+	pcb->xmit_busy = 1;
+	while (pcb->xmit_head) {
+		struct tcp_xmit * x = pcb->xmit_head;
+		pcb->xmit_head = pcb->xmit_tail = NULL;
+		spin_unlock(pcb->lock);
+		while (x) {
+			struct tcp_xmit * next = x->next;
+			net_ipv4_send_csum((struct ipv4_packet *)x->packet, x->nic, offsetof(struct tcp_header, checksum));
+			free(x);
+			x = next;
+		}
+		spin_lock(pcb->lock);
+	}
+	pcb->xmit_busy = 0;
+	spin_unlock(pcb->lock);
+}
+
+static int tcp_can_send(struct tcp_pcb * pcb) {
+	switch (pcb->state) {
+		case TCP_ESTABLISHED:
+		case TCP_CLOSE_WAIT:
+		case TCP_FIN_WAIT_1:
+		case TCP_CLOSING:
+		case TCP_LAST_ACK:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/**
+ * Send as much new data as the windows allow, a FIN once the send
+ * buffer has drained, and an ACK if one is owed and nothing else
+ * carried it.
+ */
+static void tcp_output(struct tcp_pcb * pcb) {
+	if (tcp_can_send(pcb)) {
+		/* Limited transmit (RFC 3042): each of the first two duplicate ACKs lets out one new segment */
+		uint32_t cwnd = pcb->cwnd;
+		if (!pcb->in_recovery && pcb->dupacks < 3) cwnd += pcb->dupacks * pcb->mss;
+		uint32_t wnd = MIN(pcb->snd_wnd, cwnd);
+
+		while (1) {
+			size_t sent = pcb->snd_nxt - pcb->snd_una;
+			size_t unsent = sent < pcb->snd.len ? pcb->snd.len - sent : 0;
+
+			if (!unsent) {
+				if (pcb->fin_queued && sent == pcb->snd.len) {
+					tcp_emit(pcb, pcb->snd_nxt, TCP_FLAGS_FIN, 0, 0);
+					pcb->snd_nxt++;
+					if (SEQ_GT(pcb->snd_nxt, pcb->snd_max)) pcb->snd_max = pcb->snd_nxt;
+				}
+				break;
+			}
+
+			size_t avail = wnd > sent ? wnd - sent : 0;
+			size_t len = MIN(MIN(unsent, (size_t)pcb->mss), avail);
+			if (!len) break;
+
+			/* Hold back small segments while anything is in flight (Nagle, and sender-side SWS avoidance) */
+			if (len < pcb->mss && sent) break;
+
+			int flags = (len == unsent) ? TCP_FLAGS_PSH : 0;
+			tcp_emit(pcb, pcb->snd_nxt, flags, sent, len);
+
+			/* Time one segment per round trip, never a retransmission */
+			if (!pcb->rtt_timing && !SEQ_LT(pcb->snd_nxt, pcb->snd_max)) {
+				pcb->rtt_timing = 1;
+				pcb->rtt_seq = pcb->snd_nxt + len;
+				pcb->rtt_start = tcp_now();
+			}
+
+			pcb->snd_nxt += len;
+			if (SEQ_GT(pcb->snd_nxt, pcb->snd_max)) pcb->snd_max = pcb->snd_nxt;
+		}
+
+		if (pcb->snd_nxt != pcb->snd_una) {
+			if (!pcb->rto_deadline) tcp_rto_start(pcb);
+			pcb->persist_deadline = 0;
+		} else if (pcb->snd.len && !pcb->snd_wnd && !pcb->persist_deadline) {
+			tcp_set_timer(&pcb->persist_deadline, tcp_now() + pcb->rto);
+		}
+	}
+
+	if (pcb->ack_now && pcb->state >= TCP_ESTABLISHED) {
+		tcp_emit(pcb, pcb->snd_nxt, 0, 0, 0);
+	}
+}
+
+/* Resend the oldest unacknowledged segment. */
+static void tcp_retransmit(struct tcp_pcb * pcb) {
+	pcb->rtt_timing = 0;
+	size_t len = MIN(pcb->snd.len, (size_t)pcb->mss);
+	if (len) {
+		tcp_emit(pcb, pcb->snd_una, 0, 0, len);
+	} else if (pcb->fin_queued) {
+		tcp_emit(pcb, pcb->snd_una, TCP_FLAGS_FIN, 0, 0);
+	}
+}
+
+static void tcp_send_reset(struct tcp_pcb * pcb) {
+	tcp_emit(pcb, pcb->snd_nxt, TCP_FLAGS_RST, 0, 0);
+}
+
+/**
+ * Move a connection to CLOSED and out of the tables. The caller
+ * must hold the lock and a reference.
+ */
+static void tcp_set_closed(struct tcp_pcb * pcb, int error) {
+	if (pcb->state == TCP_SYN_RECEIVED) {
+		spin_lock(pcb->listener->lock);
+		pcb->listener->syn_pending--;
+		spin_unlock(pcb->listener->lock);
+	}
+	pcb->state = TCP_CLOSED;
+	if (error) pcb->error = error;
+	pcb->rto_deadline = 0;
+	pcb->delack_deadline = 0;
+	pcb->persist_deadline = 0;
+	pcb->timewait_deadline = 0;
+	tcp_unhash(pcb);
+	if (pcb->listener) {
+		tcp_pcb_unref(pcb->listener);
+		pcb->listener = NULL;
+	}
+	tcp_wake_readers(pcb);
+	tcp_wake_writers(pcb);
+}
+
+static void tcp_enter_time_wait(struct tcp_pcb * pcb) {
+	pcb->state = TCP_TIME_WAIT;
+	pcb->rto_deadline = 0;
+	pcb->persist_deadline = 0;
+	tcp_set_timer(&pcb->timewait_deadline, tcp_now() + TCP_TIME_WAIT_TIMEOUT);
+}
+
+/* Input */
+
+struct tcp_seg {
+	uint32_t seq, ack;
+	int flags;
+	uint32_t wnd;
+	uint8_t * data;
+	size_t len;
+	uint16_t mss;
+	int wscale;
+};
+
+static void tcp_parse_options(struct tcp_header * tcp, size_t hlen, struct tcp_seg * seg) {
+	uint8_t * opt = tcp->payload;
+	size_t len = hlen - sizeof(struct tcp_header);
+	size_t i = 0;
+
+	while (i < len) {
+		uint8_t kind = opt[i];
+		if (kind == TCP_OPT_END) break;
+		if (kind == TCP_OPT_NOP) {
+			i++;
+			continue;
+		}
+		if (i + 1 >= len) break;
+		uint8_t olen = opt[i+1];
+		if (olen < 2 || i + olen > len) break;
+		if (kind == TCP_OPT_MSS && olen == 4) seg->mss = (opt[i+2] << 8) | opt[i+3];
+		if (kind == TCP_OPT_WSCALE && olen == 3) seg->wscale = MIN(opt[i+2], 14);
+		i += olen;
+	}
+}
+
+/* Settle MSS and window scaling from the peer's SYN. */
+static void tcp_apply_syn(struct tcp_pcb * pcb, struct tcp_seg * seg) {
+	pcb->mss = MIN(pcb->our_mss, seg->mss ? seg->mss : TCP_DEFAULT_MSS);
+	if (pcb->wscale_offer && seg->wscale >= 0) {
+		pcb->snd_wscale = seg->wscale;
+		pcb->rcv_wscale = TCP_WSCALE;
+	} else {
+		pcb->snd_wscale = 0;
+		pcb->rcv_wscale = 0;
+	}
+	pcb->irs = seg->seq;
+	pcb->rcv_nxt = seg->seq + 1;
+	pcb->rcv_adv = pcb->rcv_nxt;
+}
+
+/* The handshake is done; start the congestion window at RFC 6928's IW10. */
+static void tcp_established(struct tcp_pcb * pcb, struct tcp_seg * seg) {
+	pcb->state = TCP_ESTABLISHED;
+	pcb->snd_una = seg->ack;
+	pcb->snd_wnd = seg->wnd << pcb->snd_wscale;
+	pcb->snd_wl1 = seg->seq;
+	pcb->snd_wl2 = seg->ack;
+	pcb->cwnd = MIN(10 * pcb->mss, MAX(2 * pcb->mss, 14600));
+	pcb->recover = pcb->iss;
+	pcb->retries = 0;
+	pcb->rto_deadline = 0;
+	if (pcb->rtt_timing) {
+		tcp_rtt_sample(pcb, tcp_now() - pcb->rtt_start);
+		pcb->rtt_timing = 0;
+	}
+}
+
+/**
+ * A passively opened connection finished its handshake; hand it to
+ * the listener's accept queue.
+ */
+static void tcp_accept_ready(struct tcp_pcb * pcb) {
+	struct tcp_pcb * listener = pcb->listener;
+	int queued = 0;
+
+	spin_lock(listener->lock);
+	listener->syn_pending--;
+	if (listener->state == TCP_LISTEN) {
+		list_insert(listener->accept_queue, tcp_pcb_ref(pcb));
+		tcp_wake_readers(listener);
+		queued = 1;
+	}
+	spin_unlock(listener->lock);
+
+	if (!queued) {
+		tcp_send_reset(pcb);
+		tcp_set_closed(pcb, ECONNABORTED);
+	}
+}
+
+static void tcp_syn_sent_input(struct tcp_pcb * pcb, struct tcp_seg * seg) {
+	if (seg->flags & TCP_FLAGS_ACK) {
+		if (SEQ_LEQ(seg->ack, pcb->iss) || SEQ_GT(seg->ack, pcb->snd_max)) {
+			if (!(seg->flags & TCP_FLAGS_RST)) tcp_emit(pcb, seg->ack, TCP_FLAGS_RST, 0, 0);
+			return;
+		}
+	}
+
+	if (seg->flags & TCP_FLAGS_RST) {
+		if (seg->flags & TCP_FLAGS_ACK) tcp_set_closed(pcb, ECONNREFUSED);
+		return;
+	}
+
+	/* We don't do simultaneous open. */
+	if ((seg->flags & (TCP_FLAGS_SYN | TCP_FLAGS_ACK)) != (TCP_FLAGS_SYN | TCP_FLAGS_ACK)) return;
+
+	tcp_apply_syn(pcb, seg);
+	tcp_established(pcb, seg);
+	pcb->ack_now = 1;
+	tcp_wake_readers(pcb);
+	tcp_wake_writers(pcb);
+	tcp_output(pcb);
+}
+
+/**
+ * A SYN for a listening socket: make the new connection and queue its
+ * SYN-ACK. Returns the new connection locked and with a reference for
+ * the caller, who sends the SYN-ACK once the listener is unlocked.
+ */
+static struct tcp_pcb * tcp_listen_input(struct tcp_pcb * listener, struct tcp_seg * seg, struct ipv4_packet * packet, uint16_t rport, fs_node_t * nic) {
+	if ((seg->flags & (TCP_FLAGS_SYN | TCP_FLAGS_ACK | TCP_FLAGS_RST)) != TCP_FLAGS_SYN) return NULL;
+	if ((int)listener->accept_queue->length + listener->syn_pending >= listener->backlog) return NULL;
+
+	struct tcp_pcb * pcb = tcp_pcb_create();
+	tcp_pcb_attach(pcb, nic, packet->destination);
+	pcb->local_port = listener->local_port;
+	pcb->remote_addr = packet->source;
+	pcb->remote_port = rport;
+	pcb->wscale_offer = seg->wscale >= 0;
+	tcp_apply_syn(pcb, seg);
+	pcb->iss = rand();
+	pcb->snd_una = pcb->iss;
+	pcb->snd_nxt = pcb->iss + 1;
+	pcb->snd_max = pcb->snd_nxt;
+	pcb->snd_wnd = seg->wnd;
+	pcb->state = TCP_SYN_RECEIVED;
+	pcb->listener = tcp_pcb_ref(listener);
+
+	spin_lock(pcb->lock);
+	spin_lock(tcp_lock);
+	int err = tcp_hash_conn(pcb);
+	spin_unlock(tcp_lock);
+	if (err) {
+		pcb->state = TCP_CLOSED;
+		tcp_pcb_unref(listener);
+		pcb->listener = NULL;
+		spin_unlock(pcb->lock);
+		tcp_pcb_unref(pcb);
+		return NULL;
+	}
+
+	listener->syn_pending++;
+	tcp_emit(pcb, pcb->iss, TCP_FLAGS_SYN, 0, 0);
+	pcb->rtt_timing = 1;
+	pcb->rtt_start = tcp_now();
+	tcp_rto_start(pcb);
+	return pcb;
+}
+
+static void tcp_ooo_insert(struct tcp_pcb * pcb, uint32_t seq, const uint8_t * data, size_t len) {
+	/* Only keep what will fit once the hole is filled */
+	uint32_t limit = pcb->rcv_nxt + tcp_rcv_window(pcb);
+	if (SEQ_GEQ(seq, limit)) return;
+	if (SEQ_GT(seq + len, limit)) len = limit - seq;
+	if (pcb->ooo_count >= TCP_OOO_MAX) return;
+
+	struct tcp_ooo ** p = &pcb->ooo;
+	while (*p && SEQ_LT((*p)->seq, seq)) p = &(*p)->next;
+	if (*p && (*p)->seq == seq && (*p)->len >= len) return;
+
+	struct tcp_ooo * o = malloc(sizeof(struct tcp_ooo) + len);
+	o->seq = seq;
+	o->len = len;
+	memcpy(o->data, data, len);
+	o->next = *p;
+	*p = o;
+	pcb->ooo_count++;
+}
+
+/* Move anything that is now in sequence from the out-of-order list to the receive buffer. */
+static void tcp_ooo_drain(struct tcp_pcb * pcb) {
+	while (pcb->ooo && SEQ_LEQ(pcb->ooo->seq, pcb->rcv_nxt)) {
+		struct tcp_ooo * o = pcb->ooo;
+		pcb->ooo = o->next;
+		pcb->ooo_count--;
+		if (SEQ_GT(o->seq + o->len, pcb->rcv_nxt)) {
+			size_t skip = pcb->rcv_nxt - o->seq;
+			size_t len = MIN(o->len - skip, (size_t)tcp_rcv_window(pcb));
+			tcp_ring_append(&pcb->rcv, o->data + skip, len);
+			pcb->rcv_nxt += len;
+		}
+		free(o);
+	}
+}
+
+static int tcp_acceptable(struct tcp_pcb * pcb, struct tcp_seg * seg, size_t seg_len) {
+	uint32_t wnd = tcp_rcv_window(pcb);
+	/* Never shrink what we already advertised */
+	if (SEQ_GT(pcb->rcv_adv, pcb->rcv_nxt + wnd)) wnd = pcb->rcv_adv - pcb->rcv_nxt;
+
+	if (seg->seq == pcb->rcv_nxt) return 1;
+	if (!seg_len) return SEQ_GEQ(seg->seq, pcb->rcv_nxt) && SEQ_LT(seg->seq, pcb->rcv_nxt + wnd);
+	if (!wnd) return 0;
+	uint32_t last = seg->seq + seg_len - 1;
+	return (SEQ_GEQ(seg->seq, pcb->rcv_nxt) && SEQ_LT(seg->seq, pcb->rcv_nxt + wnd)) ||
+		(SEQ_GEQ(last, pcb->rcv_nxt) && SEQ_LT(last, pcb->rcv_nxt + wnd));
+}
+
+/* Process an acknowledgement that covers new data. */
+static void tcp_new_ack(struct tcp_pcb * pcb, struct tcp_seg * seg) {
+	uint32_t acked = seg->ack - pcb->snd_una;
+	/* Only grow the window if it was what held us back (RFC 7661) */
+	int cwnd_limited = pcb->snd_max - pcb->snd_una + pcb->mss >= pcb->cwnd;
+
+	if (pcb->rtt_timing && SEQ_GEQ(seg->ack, pcb->rtt_seq)) {
+		tcp_rtt_sample(pcb, tcp_now() - pcb->rtt_start);
+		pcb->rtt_timing = 0;
+	}
+
+	size_t data_acked = MIN((size_t)acked, pcb->snd.len);
+	int fin_acked = pcb->fin_queued && acked > data_acked;
+	tcp_ring_consume(&pcb->snd, data_acked);
+	pcb->snd_una = seg->ack;
+	if (SEQ_LT(pcb->snd_nxt, pcb->snd_una)) pcb->snd_nxt = pcb->snd_una;
+	pcb->retries = 0;
+
+	if (pcb->in_recovery) {
+		if (SEQ_GEQ(seg->ack, pcb->recover)) {
+			/* Full acknowledgement: deflate the window and leave recovery */
+			uint32_t flight = pcb->snd_max - pcb->snd_una;
+			pcb->cwnd = MIN(pcb->ssthresh, MAX(flight, (uint32_t)pcb->mss) + pcb->mss);
+			pcb->in_recovery = 0;
+			pcb->dupacks = 0;
+		} else {
+			/* Partial acknowledgement: the next hole is lost too */
+			tcp_retransmit(pcb);
+			pcb->cwnd = (pcb->cwnd > acked ? pcb->cwnd - acked : 0) + pcb->mss;
+			tcp_rto_start(pcb);
+		}
+	} else {
+		pcb->dupacks = 0;
+		if (!cwnd_limited) {
+			/* Application-limited; leave the window alone */
+		} else if (pcb->cwnd < pcb->ssthresh) {
+			pcb->cwnd += MIN(acked, (uint32_t)pcb->mss);
+		} else {
+			pcb->cwnd_acc += acked;
+			if (pcb->cwnd_acc >= pcb->cwnd) {
+				pcb->cwnd_acc -= pcb->cwnd;
+				pcb->cwnd += pcb->mss;
+			}
+		}
+		if (pcb->cwnd > 0x40000000) pcb->cwnd = 0x40000000;
+	}
+
+	if (pcb->snd_una == pcb->snd_max) {
+		pcb->rto_deadline = 0;
+	} else if (!pcb->in_recovery) {
+		tcp_rto_start(pcb);
+	}
+
+	if (data_acked) tcp_wake_writers(pcb);
+
+	if (fin_acked) {
+		switch (pcb->state) {
+			case TCP_FIN_WAIT_1:
+				pcb->state = TCP_FIN_WAIT_2;
+				if (pcb->orphaned) tcp_set_timer(&pcb->timewait_deadline, tcp_now() + TCP_FIN_WAIT_2_TIMEOUT);
+				break;
+			case TCP_CLOSING:
+				tcp_enter_time_wait(pcb);
+				break;
+			case TCP_LAST_ACK:
+				tcp_set_closed(pcb, 0);
+				break;
+		}
+	}
+}
+
+static void tcp_dup_ack(struct tcp_pcb * pcb) {
+	if (pcb->in_recovery) {
+		/* Each duplicate means another segment has left the network */
+		pcb->cwnd += pcb->mss;
+		return;
+	}
+	if (++pcb->dupacks == 3 && SEQ_GEQ(pcb->snd_una, pcb->recover)) {
+		/* Fast retransmit */
+		uint32_t flight = pcb->snd_max - pcb->snd_una;
+		pcb->ssthresh = MAX(flight / 2, 2 * (uint32_t)pcb->mss);
+		pcb->recover = pcb->snd_max;
+		pcb->in_recovery = 1;
+		tcp_retransmit(pcb);
+		pcb->cwnd = pcb->ssthresh + 3 * pcb->mss;
+	}
+}
+
+/* Process a segment for a synchronized connection. Called with the lock held. */
+static void tcp_input(struct tcp_pcb * pcb, struct tcp_seg * seg) {
+	size_t seg_len = seg->len + !!(seg->flags & TCP_FLAGS_SYN) + !!(seg->flags & TCP_FLAGS_FIN);
+
+	if (pcb->state == TCP_SYN_RECEIVED && (seg->flags & TCP_FLAGS_SYN) && !(seg->flags & TCP_FLAGS_ACK) && seg->seq == pcb->irs) {
+		/* Our SYN-ACK went missing */
+		tcp_emit(pcb, pcb->iss, TCP_FLAGS_SYN, 0, 0);
+		return;
+	}
+
+	if (!tcp_acceptable(pcb, seg, seg_len)) {
+		if (!(seg->flags & TCP_FLAGS_RST)) {
+			pcb->ack_now = 1;
+			tcp_output(pcb);
+		}
+		if (pcb->state == TCP_TIME_WAIT && (seg->flags & TCP_FLAGS_FIN)) {
+			tcp_set_timer(&pcb->timewait_deadline, tcp_now() + TCP_TIME_WAIT_TIMEOUT);
+		}
+		return;
+	}
+
+	if (seg->flags & TCP_FLAGS_RST) {
+		/* RFC 5961 section 3.2: only a reset at exactly rcv_nxt is believed; for
+		 * anything else in the window, a challenge ACK makes a real peer resend it there. */
+		if (seg->seq != pcb->rcv_nxt) {
+			pcb->ack_now = 1;
+			tcp_output(pcb);
+			return;
+		}
+		int error = 0;
+		if (pcb->state == TCP_ESTABLISHED || pcb->state == TCP_FIN_WAIT_1 ||
+			pcb->state == TCP_FIN_WAIT_2 || pcb->state == TCP_CLOSE_WAIT) error = ECONNRESET;
+		tcp_set_closed(pcb, error);
+		return;
+	}
+
+	if (seg->flags & TCP_FLAGS_SYN) {
+		/* RFC 5961: answer an in-window SYN with an ACK and let the peer sort it out */
+		pcb->ack_now = 1;
+		tcp_output(pcb);
+		return;
+	}
+
+	if (!(seg->flags & TCP_FLAGS_ACK)) return;
+
+	if (pcb->state == TCP_SYN_RECEIVED) {
+		if (SEQ_LEQ(seg->ack, pcb->snd_una) || SEQ_GT(seg->ack, pcb->snd_max)) {
+			tcp_emit(pcb, seg->ack, TCP_FLAGS_RST, 0, 0);
+			return;
+		}
+		tcp_established(pcb, seg);
+		tcp_accept_ready(pcb);
+		if (pcb->state == TCP_CLOSED) return;
+	}
+
+	if (SEQ_GT(seg->ack, pcb->snd_max)) {
+		pcb->ack_now = 1;
+		tcp_output(pcb);
+		return;
+	}
+
+	uint32_t wnd = seg->wnd << pcb->snd_wscale;
+
+	if (SEQ_GT(seg->ack, pcb->snd_una)) {
+		tcp_new_ack(pcb, seg);
+		if (pcb->state == TCP_CLOSED) return;
+	} else if (seg->ack == pcb->snd_una && !seg->len && !(seg->flags & TCP_FLAGS_FIN) &&
+		wnd == pcb->snd_wnd && pcb->snd_max != pcb->snd_una) {
+		tcp_dup_ack(pcb);
+	}
+
+	if (SEQ_LT(pcb->snd_wl1, seg->seq) || (pcb->snd_wl1 == seg->seq && SEQ_LEQ(pcb->snd_wl2, seg->ack))) {
+		if (wnd > pcb->snd_wnd) tcp_wake_writers(pcb);
+		pcb->snd_wnd = wnd;
+		pcb->snd_wl1 = seg->seq;
+		pcb->snd_wl2 = seg->ack;
+		if (wnd) pcb->persist_deadline = 0;
+	}
+
+	int receiving = pcb->state == TCP_ESTABLISHED || pcb->state == TCP_FIN_WAIT_1 || pcb->state == TCP_FIN_WAIT_2;
+	int fin_ok = 1;
+
+	if (seg->len && receiving) {
+		if (pcb->orphaned) {
+			/* Nobody will ever read this */
+			tcp_send_reset(pcb);
+			tcp_set_closed(pcb, 0);
+			return;
+		}
+
+		uint32_t seq = seg->seq;
+		uint8_t * data = seg->data;
+		size_t len = seg->len;
+
+		if (SEQ_LT(seq, pcb->rcv_nxt)) {
+			uint32_t skip = pcb->rcv_nxt - seq;
+			if (skip >= len) {
+				len = 0;
+			} else {
+				data += skip;
+				len -= skip;
+				seq = pcb->rcv_nxt;
+			}
+		}
+
+		if (len && seq == pcb->rcv_nxt) {
+			size_t room = tcp_rcv_window(pcb);
+			if (len > room) {
+				len = room;
+				fin_ok = 0;
+			}
+			tcp_ring_append(&pcb->rcv, data, len);
+			pcb->rcv_nxt += len;
+			if (pcb->ooo) {
+				tcp_ooo_drain(pcb);
+				pcb->ack_now = 1;
+			}
+			tcp_wake_readers(pcb);
+			if (++pcb->ack_pending >= 2) {
+				pcb->ack_now = 1;
+			} else if (!pcb->delack_deadline) {
+				tcp_set_timer(&pcb->delack_deadline, tcp_now() + TCP_DELACK);
+			}
+		} else if (len) {
+			tcp_ooo_insert(pcb, seq, data, len);
+			pcb->ack_now = 1;
+			fin_ok = 0;
+		}
+	}
+
+	if ((seg->flags & TCP_FLAGS_FIN) && fin_ok && receiving && pcb->rcv_nxt == seg->seq + seg->len) {
+		pcb->rcv_nxt++;
+		pcb->fin_received = 1;
+		pcb->ack_now = 1;
+		tcp_wake_readers(pcb);
+		switch (pcb->state) {
+			case TCP_ESTABLISHED:
+				pcb->state = TCP_CLOSE_WAIT;
+				break;
+			case TCP_FIN_WAIT_1:
+				pcb->state = TCP_CLOSING;
+				break;
+			case TCP_FIN_WAIT_2:
+				tcp_enter_time_wait(pcb);
+				break;
+		}
+	}
+
+	tcp_output(pcb);
+}
+
+/* Answer a segment that belongs to no connection, per RFC 793. */
+static void tcp_reset_reply(struct ipv4_packet * packet, struct tcp_header * in, struct tcp_seg * seg, fs_node_t * nic) {
+	size_t total_length = sizeof(struct ipv4_packet) + sizeof(struct tcp_header);
+	struct ipv4_packet * response = malloc(total_length);
+	response->version_ihl = 0x45;
+	response->dscp_ecn = 0;
+	response->length = htons(total_length);
+	response->ident = 0;
+	response->flags_fragment = htons(0x4000);
+	response->ttl = 64;
+	response->protocol = IPV4_PROT_TCP;
+	response->checksum = 0;
+	response->source = packet->destination;
+	response->destination = packet->source;
+	response->checksum = net_checksum(response, sizeof(struct ipv4_packet));
+
+	struct tcp_header * tcp = (struct tcp_header *)&response->payload;
+	tcp->source_port = in->destination_port;
+	tcp->destination_port = in->source_port;
+	if (seg->flags & TCP_FLAGS_ACK) {
+		tcp->seq_number = htonl(seg->ack);
+		tcp->ack_number = 0;
+		tcp->flags = htons(TCP_FLAGS_RST | 0x5000);
+	} else {
+		size_t seg_len = seg->len + !!(seg->flags & TCP_FLAGS_SYN) + !!(seg->flags & TCP_FLAGS_FIN);
+		tcp->seq_number = 0;
+		tcp->ack_number = htonl(seg->seq + seg_len);
+		tcp->flags = htons(TCP_FLAGS_RST | TCP_FLAGS_ACK | 0x5000);
+	}
+	tcp->window_size = 0;
+	tcp->urgent = 0;
+
+	net_ipv4_send_csum(response, nic, offsetof(struct tcp_header, checksum));
+	free(response);
+}
+
+void net_tcp_handle(net_buffer_t * buf, struct ipv4_packet * packet, fs_node_t * nic, size_t size) {
+	size_t ihl = (packet->version_ihl & 0xF) * 4;
+	size_t total = ntohs(packet->length);
+	if (total > size) total = size;
+	if (ihl < sizeof(struct ipv4_packet) || total < ihl + sizeof(struct tcp_header)) return;
+
+	struct tcp_header * tcp = (struct tcp_header *)((uint8_t *)packet + ihl);
+	size_t tcp_length = total - ihl;
+	size_t hlen = (ntohs(tcp->flags) >> 12) * 4;
+	if (hlen < sizeof(struct tcp_header) || hlen > tcp_length) return;
+
+	if (!net_ipv4_checksum_ok(buf, packet, tcp, tcp_length)) {
+		printf("tcp: bad checksum from " IPV4_FORMAT "\n", FORMAT_IPV4(packet->source));
+		return;
+	}
+
+	struct tcp_seg seg = {
+		.seq = ntohl(tcp->seq_number),
+		.ack = ntohl(tcp->ack_number),
+		.flags = ntohs(tcp->flags) & 0x1FF,
+		.wnd = ntohs(tcp->window_size),
+		.data = (uint8_t *)tcp + hlen,
+		.len = tcp_length - hlen,
+		.mss = 0,
+		.wscale = -1,
+	};
+	if (seg.flags & TCP_FLAGS_SYN) tcp_parse_options(tcp, hlen, &seg);
+
+	uint16_t sport = ntohs(tcp->source_port);
+	uint16_t dport = ntohs(tcp->destination_port);
+
+	printf("tcp: " IPV4_FORMAT ":%d -> " IPV4_FORMAT ":%d flags %#x seq %u ack %u len %zu\n",
+		FORMAT_IPV4(packet->source), sport, FORMAT_IPV4(packet->destination), dport,
+		seg.flags, seg.seq, seg.ack, seg.len);
+
+	struct tcp_pcb * pcb = tcp_lookup(packet->source, sport, dport);
+	if (!pcb) {
+		if (!(seg.flags & TCP_FLAGS_RST)) tcp_reset_reply(packet, tcp, &seg, nic);
+		return;
+	}
+
+	spin_lock(pcb->lock);
+	switch (pcb->state) {
+		case TCP_LISTEN: {
+			struct tcp_pcb * child = tcp_listen_input(pcb, &seg, packet, sport, nic);
+			int reset = !child && (seg.flags & TCP_FLAGS_ACK) && !(seg.flags & TCP_FLAGS_RST);
+			tcp_unlock(pcb);
+			if (child) {
+				tcp_unlock(child);
+				tcp_pcb_unref(child);
+			} else if (reset) {
+				tcp_reset_reply(packet, tcp, &seg, nic);
+			}
+			tcp_pcb_unref(pcb);
+			return;
+		}
+		case TCP_SYN_SENT:
+			tcp_syn_sent_input(pcb, &seg);
+			break;
+		case TCP_CLOSED:
+			break;
+		default:
+			tcp_input(pcb, &seg);
+			break;
+	}
+	tcp_unlock(pcb);
+	tcp_pcb_unref(pcb);
+}
+
+/* Timers */
+
+static void tcp_rto_expired(struct tcp_pcb * pcb) {
+	if (pcb->state == TCP_SYN_SENT || pcb->state == TCP_SYN_RECEIVED) {
+		if (++pcb->retries > TCP_SYN_RETRIES) {
+			tcp_set_closed(pcb, ETIMEDOUT);
+			return;
+		}
+		pcb->rto = MIN(pcb->rto * 2, TCP_RTO_MAX);
+		pcb->rtt_timing = 0;
+		tcp_emit(pcb, pcb->iss, TCP_FLAGS_SYN, 0, 0);
+		tcp_rto_start(pcb);
+		return;
+	}
+
+	if (!tcp_can_send(pcb) || pcb->snd_una == pcb->snd_max) return;
+
+	if (++pcb->retries > TCP_RETRIES) {
+		tcp_send_reset(pcb);
+		tcp_set_closed(pcb, ETIMEDOUT);
+		return;
+	}
+
+	/* Back off, collapse the congestion window and go back to the first unacknowledged byte */
+	uint32_t flight = pcb->snd_max - pcb->snd_una;
+	pcb->ssthresh = MAX(flight / 2, 2 * (uint32_t)pcb->mss);
+	pcb->cwnd = pcb->mss;
+	pcb->cwnd_acc = 0;
+	pcb->in_recovery = 0;
+	pcb->dupacks = 0;
+	pcb->recover = pcb->snd_max;
+	pcb->rto = MIN(pcb->rto * 2, TCP_RTO_MAX);
+	pcb->rtt_timing = 0;
+	pcb->snd_nxt = pcb->snd_una;
+	tcp_output(pcb);
+}
+
+/* The peer's window has been closed for a while; poke it with one byte. */
+static void tcp_persist_probe(struct tcp_pcb * pcb) {
+	size_t sent = pcb->snd_nxt - pcb->snd_una;
+	if (!tcp_can_send(pcb) || pcb->snd_wnd || sent >= pcb->snd.len) return;
+	tcp_emit(pcb, pcb->snd_nxt, 0, sent, 1);
+	pcb->snd_nxt++;
+	if (SEQ_GT(pcb->snd_nxt, pcb->snd_max)) pcb->snd_max = pcb->snd_nxt;
+	tcp_rto_start(pcb);
+}
+
+static void tcp_timers(struct tcp_pcb * pcb, uint64_t now) {
+	spin_lock(pcb->lock);
+
+	if (pcb->timewait_deadline && pcb->timewait_deadline <= now) {
+		tcp_set_closed(pcb, pcb->state == TCP_TIME_WAIT ? 0 : ETIMEDOUT);
+		tcp_unlock(pcb);
+		return;
+	}
+
+	if (pcb->delack_deadline && pcb->delack_deadline <= now) {
+		pcb->delack_deadline = 0;
+		if (pcb->ack_pending) pcb->ack_now = 1;
+	}
+
+	if (pcb->rto_deadline && pcb->rto_deadline <= now) {
+		pcb->rto_deadline = 0;
+		tcp_rto_expired(pcb);
+	}
+
+	if (pcb->persist_deadline && pcb->persist_deadline <= now) {
+		pcb->persist_deadline = 0;
+		tcp_persist_probe(pcb);
+	}
+
+	if (pcb->ack_now && pcb->state != TCP_CLOSED) tcp_output(pcb);
+
+	tcp_unlock(pcb);
+}
+
+static uint64_t tcp_pcb_deadline(struct tcp_pcb * pcb) {
+	uint64_t deadlines[] = {pcb->rto_deadline, pcb->delack_deadline, pcb->persist_deadline, pcb->timewait_deadline};
+	uint64_t out = 0;
+	for (int i = 0; i < 4; ++i) {
+		if (deadlines[i] && (!out || deadlines[i] < out)) out = deadlines[i];
+	}
+	return out;
+}
+
+#define TCP_TIMER_BATCH 32
+
+static void tcp_timer_worker(void * data) {
+	while (1) {
+		spin_lock(tcp_timer_lock);
+		tcp_timer_next = UINT64_MAX;
+		tcp_timer_kicked = 0;
+		spin_unlock(tcp_timer_lock);
+
+		uint64_t now = tcp_now();
+		uint64_t next = UINT64_MAX;
+		struct tcp_pcb * expired[TCP_TIMER_BATCH];
+		int count = 0;
+
+		spin_lock(tcp_lock);
+		foreach(node, tcp_pcbs) {
+			struct tcp_pcb * pcb = node->value;
+			uint64_t deadline = tcp_pcb_deadline(pcb);
+			if (!deadline) continue;
+			if (deadline <= now && count < TCP_TIMER_BATCH) {
+				expired[count++] = tcp_pcb_ref(pcb);
+			} else if (deadline < next) {
+				next = deadline;
+			}
+		}
+		spin_unlock(tcp_lock);
+
+		for (int i = 0; i < count; ++i) {
+			tcp_timers(expired[i], now);
+			tcp_pcb_unref(expired[i]);
+		}
+
+		if (count) continue;
+
+		spin_lock(tcp_timer_lock);
+		if (tcp_timer_kicked) {
+			spin_unlock(tcp_timer_lock);
+			continue;
+		}
+		tcp_timer_next = next;
+		if (next == UINT64_MAX) {
+			sleep_on_unlocking(tcp_timer_wait, &tcp_timer_lock);
+		} else {
+			sleep_on_unlocking_until(tcp_timer_wait, &tcp_timer_lock, next / 1000, (next % 1000) * 1000);
+		}
+	}
+}
+
+/* Socket interface */
+
+/**
+ * What a read should do with nothing buffered: 1 to wait for data,
+ * 0 for end of stream, or an error.
+ */
+static long tcp_recv_status(struct tcp_pcb * pcb) {
+	if (pcb->fin_received) return 0;
+	switch (pcb->state) {
+		case TCP_LISTEN:
+			return -ENOTCONN;
+		case TCP_CLOSED:
+			if (pcb->error) return -pcb->error;
+			return pcb->remote_port ? 0 : -ENOTCONN;
+		default:
+			return 1;
+	}
+}
+
+static long sock_tcp_recv(sock_t * sock, struct msghdr * msg, int flags) {
+	struct tcp_pcb * pcb = sock->proto;
+
+	if (msg->msg_iovlen == 0) return 0;
+	size_t space = iov_length(msg->msg_iov, msg->msg_iovlen);
+	if (!space) return 0;
+
+	unsigned long s = 0, ss = 0;
+	unsigned long ns = 0, nss = 0;
+
+	if (sock->timeout_s || sock->timeout_us) {
+		relative_time(sock->timeout_s,sock->timeout_us,&s,&ss);
+	}
+
+	spin_lock(pcb->lock);
+	while (!pcb->rcv.len) {
+		long status = tcp_recv_status(pcb);
+		if (status <= 0) {
+			spin_unlock(pcb->lock);
+			return status;
+		}
+		if (sock->nonblocking) {
+			spin_unlock(pcb->lock);
+			return -EAGAIN;
+		}
+
+		int interrupted;
+		if (s || ss) {
+			interrupted = sleep_on_unlocking_until(sock->rx_wait, &pcb->lock, s, ss);
+		} else {
+			interrupted = sleep_on_unlocking(sock->rx_wait, &pcb->lock);
+		}
+		if (interrupted) {
+			/* Timing out looks the same as a signal; tell them apart by the clock. */
+			if (s || ss) {
+				relative_time(0,0,&ns,&nss);
+				if (ns > s || (ns == s && nss >= ss)) return -EAGAIN;
+			}
+			return -ERESTARTSYS;
+		}
+
+		spin_lock(pcb->lock);
+		if (!pcb->rcv.len && (s || ss)) {
+			relative_time(0,0,&ns,&nss);
+			if (ns > s || (ns == s && nss >= ss)) {
+				spin_unlock(pcb->lock);
+				return -EAGAIN;
+			}
+		}
+	}
+
+	size_t len = MIN(space, pcb->rcv.len);
+	tcp_ring_read_iov(&pcb->rcv, msg->msg_iov, msg->msg_iovlen, len);
+
+	/* Tell the peer once the window has opened up meaningfully (RFC 1122 receiver SWS avoidance) */
+	if (pcb->state >= TCP_ESTABLISHED && !pcb->fin_received) {
+		uint32_t threshold = MIN(pcb->rcv.size / 2, (size_t)pcb->mss);
+		if (SEQ_GEQ(pcb->rcv_nxt + tcp_rcv_window(pcb), pcb->rcv_adv + threshold)) {
+			pcb->ack_now = 1;
+			tcp_output(pcb);
+		}
+	}
+
+	tcp_unlock(pcb);
+	return len;
+}
+
+static long sock_tcp_send(sock_t * sock, const struct msghdr *msg, int flags) {
+	struct tcp_pcb * pcb = sock->proto;
+
+	if (msg->msg_iovlen == 0) return 0;
+	size_t size = iov_length(msg->msg_iov, msg->msg_iovlen);
+	size_t written = 0;
+	long err = -EAGAIN;
+
+	spin_lock(pcb->lock);
+	while (written < size) {
+		if (pcb->state == TCP_SYN_SENT) {
+			if (sock->nonblocking) break;
+			if (sleep_on_unlocking(pcb->tx_wait, &pcb->lock)) return written ? (long)written : -ERESTARTSYS;
+			spin_lock(pcb->lock);
+			continue;
+		}
+
+		if (pcb->state != TCP_ESTABLISHED && pcb->state != TCP_CLOSE_WAIT) {
+			if (pcb->error) err = -pcb->error;
+			else if (pcb->state == TCP_CLOSED && !pcb->remote_port) err = -ENOTCONN;
+			else err = -EPIPE;
+			spin_unlock(pcb->lock);
+			return written ? (long)written : err;
+		}
+
+		size_t room = pcb->snd.size - pcb->snd.len;
+		if (!room) {
+			if (sock->nonblocking) break;
+			if (sleep_on_unlocking(pcb->tx_wait, &pcb->lock)) return written ? (long)written : -ERESTARTSYS;
+			spin_lock(pcb->lock);
+			continue;
+		}
+
+		size_t chunk = MIN(room, size - written);
+		tcp_ring_append_iov(&pcb->snd, msg->msg_iov, msg->msg_iovlen, written, chunk);
+		written += chunk;
+		tcp_output(pcb);
+		tcp_unlock(pcb);
+		spin_lock(pcb->lock);
+	}
+	tcp_unlock(pcb);
+
+	return written ? (long)written : err;
+}
+
+static long sock_tcp_connect(sock_t * sock, const struct sockaddr *addr, socklen_t addrlen) {
+	struct tcp_pcb * pcb = sock->proto;
+	const struct sockaddr_in * dest = (const struct sockaddr_in *)addr;
+
+	if (addrlen < sizeof(struct sockaddr_in)) return -EINVAL;
+	printf("tcp: connect requested to " IPV4_FORMAT " port %d\n", FORMAT_IPV4(dest->sin_addr.s_addr), ntohs(dest->sin_port));
+
+	if (!dest->sin_port) return -EADDRNOTAVAIL; /* 0 is still 0 in both endians */
+
+	fs_node_t * nic = net_if_route(dest->sin_addr.s_addr);
+	if (!nic) return -ENONET;
+
+	spin_lock(pcb->lock);
+	if (pcb->state == TCP_SYN_SENT) {
+		spin_unlock(pcb->lock);
+		return -EALREADY;
+	}
+	if (pcb->state != TCP_CLOSED || pcb->remote_port) {
+		spin_unlock(pcb->lock);
+		return -EISCONN;
+	}
+
+	pcb->remote_addr = dest->sin_addr.s_addr;
+	pcb->remote_port = ntohs(dest->sin_port);
+
+	spin_lock(tcp_lock);
+	int err = pcb->local_port ? 0 : tcp_port_alloc(pcb);
+	if (!err) err = tcp_hash_conn(pcb);
+	spin_unlock(tcp_lock);
+
+	if (err) {
+		pcb->remote_port = 0;
+		spin_unlock(pcb->lock);
+		return err;
+	}
+
+	/* Only now that this can't fail; segments for us wait on our lock until it's done. */
+	tcp_pcb_attach(pcb, nic, ((struct EthernetDevice*)nic->device)->ipv4_addr);
+	pcb->wscale_offer = 1;
+
+	printf("tcp: connecting from port %d\n", pcb->local_port);
+
+	pcb->iss = rand();
+	pcb->snd_una = pcb->iss;
+	pcb->snd_nxt = pcb->iss + 1;
+	pcb->snd_max = pcb->snd_nxt;
+	pcb->state = TCP_SYN_SENT;
+	tcp_emit(pcb, pcb->iss, TCP_FLAGS_SYN, 0, 0);
+	pcb->rtt_timing = 1;
+	pcb->rtt_start = tcp_now();
+	tcp_rto_start(pcb);
+	tcp_unlock(pcb);
+
+	if (sock->nonblocking) return -EINPROGRESS;
+
+	spin_lock(pcb->lock);
+	while (pcb->state == TCP_SYN_SENT) {
+		if (sleep_on_unlocking(sock->rx_wait, &pcb->lock)) return -EINTR;
+		spin_lock(pcb->lock);
+	}
+	long out = 0;
+	if (pcb->state == TCP_CLOSED) out = -(pcb->error ? pcb->error : ECONNREFUSED);
+	spin_unlock(pcb->lock);
+
+	return out;
+}
+
+ssize_t sock_tcp_read(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+	printf("tcp: read into buffer of %zu bytes\n", size);
+	struct iovec _iovec = {
+		buffer, size
+	};
+	struct msghdr _header = {
+		.msg_name = NULL,
+		.msg_namelen = 0,
+		.msg_iov = &_iovec,
+		.msg_iovlen = 1,
+		.msg_control = NULL,
+		.msg_controllen = 0,
+		.msg_flags = 0,
+	};
+	return sock_tcp_recv((sock_t*)node, &_header, 0);
+}
+
+ssize_t sock_tcp_write(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+	printf("tcp: write of %zu bytes\n", size);
+	struct iovec _iovec = {
+		(void*)buffer, size
+	};
+	struct msghdr _header = {
+		.msg_name = NULL,
+		.msg_namelen = 0,
+		.msg_iov = &_iovec,
+		.msg_iovlen = 1,
+		.msg_control = NULL,
+		.msg_controllen = 0,
+		.msg_flags = 0,
+	};
+	return sock_tcp_send((sock_t*)node, &_header, 0);
+}
+
+static ssize_t sock_tcp_readv(fs_node_t *node, off_t offset, const struct iovec * iov, int iovcnt) {
+	struct msghdr _header = {
+		.msg_name = NULL,
+		.msg_namelen = 0,
+		.msg_iov = (struct iovec *)iov,
+		.msg_iovlen = iovcnt,
+		.msg_control = NULL,
+		.msg_controllen = 0,
+		.msg_flags = 0,
+	};
+	return sock_tcp_recv((sock_t*)node, &_header, 0);
+}
+
+static ssize_t sock_tcp_writev(fs_node_t *node, off_t offset, const struct iovec * iov, int iovcnt) {
+	struct msghdr _header = {
+		.msg_name = NULL,
+		.msg_namelen = 0,
+		.msg_iov = (struct iovec *)iov,
+		.msg_iovlen = iovcnt,
+		.msg_control = NULL,
+		.msg_controllen = 0,
+		.msg_flags = 0,
+	};
+	return sock_tcp_send((sock_t*)node, &_header, 0);
+}
+
+static long sock_tcp_getsockname(sock_t * sock, struct sockaddr *addr, socklen_t * addrlen) {
+	struct tcp_pcb * pcb = sock->proto;
+	in_addr_t ip4_addr = pcb->local_addr;
+	if (!ip4_addr && pcb->nic) ip4_addr = ((struct EthernetDevice*)pcb->nic->device)->ipv4_addr;
+
+	struct sockaddr_in out = {
+		AF_INET, htons(pcb->local_port), { ip4_addr }, {0},
+	};
+
+	memcpy(addr, &out, *addrlen < sizeof(struct sockaddr_in) ? *addrlen : sizeof(struct sockaddr_in));
+	if (*addrlen < sizeof(struct sockaddr_in)) *addrlen = sizeof(struct sockaddr_in);
+	return 0;
+}
+
+static long sock_tcp_getpeername(sock_t * sock, struct sockaddr *addr, socklen_t * addrlen) {
+	struct tcp_pcb * pcb = sock->proto;
+	if (!pcb->remote_port) return -ENOTCONN;
+	struct sockaddr_in out = {
+		AF_INET, htons(pcb->remote_port), { pcb->remote_addr }, {0},
+	};
+	memcpy(addr, &out, *addrlen < sizeof(struct sockaddr_in) ? *addrlen : sizeof(struct sockaddr_in));
+	if (*addrlen < sizeof(struct sockaddr_in)) *addrlen = sizeof(struct sockaddr_in);
+	return 0;
+}
+
+static long sock_tcp_bind(sock_t * sock, const struct sockaddr *addr, socklen_t addrlen) {
+	struct tcp_pcb * pcb = sock->proto;
+	const struct sockaddr_in * addr_in = (const struct sockaddr_in*)addr;
+
+	if (addrlen < sizeof(struct sockaddr_in)) return -EINVAL;
+	unsigned short port = ntohs(addr_in->sin_port);
+	dprintf("tcp_bind({port=%u})\n", port);
+
+	if (port && port < 1024 && this_core->current_process->user != USER_ROOT_UID) return -EACCES;
+
+	spin_lock(pcb->lock);
+	if (pcb->local_port || pcb->state != TCP_CLOSED) {
+		spin_unlock(pcb->lock);
+		return -EINVAL; /* Already bound */
+	}
+
+	long out = 0;
+	spin_lock(tcp_lock);
+	if (!port) {
+		out = tcp_port_alloc(pcb);
+	} else if (hashmap_has(tcp_bound, (void*)(uintptr_t)port)) {
+		out = -EADDRINUSE;
+	} else {
+		hashmap_set(tcp_bound, (void*)(uintptr_t)port, pcb);
+		pcb->local_port = port;
+		pcb->bound = 1;
+		tcp_list_add(pcb);
+	}
+	spin_unlock(tcp_lock);
+
+	if (!out) pcb->local_addr = addr_in->sin_addr.s_addr;
+	spin_unlock(pcb->lock);
+
+	return out;
+}
+
+static long sock_tcp_listen(sock_t * sock, int backlog) {
+	struct tcp_pcb * pcb = sock->proto;
+
+	spin_lock(pcb->lock);
+	if (!pcb->local_port || (pcb->state != TCP_CLOSED && pcb->state != TCP_LISTEN) || pcb->remote_port) {
+		spin_unlock(pcb->lock);
+		return -EINVAL; /* Not a bound socket. */
+	}
+
+	if (backlog < 1) backlog = 1;
+	if (backlog > TCP_BACKLOG_MAX) backlog = TCP_BACKLOG_MAX;
+	pcb->backlog = backlog;
+	if (!pcb->accept_queue) pcb->accept_queue = list_create("tcp accept queue", pcb);
+	pcb->state = TCP_LISTEN;
+	spin_unlock(pcb->lock);
+
+	return 0;
+}
+
+static void tcp_sock_init(sock_t * sock, struct tcp_pcb * pcb);
+
+static long sock_tcp_accept(sock_t * sock, struct sockaddr *addr, socklen_t *addrlen) {
+	struct tcp_pcb * pcb = sock->proto;
+
+	unsigned long s = 0, ss = 0;
+	unsigned long ns = 0, nss = 0;
+
+	if (sock->timeout_s || sock->timeout_us) {
+		relative_time(sock->timeout_s,sock->timeout_us,&s,&ss);
+	}
+
+	spin_lock(pcb->lock);
+	while (1) {
+		if (pcb->state != TCP_LISTEN) {
+			spin_unlock(pcb->lock);
+			return -EINVAL;
+		}
+		if (pcb->accept_queue->length) break;
+		if (sock->nonblocking) {
+			spin_unlock(pcb->lock);
+			return -EAGAIN;
+		}
+
+		int interrupted;
+		if (s || ss) {
+			interrupted = sleep_on_unlocking_until(sock->rx_wait, &pcb->lock, s, ss);
+		} else {
+			interrupted = sleep_on_unlocking(sock->rx_wait, &pcb->lock);
+		}
+		if (interrupted) {
+			/* Timing out looks the same as a signal; tell them apart by the clock. */
+			if (s || ss) {
+				relative_time(0,0,&ns,&nss);
+				if (ns > s || (ns == s && nss >= ss)) return -EAGAIN;
+			}
+			return -ERESTARTSYS;
+		}
+
+		spin_lock(pcb->lock);
+		if (!pcb->accept_queue->length && (s || ss)) {
+			relative_time(0,0,&ns,&nss);
+			if (ns > s || (ns == s && nss >= ss)) {
+				spin_unlock(pcb->lock);
+				return -EAGAIN;
+			}
+		}
+	}
+
+	node_t * n = list_dequeue(pcb->accept_queue);
+	struct tcp_pcb * child = n->value;
+	free(n);
+	spin_unlock(pcb->lock);
+
+	/* The accept queue's reference becomes the new socket's */
+	sock_t * new_sock = net_sock_create();
+	spin_lock(child->lock);
+	tcp_sock_init(new_sock, child);
+	spin_unlock(child->lock);
+
+	if (addr && addrlen) {
+		struct sockaddr_in out = {
+			AF_INET, htons(child->remote_port), { child->remote_addr }, {0},
+		};
+		memcpy(addr, &out, *addrlen < sizeof(struct sockaddr_in) ? *addrlen : sizeof(struct sockaddr_in));
+		if (*addrlen < sizeof(struct sockaddr_in)) *addrlen = sizeof(struct sockaddr_in);
+	}
+
+	return process_append_fd((process_t *)this_core->current_process, (fs_node_t *)new_sock, PROC_FD_MODE__RW);
+}
+
+static void sock_tcp_close(sock_t * sock) {
+	struct tcp_pcb * pcb = sock->proto;
+	list_t * pending = NULL;
+
+	spin_lock(pcb->lock);
+	pcb->sock = NULL;
+	pcb->orphaned = 1;
+
+	switch (pcb->state) {
+		case TCP_LISTEN:
+			pending = pcb->accept_queue;
+			pcb->accept_queue = NULL;
+			tcp_set_closed(pcb, 0);
+			break;
+		case TCP_SYN_SENT:
+			tcp_set_closed(pcb, 0);
+			break;
+		case TCP_CLOSED:
+			tcp_unhash(pcb);
+			break;
+		case TCP_ESTABLISHED:
+		case TCP_CLOSE_WAIT:
+			if (pcb->rcv.len) {
+				/* Unread data is lost; tell the peer rather than pretend otherwise */
+				tcp_send_reset(pcb);
+				tcp_set_closed(pcb, 0);
+				break;
+			}
+			pcb->fin_queued = 1;
+			pcb->state = pcb->state == TCP_ESTABLISHED ? TCP_FIN_WAIT_1 : TCP_LAST_ACK;
+			tcp_output(pcb);
+			break;
+		case TCP_FIN_WAIT_2:
+			tcp_set_timer(&pcb->timewait_deadline, tcp_now() + TCP_FIN_WAIT_2_TIMEOUT);
+			break;
+		default:
+			break;
+	}
+	tcp_unlock(pcb);
+
+	if (pending) {
+		/* Connections nobody accepted */
+		while (pending->length) {
+			node_t * n = list_dequeue(pending);
+			struct tcp_pcb * child = n->value;
+			free(n);
+			spin_lock(child->lock);
+			if (child->state != TCP_CLOSED) {
+				tcp_send_reset(child);
+				tcp_set_closed(child, 0);
+			}
+			tcp_unlock(child);
+			tcp_pcb_unref(child);
+		}
+		list_free(pending);
+		free(pending);
+	}
+
+	tcp_pcb_unref(pcb);
+}
+
+static int sock_tcp_check(fs_node_t * node) {
+	sock_t * sock = (sock_t*)node;
+	struct tcp_pcb * pcb = sock->proto;
+	if (pcb->state == TCP_LISTEN) return pcb->accept_queue->length ? 0 : 1;
+	if (pcb->rcv.len || pcb->fin_received || pcb->state == TCP_CLOSED) return 0;
+	return 1;
+}
+
+static void tcp_sock_init(sock_t * sock, struct tcp_pcb * pcb) {
+	sock->proto = pcb;
+	pcb->sock = sock;
+	sock->sock_recv = sock_tcp_recv;
+	sock->sock_send = sock_tcp_send;
+	sock->sock_close = sock_tcp_close;
+	sock->sock_connect = sock_tcp_connect;
+	sock->sock_getsockname = sock_tcp_getsockname;
+	sock->sock_getpeername = sock_tcp_getpeername;
+	sock->sock_bind = sock_tcp_bind;
+	sock->sock_listen = sock_tcp_listen;
+	sock->sock_accept = sock_tcp_accept;
+	sock->_fnode.read = sock_tcp_read;
+	sock->_fnode.write = sock_tcp_write;
+	sock->_fnode.readv = sock_tcp_readv;
+	sock->_fnode.writev = sock_tcp_writev;
+	sock->_fnode.selectcheck = sock_tcp_check;
+}
+
+long net_tcp_socket(int flags, int nb) {
+	/* Tasking isn't up when the network stack is installed, so start the timer here. */
+	if (!tcp_timer_started && __sync_bool_compare_and_swap(&tcp_timer_started, 0, 1)) {
+		spawn_worker_thread(tcp_timer_worker, "[tcp]", NULL);
+	}
+
+	printf("tcp socket...\n");
+	sock_t * sock = net_sock_create();
+	struct tcp_pcb * pcb = tcp_pcb_create();
+	tcp_sock_init(sock, pcb);
+	sock->nonblocking = nb;
+
+	return process_append_fd((process_t *)this_core->current_process, (fs_node_t *)sock, flags | PROC_FD_MODE__RW);
+}
+
+void net_tcp_install(void) {
+	tcp_bound = hashmap_create_int(64);
+	tcp_conns = hashmap_create_int(64);
+	tcp_pcbs = list_create("tcp connections", NULL);
+	tcp_timer_wait = list_create("tcp timer", NULL);
+}
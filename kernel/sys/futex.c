@@ -0,0 +1,150 @@
+/**
+ * @file kernel/sys/futex.c
+ * @brief Address-keyed wait queues for userspace locks.
+ *
+ * Userspace locks do their uncontended work with atomics and only call
+ * into the kernel to sleep when an integer in their memory still holds
+ * the value they expect, or to wake sleepers after changing it.
+ *
+ * Waiters are keyed by their thread group's page directory and the
+ * virtual address of the integer, so futexes are private to a process.
+ * Each distinct address with sleepers gets a small wait queue, found
+ * through a fixed hash table; the value check and the enqueue happen
+ * under the bucket lock so a wakeup can not be missed between them.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdint.h>
+#include <bits/errno.h>
+#include <kernel/process.h>
+#include <kernel/string.h>
+#include <kernel/spinlock.h>
+#include <kernel/list.h>
+#include <kernel/time.h>
+#include <kernel/futex.h>
+
+#define FUTEX_BUCKETS 64
+
+struct futex {
+	page_directory_t * directory;
+	uintptr_t address;
+	list_t waiters;
+};
+
+struct futex_bucket {
+	spin_lock_t lock;
+	list_t futexes;
+};
+
+static struct futex_bucket futex_buckets[FUTEX_BUCKETS];
+
+static struct futex_bucket * futex_bucket_for(page_directory_t * directory, uintptr_t address) {
+	uintptr_t hash = (address >> 2) ^ ((uintptr_t)directory >> 4);
+	hash ^= hash >> 16;
+	return &futex_buckets[hash % FUTEX_BUCKETS];
+}
+
+/**
+ * @brief Find the wait queue for an address, optionally creating it.
+ *
+ * Must be called with the bucket lock held.
+ */
+static node_t * futex_find(struct futex_bucket * bucket, page_directory_t * directory, uintptr_t address, int create) {
+	foreach(node, &bucket->futexes) {
+		struct futex * futex = node->value;
+		if (futex->directory == directory && futex->address == address) return node;
+	}
+
+	if (!create) return NULL;
+
+	struct futex * futex = calloc(1, sizeof(struct futex));
+	futex->directory = directory;
+	futex->address = address;
+	return list_insert(&bucket->futexes, futex);
+}
+
+/**
+ * @brief Sleep until woken, if @p address still holds @p expected.
+ *
+ * @param timeout Optional relative timeout.
+ * @returns 0 when woken, -EAGAIN if the value did not match,
+ *          -ETIMEDOUT if the timeout expired, -EINTR on a signal.
+ */
+long futex_wait(volatile int * address, int expected, const struct timespec * timeout) {
+	page_directory_t * directory = this_core->current_process->thread.page_directory;
+	struct futex_bucket * bucket = futex_bucket_for(directory, (uintptr_t)address);
+
+	unsigned long s = 0, ss = 0;
+	if (timeout) {
+		if (timeout->tv_sec < 0 || timeout->tv_nsec < 0 || timeout->tv_nsec >= 1000000000L) return -EINVAL;
+		relative_time(timeout->tv_sec, timeout->tv_nsec / 1000, &s, &ss);
+	}
+
+	spin_lock(bucket->lock);
+
+	if (*address != expected) {
+		spin_unlock(bucket->lock);
+		return -EAGAIN;
+	}
+
+	struct futex * futex = futex_find(bucket, directory, (uintptr_t)address, 1)->value;
+
+	int interrupted = timeout
+		? sleep_on_unlocking_until(&futex->waiters, &bucket->lock, s, ss)
+		: sleep_on_unlocking(&futex->waiters, &bucket->lock);
+
+	if (!interrupted) return 0;
+
+	/* A timeout or signal took us off the queue without a waker seeing
+	 * it; if we were the last sleeper, the queue is ours to clean up. */
+	spin_lock(bucket->lock);
+	node_t * node = futex_find(bucket, directory, (uintptr_t)address, 0);
+	if (node && !((struct futex *)node->value)->waiters.length) {
+		list_delete(&bucket->futexes, node);
+		free(node->value);
+		free(node);
+	}
+	spin_unlock(bucket->lock);
+
+	if (timeout) {
+		unsigned long now_s, now_ss;
+		relative_time(0, 0, &now_s, &now_ss);
+		if (now_s > s || (now_s == s && now_ss >= ss)) return -ETIMEDOUT;
+	}
+
+	return -EINTR;
+}
+
+/**
+ * @brief Wake up to @p count threads sleeping on @p address.
+ *
+ * @returns the number of threads woken.
+ */
+long futex_wake(volatile int * address, int count) {
+	page_directory_t * directory = this_core->current_process->thread.page_directory;
+	struct futex_bucket * bucket = futex_bucket_for(directory, (uintptr_t)address);
+	long woken = 0;
+
+	spin_lock(bucket->lock);
+
+	node_t * node = futex_find(bucket, directory, (uintptr_t)address, 0);
+	if (node) {
+		struct futex * futex = node->value;
+		while (woken < count && futex->waiters.length) {
+			woken += wakeup_queue_one(&futex->waiters);
+		}
+		/* Drop queues nobody is waiting on anymore, so the bucket
+		 * only holds addresses that are actually contended. */
+		if (!futex->waiters.length) {
+			list_delete(&bucket->futexes, node);
+			free(node);
+			free(futex);
+		}
+	}
+
+	spin_unlock(bucket->lock);
+	return woken;
+}
@@ -2,6 +2,12 @@
  * @file kernel/sys/mman.c
  * @brief Generic memory management functions
  *
+ * File mappings are not populated when they are created. Instead, each
+ * address space keeps a list of mapped file regions, and pages are
+ * filled in by @ref generic_page_fault the first time they are touched.
+ * Pages of files in the page cache are mapped straight from the cache,
+ * so read-only text is shared by every process that maps it.
+ *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
@@ -15,14 +21,212 @@
 #include <kernel/mmu.h>
 #include <kernel/string.h>
 #include <kernel/mman.h>
+#include <kernel/pagecache.h>
+#include <kernel/list.h>
+#include <kernel/spinlock.h>
+
+struct mmap_region {
+	uintptr_t start;
+	uintptr_t end;
+	fs_node_t * file;
+	off_t offset;
+	int mmu_flags;
+	struct mmap_region * next; /* On the way to mmap_region_close */
+};
+
+static struct mmap_region * mmap_region_find(page_directory_t * dir, uintptr_t addr) {
+	if (!dir->mappings) return NULL;
+	foreach(node, dir->mappings) {
+		struct mmap_region * region = node->value;
+		if (addr >= region->start && addr < region->end) return region;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Close the files of regions removed by @ref mmap_region_remove and free them.
+ *
+ * Closing can block, so this is called after the directory lock is released.
+ */
+static void mmap_region_close(struct mmap_region * dead) {
+	while (dead) {
+		struct mmap_region * next = dead->next;
+		close_fs(dead->file);
+		free(dead);
+		dead = next;
+	}
+}
+
+/**
+ * @brief Forget about file mappings in [start,end), splitting regions as needed.
+ *
+ * Must be called with the directory lock held. Regions that are removed
+ * entirely are returned in a chain for @ref mmap_region_close.
+ */
+static struct mmap_region * mmap_region_remove(page_directory_t * dir, uintptr_t start, uintptr_t end) {
+	struct mmap_region * dead = NULL;
+	if (!dir->mappings) return NULL;
+	node_t * node = dir->mappings->head;
+	while (node) {
+		node_t * next = node->next;
+		struct mmap_region * region = node->value;
+		if (region->end <= start || region->start >= end) {
+			/* Not affected. */
+		} else if (region->start < start && region->end > end) {
+			struct mmap_region * tail = malloc(sizeof(struct mmap_region));
+			*tail = *region;
+			tail->offset += end - region->start;
+			tail->start = end;
+			vfs_lock(tail->file);
+			region->end = start;
+			list_insert(dir->mappings, tail);
+		} else if (region->start < start) {
+			region->end = start;
+		} else if (region->end > end) {
+			region->offset += end - region->start;
+			region->start = end;
+		} else {
+			list_delete(dir->mappings, node);
+			free(node);
+			region->next = dead;
+			dead = region;
+		}
+		node = next;
+	}
+	return dead;
+}
+
+static void mmap_region_add(uintptr_t start, size_t length, fs_node_t * file, off_t offset, int mmu_flags) {
+	page_directory_t * dir = this_core->current_process->thread.page_directory;
+	struct mmap_region * region = malloc(sizeof(struct mmap_region));
+	region->start = start;
+	region->end = start + length;
+	region->file = file;
+	region->offset = offset;
+	region->mmu_flags = mmu_flags;
+	vfs_lock(file);
 
+	spin_lock(dir->lock);
+	struct mmap_region * dead = mmap_region_remove(dir, region->start, region->end);
+	if (!dir->mappings) dir->mappings = list_create("mmap regions", dir);
+	list_insert(dir->mappings, region);
+	spin_unlock(dir->lock);
+	mmap_region_close(dead);
+}
+
+/**
+ * @brief Copy the file mappings of an address space into a forked one.
+ */
+void mmap_clone_regions(page_directory_t * from, page_directory_t * to) {
+	spin_lock(from->lock);
+	if (from->mappings && from->mappings->length) {
+		to->mappings = list_create("mmap regions", to);
+		foreach(node, from->mappings) {
+			struct mmap_region * region = malloc(sizeof(struct mmap_region));
+			*region = *(struct mmap_region *)node->value;
+			vfs_lock(region->file);
+			list_insert(to->mappings, region);
+		}
+	}
+	spin_unlock(from->lock);
+}
+
+/**
+ * @brief Drop the file mappings of an address space that is being freed.
+ *
+ * @p mappings must already have been detached from the directory, and
+ * the directory lock released, as closing the files can block.
+ */
+void mmap_release_regions(list_t * mappings) {
+	if (!mappings) return;
+	foreach(node, mappings) {
+		struct mmap_region * region = node->value;
+		close_fs(region->file);
+		free(region);
+	}
+	list_free(mappings);
+	free(mappings);
+}
+
+/**
+ * @brief Fill in a not-present page of a file mapping.
+ *
+ * Called for user page faults on addresses without a present
+ * page, and when the kernel validates a user pointer.
+ *
+ * @param addr  Faulting address.
+ * @param flags MMU_PTR_WRITE if this was a write access.
+ * @returns 1 if the page is now mapped, 0 if the address is not part of a file mapping.
+ */
 long generic_page_fault(uintptr_t addr, int flags) {
+	if (!this_core->current_process) return 0;
+	page_directory_t * dir = this_core->current_process->thread.page_directory;
+	uintptr_t page_addr = addr & ~0xFFFUL;
 
-	return 0;
+	spin_lock(dir->lock);
+	struct mmap_region * region = mmap_region_find(dir, page_addr);
+	if (!region || ((flags & MMU_PTR_WRITE) && !(region->mmu_flags & MMU_FLAG_WRITABLE))) {
+		spin_unlock(dir->lock);
+		return 0;
+	}
+	fs_node_t * file = region->file;
+	off_t offset = region->offset + (page_addr - region->start);
+	int mmu_flags = region->mmu_flags;
+	vfs_lock(file);
+	spin_unlock(dir->lock);
+
+	union PML * page = mmu_get_page(page_addr, MMU_GET_MAKE);
+
+	/* Filling may block on disk, so do it without holding the directory lock... */
+	union PML entry = { .raw = 0 };
+	uintptr_t frame = 0;
+	int shared = (file->flags & FS_PAGECACHE) && !pagecache_map(file, offset, &entry, mmu_flags);
+	if (!shared) {
+		frame = mmu_allocate_a_frame() << 12;
+		char * page_back = mmu_map_from_physical(frame);
+		ssize_t r = read_fs(file, offset, 0x1000, (void*)page_back);
+		if (r < 0) r = 0;
+		if (r < 0x1000) memset(page_back + r, 0, 0x1000 - r);
+	}
+
+	/* ...and then make sure another thread didn't beat us to it, or unmap it. */
+	spin_lock(dir->lock);
+	region = mmap_region_find(dir, page_addr);
+	if (page->bits.present || !region || region->file != file || region->offset + (off_t)(page_addr - region->start) != offset) {
+		spin_unlock(dir->lock);
+		close_fs(file);
+		if (shared) mmu_release_shared_frame((uintptr_t)entry.bits.page << 12);
+		else mmu_frame_release(frame);
+		return !!region;
+	}
+
+	if (shared) {
+		page->raw = entry.raw;
+	} else {
+		page->raw = 0;
+		page->bits.page = frame >> 12;
+		mmu_frame_allocate(page, mmu_flags);
+	}
+	spin_unlock(dir->lock);
+	close_fs(file);
+
+	if (!(mmu_flags & MMU_FLAG_NOEXECUTE)) {
+		arch_clear_icache(page_addr, page_addr + 0x1000);
+	}
+
+	return 1;
 }
 
 long mmap_sbrk(size_t size) {
-	return mmap_anon(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE);
+	/* Each break must follow the last, so don't let mmap_anon align this. */
+	process_t * proc = this_core->current_process->process;
+	if ((size & 0xFFF) || size == 0) return -EINVAL;
+	if (size > 0x800000000) return -ENOMEM;
+	spin_lock(proc->image.lock);
+	uintptr_t addr = proc->image.heap;
+	proc->image.heap += size;
+	spin_unlock(proc->image.lock);
+	return mmap_anon(addr, size, PROT_READ|PROT_WRITE, MAP_PRIVATE | MAP_FIXED);
 }
 
 extern void mmu_unmap_user(uintptr_t addr, size_t size);
@@ -31,6 +235,12 @@ long mmap_unmap(uintptr_t addr, size_t length) {
 	spin_lock(proc->image.lock);
 	mmu_unmap_user(addr, length);
 	spin_unlock(proc->image.lock);
+
+	page_directory_t * dir = this_core->current_process->thread.page_directory;
+	spin_lock(dir->lock);
+	struct mmap_region * dead = mmap_region_remove(dir, addr, addr + length);
+	spin_unlock(dir->lock);
+	mmap_region_close(dead);
 	return 0;
 }
 
@@ -66,6 +276,10 @@ long mmap_anon(uintptr_t addr, size_t length, int prot, int flags) {
 
 	if (!(flags & MAP_FIXED)) {
 		spin_lock(proc->image.lock);
+		/* Mappings big enough for a large page get one at least. */
+		if (length >= MMU_LARGE_PAGE_SIZE && (proc->image.heap & (MMU_LARGE_PAGE_SIZE - 1))) {
+			proc->image.heap = (proc->image.heap | (MMU_LARGE_PAGE_SIZE - 1)) + 1;
+		}
 		addr = proc->image.heap;
 		proc->image.heap += length;
 		spin_unlock(proc->image.lock);
@@ -75,11 +289,25 @@ long mmap_anon(uintptr_t addr, size_t length, int prot, int flags) {
 	 * We need to at least mark the mapping as non-present or something. */
 	if (prot & PROT_NONE) return addr;
 
+	if (flags & MAP_FIXED) {
+		page_directory_t * dir = this_core->current_process->thread.page_directory;
+		spin_lock(dir->lock);
+		struct mmap_region * dead = mmap_region_remove(dir, addr, addr + length);
+		spin_unlock(dir->lock);
+		mmap_region_close(dead);
+	}
+
 	int mmu_flags = 0;
 	if (prot & PROT_WRITE) mmu_flags |= MMU_FLAG_WRITABLE;
 	if (!(prot & PROT_EXEC)) mmu_flags |= MMU_FLAG_NOEXECUTE;
 
 	for (uintptr_t i = 0; i < length; i += 0x1000) {
+		/* Use a large page for every aligned 2MiB we cover, if the MMU can find one. */
+		if (!((addr + i) & (MMU_LARGE_PAGE_SIZE - 1)) && length - i >= MMU_LARGE_PAGE_SIZE &&
+			mmu_allocate_large(addr + i, mmu_flags)) {
+			i += MMU_LARGE_PAGE_SIZE - 0x1000;
+			continue;
+		}
 		union PML * page = mmu_get_page(addr + i, MMU_GET_MAKE);
 		sanity_check(page);
 		mmu_frame_allocate(page, mmu_flags);
@@ -119,24 +347,14 @@ long mmap_file(uintptr_t addr, size_t length, int prot, int flags, fs_node_t * f
 	if (prot & PROT_WRITE) mmu_flags |= MMU_FLAG_WRITABLE;
 	if (!(prot & PROT_EXEC)) mmu_flags |= MMU_FLAG_NOEXECUTE;
 
-	for (uintptr_t i = 0; i < length; i += 0x1000) {
-		union PML * page = mmu_get_page(addr + i, MMU_GET_MAKE);
-		sanity_check(page);
-		mmu_frame_allocate(page, mmu_flags);
-
-		char * page_back = mmu_map_from_physical((uintptr_t)page->bits.page << 12);
-		ssize_t r = read_fs(file, offset + i, 0x1000, (void*)page_back);
-		if (r >= 0 && r < 0x1000) {
-			memset((void*)(page_back + r), 0, 0x1000 - r);
-		}
-
-		mmu_flush(page_back);
+	/* Anything already mapped here is replaced; pages are filled in on first access. */
+	if (flags & MAP_FIXED) {
+		spin_lock(proc->image.lock);
+		mmu_unmap_user(addr, length);
+		spin_unlock(proc->image.lock);
 	}
 
-	if (prot & PROT_EXEC) {
-		arch_clear_icache(addr, addr + length);
-	}
+	mmap_region_add(addr, length, file, offset, mmu_flags);
 
 	return addr;
 }
-
@@ -40,6 +40,8 @@
 #include <kernel/pty.h>
 #include <kernel/ptrace.h>
 #include <kernel/args.h>
+#include <kernel/mman.h>
+#include <kernel/slab.h>
 #include <sys/wait.h>
 #include <sys/signal_defs.h>
 
@@ -54,17 +56,24 @@
 
 tree_t * process_tree;  /* Stores the parent-child process relationships; the root of this graph is 'init'. */
 list_t * process_list;  /* Stores all existing processes. Mostly used for sanity checking or for places where iterating over all processes is useful. */
-list_t * process_queue; /* Scheduler ready queue. This the round-robin source. The head is the next process to run. */
-list_t * sleep_queue;   /* Ordered list of processes waiting to be awoken by timeouts. The head is the earliest thread to awaken. */
 list_t * reap_queue;    /* Processes that could not be cleaned up and need to be deleted. */
 
+static kmem_cache_t process_cache = KMEM_CACHE("process_t", sizeof(process_t));
+
+/* Binary min-heap of pending timeouts, 1-indexed, ordered by wakeup time. The
+ * sleepers live inside their processes; capacity is reserved when a process is
+ * created so that queueing a timeout never needs to allocate. */
+static sleeper_t ** sleep_heap = NULL;
+static size_t sleep_heap_length = 0;
+static size_t sleep_heap_capacity = 0;
+static size_t sleep_heap_reserved = 0;
+
 struct ProcessorLocal processor_local_data[32] = {0};
 int processor_count = 1;
 
 /* The following locks protect access to the process tree, scheduler queue,
  * sleeping, and the very special wait queue... */
 static spin_lock_t tree_lock = { 0 };
-static spin_lock_t process_queue_lock = { 0 };
 static spin_lock_t wait_lock_tmp = { 0 };
 static spin_lock_t sleep_lock = { 0 };
 static spin_lock_t reap_lock = { 0 };
@@ -100,6 +109,158 @@ void update_process_times_on_exit(void) {
 
 #define must_have_lock(lck) if (lck.owner != this_core->cpu_id+1) { arch_fatal_prepare(); printf("Failed lock check.\n"); arch_dump_traceback(); arch_fatal(); }
 
+/**
+ * @brief Whether sleeper @p a should be awoken before sleeper @p b.
+ */
+static inline int sleeper_before(sleeper_t * a, sleeper_t * b) {
+	return a->end_tick < b->end_tick || (a->end_tick == b->end_tick && a->end_subtick < b->end_subtick);
+}
+
+static inline void sleep_heap_set(size_t index, sleeper_t * sleeper) {
+	sleep_heap[index] = sleeper;
+	sleeper->heap_index = index;
+}
+
+static void sleep_heap_sift_up(size_t index) {
+	sleeper_t * sleeper = sleep_heap[index];
+	while (index > 1 && sleeper_before(sleeper, sleep_heap[index / 2])) {
+		sleep_heap_set(index, sleep_heap[index / 2]);
+		index /= 2;
+	}
+	sleep_heap_set(index, sleeper);
+}
+
+static void sleep_heap_sift_down(size_t index) {
+	sleeper_t * sleeper = sleep_heap[index];
+	while (index * 2 <= sleep_heap_length) {
+		size_t child = index * 2;
+		if (child < sleep_heap_length && sleeper_before(sleep_heap[child+1], sleep_heap[child])) child++;
+		if (!sleeper_before(sleep_heap[child], sleeper)) break;
+		sleep_heap_set(index, sleep_heap[child]);
+		index = child;
+	}
+	sleep_heap_set(index, sleeper);
+}
+
+/**
+ * @brief Queue a timeout. Must hold the sleep lock.
+ *
+ * Space is guaranteed by @ref sleep_heap_reserve, so this never allocates.
+ */
+static void sleep_heap_insert(sleeper_t * sleeper) {
+	must_have_lock(sleep_lock);
+	sleep_heap_length++;
+	sleep_heap_set(sleep_heap_length, sleeper);
+	sleep_heap_sift_up(sleep_heap_length);
+	/* The BSP keeps the timer for the earliest sleeper; if that just
+	 * changed, nudge it so it re-arms from switch_next. */
+	if (sleeper->heap_index == 1 && this_core->cpu_id != 0) {
+		arch_wakeup_core(0);
+	}
+}
+
+/**
+ * @brief Cancel a queued timeout. Must hold the sleep lock.
+ */
+static void sleep_heap_remove(sleeper_t * sleeper) {
+	must_have_lock(sleep_lock);
+	size_t index = sleeper->heap_index;
+	if (!index) return;
+	sleeper->heap_index = 0;
+	sleeper_t * last = sleep_heap[sleep_heap_length];
+	sleep_heap[sleep_heap_length] = NULL;
+	sleep_heap_length--;
+	if (last == sleeper) return;
+	sleep_heap_set(index, last);
+	if (index > 1 && sleeper_before(last, sleep_heap[index / 2])) {
+		sleep_heap_sift_up(index);
+	} else {
+		sleep_heap_sift_down(index);
+	}
+}
+
+/**
+ * @brief Make room in the timeout heap for one more process.
+ *
+ * Called when a process is created, rather than when it sleeps,
+ * so that the sleep path and the timer interrupt never allocate.
+ */
+static void sleep_heap_reserve(void) {
+	spin_lock(sleep_lock);
+	sleep_heap_reserved++;
+	while (sleep_heap_reserved + 1 > sleep_heap_capacity) {
+		/* Don't allocate under the lock the timer interrupt takes; grow
+		 * into a new array and swap it in once we have it. Another core
+		 * may have beaten us to it in the meantime, so check again. */
+		size_t capacity = sleep_heap_capacity ? sleep_heap_capacity * 2 : 64;
+		spin_unlock(sleep_lock);
+		sleeper_t ** heap = malloc(sizeof(sleeper_t *) * capacity);
+		spin_lock(sleep_lock);
+		if (capacity <= sleep_heap_capacity) {
+			spin_unlock(sleep_lock);
+			free(heap);
+			spin_lock(sleep_lock);
+			continue;
+		}
+		sleeper_t ** old = sleep_heap;
+		if (old) memcpy(heap, old, sizeof(sleeper_t *) * (sleep_heap_length + 1));
+		sleep_heap = heap;
+		sleep_heap_capacity = capacity;
+		spin_unlock(sleep_lock);
+		free(old);
+		spin_lock(sleep_lock);
+	}
+	spin_unlock(sleep_lock);
+}
+
+/**
+ * @brief Release the timeout heap slot reserved for an exiting process.
+ */
+static void sleep_heap_release(process_t * proc) {
+	spin_lock(sleep_lock);
+	sleep_heap_remove(&proc->sleeper);
+	sleep_heap_reserved--;
+	spin_unlock(sleep_lock);
+}
+
+/**
+ * @brief Program this core's timer for the next time it needs to run the scheduler.
+ *
+ * A core running a process needs an interrupt at the end of its time slice,
+ * and the BSP also needs one when the earliest timed sleeper is due; the
+ * other cores leave the sleepers to it, so they don't all take an interrupt
+ * for one deadline. An idle core with nothing else to do needs no timer
+ * interrupt at all; anything that gives it work will send it a wakeup IPI.
+ *
+ * @ref sleep_heap_insert sends the BSP such an IPI when another core queues
+ * a new earliest sleeper, and the BSP re-arms when it goes through
+ * @ref switch_next.
+ */
+void sched_arm_timer(void) {
+	unsigned long usecs = 0;
+
+	if (this_core->current_process != this_core->kernel_idle_task) {
+		usecs = SCHED_TIME_SLICE;
+	}
+
+	spin_lock(sleep_lock);
+	if (this_core->cpu_id == 0 && sleep_heap_length) {
+		unsigned long seconds, subseconds;
+		relative_time(0, 0, &seconds, &subseconds);
+		sleeper_t * next = sleep_heap[1];
+		unsigned long due;
+		if (next->end_tick < seconds || (next->end_tick == seconds && next->end_subtick <= subseconds)) {
+			due = 1;
+		} else {
+			due = (next->end_tick - seconds) * 1000000 + next->end_subtick - subseconds;
+		}
+		if (!usecs || due < usecs) usecs = due;
+	}
+	spin_unlock(sleep_lock);
+
+	arch_timer_arm(usecs);
+}
+
 /**
  * @brief Restore the context of the next available process's kernel thread.
  *
@@ -153,6 +314,8 @@ void switch_next(void) {
 	/* Mark the process as running and started. */
 	__sync_or_and_fetch(&this_core->current_process->flags, PROC_FLAG_STARTED);
 
+	sched_arm_timer();
+
 	asm volatile ("" ::: "memory");
 
 	/* Jump to next */
@@ -224,8 +387,10 @@ void switch_task(uint8_t reschedule) {
 void initialize_process_tree(void) {
 	process_tree = tree_create();
 	process_list = list_create("global process list",NULL);
-	process_queue = list_create("global scheduler queue",NULL);
-	sleep_queue = list_create("global timed sleep queue",NULL);
+	for (size_t i = 0; i < sizeof(processor_local_data) / sizeof(*processor_local_data); ++i) {
+		processor_local_data[i].ready_queue = list_create("core scheduler queue",&processor_local_data[i]);
+		spin_init(processor_local_data[i].ready_lock);
+	}
 	reap_queue = list_create("processes awaiting later cleanup",NULL);
 
 	/* TODO: PID bitset? */
@@ -376,6 +541,40 @@ pid_t get_next_pid(void) {
 	return __sync_fetch_and_add(&_next_pid,1);
 }
 
+/**
+ * @brief Pick a ready queue for a thread that has never been scheduled.
+ *
+ * New threads go to the core with the least work, counting its
+ * queued threads and whether it is busy with something other than
+ * its idle task. Ties favor the calling core, which is where the
+ * parent's memory is most likely to be cache-hot.
+ */
+static int sched_pick_core(void) {
+	int best = this_core->cpu_id;
+	size_t best_load = SIZE_MAX;
+	for (int i = 0; i < processor_count; ++i) {
+		int core = (this_core->cpu_id + i) % processor_count;
+		size_t load = processor_local_data[core].ready_queue->length;
+		if (processor_local_data[core].current_process != processor_local_data[core].kernel_idle_task) load++;
+		if (load < best_load) {
+			best = core;
+			best_load = load;
+		}
+	}
+	return best;
+}
+
+/**
+ * @brief Whether any core other than this one is sitting in its idle task.
+ */
+static int sched_others_idle(void) {
+	for (int i = 0; i < processor_count; ++i) {
+		if (i == this_core->cpu_id) continue;
+		if (processor_local_data[i].current_process == processor_local_data[i].kernel_idle_task) return 1;
+	}
+	return 0;
+}
+
 /**
  * @brief The idle task.
  *
@@ -386,6 +585,7 @@ pid_t get_next_pid(void) {
 static void _kidle(void) {
 	while (1) {
 		arch_pause();
+		this_core->idle_wakeups++;
 		switch_next();
 	}
 }
@@ -405,7 +605,12 @@ void process_release_directory(page_directory_t * dir) {
 	spin_lock(dir->lock);
 	dir->refcount--;
 	if (dir->refcount < 1) {
+		/* Closing mapped files can block, so do it after letting go of the lock. */
+		list_t * mappings = dir->mappings;
+		dir->mappings = NULL;
+		spin_unlock(dir->lock);
 		mmu_free(dir->directory);
+		mmap_release_regions(mappings);
 		free(dir);
 	} else {
 		spin_unlock(dir->lock);
@@ -413,7 +618,7 @@ void process_release_directory(page_directory_t * dir) {
 }
 
 process_t * spawn_kidle(int bsp) {
-	process_t * idle = calloc(1,sizeof(process_t));
+	process_t * idle = kmem_cache_zalloc(&process_cache);
 	idle->process = idle;
 	idle->id = -1;
 	idle->name = strdup("[kidle]");
@@ -442,7 +647,7 @@ process_t * spawn_kidle(int bsp) {
 }
 
 process_t * spawn_init(void) {
-	process_t * init = calloc(1,sizeof(process_t));
+	process_t * init = kmem_cache_zalloc(&process_cache);
 	tree_set_root(process_tree, (void*)init);
 
 	init->process = init;
@@ -491,7 +696,8 @@ process_t * spawn_init(void) {
 	init->sleep_node.next = NULL;
 	init->sleep_node.value = init;
 
-	init->timed_sleep_node = NULL;
+	init->sleeper.process = init;
+	sleep_heap_reserve();
 
 	init->thread.page_directory = calloc(1, sizeof(page_directory_t));
 	init->thread.page_directory->refcount = 1;
@@ -503,7 +709,7 @@ process_t * spawn_init(void) {
 }
 
 process_t * spawn_process(volatile process_t * parent, int flags, int close_at_fork) {
-	process_t * proc = calloc(1,sizeof(process_t));
+	process_t * proc = kmem_cache_zalloc(&process_cache);
 
 	proc->id          = get_next_pid();
 	proc->tgid        = proc->id;
@@ -573,6 +779,9 @@ process_t * spawn_process(volatile process_t * parent, int flags, int close_at_f
 
 	proc->sched_node.value = proc;
 	proc->sleep_node.value = proc;
+	proc->sched_core = sched_pick_core();
+	proc->sleeper.process = proc;
+	sleep_heap_reserve();
 
 	gettimeofday(&proc->start, NULL);
 	tree_node_t * entry = tree_node_create(proc);
@@ -606,6 +815,7 @@ void process_reap(process_t * proc) {
 
 	free((void *)(proc->image.stack - KERNEL_STACK_SIZE));
 	process_release_directory(proc->thread.page_directory);
+	sleep_heap_release(proc);
 
 	if (proc->sig_queue) {
 		list_destroy(proc->sig_queue);
@@ -709,94 +919,175 @@ void process_delete(process_t * proc) {
  * marked as having been interrupted and removed from its
  * owning queue before being moved.
  *
+ * The process is queued on the core it last ran on. That
+ * core is woken directly if it is idle; otherwise any idle
+ * cores are nudged so they can steal the work.
+ *
  * The process must not otherwise have been in a scheduling
  * queue before it is placed in the ready queue.
+ *
+ * Wait queues are only modified under wait_lock_tmp, which
+ * is taken before the sleep lock. Callers that already hold
+ * the sleep lock but not wait_lock_tmp must not be waking a
+ * process that is on a wait queue.
  */
 void make_process_ready(volatile process_t * proc) {
 	int sleep_lock_is_mine = sleep_lock.owner == (this_core->cpu_id + 1);
+	int wait_lock_is_mine = sleep_lock_is_mine || wait_lock_tmp.owner == (this_core->cpu_id + 1);
+	if (!wait_lock_is_mine) spin_lock(wait_lock_tmp);
 	if (!sleep_lock_is_mine) spin_lock(sleep_lock);
+	if (proc->sleeper.heap_index && !proc->sleeper.is_fswait) {
+		/* Cancel a pending timed sleep. */
+		sleep_heap_remove((sleeper_t*)&proc->sleeper);
+	}
 	if (proc->sleep_node.owner != NULL) {
-		if (proc->sleep_node.owner == sleep_queue) {
-			/* The sleep queue is slightly special... */
-			if (proc->timed_sleep_node) {
-				list_delete(sleep_queue, proc->timed_sleep_node);
-				proc->sleep_node.owner = NULL;
-				free(proc->timed_sleep_node->value);
-			}
-		} else {
-			/* This was blocked on a semaphore we can interrupt. */
-			__sync_or_and_fetch(&proc->flags, PROC_FLAG_SLEEP_INT);
-			list_delete((list_t*)proc->sleep_node.owner, (node_t*)&proc->sleep_node);
-		}
+		/* This was blocked on a semaphore we can interrupt. */
+		__sync_or_and_fetch(&proc->flags, PROC_FLAG_SLEEP_INT);
+		list_delete((list_t*)proc->sleep_node.owner, (node_t*)&proc->sleep_node);
 	}
 	if (!sleep_lock_is_mine) spin_unlock(sleep_lock);
+	if (!wait_lock_is_mine) spin_unlock(wait_lock_tmp);
+
+	/* sched_core only changes while its queue lock is held, so
+	 * make sure we are holding the lock for the current value. */
+	int core;
+	do {
+		core = proc->sched_core;
+		spin_lock(processor_local_data[core].ready_lock);
+		if (proc->sched_core == core) break;
+		spin_unlock(processor_local_data[core].ready_lock);
+	} while (1);
 
-	spin_lock(process_queue_lock);
 	if (proc->sched_node.owner) {
-		/* There's only one ready queue, so this means the process was already ready, which
-		 * is indicative of a bug somewhere as we shouldn't be added processes to the ready
-		 * queue multiple times. */
-		spin_unlock(process_queue_lock);
+		/* This means the process was already ready, which is indicative of a bug
+		 * somewhere as we shouldn't be added processes to the ready queue multiple times. */
+		spin_unlock(processor_local_data[core].ready_lock);
 		return;
 	}
 
-	list_append(process_queue, (node_t*)&proc->sched_node);
-	spin_unlock(process_queue_lock);
+	list_append(processor_local_data[core].ready_queue, (node_t*)&proc->sched_node);
+	spin_unlock(processor_local_data[core].ready_lock);
 
-	arch_wakeup_others();
+	if (core != this_core->cpu_id && processor_local_data[core].current_process == processor_local_data[core].kernel_idle_task) {
+		arch_wakeup_core(core);
+	} else if (sched_others_idle()) {
+		arch_wakeup_others();
+	}
 }
 
 /**
- * @brief Pop the next available process from the queue.
+ * @brief Take the first runnable process from a core's ready queue.
  *
- * Gets the next available process from the round-robin scheduling
- * queue. If there is no process to run, the idle task is returned.
+ * Skips over processes that are still marked as running on another
+ * core; they were made ready before that core finished switching
+ * away from them and can not be resumed here yet.
  *
- * TODO This needs more locking for SMP...
+ * The caller must hold the ready lock for @p core.
  */
-volatile process_t * next_ready_process(void) {
-	spin_lock(process_queue_lock);
+static volatile process_t * sched_take(int core) {
+	list_t * queue = processor_local_data[core].ready_queue;
 
-	if (!process_queue->head) {
-		if (process_queue->length) {
+	if (!queue->head && queue->length) {
+		arch_fatal_prepare();
+		printf("Queue has a length but head is NULL\n");
+		arch_dump_traceback();
+		arch_fatal();
+	}
+
+	foreach(np, queue) {
+		if ((uintptr_t)np < 0xFFFFff0000000000UL || (uintptr_t)np > 0xFFFFfff000000000UL) {
 			arch_fatal_prepare();
-			printf("Queue has a length but head is NULL\n");
+			printf("Suspicious pointer in queue: %#zx\n", (uintptr_t)np);
 			arch_dump_traceback();
 			arch_fatal();
 		}
-		spin_unlock(process_queue_lock);
-		return this_core->kernel_idle_task;
+		volatile process_t * next = np->value;
+		if ((next->flags & PROC_FLAG_RUNNING) && (next->owner != this_core->cpu_id)) continue;
+		list_delete(queue, np);
+		next->sched_core = this_core->cpu_id;
+		return next;
 	}
 
-	node_t * np = list_dequeue(process_queue);
+	return NULL;
+}
 
-	if ((uintptr_t)np < 0xFFFFff0000000000UL || (uintptr_t)np > 0xFFFFfff000000000UL) {
-		arch_fatal_prepare();
-		printf("Suspicious pointer in queue: %#zx\n", (uintptr_t)np);
-		arch_dump_traceback();
-		arch_fatal();
+/**
+ * @brief Steal a runnable process from the busiest other core.
+ *
+ * Called when this core's own queue has nothing to run. Queue lengths
+ * are sampled without locking to choose a victim; only the victim's
+ * queue is locked for the actual removal.
+ */
+static volatile process_t * sched_steal(void) {
+	int victim = -1;
+	size_t longest = 0;
+
+	for (int i = 1; i < processor_count; ++i) {
+		int core = (this_core->cpu_id + i) % processor_count;
+		size_t length = processor_local_data[core].ready_queue->length;
+		if (length > longest) {
+			longest = length;
+			victim = core;
+		}
 	}
-	volatile process_t * next = np->value;
 
-	if ((next->flags & PROC_FLAG_RUNNING) && (next->owner != this_core->cpu_id)) {
-		/* We pulled a process too soon, switch to idle for a bit so the
-		 * core that marked this process as ready can finish switching away from it. */
-		list_append(process_queue, (node_t*)&next->sched_node);
-		spin_unlock(process_queue_lock);
-		return this_core->kernel_idle_task;
-	}
+	if (victim == -1) return NULL;
+
+	spin_lock(processor_local_data[victim].ready_lock);
+	volatile process_t * next = sched_take(victim);
+	spin_unlock(processor_local_data[victim].ready_lock);
+
+	if (next) processor_local_data[this_core->cpu_id].sched_steals++;
+
+	return next;
+}
 
-	spin_unlock(process_queue_lock);
+/**
+ * @brief Pop the next available process from the queue.
+ *
+ * Gets the next available process from this core's round-robin
+ * scheduling queue, or steals one from another core if the local
+ * queue is empty. If there is no process to run, the idle task
+ * is returned.
+ */
+volatile process_t * next_ready_process(void) {
+	int me = this_core->cpu_id;
+
+	spin_lock(processor_local_data[me].ready_lock);
+	volatile process_t * next = sched_take(me);
+	spin_unlock(processor_local_data[me].ready_lock);
+
+	if (!next) next = sched_steal();
+	if (!next) return this_core->kernel_idle_task;
 
 	if (!(next->flags & PROC_FLAG_FINISHED)) {
 		__sync_or_and_fetch(&next->flags, PROC_FLAG_RUNNING);
 	}
 
-	next->owner = this_core->cpu_id;
+	if (next->owner != me && (next->flags & PROC_FLAG_STARTED)) {
+		processor_local_data[me].sched_migrations++;
+	}
+
+	next->owner = me;
 
 	return next;
 }
 
+/**
+ * @brief Whether there is anything in a ready queue this core could run.
+ *
+ * Used by interrupt handlers running on top of the idle task to
+ * decide whether to switch away immediately instead of returning
+ * to the idle loop.
+ */
+int ready_process_available(void) {
+	if (!processor_local_data[0].ready_queue) return 0;
+	for (int i = 0; i < processor_count; ++i) {
+		if (processor_local_data[i].ready_queue->head) return 1;
+	}
+	return 0;
+}
+
 /**
  * @brief Signal a semaphore.
  *
@@ -883,7 +1174,7 @@ int wakeup_queue_one(list_t * queue) {
  * @returns 1 if the wait was interrupted (eg. the event did not occur); 0 otherwise.
  */
 int sleep_on(list_t * queue) {
-	if (this_core->current_process->sleep_node.owner) {
+	if (this_core->current_process->sleep_node.owner || this_core->current_process->sleeper.heap_index) {
 		switch_task(0);
 		return 0;
 	}
@@ -907,6 +1198,39 @@ int sleep_on_unlocking(list_t * queue, spin_lock_t * release) {
 	return !!(this_core->current_process->flags & PROC_FLAG_SLEEP_INT);
 }
 
+/**
+ * @brief Wait for a binary semaphore, with a deadline.
+ *
+ * Like @ref sleep_on_unlocking, but the process is also given a timed
+ * wakeup at @p seconds, @p subseconds. If the deadline passes first, the
+ * process is removed from @p queue and the wait is reported as interrupted;
+ * callers that need to tell a timeout from a signal should check the clock.
+ *
+ * @returns 1 if the wait was interrupted or timed out; 0 otherwise.
+ */
+int sleep_on_unlocking_until(list_t * queue, spin_lock_t * release, unsigned long seconds, unsigned long subseconds) {
+	process_t * proc = (process_t *)this_core->current_process;
+	__sync_and_and_fetch(&proc->flags, ~(PROC_FLAG_SLEEP_INT));
+
+	/* Hold both locks across the insertions so neither the timer nor a
+	 * waker can see us on one list but not the other. The order matches
+	 * make_process_ready and wakeup_sleepers. */
+	spin_lock(wait_lock_tmp);
+	spin_lock(sleep_lock);
+	proc->sleeper.end_tick    = seconds;
+	proc->sleeper.end_subtick = subseconds;
+	proc->sleeper.is_fswait   = 0;
+	sleep_heap_insert(&proc->sleeper);
+	list_append(queue, &proc->sleep_node);
+	spin_unlock(sleep_lock);
+	spin_unlock(wait_lock_tmp);
+
+	spin_unlock(*release);
+
+	switch_task(0);
+	return !!(proc->flags & PROC_FLAG_SLEEP_INT);
+}
+
 /**
  * @brief Indicates whether a process is ready to be run but not currently running.
  */
@@ -923,34 +1247,31 @@ int process_alert_node_locked(process_t * process, void * value);
  * the time indicated by @p seconds and @p subseconds. If the sleep
  * was part of an fswait system call timing out, the call is marked
  * as timed out before the process is rescheduled.
+ *
+ * A process whose timed wait expired is still on its wait queue, and
+ * make_process_ready takes it off; wait_lock_tmp covers that, and is
+ * taken first, as in sleep_on_unlocking_until.
  */
 void wakeup_sleepers(unsigned long seconds, unsigned long subseconds) {
+	spin_lock(wait_lock_tmp);
 	spin_lock(sleep_lock);
-	if (sleep_queue->length) {
-		sleeper_t * proc = ((sleeper_t *)sleep_queue->head->value);
-		while (proc && (proc->end_tick < seconds || (proc->end_tick == seconds && proc->end_subtick <= subseconds))) {
-
-			if (proc->is_fswait) {
-				proc->is_fswait = -1;
-				process_alert_node_locked(proc->process,proc);
-			} else {
-				process_t * process = proc->process;
-				process->sleep_node.owner = NULL;
-				process->timed_sleep_node = NULL;
-				if (!process_is_ready(process)) {
-					make_process_ready(process);
-				}
-			}
-			free(proc);
-			free(list_dequeue(sleep_queue));
-			if (sleep_queue->length) {
-				proc = ((sleeper_t *)sleep_queue->head->value);
-			} else {
-				break;
+	while (sleep_heap_length) {
+		sleeper_t * proc = sleep_heap[1];
+		if (proc->end_tick > seconds || (proc->end_tick == seconds && proc->end_subtick > subseconds)) break;
+
+		sleep_heap_remove(proc);
+
+		if (proc->is_fswait) {
+			process_alert_node_locked(proc->process,proc);
+		} else {
+			process_t * process = proc->process;
+			if (!process_is_ready(process)) {
+				make_process_ready(process);
 			}
 		}
 	}
 	spin_unlock(sleep_lock);
+	spin_unlock(wait_lock_tmp);
 }
 
 /**
@@ -962,31 +1283,16 @@ void wakeup_sleepers(unsigned long seconds, unsigned long subseconds) {
  */
 void sleep_until(process_t * process, unsigned long seconds, unsigned long subseconds) {
 	spin_lock(sleep_lock);
-	if (this_core->current_process->sleep_node.owner) {
+	if (this_core->current_process->sleep_node.owner || this_core->current_process->sleeper.heap_index) {
 		spin_unlock(sleep_lock);
 		/* Can't sleep, sleeping already */
 		return;
 	}
-	process->sleep_node.owner = sleep_queue;
 
-	node_t * before = NULL;
-	foreach(node, sleep_queue) {
-		sleeper_t * candidate = ((sleeper_t *)node->value);
-		if (!candidate) {
-			printf("null candidate?\n");
-			continue;
-		}
-		if (candidate->end_tick > seconds || (candidate->end_tick == seconds && candidate->end_subtick > subseconds)) {
-			break;
-		}
-		before = node;
-	}
-	sleeper_t * proc = malloc(sizeof(sleeper_t));
-	proc->process     = process;
-	proc->end_tick    = seconds;
-	proc->end_subtick = subseconds;
-	proc->is_fswait = 0;
-	process->timed_sleep_node = list_insert_after(sleep_queue, before, proc);
+	process->sleeper.end_tick    = seconds;
+	process->sleeper.end_subtick = subseconds;
+	process->sleeper.is_fswait   = 0;
+	sleep_heap_insert(&process->sleeper);
 	spin_unlock(sleep_lock);
 }
 
@@ -1143,21 +1449,11 @@ int process_timeout_sleep(process_t * process, int timeout) {
 	unsigned long s, ss;
 	relative_time(0, timeout * 1000, &s, &ss);
 
-	node_t * before = NULL;
-	foreach(node, sleep_queue) {
-		sleeper_t * candidate = ((sleeper_t *)node->value);
-		if (candidate->end_tick > s || (candidate->end_tick == s && candidate->end_subtick > ss)) {
-			break;
-		}
-		before = node;
-	}
-	sleeper_t * proc = malloc(sizeof(sleeper_t));
-	proc->process     = process;
-	proc->end_tick    = s;
-	proc->end_subtick = ss;
-	proc->is_fswait = 1;
-	list_insert(((process_t *)process)->node_waits, proc);
-	process->timeout_node = list_insert_after(sleep_queue, before, proc);
+	process->sleeper.end_tick    = s;
+	process->sleeper.end_subtick = ss;
+	process->sleeper.is_fswait   = 1;
+	list_insert(((process_t *)process)->node_waits, &process->sleeper);
+	sleep_heap_insert(&process->sleeper);
 
 	return 0;
 }
@@ -1199,8 +1495,6 @@ int process_wait_nodes(process_t * process,fs_node_t * nodes[], int timeout) {
 
 	if (timeout > 0) {
 		process_timeout_sleep(process, timeout);
-	} else {
-		process->timeout_node = NULL;
 	}
 
 	process->awoken_index = -1;
@@ -1221,15 +1515,8 @@ int process_awaken_from_fswait(process_t * process, int index) {
 	free(process->node_waits);
 	process->node_waits = NULL;
 
-	if (process->timeout_node && process->timeout_node->owner == sleep_queue) {
-		sleeper_t * proc = process->timeout_node->value;
-		if (proc->is_fswait != -1) {
-			list_delete(sleep_queue, process->timeout_node);
-			free(process->timeout_node->value);
-			free(process->timeout_node);
-		}
-	}
-	process->timeout_node = NULL;
+	/* Cancel the timeout, if it has not already fired. */
+	sleep_heap_remove(&process->sleeper);
 
 	make_process_ready(process);
 	spin_unlock(process->sched_lock);
@@ -1403,6 +1690,7 @@ pid_t fork(void) {
 	new_proc->thread.page_directory->refcount = 1;
 	new_proc->thread.page_directory->directory = directory;
 	spin_init(new_proc->thread.page_directory->lock);
+	mmap_clone_regions(parent->thread.page_directory, new_proc->thread.page_directory);
 
 	new_proc->signals = calloc(NUMSIGNALS + 1, sizeof(struct signal_config));
 	memcpy(new_proc->signals, parent->signals, sizeof(struct signal_config) * (NUMSIGNALS+1));
@@ -1495,7 +1783,7 @@ pid_t clone(uintptr_t new_stack, uintptr_t thread_func, uintptr_t arg) {
 }
 
 process_t * spawn_worker_thread(void (*entrypoint)(void * argp), const char * name, void * argp) {
-	process_t * proc = calloc(1,sizeof(process_t));
+	process_t * proc = kmem_cache_zalloc(&process_cache);
 
 	proc->flags = PROC_FLAG_IS_TASKLET | PROC_FLAG_STARTED;
 
@@ -1529,6 +1817,9 @@ process_t * spawn_worker_thread(void (*entrypoint)(void * argp), const char * na
 
 	proc->sched_node.value = proc;
 	proc->sleep_node.value = proc;
+	proc->sched_core = sched_pick_core();
+	proc->sleeper.process = proc;
+	sleep_heap_reserve();
 
 	gettimeofday(&proc->start, NULL);
 	tree_node_t * entry = tree_node_create(proc);
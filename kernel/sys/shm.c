@@ -21,6 +21,7 @@
 #include <kernel/shm.h>
 #include <kernel/spinlock.h>
 #include <kernel/string.h>
+#include <kernel/buddy.h>
 
 #include <kernel/tree.h>
 #include <kernel/list.h>
@@ -30,6 +31,10 @@
 static spin_lock_t bsl; // big shm lock
 tree_t * shm_tree = NULL;
 
+/* Frames per large page, and the buddy order of a block that size */
+#define LARGE_FRAMES (MMU_LARGE_PAGE_SIZE / 0x1000)
+#define LARGE_ORDER  9
+
 
 void shm_install(void) {
 	shm_tree = tree_create();
@@ -109,11 +114,20 @@ static shm_chunk_t * create_chunk (shm_node_t * parent, size_t size) {
 		return NULL;
 	}
 
-	/* Now grab some frames for this guy. */
-	for (uint32_t i = 0; i < chunk->num_frames; i++) {
+	/* Now grab some frames for this guy, in 2MiB blocks where we can so they can be mapped as large pages. */
+	for (uint32_t i = 0; i < chunk->num_frames; ) {
+		if (chunk->num_frames - i >= LARGE_FRAMES) {
+			uintptr_t block = buddy_alloc(LARGE_ORDER);
+			if (block != BUDDY_NONE) {
+				for (uint32_t j = 0; j < LARGE_FRAMES; ++j) {
+					chunk->frames[i++] = block + j;
+				}
+				continue;
+			}
+		}
 		/* Allocate frame */
 		uintptr_t index = mmu_allocate_a_frame();
-		chunk->frames[i] = index;
+		chunk->frames[i++] = index;
 	}
 
 	return chunk;
@@ -149,16 +163,40 @@ static int release_chunk (shm_chunk_t * chunk) {
 
 /* Mapping and Unmapping */
 
-static uintptr_t proc_sbrk(uint32_t num_pages, volatile process_t * volatile proc) {
-	uintptr_t initial = proc->image.shm_heap;
+static uintptr_t align_up(uintptr_t addr, uintptr_t align) {
+	return (addr + align - 1) & ~(align - 1);
+}
 
-	if (initial & 0xFFF) {
-		initial += 0x1000 - (initial & 0xFFF);
-		proc->image.shm_heap = initial;
+static uintptr_t proc_sbrk(uint32_t num_pages, uintptr_t align, volatile process_t * volatile proc) {
+	uintptr_t initial = align_up(proc->image.shm_heap, align);
+	proc->image.shm_heap = initial + ((uintptr_t)num_pages << 12);
+	return initial;
+}
+
+/* Whether the frames starting at @p i came from one 2MiB block */
+static int chunk_has_large(shm_chunk_t * chunk, uint32_t i) {
+	if (i % LARGE_FRAMES || i + LARGE_FRAMES > chunk->num_frames) return 0;
+	if (chunk->frames[i] % LARGE_FRAMES) return 0;
+	for (uint32_t j = 1; j < LARGE_FRAMES; ++j) {
+		if (chunk->frames[i+j] != chunk->frames[i] + j) return 0;
 	}
-	proc->image.shm_heap += num_pages << 12;
+	return 1;
+}
 
-	return initial;
+static void map_frames(shm_chunk_t * chunk, shm_mapping_t * mapping, uintptr_t base) {
+	for (uint32_t i = 0; i < chunk->num_frames; ) {
+		uintptr_t vaddr = base + ((uintptr_t)i << 12);
+		if (chunk_has_large(chunk, i) && mmu_map_large(vaddr, chunk->frames[i] << 12, MMU_FLAG_WRITABLE)) {
+			for (uint32_t j = 0; j < LARGE_FRAMES; ++j) {
+				mapping->vaddrs[i++] = vaddr + (j << 12);
+			}
+			continue;
+		}
+		union PML * page = mmu_get_page(vaddr, MMU_GET_MAKE);
+		page->bits.page = chunk->frames[i];
+		mmu_frame_allocate(page, MMU_FLAG_WRITABLE);
+		mapping->vaddrs[i++] = vaddr;
+	}
 }
 
 static void * map_in (shm_chunk_t * chunk, volatile process_t * volatile proc) {
@@ -171,19 +209,18 @@ static void * map_in (shm_chunk_t * chunk, volatile process_t * volatile proc) {
 	mapping->num_vaddrs = chunk->num_frames;
 	mapping->vaddrs = malloc(sizeof(uintptr_t) * mapping->num_vaddrs);
 
+	/* Chunks with large blocks in them are placed so the blocks line up with large pages. */
+	uintptr_t align = chunk->num_frames >= LARGE_FRAMES ? MMU_LARGE_PAGE_SIZE : 0x1000;
+
 	uintptr_t last_address = USER_SHM_LOW;
 	foreach(node, proc->shm_mappings) {
 		shm_mapping_t * m = node->value;
+		last_address = align_up(last_address, align);
 		if (m->vaddrs[0] > last_address) {
 			size_t gap = (uintptr_t)m->vaddrs[0] - last_address;
 			if (gap >= mapping->num_vaddrs * 0x1000) {
 				/* Map the gap */
-				for (unsigned int i = 0; i < chunk->num_frames; ++i) {
-					union PML * page = mmu_get_page(last_address + (i << 12), MMU_GET_MAKE);
-					page->bits.page = chunk->frames[i];
-					mmu_frame_allocate(page, MMU_FLAG_WRITABLE);
-					mapping->vaddrs[i] = last_address + (i << 12);
-				}
+				map_frames(chunk, mapping, last_address);
 
 				/* Insert us before this node */
 				list_insert_before(proc->shm_mappings, node, mapping);
@@ -194,31 +231,18 @@ static void * map_in (shm_chunk_t * chunk, volatile process_t * volatile proc) {
 		last_address = m->vaddrs[0] + m->num_vaddrs * 0x1000;
 	}
 
+	last_address = align_up(last_address, align);
 	if (proc->image.shm_heap > last_address) {
 		size_t gap = proc->image.shm_heap - last_address;
 		if (gap >= mapping->num_vaddrs * 0x1000) {
-
-			for (unsigned int i = 0; i < chunk->num_frames; ++i) {
-				union PML * page = mmu_get_page(last_address + (i << 12), MMU_GET_MAKE);
-				page->bits.page = chunk->frames[i];
-				mmu_frame_allocate(page, MMU_FLAG_WRITABLE);
-				mapping->vaddrs[i] = last_address + (i << 12);
-			}
+			map_frames(chunk, mapping, last_address);
 
 			list_insert(proc->shm_mappings, mapping);
 			return (void *)mapping->vaddrs[0];
 		}
 	}
 
-
-	for (uint32_t i = 0; i < chunk->num_frames; i++) {
-		uintptr_t new_vpage = proc_sbrk(1, proc);
-
-		union PML * page = mmu_get_page(new_vpage, MMU_GET_MAKE);
-		page->bits.page = chunk->frames[i];
-		mmu_frame_allocate(page, MMU_FLAG_WRITABLE);
-		mapping->vaddrs[i] = new_vpage;
-	}
+	map_frames(chunk, mapping, proc_sbrk(chunk->num_frames, align, proc));
 
 	list_insert(proc->shm_mappings, mapping);
 
@@ -299,6 +323,10 @@ int shm_release (char * path) {
 
 	/* Clear the mappings from the process's address space */
 	for (uint32_t i = 0; i < mapping->num_vaddrs; i++) {
+		if (mmu_unmap_large(mapping->vaddrs[i])) {
+			i += LARGE_FRAMES - 1;
+			continue;
+		}
 		union PML * page = mmu_get_page(mapping->vaddrs[i], 0);
 		page->bits.present = 0;
 		mmu_invalidate(mapping->vaddrs[i]);
@@ -18,6 +18,9 @@
 #include <sys/resource.h>
 #include <sys/mman.h>
 #include <sys/syscall.h>
+#include <sys/futex.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include <kernel/printf.h>
 #include <kernel/process.h>
 #include <kernel/string.h>
@@ -33,6 +36,8 @@
 #include <kernel/misc.h>
 #include <kernel/ptrace.h>
 #include <kernel/mman.h>
+#include <kernel/futex.h>
+#include <kernel/pagecache.h>
 #include <kernel/net/netif.h>
 
 static char   hostname[256];
@@ -101,6 +106,183 @@ long sys_pread(int fd, void * ptr, size_t count, off_t offset) {
 	return read_fs(node, offset, count, (uint8_t *)ptr);
 }
 
+/* Largest bounce buffer for splices the page cache can't serve */
+#define SPLICE_BUFFER 0x10000
+
+static int node_is_stream(fs_node_t * node) {
+	return (node->flags & FS_PIPE) || (node->flags & FS_CHARDEVICE) || (node->flags & FS_SOCKET);
+}
+
+/**
+ * @brief Move data between two nodes through a kernel buffer.
+ *
+ * Used when the source is not in the page cache, eg. a pipe being
+ * drained into a file. A stream source is read once, like read() would,
+ * so we never block for more data after already having some. What we
+ * read from a stream can't be put back, so each chunk is written out
+ * in full before anything else is read, and an error from the output
+ * is only returned if nothing at all was moved.
+ */
+static ssize_t splice_copy(fs_node_t * in, off_t in_pos, fs_node_t * out, off_t out_pos, size_t len) {
+	size_t bufsize = len < SPLICE_BUFFER ? len : SPLICE_BUFFER;
+	uint8_t * buf = malloc(bufsize);
+	ssize_t done = 0;
+
+	while ((size_t)done < len) {
+		size_t count = len - done < bufsize ? len - done : bufsize;
+		ssize_t r = read_fs(in, in_pos + done, count, buf);
+		if (r <= 0) {
+			if (!done) done = r;
+			break;
+		}
+		ssize_t written = 0;
+		while (written < r) {
+			ssize_t w = write_fs(out, out_pos + done + written, r - written, buf + written);
+			if (w <= 0) {
+				done += written;
+				if (!done) done = w;
+				goto _finish;
+			}
+			written += w;
+		}
+		done += written;
+		if ((size_t)r < count || node_is_stream(in)) break;
+	}
+
+_finish:
+
+	free(buf);
+	return done;
+}
+
+/**
+ * @brief Move up to @p len bytes from one file descriptor to another in the kernel.
+ *
+ * Offsets work like pread/pwrite when given and are updated in place;
+ * otherwise the descriptors' own offsets are used and advanced. Cached
+ * files are written out straight from the page cache.
+ */
+long sys_splice(int fd_in, off_t * off_in, int fd_out, off_t * off_out, size_t len, unsigned int flags) {
+	if (!FD_CHECK(fd_in) || !FD_CHECK(fd_out)) return -EBADF;
+	if (!(FD_MODE(fd_in) & PROC_FD_MODE_READ)) return -EBADF;
+	if (!(FD_MODE(fd_out) & PROC_FD_MODE_WRITE)) return -EBADF;
+	if (flags & ~(SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE)) return -EINVAL;
+
+	fs_node_t * in  = FD_ENTRY(fd_in);
+	fs_node_t * out = FD_ENTRY(fd_out);
+
+	if (off_in) {
+		if (node_is_stream(in)) return -ESPIPE;
+		PTRCHECK(off_in,sizeof(off_t),MMU_PTR_WRITE);
+		if (*off_in < 0) return -EINVAL;
+	}
+	if (off_out) {
+		if (node_is_stream(out)) return -ESPIPE;
+		PTRCHECK(off_out,sizeof(off_t),MMU_PTR_WRITE);
+		if (*off_out < 0) return -EINVAL;
+	}
+	if (!len) return 0;
+
+	off_t in_pos  = off_in  ? *off_in  : (off_t)FD_OFFSET(fd_in);
+	off_t out_pos = off_out ? *off_out : (off_t)FD_OFFSET(fd_out);
+
+	ssize_t done;
+	if ((in->flags & FS_PAGECACHE) && in->read && in_pos >= 0) {
+		done = pagecache_splice(in, in_pos, len, out, out_pos);
+	} else {
+		done = splice_copy(in, in_pos, out, out_pos, len);
+	}
+
+	if (done > 0) {
+		if (off_in)  *off_in += done;  else FD_OFFSET(fd_in) += done;
+		if (off_out) *off_out += done; else FD_OFFSET(fd_out) += done;
+	}
+
+	return done;
+}
+
+/* iovec arrays up to this long are copied onto the stack */
+#define IOV_FAST 8
+
+/**
+ * @brief Copy a user iovec array into the kernel and validate its buffers.
+ *
+ * @p kiov is pointed at @p fast, or at a new allocation for long arrays,
+ * which the caller frees whatever the result.
+ * @returns the total length of the buffers, or an error.
+ */
+static long iov_import(const struct iovec * iov, int iovcnt, int flags, struct iovec * fast, struct iovec ** kiov) {
+	*kiov = fast;
+	if (iovcnt < 0 || iovcnt > IOV_MAX) return -EINVAL;
+	if (!iovcnt) return 0;
+	PTRCHECK(iov,iovcnt * sizeof(struct iovec),0);
+
+	if (iovcnt > IOV_FAST) *kiov = malloc(iovcnt * sizeof(struct iovec));
+	memcpy(*kiov, iov, iovcnt * sizeof(struct iovec));
+
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		if ((*kiov)[i].iov_len > (size_t)INT64_MAX - total) return -EINVAL;
+		PTRCHECK((*kiov)[i].iov_base,(*kiov)[i].iov_len,MMU_PTR_NULL|flags);
+		total += (*kiov)[i].iov_len;
+	}
+	return total;
+}
+
+long sys_readv(int fd, const struct iovec * iov, int iovcnt) {
+	if (!FD_CHECK(fd)) return -EBADF;
+	if (!(FD_MODE(fd) & PROC_FD_MODE_READ)) return -EBADF;
+
+	struct iovec fast[IOV_FAST], * kiov;
+	long out = iov_import(iov, iovcnt, MMU_PTR_WRITE, fast, &kiov);
+	if (out > 0) {
+		out = readv_fs(FD_ENTRY(fd), FD_OFFSET(fd), kiov, iovcnt);
+		if (out > 0) FD_OFFSET(fd) += out;
+	}
+	if (kiov != fast) free(kiov);
+	return out;
+}
+
+long sys_writev(int fd, const struct iovec * iov, int iovcnt) {
+	if (!FD_CHECK(fd)) return -EBADF;
+	if (!(FD_MODE(fd) & PROC_FD_MODE_WRITE)) return -EBADF;
+
+	struct iovec fast[IOV_FAST], * kiov;
+	long out = iov_import(iov, iovcnt, 0, fast, &kiov);
+	if (out > 0) {
+		out = writev_fs(FD_ENTRY(fd), FD_OFFSET(fd), kiov, iovcnt);
+		if (out > 0) FD_OFFSET(fd) += out;
+	}
+	if (kiov != fast) free(kiov);
+	return out;
+}
+
+long sys_preadv(int fd, const struct iovec * iov, int iovcnt, off_t offset) {
+	if (!FD_CHECK(fd)) return -EBADF;
+	if (node_is_stream(FD_ENTRY(fd))) return -ESPIPE;
+	if (!(FD_MODE(fd) & PROC_FD_MODE_READ)) return -EBADF;
+	if (offset < 0) return -EINVAL;
+
+	struct iovec fast[IOV_FAST], * kiov;
+	long out = iov_import(iov, iovcnt, MMU_PTR_WRITE, fast, &kiov);
+	if (out > 0) out = readv_fs(FD_ENTRY(fd), offset, kiov, iovcnt);
+	if (kiov != fast) free(kiov);
+	return out;
+}
+
+long sys_pwritev(int fd, const struct iovec * iov, int iovcnt, off_t offset) {
+	if (!FD_CHECK(fd)) return -EBADF;
+	if (node_is_stream(FD_ENTRY(fd))) return -ESPIPE;
+	if (!(FD_MODE(fd) & PROC_FD_MODE_WRITE)) return -EBADF;
+	if (offset < 0) return -EINVAL;
+
+	struct iovec fast[IOV_FAST], * kiov;
+	long out = iov_import(iov, iovcnt, 0, fast, &kiov);
+	if (out > 0) out = writev_fs(FD_ENTRY(fd), offset, kiov, iovcnt);
+	if (kiov != fast) free(kiov);
+	return out;
+}
+
 static long stat_node(fs_node_t * fn, struct stat * f) {
 	f->st_dev   = (uint16_t)(((uint64_t)fn->device & 0xFFFF0) >> 8);
 	f->st_ino   = fn->inode;
@@ -647,6 +829,20 @@ long sys_getsid(pid_t pid) {
 	return proc->session;
 }
 
+long sys_futex(int * uaddr, int op, int val, const struct timespec * timeout) {
+	if ((uintptr_t)uaddr & (sizeof(int) - 1)) return -EINVAL;
+	PTRCHECK(uaddr,sizeof(int),0);
+	switch (op) {
+		case FUTEX_WAIT:
+			if (timeout) PTRCHECK(timeout,sizeof(struct timespec),0);
+			return futex_wait(uaddr, val, timeout);
+		case FUTEX_WAKE:
+			return futex_wake(uaddr, val);
+		default:
+			return -EINVAL;
+	}
+}
+
 long sys_setpgid(pid_t pid, pid_t pgid) {
 	if (pgid < 0) {
 		return -EINVAL;
@@ -941,7 +1137,7 @@ long sys_sleepabs(unsigned long seconds, unsigned long subseconds) {
 
 long sys_sleep(unsigned long seconds, unsigned long subseconds) {
 	unsigned long s, ss;
-	relative_time(seconds, subseconds * 10000, &s, &ss);
+	relative_time(seconds, subseconds, &s, &ss);
 	return sys_sleepabs(s, ss);
 }
 
@@ -1370,6 +1566,12 @@ static scall_func syscalls[] = {
 	[SYS_SETTLSBASE]   = (scall_func)(uintptr_t)sys_set_tls_base,
 	[SYS_INSMOD]       = (scall_func)(uintptr_t)sys_insmod,
 	[SYS_GETSID]       = (scall_func)(uintptr_t)sys_getsid,
+	[SYS_FUTEX]        = (scall_func)(uintptr_t)sys_futex,
+	[SYS_SPLICE]       = (scall_func)(uintptr_t)sys_splice,
+	[SYS_READV]        = (scall_func)(uintptr_t)sys_readv,
+	[SYS_WRITEV]       = (scall_func)(uintptr_t)sys_writev,
+	[SYS_PREADV]       = (scall_func)(uintptr_t)sys_preadv,
+	[SYS_PWRITEV]      = (scall_func)(uintptr_t)sys_pwritev,
 
 	[SYS_SOCKET]       = (scall_func)(uintptr_t)net_socket,
 	[SYS_SETSOCKOPT]   = (scall_func)(uintptr_t)net_setsockopt,
@@ -0,0 +1,527 @@
+/**
+ * @file  kernel/vfs/bcache.c
+ * @brief Block buffer cache.
+ *
+ * Sits between filesystems and block device drivers. A driver passes
+ * its raw device node to bcache_create() and mounts the node it gets
+ * back; reads and writes on that node are served from 4KiB blocks held
+ * in memory, and the raw node only ever sees whole, aligned blocks.
+ *
+ * Blocks are found through a hash of (device, block number) and are
+ * evicted with the CLOCK algorithm. Writes are write-back: a dirty block
+ * goes to disk when the [bcache] thread finds it has been dirty for a
+ * few seconds, when it is chosen for eviction, or when its device is
+ * sent IOCTLSYNC.
+ *
+ * Runs of missing blocks are read from the device with a single
+ * request, both for reads spanning several blocks and for readahead
+ * asked for by a filesystem with BCACHE_IOCTL_READAHEAD.
+ *
+ * Device I/O happens without the cache lock held, so requests for
+ * different blocks can be in flight at once. A block being filled is
+ * marked invalid; anyone else who wants it sleeps until it is ready.
+ * Blocks are pinned while their contents are being copied or written
+ * out, and pinned blocks are never evicted.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdint.h>
+#include <bits/errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/vfs.h>
+#include <kernel/slab.h>
+#include <kernel/mmu.h>
+#include <kernel/list.h>
+#include <kernel/time.h>
+#include <kernel/process.h>
+#include <kernel/procfs.h>
+#include <kernel/spinlock.h>
+#include <kernel/bcache.h>
+
+#include <sys/ioctl.h>
+
+#define BCACHE_BLOCKS  4096
+#define BCACHE_BUCKETS 4096
+
+/* Dirty blocks older than this many seconds are written back. */
+#define BCACHE_FLUSH_AGE 5
+
+/* How often the write-back thread wakes up to look for them. */
+#define BCACHE_FLUSH_INTERVAL 1
+
+/* Past this many dirty blocks, wake the write-back thread early. */
+#define BCACHE_DIRTY_LIMIT (BCACHE_BLOCKS / 4)
+
+/* Largest run of missing blocks read from a device at once. */
+#define BCACHE_RUN_BLOCKS 16
+
+/* Statistics request understood by block-dev-stats. */
+#define BCACHE_IOCTL_STATS 0x2A01234UL
+
+struct bcache_device {
+	fs_node_t * raw;
+	struct bcache_device * next;
+	size_t cached;
+	size_t dirty;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t writes;
+	uint64_t writebacks;
+};
+
+struct bcache_block {
+	struct bcache_device * dev;
+	struct bcache_block * hash_next;
+	uint64_t number;
+	uint8_t * data;
+	uint64_t dirtied;    /* When the block last went from clean to dirty */
+	int pins;
+	uint8_t valid;       /* Contents have been read in */
+	uint8_t dirty;
+	uint8_t referenced;  /* Used since the clock hand last passed */
+};
+
+static spin_lock_t bcache_lock = { 0 };
+static struct bcache_block * blocks = NULL;
+static struct bcache_block * buckets[BCACHE_BUCKETS];
+static struct bcache_device * devices = NULL;
+static size_t clock_hand = 0;
+static size_t bcache_dirty = 0;
+static int bcache_flush_all = 0;
+
+static list_t * bcache_waiters = NULL;
+static list_t * bcache_flusher_queue = NULL;
+
+static size_t block_hash(struct bcache_device * dev, uint64_t number) {
+	uintptr_t hash = ((uintptr_t)dev >> 4) ^ (number * 0x9E3779B1UL);
+	hash ^= hash >> 20;
+	return hash % BCACHE_BUCKETS;
+}
+
+static struct bcache_block * block_find(struct bcache_device * dev, uint64_t number) {
+	for (struct bcache_block * block = buckets[block_hash(dev, number)]; block; block = block->hash_next) {
+		if (block->dev == dev && block->number == number) return block;
+	}
+	return NULL;
+}
+
+static void block_unhash(struct bcache_block * block) {
+	struct bcache_block ** link = &buckets[block_hash(block->dev, block->number)];
+	while (*link != block) link = &(*link)->hash_next;
+	*link = block->hash_next;
+	block->dev->cached--;
+	block->dev = NULL;
+}
+
+static void block_hash_insert(struct bcache_block * block, struct bcache_device * dev, uint64_t number) {
+	size_t bucket = block_hash(dev, number);
+	block->dev = dev;
+	block->number = number;
+	block->hash_next = buckets[bucket];
+	buckets[bucket] = block;
+	dev->cached++;
+}
+
+/**
+ * @brief Advance the clock hand to a block that can be reused.
+ *
+ * Unused and clean blocks are taken as soon as the hand reaches them
+ * with their reference bit clear. Dirty blocks are only returned if
+ * two full sweeps turn up nothing clean, and the caller has to write
+ * them back first. Returns NULL if every block is pinned.
+ */
+static struct bcache_block * block_victim(void) {
+	struct bcache_block * dirty = NULL;
+	for (size_t i = 0; i < 2 * BCACHE_BLOCKS; ++i) {
+		struct bcache_block * block = &blocks[clock_hand];
+		clock_hand = (clock_hand + 1) % BCACHE_BLOCKS;
+		if (block->pins) continue;
+		if (!block->dev) return block;
+		if (block->referenced) {
+			block->referenced = 0;
+			continue;
+		}
+		if (!block->dirty) return block;
+		if (!dirty) dirty = block;
+	}
+	return dirty;
+}
+
+/**
+ * @brief Write one dirty block to its device.
+ *
+ * Called and returns with the cache lock held, but drops it for the
+ * write itself. The block is marked clean before the write starts, so
+ * anything written into it meanwhile dirties it again rather than
+ * being lost.
+ */
+static void block_writeback(struct bcache_block * block) {
+	struct bcache_device * dev = block->dev;
+	block->pins++;
+	block->dirty = 0;
+	dev->dirty--;
+	bcache_dirty--;
+	spin_unlock(bcache_lock);
+
+	ssize_t result = write_fs(dev->raw, block->number * BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE, block->data);
+	if (result < 0) {
+		printf("bcache: %s: write error %zd on block %lu\n", dev->raw->name, result, (unsigned long)block->number);
+	}
+
+	spin_lock(bcache_lock);
+	dev->writebacks++;
+	block->pins--;
+	if (bcache_waiters->length) wakeup_queue(bcache_waiters);
+}
+
+/**
+ * @brief Look up a block, reading it in on a miss, and pin it.
+ *
+ * If @p fill is zero the caller is about to overwrite the whole block,
+ * so a miss skips the read; the block stays invalid until it is put.
+ */
+static struct bcache_block * block_get(struct bcache_device * dev, uint64_t number, int fill) {
+	spin_lock(bcache_lock);
+	while (1) {
+		struct bcache_block * block = block_find(dev, number);
+		if (block) {
+			if (!block->valid) {
+				sleep_on_unlocking(bcache_waiters, &bcache_lock);
+				spin_lock(bcache_lock);
+				continue;
+			}
+			block->pins++;
+			block->referenced = 1;
+			dev->hits++;
+			spin_unlock(bcache_lock);
+			return block;
+		}
+
+		block = block_victim();
+		if (!block) {
+			sleep_on_unlocking(bcache_waiters, &bcache_lock);
+			spin_lock(bcache_lock);
+			continue;
+		}
+
+		if (block->dirty) {
+			/* Everything is dirty; the write-back thread is falling behind. */
+			bcache_flush_all = 1;
+			wakeup_queue(bcache_flusher_queue);
+			block_writeback(block);
+			continue;
+		}
+
+		if (block->dev) {
+			block->dev->evictions++;
+			block_unhash(block);
+		}
+
+		block_hash_insert(block, dev, number);
+		block->valid = 0;
+		block->referenced = 1;
+		block->pins = 1;
+		dev->misses++;
+		spin_unlock(bcache_lock);
+
+		if (!fill) return block;
+
+		ssize_t result = read_fs(dev->raw, number * BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE, block->data);
+		if (result >= 0 && result < BCACHE_BLOCK_SIZE) {
+			/* Short read past the end of the device */
+			memset(block->data + result, 0, BCACHE_BLOCK_SIZE - result);
+		}
+
+		spin_lock(bcache_lock);
+		if (result < 0) {
+			block_unhash(block);
+			block->pins = 0;
+			block = NULL;
+		} else {
+			block->valid = 1;
+		}
+		if (bcache_waiters->length) wakeup_queue(bcache_waiters);
+		spin_unlock(bcache_lock);
+		return block;
+	}
+}
+
+/**
+ * @brief Read up to @p count missing blocks from @p first with one device read.
+ *
+ * Only the leading run of blocks that are not cached is read; this
+ * stops at the first one that is, or when the only blocks left to
+ * reuse are pinned or dirty. Returns how many blocks were read in.
+ */
+static size_t block_fill_run(struct bcache_device * dev, uint64_t first, size_t count) {
+	struct bcache_block * run[BCACHE_RUN_BLOCKS];
+	size_t claimed = 0;
+
+	if (count > BCACHE_RUN_BLOCKS) count = BCACHE_RUN_BLOCKS;
+
+	spin_lock(bcache_lock);
+	while (claimed < count) {
+		if (block_find(dev, first + claimed)) break;
+
+		struct bcache_block * block = block_victim();
+		if (!block || block->dirty) break;
+
+		if (block->dev) {
+			block->dev->evictions++;
+			block_unhash(block);
+		}
+
+		block_hash_insert(block, dev, first + claimed);
+		block->valid = 0;
+		block->referenced = 1;
+		block->pins = 1;
+		dev->misses++;
+		run[claimed++] = block;
+	}
+	spin_unlock(bcache_lock);
+
+	if (!claimed) return 0;
+
+	uint8_t * data = claimed == 1 ? run[0]->data : malloc(claimed * BCACHE_BLOCK_SIZE);
+	ssize_t result = read_fs(dev->raw, first * BCACHE_BLOCK_SIZE, claimed * BCACHE_BLOCK_SIZE, data);
+
+	for (size_t i = 0; result >= 0 && i < claimed; ++i) {
+		/* Anything short of the end of the device reads as zeroes */
+		size_t have = (size_t)result > i * BCACHE_BLOCK_SIZE ? result - i * BCACHE_BLOCK_SIZE : 0;
+		if (have > BCACHE_BLOCK_SIZE) have = BCACHE_BLOCK_SIZE;
+		if (data != run[i]->data) memcpy(run[i]->data, data + i * BCACHE_BLOCK_SIZE, have);
+		if (have < BCACHE_BLOCK_SIZE) memset(run[i]->data + have, 0, BCACHE_BLOCK_SIZE - have);
+	}
+
+	if (data != run[0]->data) free(data);
+
+	spin_lock(bcache_lock);
+	for (size_t i = 0; i < claimed; ++i) {
+		if (result < 0) {
+			block_unhash(run[i]);
+		} else {
+			run[i]->valid = 1;
+		}
+		run[i]->pins = 0;
+	}
+	if (bcache_waiters->length) wakeup_queue(bcache_waiters);
+	spin_unlock(bcache_lock);
+
+	return result < 0 ? 0 : claimed;
+}
+
+/**
+ * @brief Unpin a block, marking it dirty if it was written to.
+ */
+static void block_put(struct bcache_block * block, int dirty) {
+	spin_lock(bcache_lock);
+	if (dirty) {
+		block->dev->writes++;
+		if (!block->dirty) {
+			block->dirty = 1;
+			block->dirtied = now();
+			block->dev->dirty++;
+			bcache_dirty++;
+			if (bcache_dirty > BCACHE_DIRTY_LIMIT) {
+				bcache_flush_all = 1;
+				wakeup_queue(bcache_flusher_queue);
+			}
+		}
+	}
+	block->valid = 1;
+	block->pins--;
+	if (bcache_waiters->length) wakeup_queue(bcache_waiters);
+	spin_unlock(bcache_lock);
+}
+
+/**
+ * @brief Write back dirty blocks.
+ *
+ * Only blocks belonging to @p dev, or all of them if it is NULL, and
+ * only those dirtied at or before @p dirtied_before.
+ */
+static void bcache_flush(struct bcache_device * dev, uint64_t dirtied_before) {
+	spin_lock(bcache_lock);
+	for (size_t i = 0; i < BCACHE_BLOCKS && bcache_dirty; ++i) {
+		struct bcache_block * block = &blocks[i];
+		if (!block->dirty) continue;
+		if (dev && block->dev != dev) continue;
+		if (block->dirtied > dirtied_before) continue;
+		block_writeback(block);
+	}
+	spin_unlock(bcache_lock);
+}
+
+static void bcache_flusher(void * arg) {
+	while (1) {
+		spin_lock(bcache_lock);
+		if (!bcache_flush_all) {
+			unsigned long s, ss;
+			relative_time(BCACHE_FLUSH_INTERVAL, 0, &s, &ss);
+			sleep_on_unlocking_until(bcache_flusher_queue, &bcache_lock, s, ss);
+			spin_lock(bcache_lock);
+		}
+		int all = bcache_flush_all;
+		bcache_flush_all = 0;
+		spin_unlock(bcache_lock);
+
+		bcache_flush(NULL, all ? (uint64_t)-1 : now() - BCACHE_FLUSH_AGE);
+	}
+}
+
+static ssize_t read_bcache(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	struct bcache_device * dev = node->device;
+
+	if (offset < 0) return -EINVAL;
+	if ((uint64_t)offset >= node->length) return 0;
+	if (offset + size > node->length) size = node->length - offset;
+
+	uint64_t last = (offset + size - 1) / BCACHE_BLOCK_SIZE;
+	uint64_t filled = 0;
+
+	size_t done = 0;
+	while (done < size) {
+		uint64_t number = (offset + done) / BCACHE_BLOCK_SIZE;
+		size_t within = (offset + done) % BCACHE_BLOCK_SIZE;
+		size_t count = BCACHE_BLOCK_SIZE - within;
+		if (count > size - done) count = size - done;
+
+		if (number < last && number >= filled) {
+			/* Read any run of missing blocks ahead of us in one go */
+			filled = number + block_fill_run(dev, number, last - number + 1);
+		}
+
+		struct bcache_block * block = block_get(dev, number, 1);
+		if (!block) return done ? (ssize_t)done : -EIO;
+		memcpy(buffer + done, block->data + within, count);
+		block_put(block, 0);
+		done += count;
+	}
+
+	return done;
+}
+
+static ssize_t write_bcache(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	struct bcache_device * dev = node->device;
+
+	if (offset < 0) return -EINVAL;
+	if ((uint64_t)offset >= node->length) return -ENOSPC;
+	if (offset + size > node->length) size = node->length - offset;
+
+	size_t done = 0;
+	while (done < size) {
+		uint64_t number = (offset + done) / BCACHE_BLOCK_SIZE;
+		size_t within = (offset + done) % BCACHE_BLOCK_SIZE;
+		size_t count = BCACHE_BLOCK_SIZE - within;
+		if (count > size - done) count = size - done;
+
+		struct bcache_block * block = block_get(dev, number, count != BCACHE_BLOCK_SIZE);
+		if (!block) return done ? (ssize_t)done : -EIO;
+		memcpy(block->data + within, buffer + done, count);
+		block_put(block, 1);
+		done += count;
+	}
+
+	return done;
+}
+
+static int ioctl_bcache(fs_node_t * node, unsigned long request, void * argp) {
+	struct bcache_device * dev = node->device;
+
+	switch (request) {
+		case IOCTLSYNC: {
+			bcache_flush(dev, (uint64_t)-1);
+			int result = ioctl_fs(dev->raw, IOCTLSYNC, NULL);
+			return result == -ENOTTY ? 0 : result;
+		}
+
+		case BCACHE_IOCTL_READAHEAD: {
+			struct bcache_readahead * ra = argp;
+			if (ra->offset >= node->length || !ra->length) return 0;
+			uint64_t end = ra->offset + ra->length;
+			if (end > node->length) end = node->length;
+			uint64_t number = ra->offset / BCACHE_BLOCK_SIZE;
+			uint64_t last = (end - 1) / BCACHE_BLOCK_SIZE;
+			while (number <= last) {
+				size_t count = block_fill_run(dev, number, last - number + 1);
+				number += count ? count : 1;
+			}
+			return 0;
+		}
+
+		case BCACHE_IOCTL_STATS: {
+			uint64_t stats[4] = { dev->hits, dev->misses, dev->evictions, dev->writes };
+			memcpy(argp, stats, sizeof(stats));
+			return 0;
+		}
+
+		default:
+			return ioctl_fs(dev->raw, request, argp);
+	}
+}
+
+static void bcache_func(fs_node_t * node) {
+	procfs_printf(node, "%-12s %7s %6s %10s %10s %10s %10s %10s\n",
+		"device", "cached", "dirty", "hits", "misses", "evictions", "writes", "writebacks");
+	spin_lock(bcache_lock);
+	for (struct bcache_device * dev = devices; dev; dev = dev->next) {
+		procfs_printf(node, "%-12s %7zu %6zu %10lu %10lu %10lu %10lu %10lu\n",
+			dev->raw->name, dev->cached, dev->dirty,
+			(unsigned long)dev->hits, (unsigned long)dev->misses,
+			(unsigned long)dev->evictions, (unsigned long)dev->writes,
+			(unsigned long)dev->writebacks);
+	}
+	spin_unlock(bcache_lock);
+}
+
+static struct procfs_entry bcache_entry = {
+	0,
+	"bcache",
+	bcache_func,
+	0
+};
+
+static void bcache_initialize(void) {
+	uint8_t * data = mmu_map_module(BCACHE_BLOCKS * BCACHE_BLOCK_SIZE);
+	blocks = calloc(BCACHE_BLOCKS, sizeof(struct bcache_block));
+	for (size_t i = 0; i < BCACHE_BLOCKS; ++i) {
+		blocks[i].data = data + i * BCACHE_BLOCK_SIZE;
+	}
+
+	bcache_waiters = list_create("bcache waiters", NULL);
+	bcache_flusher_queue = list_create("bcache flusher", NULL);
+
+	procfs_install(&bcache_entry);
+	spawn_worker_thread(bcache_flusher, "[bcache]", NULL);
+}
+
+fs_node_t * bcache_create(fs_node_t * raw) {
+	if (!blocks) bcache_initialize();
+
+	struct bcache_device * dev = calloc(1, sizeof(struct bcache_device));
+	dev->raw = raw;
+
+	spin_lock(bcache_lock);
+	dev->next = devices;
+	devices = dev;
+	spin_unlock(bcache_lock);
+
+	fs_node_t * fnode = kmem_cache_zalloc(&fs_node_cache);
+	memcpy(fnode->name, raw->name, sizeof(fnode->name));
+	fnode->device  = dev;
+	fnode->uid     = raw->uid;
+	fnode->gid     = raw->gid;
+	fnode->mask    = raw->mask;
+	fnode->length  = raw->length;
+	fnode->flags   = FS_BLOCKDEVICE;
+	fnode->read    = read_bcache;
+	fnode->write   = raw->write ? write_bcache : NULL;
+	fnode->ioctl   = ioctl_bcache;
+	return fnode;
+}
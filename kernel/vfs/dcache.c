@@ -0,0 +1,233 @@
+/**
+ * @file  kernel/vfs/dcache.c
+ * @brief Directory entry cache.
+ *
+ * Remembers the results of finddir: which inode a name refers to in a
+ * given directory, or that the name does not exist there. Directories
+ * are identified by their (device, inode, finddir) triple, so the cache
+ * survives the short lifetime of the fs_node_t objects that lookups
+ * pass around, and the root of a filesystem never aliases an ordinary
+ * directory that happens to share its inode number.
+ *
+ * Filesystems opt in by giving directory nodes an iget method, which
+ * rebuilds a node for an inode found here without searching the
+ * directory again. Entries are dropped by the VFS whenever it creates,
+ * removes or renames a name, and everything is dropped on mount.
+ *
+ * Lookups that raced with one of those changes are detected with a
+ * generation counter and are not inserted.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdint.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/vfs.h>
+#include <kernel/list.h>
+#include <kernel/procfs.h>
+#include <kernel/spinlock.h>
+#include <kernel/dcache.h>
+
+#define DCACHE_BUCKETS 1024
+#define DCACHE_ENTRIES 4096
+
+struct dentry {
+	void * device;
+	uint64_t dir;
+	finddir_type_t finddir;
+	uint64_t inode;
+	int negative;
+	struct dentry * hash_next;
+	node_t lru_node;
+	size_t hash;
+	char name[];
+};
+
+static spin_lock_t dcache_lock = { 0 };
+static struct dentry * buckets[DCACHE_BUCKETS];
+static list_t dcache_lru = { 0 };
+static uint64_t dcache_generation = 0;
+
+static uint64_t dcache_hits = 0;
+static uint64_t dcache_negative_hits = 0;
+static uint64_t dcache_misses = 0;
+
+static size_t dentry_hash(fs_node_t * dir, const char * name) {
+	/* FNV-1a over the name, mixed with the directory */
+	size_t hash = 0xcbf29ce484222325UL;
+	for (const char * c = name; *c; ++c) {
+		hash ^= (unsigned char)*c;
+		hash *= 0x100000001b3UL;
+	}
+	hash ^= ((uintptr_t)dir->device >> 4) ^ (dir->inode * 0x9E3779B1UL);
+	return hash ^ (hash >> 32);
+}
+
+static int dentry_cacheable(fs_node_t * dir, const char * name) {
+	if (!dir->iget) return 0;
+	if (!strcmp(name, PATH_DOT) || !strcmp(name, PATH_UP)) return 0;
+	return strlen(name) < sizeof(dir->name);
+}
+
+static struct dentry * dentry_find(fs_node_t * dir, const char * name, size_t hash) {
+	for (struct dentry * d = buckets[hash % DCACHE_BUCKETS]; d; d = d->hash_next) {
+		if (d->hash == hash && d->device == dir->device && d->dir == dir->inode &&
+			d->finddir == dir->finddir && !strcmp(d->name, name)) return d;
+	}
+	return NULL;
+}
+
+static void dentry_remove(struct dentry * d) {
+	struct dentry ** link = &buckets[d->hash % DCACHE_BUCKETS];
+	while (*link != d) link = &(*link)->hash_next;
+	*link = d->hash_next;
+	list_delete(&dcache_lru, &d->lru_node);
+	free(d);
+}
+
+/**
+ * @brief Look up @p name in @p dir.
+ *
+ * @param inode      Set to the cached inode on a positive hit.
+ * @param generation Set to a token to pass to dcache_insert after a miss.
+ * @returns DCACHE_POSITIVE, DCACHE_NEGATIVE, or DCACHE_MISS.
+ */
+int dcache_lookup(fs_node_t * dir, const char * name, uint64_t * inode, uint64_t * generation) {
+	if (!dentry_cacheable(dir, name)) {
+		*generation = (uint64_t)-1;
+		return DCACHE_MISS;
+	}
+
+	size_t hash = dentry_hash(dir, name);
+	int result = DCACHE_MISS;
+
+	spin_lock(dcache_lock);
+	*generation = dcache_generation;
+	struct dentry * d = dentry_find(dir, name, hash);
+	if (d) {
+		list_delete(&dcache_lru, &d->lru_node);
+		list_append(&dcache_lru, &d->lru_node);
+		if (d->negative) {
+			dcache_negative_hits++;
+			result = DCACHE_NEGATIVE;
+		} else {
+			dcache_hits++;
+			*inode = d->inode;
+			result = DCACHE_POSITIVE;
+		}
+	} else {
+		dcache_misses++;
+	}
+	spin_unlock(dcache_lock);
+	return result;
+}
+
+/**
+ * @brief Record the result of a finddir that missed the cache.
+ *
+ * @param found The node finddir returned, or NULL if the name does not exist.
+ */
+void dcache_insert(fs_node_t * dir, const char * name, fs_node_t * found, uint64_t generation) {
+	if (!dentry_cacheable(dir, name)) return;
+
+	size_t hash = dentry_hash(dir, name);
+	size_t len = strlen(name);
+	struct dentry * d = malloc(sizeof(struct dentry) + len + 1);
+	d->device   = dir->device;
+	d->dir      = dir->inode;
+	d->finddir  = dir->finddir;
+	d->inode    = found ? found->inode : 0;
+	d->negative = !found;
+	d->hash     = hash;
+	d->lru_node.value = d;
+	memcpy(d->name, name, len + 1);
+
+	spin_lock(dcache_lock);
+	if (generation != dcache_generation || dentry_find(dir, name, hash)) {
+		/* Something changed while the filesystem was searching. */
+		spin_unlock(dcache_lock);
+		free(d);
+		return;
+	}
+
+	if (dcache_lru.length >= DCACHE_ENTRIES) {
+		dentry_remove(dcache_lru.head->value);
+	}
+
+	d->hash_next = buckets[hash % DCACHE_BUCKETS];
+	buckets[hash % DCACHE_BUCKETS] = d;
+	list_append(&dcache_lru, &d->lru_node);
+	spin_unlock(dcache_lock);
+}
+
+/**
+ * @brief Forget whatever is known about @p name in @p dir.
+ */
+void dcache_invalidate(fs_node_t * dir, const char * name) {
+	if (!dentry_cacheable(dir, name)) return;
+	size_t hash = dentry_hash(dir, name);
+
+	spin_lock(dcache_lock);
+	dcache_generation++;
+	struct dentry * d = dentry_find(dir, name, hash);
+	if (d) dentry_remove(d);
+	spin_unlock(dcache_lock);
+}
+
+/**
+ * @brief Forget every entry in the directory at inode @p dir.
+ *
+ * Used when a directory is removed, so that nothing cached under
+ * it outlives it if its inode number is reused.
+ */
+void dcache_invalidate_dir(void * device, uint64_t dir) {
+	spin_lock(dcache_lock);
+	dcache_generation++;
+	node_t * node = dcache_lru.head;
+	while (node) {
+		node_t * next = node->next;
+		struct dentry * d = node->value;
+		if (d->device == device && d->dir == dir) dentry_remove(d);
+		node = next;
+	}
+	spin_unlock(dcache_lock);
+}
+
+void dcache_purge(void) {
+	spin_lock(dcache_lock);
+	dcache_generation++;
+	while (dcache_lru.head) {
+		dentry_remove(dcache_lru.head->value);
+	}
+	spin_unlock(dcache_lock);
+}
+
+static void dcache_func(fs_node_t * node) {
+	uint64_t lookups = dcache_hits + dcache_negative_hits + dcache_misses;
+	procfs_printf(node,
+		"Entries:\t%zu\n"
+		"Hits:\t%lu\n"
+		"NegativeHits:\t%lu\n"
+		"Misses:\t%lu\n"
+		"HitRate:\t%lu%%\n",
+		dcache_lru.length,
+		(unsigned long)dcache_hits,
+		(unsigned long)dcache_negative_hits,
+		(unsigned long)dcache_misses,
+		lookups ? (unsigned long)((dcache_hits + dcache_negative_hits) * 100 / lookups) : 0UL);
+}
+
+static struct procfs_entry dcache_entry = {
+	0,
+	"dcache",
+	dcache_func,
+	0
+};
+
+void dcache_initialize(void) {
+	procfs_install(&dcache_entry);
+}
@@ -0,0 +1,456 @@
+/**
+ * @file  kernel/vfs/pagecache.c
+ * @brief Page cache for regular file contents.
+ *
+ * Filesystems opt in by setting FS_PAGECACHE on their file nodes.
+ * Pages are keyed by the node's (device, inode) pair, so every open
+ * of the same file - from any process - shares the same cached pages.
+ *
+ * The cache is write-through: write_fs and truncate_fs pass through to
+ * the filesystem and then drop any pages they made stale, so the disk
+ * is always authoritative and nothing here ever needs flushing.
+ *
+ * Private file mappings map cached frames directly (copy-on-write where
+ * the architecture supports it) instead of copying file contents.
+ *
+ * Pages live on a global LRU list. The least recently used unpinned
+ * pages are reclaimed when the cache grows past its budget or when
+ * free memory runs low.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdint.h>
+#include <bits/errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/vfs.h>
+#include <kernel/mmu.h>
+#include <kernel/list.h>
+#include <kernel/spinlock.h>
+#include <kernel/pagecache.h>
+
+#define PAGE_SIZE 0x1000UL
+
+#define PAGE_BUCKETS   4096
+#define OBJECT_BUCKETS 256
+
+/* How many pages to evict at once when the cache is over budget. */
+#define RECLAIM_BATCH 32
+
+/* Check free memory every this many fills. */
+#define PRESSURE_INTERVAL 64
+
+struct page_cache {
+	void * device;
+	uint64_t inode;
+	uint64_t generation;           /* Changes whenever cached contents become stale */
+	struct page_cache * hash_next;
+	list_t pages;
+	struct cached_page * tail;     /* The short page at end-of-file, if cached */
+};
+
+struct cached_page {
+	struct page_cache * cache;
+	struct cached_page * hash_next;
+	node_t cache_node;
+	node_t lru_node;
+	uint64_t index;
+	uintptr_t frame;
+	size_t valid;                  /* Bytes of file data in this page */
+	int pins;
+	int dead;
+};
+
+static spin_lock_t pagecache_lock = { 0 };
+static struct page_cache * objects[OBJECT_BUCKETS];
+static struct cached_page * pages[PAGE_BUCKETS];
+static list_t pagecache_lru = { 0 };
+static size_t pagecache_pages = 0;
+static size_t pagecache_limit = 0;
+static size_t pagecache_fills = 0;
+static uint64_t pagecache_generation = 0;
+
+static size_t object_hash(void * device, uint64_t inode) {
+	uintptr_t hash = ((uintptr_t)device >> 4) ^ inode ^ (inode >> 16);
+	return hash % OBJECT_BUCKETS;
+}
+
+static size_t page_hash(struct page_cache * cache, uint64_t index) {
+	uintptr_t hash = ((uintptr_t)cache >> 4) ^ (index * 0x9E3779B1UL);
+	hash ^= hash >> 20;
+	return hash % PAGE_BUCKETS;
+}
+
+static struct page_cache * object_find(void * device, uint64_t inode, int create) {
+	size_t bucket = object_hash(device, inode);
+	for (struct page_cache * cache = objects[bucket]; cache; cache = cache->hash_next) {
+		if (cache->device == device && cache->inode == inode) return cache;
+	}
+
+	if (!create) return NULL;
+
+	struct page_cache * cache = calloc(1, sizeof(struct page_cache));
+	cache->device = device;
+	cache->inode = inode;
+	cache->generation = ++pagecache_generation;
+	cache->hash_next = objects[bucket];
+	objects[bucket] = cache;
+	return cache;
+}
+
+static void object_release_if_empty(struct page_cache * cache) {
+	if (cache->pages.length) return;
+	struct page_cache ** link = &objects[object_hash(cache->device, cache->inode)];
+	while (*link != cache) link = &(*link)->hash_next;
+	*link = cache->hash_next;
+	free(cache);
+}
+
+static struct cached_page * page_find(struct page_cache * cache, uint64_t index) {
+	for (struct cached_page * page = pages[page_hash(cache, index)]; page; page = page->hash_next) {
+		if (page->cache == cache && page->index == index) return page;
+	}
+	return NULL;
+}
+
+static void page_free(struct cached_page * page) {
+	mmu_release_shared_frame(page->frame);
+	free(page);
+}
+
+/**
+ * @brief Remove a page from the cache.
+ *
+ * If a reader still has the page pinned, it is freed when they unpin it.
+ * Must be called with the cache lock held.
+ */
+static void page_detach(struct cached_page * page) {
+	struct page_cache * cache = page->cache;
+	struct cached_page ** link = &pages[page_hash(cache, page->index)];
+	while (*link != page) link = &(*link)->hash_next;
+	*link = page->hash_next;
+
+	list_delete(&cache->pages, &page->cache_node);
+	list_delete(&pagecache_lru, &page->lru_node);
+	if (cache->tail == page) cache->tail = NULL;
+	pagecache_pages--;
+
+	page->dead = 1;
+	if (!page->pins) page_free(page);
+}
+
+static void page_unpin(struct cached_page * page) {
+	spin_lock(pagecache_lock);
+	page->pins--;
+	int release = page->dead && !page->pins;
+	spin_unlock(pagecache_lock);
+	if (release) page_free(page);
+}
+
+/**
+ * @brief Evict up to @p count of the least recently used pages.
+ *
+ * @returns the number of pages evicted.
+ */
+size_t pagecache_reclaim(size_t count) {
+	size_t evicted = 0;
+	spin_lock(pagecache_lock);
+	node_t * node = pagecache_lru.head;
+	while (node && evicted < count) {
+		node_t * next = node->next;
+		struct cached_page * page = node->value;
+		if (!page->pins) {
+			struct page_cache * cache = page->cache;
+			page_detach(page);
+			object_release_if_empty(cache);
+			evicted++;
+		}
+		node = next;
+	}
+	spin_unlock(pagecache_lock);
+	return evicted;
+}
+
+static void pagecache_pressure(void) {
+	if (pagecache_pages >= pagecache_limit) {
+		pagecache_reclaim(RECLAIM_BATCH);
+	}
+
+	if (__sync_add_and_fetch(&pagecache_fills, 1) % PRESSURE_INTERVAL == 0) {
+		size_t total = mmu_total_memory();
+		size_t used  = mmu_used_memory();
+		size_t low   = total / 16;
+		if (total - used < low) {
+			pagecache_reclaim((low - (total - used)) / 4 + RECLAIM_BATCH);
+		}
+	}
+}
+
+/**
+ * @brief Find or fill the page at @p index of @p node, and pin it.
+ *
+ * @param err Set to the filesystem's error, or 0 at end-of-file.
+ * @returns the pinned page, or NULL at end-of-file or on error.
+ */
+static struct cached_page * pagecache_get(fs_node_t * node, uint64_t index, ssize_t * err) {
+	while (1) {
+		spin_lock(pagecache_lock);
+		struct page_cache * cache = object_find(node->device, node->inode, 1);
+		struct cached_page * page = page_find(cache, index);
+		if (page) {
+			page->pins++;
+			list_delete(&pagecache_lru, &page->lru_node);
+			list_append(&pagecache_lru, &page->lru_node);
+			spin_unlock(pagecache_lock);
+			return page;
+		}
+		if (cache->tail && cache->tail->index < index) {
+			/* Known to be past the end of the file. */
+			spin_unlock(pagecache_lock);
+			*err = 0;
+			return NULL;
+		}
+		uint64_t generation = cache->generation;
+		spin_unlock(pagecache_lock);
+
+		pagecache_pressure();
+
+		uintptr_t frame = mmu_allocate_a_frame() << 12;
+		uint8_t * data = mmu_map_from_physical(frame);
+		ssize_t r = node->read(node, index * PAGE_SIZE, PAGE_SIZE, data);
+
+		spin_lock(pagecache_lock);
+		cache = object_find(node->device, node->inode, 1);
+
+		if (r <= 0) {
+			object_release_if_empty(cache);
+			spin_unlock(pagecache_lock);
+			mmu_frame_release(frame);
+			*err = r;
+			return NULL;
+		}
+
+		if (cache->generation != generation || page_find(cache, index)) {
+			/* Raced with a write, or with another fill; try again. */
+			spin_unlock(pagecache_lock);
+			mmu_frame_release(frame);
+			continue;
+		}
+
+		if ((size_t)r < PAGE_SIZE) memset(data + r, 0, PAGE_SIZE - r);
+
+		page = calloc(1, sizeof(struct cached_page));
+		page->cache = cache;
+		page->index = index;
+		page->frame = frame;
+		page->valid = r;
+		page->pins  = 1;
+		page->cache_node.value = page;
+		page->lru_node.value = page;
+
+		size_t bucket = page_hash(cache, index);
+		page->hash_next = pages[bucket];
+		pages[bucket] = page;
+		list_append(&cache->pages, &page->cache_node);
+		list_append(&pagecache_lru, &page->lru_node);
+		if (page->valid < PAGE_SIZE) cache->tail = page;
+		pagecache_pages++;
+
+		spin_unlock(pagecache_lock);
+		return page;
+	}
+}
+
+/**
+ * @brief Read from a file through the page cache.
+ */
+ssize_t pagecache_read(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	if (offset < 0) return node->read(node, offset, size, buffer);
+
+	size_t done = 0;
+	while (done < size) {
+		uint64_t position = offset + done;
+		size_t in_page = position % PAGE_SIZE;
+		ssize_t err = 0;
+		struct cached_page * page = pagecache_get(node, position / PAGE_SIZE, &err);
+		if (!page) {
+			if (err < 0 && !done) return err;
+			break;
+		}
+
+		size_t available = page->valid > in_page ? page->valid - in_page : 0;
+		if (available > size - done) available = size - done;
+		memcpy(buffer + done, (uint8_t *)mmu_map_from_physical(page->frame) + in_page, available);
+		done += available;
+
+		int end_of_file = page->valid < PAGE_SIZE;
+		page_unpin(page);
+		if (end_of_file) break;
+	}
+
+	return done;
+}
+
+/**
+ * @brief Write file contents from the page cache straight to another node.
+ *
+ * Each cached page is handed to @p out as it sits in the cache, so
+ * moving a cached file into a pipe or socket takes one copy rather
+ * than a copy out to a buffer and another back in. Stops early at
+ * end-of-file or when @p out takes less than it was given.
+ *
+ * @returns bytes written, or an error if nothing was.
+ */
+ssize_t pagecache_splice(fs_node_t * node, off_t offset, size_t size, fs_node_t * out, off_t out_offset) {
+	size_t done = 0;
+	while (done < size) {
+		uint64_t position = offset + done;
+		size_t in_page = position % PAGE_SIZE;
+		ssize_t err = 0;
+		struct cached_page * page = pagecache_get(node, position / PAGE_SIZE, &err);
+		if (!page) {
+			if (err < 0 && !done) return err;
+			break;
+		}
+
+		size_t available = page->valid > in_page ? page->valid - in_page : 0;
+		if (available > size - done) available = size - done;
+		int end_of_file = page->valid < PAGE_SIZE;
+
+		/* The pin keeps the frame around even if this write invalidates it. */
+		ssize_t written = available ? write_fs(out, out_offset + done, available, (uint8_t *)mmu_map_from_physical(page->frame) + in_page) : 0;
+		page_unpin(page);
+
+		if (written < 0) {
+			if (!done) return written;
+			break;
+		}
+		done += written;
+		if ((size_t)written < available || end_of_file) break;
+	}
+
+	return done;
+}
+
+/**
+ * @brief Drop cached pages made stale by a write of @p size bytes at @p offset.
+ *
+ * Writes that extend the file also invalidate the old end-of-file page.
+ */
+void pagecache_write(fs_node_t * node, off_t offset, size_t size) {
+	if (!size || offset < 0) return;
+
+	spin_lock(pagecache_lock);
+	struct page_cache * cache = object_find(node->device, node->inode, 0);
+	if (!cache) {
+		spin_unlock(pagecache_lock);
+		return;
+	}
+
+	cache->generation = ++pagecache_generation;
+
+	uint64_t first = offset / PAGE_SIZE;
+	uint64_t last  = (offset + size - 1) / PAGE_SIZE;
+
+	if (cache->tail && cache->tail->index < first) page_detach(cache->tail);
+
+	if (last - first < cache->pages.length) {
+		for (uint64_t index = first; index <= last; ++index) {
+			struct cached_page * page = page_find(cache, index);
+			if (page) page_detach(page);
+		}
+	} else {
+		node_t * n = cache->pages.head;
+		while (n) {
+			node_t * next = n->next;
+			struct cached_page * page = n->value;
+			if (page->index >= first && page->index <= last) page_detach(page);
+			n = next;
+		}
+	}
+
+	object_release_if_empty(cache);
+	spin_unlock(pagecache_lock);
+}
+
+/**
+ * @brief Drop cached pages at or beyond a new file size.
+ *
+ * Growing the file also invalidates the old end-of-file page, which
+ * is short and would otherwise hide the new zero-filled range.
+ */
+void pagecache_truncate(fs_node_t * node, size_t size) {
+	spin_lock(pagecache_lock);
+	struct page_cache * cache = object_find(node->device, node->inode, 0);
+	if (!cache) {
+		spin_unlock(pagecache_lock);
+		return;
+	}
+
+	cache->generation = ++pagecache_generation;
+
+	node_t * n = cache->pages.head;
+	while (n) {
+		node_t * next = n->next;
+		struct cached_page * page = n->value;
+		if (page->index >= size / PAGE_SIZE) page_detach(page);
+		n = next;
+	}
+
+	if (cache->tail && cache->tail->index * PAGE_SIZE + cache->tail->valid < size) page_detach(cache->tail);
+
+	object_release_if_empty(cache);
+	spin_unlock(pagecache_lock);
+}
+
+/**
+ * @brief Drop every cached page for a file, eg. when its inode is freed.
+ */
+void pagecache_invalidate(void * device, uint64_t inode) {
+	spin_lock(pagecache_lock);
+	struct page_cache * cache = object_find(device, inode, 0);
+	if (!cache) {
+		spin_unlock(pagecache_lock);
+		return;
+	}
+
+	cache->generation = ++pagecache_generation;
+	while (cache->pages.head) {
+		page_detach(cache->pages.head->value);
+	}
+
+	object_release_if_empty(cache);
+	spin_unlock(pagecache_lock);
+}
+
+/**
+ * @brief Map the cached page at @p offset into a private file mapping.
+ *
+ * @returns 0 if the page was mapped, non-zero if the caller should
+ *          fall back to allocating and reading a fresh page.
+ */
+int pagecache_map(fs_node_t * node, off_t offset, union PML * page, unsigned int flags) {
+	if (offset < 0) return 1;
+	ssize_t err = 0;
+	struct cached_page * cached = pagecache_get(node, offset / PAGE_SIZE, &err);
+	if (!cached) return 1;
+	int result = mmu_map_shared_frame(page, flags, cached->frame);
+	page_unpin(cached);
+	return result;
+}
+
+/**
+ * @brief Number of pages currently held by the cache.
+ */
+size_t pagecache_count(void) {
+	return pagecache_pages;
+}
+
+void pagecache_initialize(void) {
+	/* Let the cache use up to half of memory before it starts evicting on its own. */
+	pagecache_limit = mmu_total_memory() / 4 / 2;
+}
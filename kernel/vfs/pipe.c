@@ -21,6 +21,7 @@
 #include <stddef.h>
 #include <kernel/printf.h>
 #include <kernel/vfs.h>
+#include <kernel/slab.h>
 #include <kernel/pipe.h>
 #include <kernel/process.h>
 #include <kernel/string.h>
@@ -252,7 +253,7 @@ void pipe_destroy(fs_node_t * node) {
 }
 
 fs_node_t * make_pipe(size_t size) {
-	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	fs_node_t * fnode = kmem_cache_alloc(&fs_node_cache);
 	pipe_device_t * pipe = malloc(sizeof(pipe_device_t));
 	memset(fnode, 0, sizeof(fs_node_t));
 	memset(pipe, 0, sizeof(pipe_device_t));
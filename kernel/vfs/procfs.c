@@ -35,6 +35,9 @@
 #include <kernel/misc.h>
 #include <kernel/module.h>
 #include <kernel/ksym.h>
+#include <kernel/pagecache.h>
+#include <kernel/buddy.h>
+#include <kernel/slab.h>
 
 #define PROCFS_STANDARD_ENTRIES (sizeof(std_entries) / sizeof(struct procfs_entry))
 #define PROCFS_PROCDIR_ENTRIES  (sizeof(procdir_entries) / sizeof(struct procfs_entry))
@@ -332,7 +335,7 @@ static fs_node_t * finddir_procfs_procdir(fs_node_t * node, const char * name) {
 
 static fs_node_t * procfs_procdir_create(process_t * process) {
 	pid_t pid = process->id;
-	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	fs_node_t * fnode = kmem_cache_alloc(&fs_node_cache);
 	memset(fnode, 0x00, sizeof(fs_node_t));
 	fnode->inode = pid;
 	snprintf(fnode->name, 100, "%d", pid);
@@ -399,12 +402,14 @@ static void meminfo_func(fs_node_t *node) {
 	size_t total = mmu_total_memory();
 	size_t free  = total - mmu_used_memory();
 	size_t kheap = ((uintptr_t)sbrk(0) - 0xffffff0000000000UL) / 1024;
+	size_t cached = pagecache_count() * 4;
 
 	procfs_printf(node,
 		"MemTotal: %zu kB\n"
 		"MemFree: %zu kB\n"
 		"KHeapUse: %zu kB\n"
-		, total, free, kheap);
+		"Cached: %zu kB\n"
+		, total, free, kheap, cached);
 }
 
 #ifdef __x86_64__
@@ -615,6 +620,83 @@ static void idle_func(fs_node_t *node) {
 	}
 }
 
+static void sched_func(fs_node_t *node) {
+	for (int i = 0; i < processor_count; ++i) {
+		procfs_printf(node, "%d: queued %zu steals %lu migrations %lu\n",
+			i,
+			processor_local_data[i].ready_queue->length,
+			processor_local_data[i].sched_steals,
+			processor_local_data[i].sched_migrations
+		);
+	}
+}
+
+static void timer_func(fs_node_t *node) {
+	procfs_printf(node,
+		"Mode: %s\n"
+		"Resolution: %lu ns\n"
+		"Slice: %u us\n",
+		arch_timer_mode(),
+		arch_timer_resolution(),
+		SCHED_TIME_SLICE);
+	for (int i = 0; i < processor_count; ++i) {
+		procfs_printf(node, "%d: interrupts %lu wakeups %lu\n",
+			i,
+			processor_local_data[i].timer_interrupts,
+			processor_local_data[i].idle_wakeups
+		);
+	}
+}
+
+/**
+ * Free blocks per order, and how much of free memory is stuck in
+ * blocks too small to satisfy an allocation of that order.
+ */
+static void buddyinfo_func(fs_node_t *node) {
+	struct buddy_stats stats;
+	buddy_get_stats(&stats);
+
+	size_t cached = 0;
+	for (int i = 0; i < processor_count; ++i) {
+		cached += stats.cached[i];
+	}
+
+	size_t smaller = cached;
+	for (int order = 0; order < BUDDY_ORDERS; ++order) {
+		procfs_printf(node, "order %2d: free %zu unusable %zu%%\n",
+			order,
+			stats.free_blocks[order],
+			stats.free_frames ? smaller * 100 / stats.free_frames : 0
+		);
+		smaller += stats.free_blocks[order] << order;
+	}
+
+	for (int i = 0; i < processor_count; ++i) {
+		procfs_printf(node, "cpu %d: cached %zu\n", i, stats.cached[i]);
+	}
+}
+
+static void slabinfo_func(fs_node_t *node) {
+	procfs_printf(node, "%-16s %6s %8s %8s %6s %5s\n", "name", "size", "active", "cached", "slabs", "hit%");
+	for (kmem_cache_t * cache = kmem_cache_list(); cache; cache = cache->next) {
+		uint64_t allocs = 0, hits = 0, frees = 0;
+		size_t cached = 0;
+		for (int i = 0; i < processor_count; ++i) {
+			allocs += cache->magazines[i].allocs;
+			hits   += cache->magazines[i].hits;
+			frees  += cache->magazines[i].frees;
+			cached += cache->magazines[i].count;
+		}
+		procfs_printf(node, "%-16s %6zu %8zu %8zu %6zu %4zu%%\n",
+			cache->name,
+			cache->size,
+			(size_t)(allocs - frees),
+			cached,
+			cache->slabs,
+			allocs ? (size_t)(hits * 100 / allocs) : (size_t)0);
+	}
+}
+
 static void kallsyms_func(fs_node_t *fnode) {
 	/* This doesn't include module symbols at the moment... */
 	list_t * syms = ksym_list();
@@ -646,9 +728,13 @@ static struct procfs_entry std_entries[] = {
 	{-12,"kallsyms", kallsyms_func, 0},
 	{-13,"pci",      pci_func, 0},
 	{-14,"self",     self_func, FS_SYMLINK},
+	{-15,"sched",    sched_func, 0},
+	{-16,"buddyinfo", buddyinfo_func, 0},
+	{-17,"slabinfo", slabinfo_func, 0},
+	{-18,"timer",    timer_func, 0},
 #ifdef __x86_64__
-	{-15,"irq",      irq_func, 0},
-	{-16,"pat",      pat_func, 0},
+	{-19,"irq",      irq_func, 0},
+	{-20,"pat",      pat_func, 0},
 #endif
 };
 
@@ -772,7 +858,7 @@ static fs_node_t * finddir_procfs_root(fs_node_t * node, const char * name) {
 
 
 static fs_node_t * procfs_create(void) {
-	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	fs_node_t * fnode = kmem_cache_alloc(&fs_node_cache);
 	memset(fnode, 0x00, sizeof(fs_node_t));
 	fnode->inode = 0;
 	strcpy(fnode->name, "proc");
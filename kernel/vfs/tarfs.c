@@ -10,6 +10,7 @@
 #include <bits/errno.h>
 #include <kernel/types.h>
 #include <kernel/vfs.h>
+#include <kernel/slab.h>
 #include <kernel/printf.h>
 #include <kernel/tokenize.h>
 
@@ -350,6 +351,20 @@ static fs_node_t * finddir_tarfs(fs_node_t *node, const char *name) {
 	return NULL;
 }
 
+static fs_node_t * iget_tarfs(fs_node_t *node, const char *name, uint64_t inode) {
+	struct tarfs * self = node->device;
+
+	struct ustar * file = malloc(sizeof(struct ustar));
+	if (inode >= self->length || !ustar_from_offset(self, inode, file)) {
+		free(file);
+		return NULL;
+	}
+
+	fs_node_t * out = file_from_ustar(self, file, inode);
+	strcpy(out->name, name);
+	return out;
+}
+
 static ssize_t readlink_tarfs(fs_node_t * node, char * buf, size_t size) {
 	struct tarfs * self = node->device;
 	struct ustar * file = malloc(sizeof(struct ustar));
@@ -362,7 +377,7 @@ static ssize_t readlink_tarfs(fs_node_t * node, char * buf, size_t size) {
 }
 
 static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, unsigned int offset) {
-	fs_node_t * fs = malloc(sizeof(fs_node_t));
+	fs_node_t * fs = kmem_cache_alloc(&fs_node_cache);
 	memset(fs, 0, sizeof(fs_node_t));
 	fs->device = self;
 	fs->inode  = offset;
@@ -380,6 +395,7 @@ static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, uns
 		fs->flags = FS_DIRECTORY;
 		fs->readdir = readdir_tarfs;
 		fs->finddir = finddir_tarfs;
+		fs->iget    = iget_tarfs;
 		fs->create  = NULL;
 	} else if (file->type[0] == '1') {
 		//debug_print(ERROR, "Hardlink detected");
@@ -388,7 +404,7 @@ static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, uns
 		fs->flags = FS_SYMLINK;
 		fs->readlink = readlink_tarfs;
 	} else {
-		fs->flags = FS_FILE;
+		fs->flags = FS_FILE | FS_PAGECACHE;
 		fs->read = read_tarfs;
 	}
 	free(file);
@@ -483,6 +499,7 @@ static fs_node_t * tar_mount(const char * device, const char * mount_path) {
 	root->mask    = 0555;
 	root->readdir = readdir_tar_root;
 	root->finddir = finddir_tar_root;
+	root->iget    = iget_tarfs;
 	root->create  = NULL;
 	root->flags   = FS_DIRECTORY;
 	root->device  = self;
@@ -16,6 +16,7 @@
 #include <kernel/string.h>
 #include <kernel/printf.h>
 #include <kernel/vfs.h>
+#include <kernel/slab.h>
 #include <kernel/process.h>
 #include <kernel/tokenize.h>
 #include <kernel/tmpfs.h>
@@ -347,7 +348,7 @@ static ssize_t get_size_tmpfs(fs_node_t * node) {
 }
 
 static fs_node_t * tmpfs_from_file(struct tmpfs_file * t) {
-	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	fs_node_t * fnode = kmem_cache_alloc(&fs_node_cache);
 	spin_lock(t->lock);
 	memset(fnode, 0x00, sizeof(fs_node_t));
 	strcpy(fnode->name, t->name);
@@ -722,7 +723,7 @@ static ssize_t get_size_tmpfsdir(fs_node_t * node) {
 }
 
 static fs_node_t * tmpfs_from_dir(struct tmpfs_dir * d) {
-	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	fs_node_t * fnode = kmem_cache_alloc(&fs_node_cache);
 	spin_lock(d->lock);
 	memset(fnode, 0x00, sizeof(fs_node_t));
 	fnode->inode = 0;
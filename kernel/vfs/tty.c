@@ -99,6 +99,50 @@ ssize_t tty_output_process(pty_t * pty, uint8_t c) {
 	return 1;
 }
 
+/* Whether tty_output_process would do anything other than pass @p c through. */
+static inline int tty_output_translates(pty_t * pty, uint8_t c) {
+	if (!(pty->tios.c_oflag & OPOST)) return 0;
+	if (c == '\n') return !!(pty->tios.c_oflag & ONLCR);
+	if (c == '\r') return !!(pty->tios.c_oflag & ONLRET);
+	if (c >= 'a' && c <= 'z') return !!(pty->tios.c_oflag & OLCUC);
+	return 0;
+}
+
+/**
+ * @brief Output a buffer to a PTY whose output goes to its ring buffer.
+ *
+ * Runs of bytes that need no translation go into the ring buffer with
+ * a single write each, rather than one locked write per byte; only the
+ * bytes in between go through tty_output_process.
+ */
+static ssize_t tty_output_bulk(pty_t * pty, size_t size, uint8_t * buffer) {
+	size_t l = 0;
+	while (l < size) {
+		size_t span = 0;
+		while (l + span < size && !tty_output_translates(pty, buffer[l + span])) span++;
+
+		if (span) {
+			ssize_t o = ring_buffer_write(pty->out, span, buffer + l);
+			if (o < 0) return l ? (ssize_t)l : o;
+			l += o;
+			if ((size_t)o < span) return l;
+			continue;
+		}
+
+		ssize_t o;
+		if (buffer[l] == '\n') {
+			/* ONLCR: both bytes in one write */
+			uint8_t nl[] = {'\n','\r'};
+			o = ring_buffer_write(pty->out, 2, nl);
+		} else {
+			o = tty_output_process(pty, buffer[l]);
+		}
+		if (o < 0) return l ? (ssize_t)l : o;
+		l++;
+	}
+	return l;
+}
+
 #define output_process(pty, chr) do { ssize_t written = tty_output_process(pty, chr); if (written < 0) return written; } while (0)
 
 static int is_control(int c) {
@@ -485,6 +529,8 @@ ssize_t write_pty_slave(fs_node_t * node, off_t offset, size_t size, uint8_t *bu
 		}
 	}
 
+	if (pty->write_out == pty_write_out) return tty_output_bulk(pty, size, buffer);
+
 	size_t l = 0;
 	for (uint8_t * c = buffer; l < size; ++c, ++l) {
 		ssize_t o = tty_output_process(pty, *c);
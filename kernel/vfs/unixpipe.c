@@ -18,6 +18,7 @@
 #include <kernel/process.h>
 #include <kernel/signal.h>
 #include <kernel/args.h>
+#include <kernel/slab.h>
 
 #include <sys/signal_defs.h>
 #include <sys/ioctl.h>
@@ -56,6 +57,23 @@ static ssize_t write_unixpipe(fs_node_t * node, off_t offset, size_t size, uint8
 	return ring_buffer_write(self->buffer, size, buffer);
 }
 
+static ssize_t readv_unixpipe(fs_node_t * node, off_t offset, const struct iovec * iov, int iovcnt) {
+	struct unix_pipe * self = node->device;
+	if (self->write_closed && !ring_buffer_unread(self->buffer)) {
+		return 0;
+	}
+	return ring_buffer_readv(self->buffer, iov, iovcnt);
+}
+
+static ssize_t writev_unixpipe(fs_node_t * node, off_t offset, const struct iovec * iov, int iovcnt) {
+	struct unix_pipe * self = node->device;
+	if (self->read_closed) {
+		send_signal(this_core->current_process->id, SIGPIPE, 1);
+		return -EPIPE;
+	}
+	return ring_buffer_writev(self->buffer, iov, iovcnt);
+}
+
 static void close_read_pipe(fs_node_t * node) {
 	struct unix_pipe * self = node->device;
 
@@ -108,8 +126,8 @@ int make_unix_pipe(fs_node_t ** pipes) {
 		size = atoi(args_value("pipesize"));
 	}
 
-	pipes[0] = malloc(sizeof(fs_node_t));
-	pipes[1] = malloc(sizeof(fs_node_t));
+	pipes[0] = kmem_cache_alloc(&fs_node_cache);
+	pipes[1] = kmem_cache_alloc(&fs_node_cache);
 
 	memset(pipes[0], 0, sizeof(fs_node_t));
 	memset(pipes[1], 0, sizeof(fs_node_t));
@@ -126,6 +144,9 @@ int make_unix_pipe(fs_node_t ** pipes) {
 	pipes[0]->read = read_unixpipe;
 	pipes[1]->write = write_unixpipe;
 
+	pipes[0]->readv = readv_unixpipe;
+	pipes[1]->writev = writev_unixpipe;
+
 	pipes[0]->close = close_read_pipe;
 	pipes[1]->close = close_write_pipe;
 
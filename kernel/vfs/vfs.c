@@ -29,11 +29,15 @@
 #include <kernel/hashmap.h>
 #include <kernel/tree.h>
 #include <kernel/spinlock.h>
+#include <kernel/pagecache.h>
+#include <kernel/dcache.h>
+#include <kernel/slab.h>
 
 #define MAX_SYMLINK_DEPTH 8
 #define MAX_SYMLINK_SIZE 4096
 
 tree_t    * fs_tree = NULL; /* File system mountpoint tree */
+kmem_cache_t fs_node_cache = KMEM_CACHE("fs_node_t", sizeof(fs_node_t));
 fs_node_t * fs_root = NULL; /* Pointer to the root mount fs_node (must be some form of filesystem, even ramdisk) */
 
 hashmap_t * fs_types = NULL;
@@ -134,7 +138,7 @@ static int readdir_mapper(fs_node_t *node, unsigned long index, struct dirent *
 }
 
 static fs_node_t * vfs_mapper(void) {
-	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	fs_node_t * fnode = kmem_cache_alloc(&fs_node_cache);
 	memset(fnode, 0x00, sizeof(fs_node_t));
 	fnode->mask    = 0555;
 	fnode->flags   = FS_DIRECTORY;
@@ -183,6 +187,7 @@ int selectwait_fs(fs_node_t * node, void * process) {
 ssize_t read_fs(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	if (!node) return -ENOENT;
 	if (node->read) {
+		if (node->flags & FS_PAGECACHE) return pagecache_read(node, offset, size, buffer);
 		return node->read(node, offset, size, buffer);
 	} else {
 		if (node->flags & FS_DIRECTORY) return -EISDIR;
@@ -202,13 +207,76 @@ ssize_t read_fs(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 ssize_t write_fs(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	if (!node) return -ENOENT;
 	if (node->write) {
-		return node->write(node, offset, size, buffer);
+		ssize_t written = node->write(node, offset, size, buffer);
+		if ((node->flags & FS_PAGECACHE) && written > 0) pagecache_write(node, offset, written);
+		return written;
 	} else {
 		if (node->flags & FS_DIRECTORY) return -EISDIR;
 		return -EROFS;
 	}
 }
 
+/**
+ * @brief Read a file system node into several buffers at once.
+ *
+ * Nodes that can fill a whole iovec array in one go (pipes, sockets)
+ * provide a readv method. Everything else, including anything in the
+ * page cache, is read one segment at a time, stopping at the first
+ * short read the way a sequence of read() calls would.
+ *
+ * @param node    Node to read from
+ * @param offset  Offset into the node data to start reading from
+ * @param iov     Buffers to fill, in order
+ * @param iovcnt  Number of entries in @p iov
+ * @returns Total bytes read, or an error if nothing was
+ */
+ssize_t readv_fs(fs_node_t *node, off_t offset, const struct iovec *iov, int iovcnt) {
+	if (!node) return -ENOENT;
+	if (node->readv && !(node->flags & FS_PAGECACHE)) return node->readv(node, offset, iov, iovcnt);
+
+	ssize_t done = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		if (!iov[i].iov_len) continue;
+		ssize_t r = read_fs(node, offset + done, iov[i].iov_len, iov[i].iov_base);
+		if (r < 0) return done ? done : r;
+		done += r;
+		if ((size_t)r < iov[i].iov_len) break;
+	}
+	return done;
+}
+
+/**
+ * @brief Write several buffers to a file system node at once.
+ *
+ * Like @ref readv_fs, nodes with a writev method take the whole array
+ * in one call and the rest are written a segment at a time. Cached
+ * pages are invalidated either way.
+ *
+ * @param node    Node to write to
+ * @param offset  Offset into the node data to start writing at
+ * @param iov     Buffers to write, in order
+ * @param iovcnt  Number of entries in @p iov
+ * @returns Total bytes written, or an error if nothing was
+ */
+ssize_t writev_fs(fs_node_t *node, off_t offset, const struct iovec *iov, int iovcnt) {
+	if (!node) return -ENOENT;
+	if (node->writev) {
+		ssize_t written = node->writev(node, offset, iov, iovcnt);
+		if ((node->flags & FS_PAGECACHE) && written > 0) pagecache_write(node, offset, written);
+		return written;
+	}
+
+	ssize_t done = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		if (!iov[i].iov_len) continue;
+		ssize_t w = write_fs(node, offset + done, iov[i].iov_len, iov[i].iov_base);
+		if (w < 0) return done ? done : w;
+		done += w;
+		if ((size_t)w < iov[i].iov_len) break;
+	}
+	return done;
+}
+
 /**
  * @brief set the size of a file to 9
  *
@@ -218,7 +286,9 @@ int truncate_fs(fs_node_t * node, size_t size) {
 	if (!node) return -ENOENT;
 
 	if (node->truncate) {
-		return node->truncate(node, size);
+		int result = node->truncate(node, size);
+		if ((node->flags & FS_PAGECACHE) && !result) pagecache_truncate(node, size);
+		return result;
 	}
 
 	return -EINVAL;
@@ -331,7 +401,25 @@ int readdir_fs(fs_node_t *node, unsigned long index, struct dirent * out) {
  */
 fs_node_t *finddir_fs(fs_node_t *node, const char *name) {
 	if (!node || !(node->flags & FS_DIRECTORY) || !node->finddir) return NULL;
-	return node->finddir(node, name);
+	if (!node->iget) return node->finddir(node, name);
+
+	uint64_t inode, generation;
+	switch (dcache_lookup(node, name, &inode, &generation)) {
+		case DCACHE_NEGATIVE:
+			return NULL;
+		case DCACHE_POSITIVE: {
+			fs_node_t * out = node->iget(node, name, inode);
+			if (out) return out;
+			/* The inode went away behind our back; search for real. */
+			dcache_invalidate(node, name);
+			generation = (uint64_t)-1;
+			break;
+		}
+	}
+
+	fs_node_t * out = node->finddir(node, name);
+	dcache_insert(node, name, out, generation);
+	return out;
 }
 
 /**
@@ -400,6 +488,8 @@ int rename_file_fs(const char * src, const char * dest) {
 	if (*src_name == '/' || *dest_name == '/') { out = -EINVAL; goto _nope; }
 
 	out = src_parent->mount->rename(src_parent->mount, src_parent, src_name, dest_parent, dest_name);
+	dcache_invalidate(src_parent, src_name);
+	dcache_invalidate(dest_parent, dest_name);
 
 _nope:
 	close_fs(dest_parent);
@@ -420,6 +510,7 @@ int create_file_fs(const char *name, mode_t permission, fs_node_t **out) {
 	if (!*src || *src == '/') return close_fs(parent), -EINVAL;
 
 	int ret = parent->create(parent, src, permission, out);
+	dcache_invalidate(parent, src);
 	close_fs(parent);
 	return ret;
 }
@@ -435,7 +526,15 @@ int unlink_fs(const char * name) {
 	const char * src = fs_basename(name);
 	if (!*src || *src == '/') return close_fs(parent), -EINVAL;
 
+	/* If this removes a directory, nothing cached beneath it may outlive it. */
+	fs_node_t * victim = parent->iget ? finddir_fs(parent, src) : NULL;
+
 	int ret = parent->unlink(parent, src);
+	dcache_invalidate(parent, src);
+	if (victim) {
+		if (!ret && (victim->flags & FS_DIRECTORY)) dcache_invalidate_dir(victim->device, victim->inode);
+		close_fs(victim);
+	}
 	close_fs(parent);
 	return ret;
 }
@@ -451,6 +550,7 @@ int mkdir_fs(const char *name, mode_t permission, fs_node_t **out) {
 
 	/* ->mkdir checks perms on parent itself; no need to do that here. */
 	int ret = parent->mkdir(parent, src, permission, out);
+	dcache_invalidate(parent, src);
 	close_fs(parent);
 	return ret;
 }
@@ -465,6 +565,7 @@ int symlink_fs(const char * target, const char * name) {
 	if (!*src || *src == '/') return -EINVAL;
 
 	int ret = parent->symlink(parent, target, src);
+	dcache_invalidate(parent, src);
 	close_fs(parent);
 	return ret;
 }
@@ -600,6 +701,9 @@ void vfs_install(void) {
 	tree_set_root(fs_tree, root);
 
 	fs_types = hashmap_create(5);
+
+	pagecache_initialize();
+	dcache_initialize();
 }
 
 int vfs_register(const char * name, vfs_mount_callback callback) {
@@ -734,6 +838,9 @@ void * vfs_mount(const char * path, fs_node_t * local_root, const char * type, c
 
 	free(p);
 	spin_unlock(tmp_vfs_lock);
+
+	/* A new filesystem may reuse a device pointer cached entries still refer to */
+	dcache_purge();
 	return ret_val;
 }
 
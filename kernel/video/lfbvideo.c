@@ -111,9 +111,18 @@ static int ioctl_vid(fs_node_t * node, unsigned long request, void * argp) {
 				} else {
 					lfb_user_offset = *(uintptr_t*)argp;
 				}
+				unsigned int flags = MMU_FLAG_WRITABLE | (lfb_use_write_combining ? MMU_FLAG_WC : 0);
+				uintptr_t lfb_phys = (uintptr_t)(lfb_vid_memory) & 0xFFFFFFFF;
 				for (uintptr_t i = 0; i < lfb_memsize; i += 0x1000) {
+					/* Use large pages wherever the framebuffer lines up with them, but only
+					 * in the device window, where nothing treats the frames as ours to free. */
+					if (lfb_user_offset >= USER_DEVICE_MAP && lfb_user_offset + lfb_memsize <= USER_SHM_HIGH &&
+						i + MMU_LARGE_PAGE_SIZE <= lfb_memsize && mmu_map_large(lfb_user_offset + i, lfb_phys + i, flags)) {
+						i += MMU_LARGE_PAGE_SIZE - 0x1000;
+						continue;
+					}
 					union PML * page = mmu_get_page(lfb_user_offset + i, MMU_GET_MAKE);
-					mmu_frame_map_address(page,MMU_FLAG_WRITABLE | (lfb_use_write_combining ? MMU_FLAG_WC : 0),((uintptr_t)(lfb_vid_memory) & 0xFFFFFFFF) + i);
+					mmu_frame_map_address(page, flags, lfb_phys + i);
 				}
 				memcpy(argp, &lfb_user_offset, sizeof(uintptr_t));
 			}
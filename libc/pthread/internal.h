@@ -1,6 +1,7 @@
 #pragma once
 
 #include <sys/types.h>
+#include <bits/timespec.h>
 
 #define PTHREAD_STACK_SIZE 0x100000
 
@@ -10,9 +11,19 @@ struct __pthread {
 	void * arg;
 	int * err_addr;
 	int   thread_err_val;
+	void * malloc_cache;
 };
 
 void * __tls_get_addr(void*);
 void __make_tls(void);
 
+/* Sleep while *address == expected, optionally until an absolute
+ * CLOCK_REALTIME deadline; returns 0 or a positive errno value. */
+int __futex_wait_abs(volatile int * address, int expected, const struct timespec * abstime);
+int __futex_wake(volatile int * address, int count);
+void __spin_pause(void);
+
+extern int __libc_tls_ready;
+void __malloc_thread_exit(void);
+
 extern int __errno __asm__("errno");
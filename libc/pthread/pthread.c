@@ -17,14 +17,47 @@
 
 #include <sys/wait.h>
 #include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/futex.h>
 
 #include <libc/pthread/internal.h>
 
 DEFN_SYSCALL1(set_tls_base, SYS_SETTLSBASE, uintptr_t);
 
 extern int __libc_is_multicore;
-static inline void _yield(void) {
-	if (!__libc_is_multicore) syscall_yield();
+
+/* How many times a contended lock polls before going to sleep. */
+#define MUTEX_SPIN_COUNT 100
+
+_hidden void __spin_pause(void) {
+#if defined(__x86_64__)
+	asm volatile ("pause" ::: "memory");
+#elif defined(__aarch64__)
+	asm volatile ("yield" ::: "memory");
+#endif
+}
+
+_hidden int __futex_wait_abs(volatile int * address, int expected, const struct timespec * abstime) {
+	struct timespec timeout;
+	if (abstime) {
+		if (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000L) return EINVAL;
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		timeout.tv_sec  = abstime->tv_sec - now.tv_sec;
+		timeout.tv_nsec = abstime->tv_nsec - now.tv_usec * 1000L;
+		if (timeout.tv_nsec < 0) {
+			timeout.tv_sec--;
+			timeout.tv_nsec += 1000000000L;
+		}
+		if (timeout.tv_sec < 0) return ETIMEDOUT;
+	}
+	long result = syscall_futex(address, FUTEX_WAIT, expected, abstime ? &timeout : NULL);
+	return result < 0 ? -result : 0;
+}
+
+_hidden int __futex_wake(volatile int * address, int count) {
+	long result = syscall_futex(address, FUTEX_WAKE, count, NULL);
+	return result < 0 ? 0 : result;
 }
 
 void * __tls_get_addr(void* input) {
@@ -64,9 +97,11 @@ _hidden void __make_tls(void) {
 	char ** tlsSelf = (char **)(tlsSpace+4096);
 	*tlsSelf = (char*)tlsSelf;
 	syscall_set_tls_base((uintptr_t)tlsSelf);
+	__libc_tls_ready = 1;
 }
 
 void pthread_exit(void * value) {
+	__malloc_thread_exit();
 	syscall_exit(0);
 	__builtin_unreachable();
 }
@@ -104,22 +139,45 @@ void pthread_cleanup_pop(int execute) {
 	/* do nothing */
 }
 
+/*
+ * Mutexes are a single futex word:
+ *   0 - unlocked
+ *   1 - locked, nobody waiting
+ *   2 - locked, and there may be sleepers to wake on unlock
+ * Uncontended lock and unlock never enter the kernel.
+ */
 int pthread_mutex_lock(pthread_mutex_t *mutex) {
-	while (__sync_lock_test_and_set(mutex, 0x01)) {
-		_yield();
+	int c = __sync_val_compare_and_swap(mutex, 0, 1);
+	if (!c) return 0;
+
+	/* Another core may be about to release it; poll briefly first. */
+	if (__libc_is_multicore) {
+		for (int i = 0; i < MUTEX_SPIN_COUNT; ++i) {
+			__spin_pause();
+			if (*mutex == 0 && (c = __sync_val_compare_and_swap(mutex, 0, 1)) == 0) return 0;
+		}
+	}
+
+	if (c != 2) c = __sync_lock_test_and_set(mutex, 2);
+	while (c) {
+		__futex_wait_abs(mutex, 2, NULL);
+		c = __sync_lock_test_and_set(mutex, 2);
 	}
 	return 0;
 }
 
 int pthread_mutex_trylock(pthread_mutex_t *mutex) {
-	if (__sync_lock_test_and_set(mutex, 0x01)) {
+	if (__sync_val_compare_and_swap(mutex, 0, 1)) {
 		return EBUSY;
 	}
 	return 0;
 }
 
 int pthread_mutex_unlock(pthread_mutex_t *mutex) {
-	__sync_lock_release(mutex);
+	if (__sync_fetch_and_sub(mutex, 1) != 1) {
+		__sync_lock_release(mutex);
+		__futex_wake(mutex, 1);
+	}
 	return 0;
 }
 
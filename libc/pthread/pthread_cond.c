@@ -0,0 +1,48 @@
+/* This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ *
+ * Condition variables are a sequence counter: waiters sample it
+ * before releasing the mutex and sleep only while it is unchanged,
+ * so a signal between the unlock and the sleep is never lost.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <errno.h>
+
+#include <libc/pthread/internal.h>
+
+int pthread_cond_init(pthread_cond_t * cond, const pthread_condattr_t * attr) {
+	cond->seq = 0;
+	return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t * cond) {
+	return 0;
+}
+
+int pthread_cond_timedwait(pthread_cond_t * cond, pthread_mutex_t * mutex, const struct timespec * abstime) {
+	int seq = cond->seq;
+	pthread_mutex_unlock(mutex);
+	int result = __futex_wait_abs(&cond->seq, seq, abstime);
+	pthread_mutex_lock(mutex);
+	/* Spurious wakeups and signals are permitted; only timeouts are reported. */
+	return result == ETIMEDOUT || result == EINVAL ? result : 0;
+}
+
+int pthread_cond_wait(pthread_cond_t * cond, pthread_mutex_t * mutex) {
+	return pthread_cond_timedwait(cond, mutex, NULL);
+}
+
+int pthread_cond_signal(pthread_cond_t * cond) {
+	__sync_fetch_and_add(&cond->seq, 1);
+	__futex_wake(&cond->seq, 1);
+	return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t * cond) {
+	__sync_fetch_and_add(&cond->seq, 1);
+	__futex_wake(&cond->seq, INT32_MAX);
+	return 0;
+}
@@ -9,17 +9,30 @@
 
 #include <sys/wait.h>
 
-extern int __libc_is_multicore;
-static inline void _yield(void) {
-	if (!__libc_is_multicore) syscall_yield();
-}
+#include <libc/pthread/internal.h>
+
+/*
+ * atomic_lock is a futex mutex guarding readers; threads that can not
+ * take the lock sleep on seq, which every unlock bumps when there are
+ * waiters to wake.
+ */
+#define ACQUIRE_LOCK() pthread_mutex_lock(&lock->atomic_lock)
+#define RELEASE_LOCK() pthread_mutex_unlock(&lock->atomic_lock)
 
-#define ACQUIRE_LOCK() do { while (__sync_lock_test_and_set(&lock->atomic_lock, 0x01)) { _yield(); } } while (0)
-#define RELEASE_LOCK() do { __sync_lock_release(&lock->atomic_lock); } while (0)
+static void wait_for_change(pthread_rwlock_t * lock) {
+	int seq = lock->seq;
+	lock->waiters++;
+	RELEASE_LOCK();
+	__futex_wait_abs(&lock->seq, seq, NULL);
+	ACQUIRE_LOCK();
+	lock->waiters--;
+}
 
 int pthread_rwlock_init(pthread_rwlock_t * lock, void * args) {
 	lock->readers = 0;
 	lock->atomic_lock = 0;
+	lock->seq = 0;
+	lock->waiters = 0;
 	if (args != NULL) {
 		fprintf(stderr, "pthread: pthread_rwlock_init arg unsupported\n");
 		return 1;
@@ -29,27 +42,23 @@ int pthread_rwlock_init(pthread_rwlock_t * lock, void * args) {
 
 int pthread_rwlock_wrlock(pthread_rwlock_t * lock) {
 	ACQUIRE_LOCK();
-	while (1) {
-		if (lock->readers == 0) {
-			lock->readers = -1;
-			lock->writerPid = syscall_getpid();
-			RELEASE_LOCK();
-			return 0;
-		}
-		_yield();
+	while (lock->readers != 0) {
+		wait_for_change(lock);
 	}
+	lock->readers = -1;
+	lock->writerPid = syscall_getpid();
+	RELEASE_LOCK();
+	return 0;
 }
 
 int pthread_rwlock_rdlock(pthread_rwlock_t * lock) {
 	ACQUIRE_LOCK();
-	while (1) {
-		if (lock->readers >= 0) {
-			lock->readers++;
-			RELEASE_LOCK();
-			return 0;
-		}
-		_yield();
+	while (lock->readers < 0) {
+		wait_for_change(lock);
 	}
+	lock->readers++;
+	RELEASE_LOCK();
+	return 0;
 }
 
 int pthread_rwlock_unlock(pthread_rwlock_t * lock) {
@@ -57,7 +66,10 @@ int pthread_rwlock_unlock(pthread_rwlock_t * lock) {
 	if (lock->readers > 0) lock->readers--;
 	else if (lock->readers < 0) lock->readers = 0;
 	else fprintf(stderr, "pthread: bad lock state detected\n");
+	int wake = lock->readers == 0 && lock->waiters;
+	if (wake) __sync_fetch_and_add(&lock->seq, 1);
 	RELEASE_LOCK();
+	if (wake) __futex_wake(&lock->seq, INT32_MAX);
 	return 0;
 }
 
@@ -0,0 +1,78 @@
+/* This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ *
+ * Unnamed semaphores. The count is the futex word; waiters sleep
+ * while it is zero, and posts only enter the kernel when someone
+ * has announced themselves in the waiters count.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <semaphore.h>
+#include <errno.h>
+
+#include <libc/pthread/internal.h>
+
+int sem_init(sem_t * sem, int pshared, unsigned int value) {
+	if (value > SEM_VALUE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (pshared) {
+		/* Futexes are keyed per address space. */
+		errno = ENOSYS;
+		return -1;
+	}
+	sem->value = value;
+	sem->waiters = 0;
+	return 0;
+}
+
+int sem_destroy(sem_t * sem) {
+	return 0;
+}
+
+int sem_trywait(sem_t * sem) {
+	int value;
+	while ((value = sem->value) > 0) {
+		if (__sync_bool_compare_and_swap(&sem->value, value, value - 1)) return 0;
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+int sem_timedwait(sem_t * sem, const struct timespec * abstime) {
+	while (1) {
+		int value = sem->value;
+		if (value > 0) {
+			if (__sync_bool_compare_and_swap(&sem->value, value, value - 1)) return 0;
+			continue;
+		}
+		__sync_fetch_and_add(&sem->waiters, 1);
+		int result = __futex_wait_abs(&sem->value, 0, abstime);
+		__sync_fetch_and_sub(&sem->waiters, 1);
+		if (result == ETIMEDOUT || result == EINTR || result == EINVAL) {
+			errno = result;
+			return -1;
+		}
+	}
+}
+
+int sem_wait(sem_t * sem) {
+	return sem_timedwait(sem, NULL);
+}
+
+int sem_post(sem_t * sem) {
+	if (sem->value == SEM_VALUE_MAX) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+	__sync_fetch_and_add(&sem->value, 1);
+	if (sem->waiters) __futex_wake(&sem->value, 1);
+	return 0;
+}
+
+int sem_getvalue(sem_t * sem, int * value) {
+	*value = sem->value;
+	return 0;
+}
@@ -96,8 +96,22 @@
  * """""""""""""""""
  *
  * TODO: Try to be more consistent on comment widths...
- * FIXME: Make thread safe! Not necessary for competition, but would be nice.
- * FIXME: Splitting/coalescing is broken. Fix this ASAP!
+ *
+ * Big bins
+ * """"""""
+ *
+ * Allocations too large for a bin come from arenas mapped a megabyte at
+ * a time. Each free block in an arena carries a boundary tag in its last
+ * bytes, so freeing a block can merge it with free blocks on either side;
+ * an arena that becomes entirely free is unmapped, save one spare. Anything
+ * of 128KiB or more gets a mapping of its own and is unmapped when freed.
+ *
+ * Threads
+ * """""""
+ *
+ * One lock guards the bins. Each thread keeps a small stack of free cells
+ * per bin in front of it, so most small allocations and frees never take
+ * the lock; the stacks refill from and flush to the bins in batches.
  *
 **/
 
@@ -110,7 +124,9 @@
 #include <stdlib.h>
 #include <malloc.h>
 #include <sys/mman.h>
+#include <pthread.h>
 #include <libc/internal.h>
+#include <libc/pthread/internal.h>
 /* }}} */
 /* Definitions {{{ */
 
@@ -134,6 +150,15 @@
 #define SKIP_MAX_LEVEL 6							/* We have a maximum of 6 levels in our skip lists. */
 
 #define BIN_MAGIC 0xDEFAD00D
+#define TAG_MAGIC 0xB16B10C5
+
+#define MMAP_THRESHOLD 0x20000						/* Big bins spanning this much get their own mapping. */
+#define ARENA_SIZE 0x100000							/* Size of a mapping big bins are carved from. */
+#define BIG_LISTS 32								/* Free lists by page count; the last holds everything larger. */
+
+#define BIG_MAPPED 0x01								/* Has its own mapping */
+#define BIG_FIRST  0x02								/* First bin in its arena */
+#define BIG_LAST   0x04								/* Last bin in its arena */
 
 /* }}} */
 
@@ -142,7 +167,6 @@
  */
 static void * __attribute__ ((malloc)) klmalloc(uintptr_t size);
 static void * __attribute__ ((malloc)) klrealloc(void * ptr, uintptr_t size);
-static void * __attribute__ ((malloc)) klcalloc(uintptr_t nmemb, uintptr_t size);
 static void * __attribute__ ((malloc)) klvalloc(uintptr_t size);
 static void klfree(void * ptr);
 
@@ -168,40 +192,6 @@ _hidden void __libc_release_malloc_lock(void) {
 	spin_unlock(&mem_lock);
 }
 
-void * __attribute__ ((malloc)) malloc(uintptr_t size) {
-	spin_lock(&mem_lock, __FUNCTION__);
-	void * ret = klmalloc(size);
-	spin_unlock(&mem_lock);
-	return ret;
-}
-
-void * __attribute__ ((malloc)) realloc(void * ptr, uintptr_t size) {
-	spin_lock(&mem_lock, __FUNCTION__);
-	void * ret = klrealloc(ptr, size);
-	spin_unlock(&mem_lock);
-	return ret;
-}
-
-void * __attribute__ ((malloc)) calloc(uintptr_t nmemb, uintptr_t size) {
-	spin_lock(&mem_lock, __FUNCTION__);
-	void * ret = klcalloc(nmemb, size);
-	spin_unlock(&mem_lock);
-	return ret;
-}
-
-void * __attribute__ ((malloc)) valloc(uintptr_t size) {
-	spin_lock(&mem_lock, __FUNCTION__);
-	void * ret = klvalloc(size);
-	spin_unlock(&mem_lock);
-	return ret;
-}
-
-void free(void * ptr) {
-	spin_lock(&mem_lock, __FUNCTION__);
-	klfree(ptr);
-	spin_unlock(&mem_lock);
-}
-
 
 /* Bin management {{{ */
 
@@ -247,15 +237,26 @@ typedef struct _klmalloc_bin_header {
 
 /*
  * A big bin header is basically the same as a regular bin header
- * only with a pointer to the previous (physically) instead of
- * a "next" and with a list of forward headers.
+ * only with a pointer back along its free list and flags noting
+ * where it sits in its arena.
  */
 typedef struct _klmalloc_big_bin_header {
 	struct _klmalloc_big_bin_header * next;
 	void * head;
 	uintptr_t size;
 	uint32_t bin_magic;
-} klmalloc_big_bin_header;
+	uint32_t flags;
+	struct _klmalloc_big_bin_header * prev;
+} __attribute__ ((aligned(16))) klmalloc_big_bin_header;		/* Keep the data after it aligned */
+
+/*
+ * Boundary tag, written in the last bytes of a free big bin
+ * so the bin physically after it can find its header.
+ */
+typedef struct _klmalloc_big_bin_tag {
+	uintptr_t magic;						/* TAG_MAGIC ^ header */
+	klmalloc_big_bin_header * header;
+} klmalloc_big_bin_tag;
 
 
 /*
@@ -269,6 +270,9 @@ typedef struct _klmalloc_bin_header_head {
  * Array of available bins.
  */
 static klmalloc_bin_header_head klmalloc_bin_head[NUM_BINS - 1];	/* Small bins */
+static klmalloc_big_bin_header * klmalloc_big_head[BIG_LISTS];	/* Free big bins, by pages spanned */
+static uint32_t klmalloc_big_avail = 0;							/* Which of those lists are non-empty */
+static klmalloc_big_bin_header * klmalloc_spare_arena = NULL;	/* An empty arena kept for reuse */
 
 /* }}} Bin management */
 /* Doubly-Linked List {{{ */
@@ -370,6 +374,141 @@ static inline int __attribute__ ((always_inline)) klmalloc_stack_empty(klmalloc_
 }
 
 /* }}} Stack */
+/* Big bins {{{ */
+
+/*
+ * Total span of a big bin, including its header.
+ */
+static inline uintptr_t __attribute__ ((always_inline, pure)) klmalloc_big_span(klmalloc_big_bin_header * header) {
+	return header->size + sizeof(klmalloc_big_bin_header);
+}
+
+/*
+ * Which free list a bin of this span belongs on.
+ */
+static inline unsigned int __attribute__ ((always_inline, pure)) klmalloc_big_list(uintptr_t span) {
+	uintptr_t pages = span / PAGE_SIZE;
+	return pages < BIG_LISTS ? pages - 1 : BIG_LISTS - 1;
+}
+
+static inline int __attribute__ ((always_inline)) klmalloc_big_is_free(klmalloc_big_bin_header * header) {
+	return header->head == (void *)((uintptr_t)header + sizeof(klmalloc_big_bin_header));
+}
+
+static void klmalloc_big_insert(klmalloc_big_bin_header * header) {
+	unsigned int list = klmalloc_big_list(klmalloc_big_span(header));
+	header->prev = NULL;
+	header->next = klmalloc_big_head[list];
+	if (header->next) header->next->prev = header;
+	klmalloc_big_head[list] = header;
+	klmalloc_big_avail |= (1U << list);
+}
+
+static void klmalloc_big_remove(klmalloc_big_bin_header * header) {
+	unsigned int list = klmalloc_big_list(klmalloc_big_span(header));
+	if (header->prev) header->prev->next = header->next;
+	else klmalloc_big_head[list] = header->next;
+	if (header->next) header->next->prev = header->prev;
+	if (!klmalloc_big_head[list]) klmalloc_big_avail &= ~(1U << list);
+	header->next = NULL;
+	header->prev = NULL;
+	if (header == klmalloc_spare_arena) klmalloc_spare_arena = NULL;
+}
+
+/*
+ * Find the smallest free bin spanning at least @p span bytes.
+ */
+static klmalloc_big_bin_header * klmalloc_big_find(uintptr_t span) {
+	unsigned int list = klmalloc_big_list(span);
+	uint32_t avail = klmalloc_big_avail & ~((1U << list) - 1);
+	while (avail) {
+		list = __builtin_ctz(avail);
+		for (klmalloc_big_bin_header * header = klmalloc_big_head[list]; header; header = header->next) {
+			if (klmalloc_big_span(header) >= span) return header;
+		}
+		avail &= ~(1U << list);
+	}
+	return NULL;
+}
+
+/*
+ * Neighbors within the same arena, if they are free.
+ */
+static klmalloc_big_bin_header * klmalloc_big_prev_free(klmalloc_big_bin_header * header) {
+	if (header->flags & BIG_FIRST) return NULL;
+	klmalloc_big_bin_tag * tag = (klmalloc_big_bin_tag *)header - 1;
+	if (tag->magic != (TAG_MAGIC ^ (uintptr_t)tag->header)) return NULL;
+	klmalloc_big_bin_header * prev = tag->header;
+	if (!klmalloc_big_is_free(prev) || (uintptr_t)prev + klmalloc_big_span(prev) != (uintptr_t)header) return NULL;
+	return prev;
+}
+
+static klmalloc_big_bin_header * klmalloc_big_next_free(klmalloc_big_bin_header * header) {
+	if (header->flags & BIG_LAST) return NULL;
+	klmalloc_big_bin_header * next = (klmalloc_big_bin_header *)((uintptr_t)header + klmalloc_big_span(header));
+	return klmalloc_big_is_free(next) ? next : NULL;
+}
+
+/*
+ * Return a big bin to its arena, merging it with any free
+ * neighbors and unmapping the arena if it is now empty.
+ */
+static void klmalloc_big_free(klmalloc_big_bin_header * header) {
+	klmalloc_big_bin_header * prev = klmalloc_big_prev_free(header);
+	klmalloc_big_bin_header * next = klmalloc_big_next_free(header);
+
+	if (next) {
+		klmalloc_big_remove(next);
+		header->size += klmalloc_big_span(next);
+		header->flags |= next->flags & BIG_LAST;
+		next->bin_magic = 0;
+	}
+
+	if (prev) {
+		klmalloc_big_remove(prev);
+		prev->size += klmalloc_big_span(header);
+		prev->flags |= header->flags & BIG_LAST;
+		header->bin_magic = 0;
+		header = prev;
+	} else {
+		klmalloc_stack_push((klmalloc_bin_header *)header, (void *)((uintptr_t)header + sizeof(klmalloc_big_bin_header)));
+	}
+
+	if ((header->flags & (BIG_FIRST | BIG_LAST)) == (BIG_FIRST | BIG_LAST)) {
+		if (klmalloc_spare_arena) {
+			munmap(header, klmalloc_big_span(header));
+			return;
+		}
+		klmalloc_spare_arena = header;
+	}
+
+	klmalloc_big_bin_tag * tag = (klmalloc_big_bin_tag *)((uintptr_t)header + klmalloc_big_span(header)) - 1;
+	tag->magic = TAG_MAGIC ^ (uintptr_t)header;
+	tag->header = header;
+	klmalloc_big_insert(header);
+}
+
+/*
+ * Shrink an in-use big bin to what @p size needs,
+ * returning whole pages past that to the arena.
+ */
+static void klmalloc_big_trim(klmalloc_big_bin_header * header, uintptr_t size) {
+	uintptr_t span = klmalloc_big_span(header);
+	uintptr_t need = (size + sizeof(klmalloc_big_bin_header) + PAGE_MASK) & ~(uintptr_t)PAGE_MASK;
+	assert(span >= need);
+	if (span - need < PAGE_SIZE) return;
+
+	klmalloc_big_bin_header * rest = (klmalloc_big_bin_header *)((uintptr_t)header + need);
+	rest->bin_magic = BIN_MAGIC;
+	rest->size = span - need - sizeof(klmalloc_big_bin_header);
+	rest->flags = header->flags & BIG_LAST;
+	rest->head = NULL;
+	header->size = need - sizeof(klmalloc_big_bin_header);
+	header->flags &= ~BIG_LAST;
+	klmalloc_big_free(rest);
+}
+
+/* }}} Big bins */
 
 /* malloc() {{{ */
 static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
@@ -441,14 +580,39 @@ static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
 		/*
 		 * Round requested size to a set of pages, plus the header size.
 		 */
-		uintptr_t pages = (size + sizeof(klmalloc_big_bin_header)) / PAGE_SIZE + 1;
-		klmalloc_big_bin_header * bin_header = (klmalloc_big_bin_header*)mmap(NULL, PAGE_SIZE * pages, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
-		bin_header->bin_magic = BIN_MAGIC;
+		uintptr_t span = (size + sizeof(klmalloc_big_bin_header) + PAGE_MASK) & ~(uintptr_t)PAGE_MASK;
+		klmalloc_big_bin_header * bin_header;
+		if (span >= MMAP_THRESHOLD) {
+			/*
+			 * Large enough to be worth its own mapping, which
+			 * goes straight back to the kernel when freed.
+			 */
+			bin_header = (klmalloc_big_bin_header*)mmap(NULL, span, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+			if (bin_header == MAP_FAILED) return NULL;
+			bin_header->bin_magic = BIN_MAGIC;
+			bin_header->flags = BIG_MAPPED;
+			bin_header->size = span - sizeof(klmalloc_big_bin_header);
+		} else {
+			bin_header = klmalloc_big_find(span);
+			if (!bin_header) {
+				/*
+				 * Map a new arena as one free bin.
+				 */
+				bin_header = (klmalloc_big_bin_header*)mmap(NULL, ARENA_SIZE, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+				if (bin_header == MAP_FAILED) return NULL;
+				bin_header->bin_magic = BIN_MAGIC;
+				bin_header->flags = BIG_FIRST | BIG_LAST;
+				bin_header->size = ARENA_SIZE - sizeof(klmalloc_big_bin_header);
+			} else {
+				klmalloc_big_remove(bin_header);
+			}
+			/*
+			 * Mark it in use, then give back what we don't need.
+			 */
+			bin_header->head = NULL;
+			klmalloc_big_trim(bin_header, size);
+		}
 		assert((uintptr_t)bin_header % PAGE_SIZE == 0);
-		/*
-		 * Give the header the remaining space.
-		 */
-		bin_header->size = pages * PAGE_SIZE - sizeof(klmalloc_big_bin_header);
 		assert((bin_header->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
 		/*
 		 * Return the head of the block.
@@ -502,7 +666,11 @@ static void klfree(void *ptr) {
 		assert(bheader->head == NULL);
 		assert((bheader->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
 
-		munmap(header, bheader->size + sizeof(klmalloc_big_bin_header));
+		if (bheader->flags & BIG_MAPPED) {
+			munmap(header, bheader->size + sizeof(klmalloc_big_bin_header));
+		} else {
+			klmalloc_big_free(bheader);
+		}
 	} else {
 		/*
 		 * If the stack is empty, we are freeing
@@ -548,7 +716,7 @@ static void * __attribute__ ((malloc)) klrealloc(void *ptr, uintptr_t size) {
 	 */
 	if (__builtin_expect(size == 0, 0))
 	{
-		free(ptr);
+		klfree(ptr);
 		return NULL;
 	}
 
@@ -574,6 +742,29 @@ static void * __attribute__ ((malloc)) klrealloc(void *ptr, uintptr_t size) {
 
 	if (old_size == size) return ptr;
 
+	/*
+	 * Big bins in an arena can shrink in place, or grow
+	 * in place into a free neighbor.
+	 */
+	if (header_old->size > (uintptr_t)NUM_BINS && (uintptr_t)ptr % PAGE_SIZE) {
+		klmalloc_big_bin_header * header_big = (klmalloc_big_bin_header *)header_old;
+		if (!(header_big->flags & BIG_MAPPED) && size + sizeof(klmalloc_big_bin_header) < MMAP_THRESHOLD) {
+			if (size < old_size) {
+				klmalloc_big_trim(header_big, size);
+				return ptr;
+			}
+			klmalloc_big_bin_header * next = klmalloc_big_next_free(header_big);
+			if (next && old_size + klmalloc_big_span(next) >= size) {
+				klmalloc_big_remove(next);
+				header_big->size += klmalloc_big_span(next);
+				header_big->flags |= next->flags & BIG_LAST;
+				next->bin_magic = 0;
+				klmalloc_big_trim(header_big, size);
+				return ptr;
+			}
+		}
+	}
+
 	/*
 	 * Reallocate more memory.
 	 */
@@ -599,22 +790,6 @@ static void * __attribute__ ((malloc)) klrealloc(void *ptr, uintptr_t size) {
 	return NULL;
 }
 /* }}} */
-/* calloc() {{{ */
-static void * __attribute__ ((malloc)) klcalloc(uintptr_t nmemb, uintptr_t size) {
-	/*
-	 * Allocate memory and zero it before returning
-	 * a pointer to the newly allocated memory.
-	 * 
-	 * Implemented by way of a simple malloc followed
-	 * by a memset to 0x00 across the length of the
-	 * requested memory chunk.
-	 */
-
-	void *ptr = klmalloc(nmemb * size);
-	if (ptr) memset(ptr,0x00,nmemb * size);
-	return ptr;
-}
-/* }}} */
 
 size_t malloc_usable_size(void *ptr) {
 	if (__builtin_expect(ptr == NULL, 0)) return 0;
@@ -625,3 +800,145 @@ size_t malloc_usable_size(void *ptr) {
 	if (bucket_id > (uintptr_t)NUM_BINS) return header->size;
 	return (1UL << (SMALLEST_BIN_LOG + header->size));
 }
+
+/* Thread caches {{{ */
+
+/*
+ * Each thread keeps a small stack of free objects per bin,
+ * hung off its pthread block, so most small allocations and
+ * frees never touch the lock. Stacks refill from and flush
+ * to the shared bins half a stack at a time.
+ */
+#define TCACHE_SIZE  32
+#define TCACHE_BATCH (TCACHE_SIZE / 2)
+
+struct __malloc_tcache {
+	unsigned int count[BIG_BIN];
+	void * objects[BIG_BIN][TCACHE_SIZE];
+};
+
+/*
+ * Set once the main thread's TLS block exists; until then
+ * (or in a static binary that never sets one up) every
+ * request goes straight to the bins.
+ */
+_hidden int __libc_tls_ready = 0;
+
+static struct __malloc_tcache * __malloc_tcache(void) {
+	if (!__libc_tls_ready) return NULL;
+	struct __pthread * self = pthread_self();
+	if (__builtin_expect(!self->malloc_cache, 0)) {
+		spin_lock(&mem_lock, __FUNCTION__);
+		self->malloc_cache = klmalloc(sizeof(struct __malloc_tcache));
+		spin_unlock(&mem_lock);
+		if (self->malloc_cache) memset(self->malloc_cache, 0, sizeof(struct __malloc_tcache));
+	}
+	return self->malloc_cache;
+}
+
+/*
+ * Which small bin a pointer came from, or BIG_BIN if it
+ * isn't a small bin cell. Small bin pages are never
+ * unmapped, so their headers can be read without the lock.
+ */
+static inline uintptr_t klmalloc_small_bin_of(void * ptr) {
+	if ((uintptr_t)ptr % PAGE_SIZE == 0) return BIG_BIN;
+	klmalloc_bin_header * header = (klmalloc_bin_header *)((uintptr_t)ptr & (uintptr_t)~PAGE_MASK);
+	if (header->bin_magic != BIN_MAGIC || header->size >= BIG_BIN) return BIG_BIN;
+	return header->size;
+}
+
+static void __malloc_tcache_flush(struct __malloc_tcache * cache, uintptr_t bin, unsigned int count) {
+	spin_lock(&mem_lock, __FUNCTION__);
+	for (unsigned int i = 0; i < count; ++i) {
+		klfree(cache->objects[bin][i]);
+	}
+	spin_unlock(&mem_lock);
+	memmove(cache->objects[bin], cache->objects[bin] + count, (cache->count[bin] - count) * sizeof(void*));
+	cache->count[bin] -= count;
+}
+
+/*
+ * Called by an exiting thread to give its cached objects back.
+ */
+_hidden void __malloc_thread_exit(void) {
+	if (!__libc_tls_ready) return;
+	struct __pthread * self = pthread_self();
+	struct __malloc_tcache * cache = self->malloc_cache;
+	if (!cache) return;
+	for (uintptr_t bin = 0; bin < BIG_BIN; ++bin) {
+		if (cache->count[bin]) __malloc_tcache_flush(cache, bin, cache->count[bin]);
+	}
+	self->malloc_cache = NULL;
+	spin_lock(&mem_lock, __FUNCTION__);
+	klfree(cache);
+	spin_unlock(&mem_lock);
+}
+
+void * __attribute__ ((malloc)) malloc(uintptr_t size) {
+	if (size && size <= (1UL << (SMALLEST_BIN_LOG + BIG_BIN - 1))) {
+		struct __malloc_tcache * cache = __malloc_tcache();
+		if (cache) {
+			uintptr_t bin = klmalloc_bin_size(size);
+			if (!cache->count[bin]) {
+				spin_lock(&mem_lock, __FUNCTION__);
+				while (cache->count[bin] < TCACHE_BATCH) {
+					void * cell = klmalloc(1UL << (SMALLEST_BIN_LOG + bin));
+					if (!cell) break;
+					cache->objects[bin][cache->count[bin]++] = cell;
+				}
+				spin_unlock(&mem_lock);
+				if (!cache->count[bin]) return NULL;
+			}
+			return cache->objects[bin][--cache->count[bin]];
+		}
+	}
+	spin_lock(&mem_lock, __FUNCTION__);
+	void * ret = klmalloc(size);
+	spin_unlock(&mem_lock);
+	return ret;
+}
+
+void free(void * ptr) {
+	if (__builtin_expect(ptr == NULL, 0)) return;
+	uintptr_t bin = klmalloc_small_bin_of(ptr);
+	if (bin < BIG_BIN) {
+		struct __malloc_tcache * cache = __malloc_tcache();
+		if (cache) {
+			if (cache->count[bin] == TCACHE_SIZE) {
+				__malloc_tcache_flush(cache, bin, TCACHE_BATCH);
+			}
+			cache->objects[bin][cache->count[bin]++] = ptr;
+			return;
+		}
+	}
+	spin_lock(&mem_lock, __FUNCTION__);
+	klfree(ptr);
+	spin_unlock(&mem_lock);
+}
+
+void * __attribute__ ((malloc)) realloc(void * ptr, uintptr_t size) {
+	spin_lock(&mem_lock, __FUNCTION__);
+	void * ret = klrealloc(ptr, size);
+	spin_unlock(&mem_lock);
+	return ret;
+}
+
+void * __attribute__ ((malloc)) calloc(uintptr_t nmemb, uintptr_t size) {
+	/*
+	 * Allocate memory and zero it before returning
+	 * a pointer to the newly allocated memory.
+	 */
+	void * ret = malloc(nmemb * size);
+	if (ret) memset(ret, 0x00, nmemb * size);
+	return ret;
+}
+
+void * __attribute__ ((malloc)) valloc(uintptr_t size) {
+	spin_lock(&mem_lock, __FUNCTION__);
+	void * ret = klvalloc(size);
+	spin_unlock(&mem_lock);
+	return ret;
+}
+
+/* }}} */
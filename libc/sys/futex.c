@@ -0,0 +1,10 @@
+#include <sys/futex.h>
+#include <libc/syscall.h>
+#include <sys/syscall.h>
+#include <errno.h>
+
+DEFN_SYSCALL4(futex, SYS_FUTEX, volatile int *, int, int, const struct timespec *);
+
+int futex(volatile int * address, int op, int value, const struct timespec * timeout) {
+	__sets_errno(syscall_futex(address, op, value, timeout));
+}
@@ -0,0 +1,15 @@
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <libc/syscall.h>
+#include <sys/syscall.h>
+#include <errno.h>
+
+DEFN_SYSCALL6(splice, SYS_SPLICE, int, off_t *, int, off_t *, size_t, unsigned int);
+
+ssize_t splice(int fd_in, off_t * off_in, int fd_out, off_t * off_out, size_t len, unsigned int flags) {
+	__sets_errno(syscall_splice(fd_in, off_in, fd_out, off_out, len, flags));
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t * offset, size_t count) {
+	__sets_errno(syscall_splice(in_fd, offset, out_fd, NULL, count, 0));
+}
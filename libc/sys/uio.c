@@ -0,0 +1,25 @@
+#include <sys/uio.h>
+#include <libc/syscall.h>
+#include <sys/syscall.h>
+#include <errno.h>
+
+DEFN_SYSCALL3(readv, SYS_READV, int, const struct iovec *, int);
+DEFN_SYSCALL3(writev, SYS_WRITEV, int, const struct iovec *, int);
+DEFN_SYSCALL4(preadv, SYS_PREADV, int, const struct iovec *, int, off_t);
+DEFN_SYSCALL4(pwritev, SYS_PWRITEV, int, const struct iovec *, int, off_t);
+
+ssize_t readv(int fd, const struct iovec * iov, int iovcnt) {
+	__sets_errno(syscall_readv(fd, iov, iovcnt));
+}
+
+ssize_t writev(int fd, const struct iovec * iov, int iovcnt) {
+	__sets_errno(syscall_writev(fd, iov, iovcnt));
+}
+
+ssize_t preadv(int fd, const struct iovec * iov, int iovcnt, off_t offset) {
+	__sets_errno(syscall_preadv(fd, iov, iovcnt, offset));
+}
+
+ssize_t pwritev(int fd, const struct iovec * iov, int iovcnt, off_t offset) {
+	__sets_errno(syscall_pwritev(fd, iov, iovcnt, offset));
+}
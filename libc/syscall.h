@@ -8,11 +8,14 @@
 #include <sys/times.h>
 #include <sys/signal.h>
 #include <sys/resource.h>
+#include <bits/timespec.h>
 
 #include <libc/internal.h>
 
 _Begin_C_Header
 
+struct iovec;
+
 #define DECL_SYSCALL0(fn)                   _hidden long syscall_##fn(void)
 #define DECL_SYSCALL1(fn,p1)                _hidden long syscall_##fn(p1)
 #define DECL_SYSCALL2(fn,p1,p2)             _hidden long syscall_##fn(p1,p2)
@@ -301,6 +304,12 @@ DECL_SYSCALL4(pread, int, void *, size_t, off_t);
 DECL_SYSCALL4(pwrite, int, const void *, size_t, off_t);
 DECL_SYSCALL6(mmap, void*, size_t, int, int, int, off_t);
 DECL_SYSCALL1(getsid, pid_t);
+DECL_SYSCALL4(futex, volatile int *, int, int, const struct timespec *);
+DECL_SYSCALL6(splice, int, off_t *, int, off_t *, size_t, unsigned int);
+DECL_SYSCALL3(readv, int, const struct iovec *, int);
+DECL_SYSCALL3(writev, int, const struct iovec *, int);
+DECL_SYSCALL4(preadv, int, const struct iovec *, int, off_t);
+DECL_SYSCALL4(pwritev, int, const struct iovec *, int, off_t);
 
 _End_C_Header
 
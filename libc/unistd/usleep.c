@@ -6,7 +6,7 @@
 DEFN_SYSCALL2(sleep,  SYS_SLEEP, unsigned long, unsigned long);
 
 static int usleep_wrap(useconds_t usec) {
-	__sets_errno(syscall_sleep((usec / 10000) / 1000, (usec / 10000) % 1000));
+	__sets_errno(syscall_sleep(usec / 1000000, usec % 1000000));
 }
 
 int usleep(useconds_t usec) {
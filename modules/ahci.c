@@ -3,19 +3,41 @@
  * @file modules/ahci.c
  * @package x86_64
  *
- * @warning This is a stub driver.
+ * Drives SATA disks behind an AHCI host controller. Each port gets a
+ * command list with one command table per slot. A request is split into
+ * commands of up to AHCI_MAX_TRANSFER bytes whose PRDTs point straight
+ * at the caller's buffer, and all of them are issued before any is waited
+ * on. Disks with native command queueing get READ/WRITE FPDMA QUEUED with
+ * up to 32 commands outstanding; other disks get the DMA EXT commands,
+ * which the controller still runs back to back from the command list.
+ * Completions are delivered by interrupt.
+ *
+ * Disks are mounted through the block cache as /dev/sda, /dev/sdb, ...
+ * and look the same as ATA disks to ext2 and dospart. ATAPI devices
+ * are detected but not yet supported.
  *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
  * Copyright (C) 2021 K. Lange
  */
+#include <bits/errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
 #include <kernel/syscall.h>
 #include <kernel/module.h>
 #include <kernel/printf.h>
+#include <kernel/process.h>
 #include <kernel/pci.h>
 #include <kernel/vfs.h>
 #include <kernel/mmu.h>
+#include <kernel/list.h>
+#include <kernel/spinlock.h>
+#include <kernel/bcache.h>
+
+#include <kernel/arch/x86_64/irq.h>
+
+#include <sys/ioctl.h>
 
 static uint32_t mmio_read4(uintptr_t mmiobase, intptr_t offset) {
 	volatile uint32_t * data = (volatile uint32_t *)(mmiobase + offset);
@@ -36,6 +58,35 @@ static char * ahci_device_name(uint32_t pcidev, int port) {
 	return buf;
 }
 
+/* HBA registers */
+#define AHCI_CAP  0x00
+#define AHCI_GHC  0x04
+#define AHCI_IS   0x08
+#define AHCI_PI   0x0C
+#define AHCI_VS   0x10
+
+#define AHCI_CAP_S64A    (1UL << 31)
+#define AHCI_CAP_SNCQ    (1UL << 30)
+#define AHCI_CAP_NCS(c)  ((((c) >> 8) & 0x1F) + 1)
+
+#define AHCI_GHC_AE      (1UL << 31)
+#define AHCI_GHC_IE      (1UL << 1)
+
+/* Port registers, relative to the port's base */
+#define AHCI_PXCLB   0x00
+#define AHCI_PXCLBU  0x04
+#define AHCI_PXFB    0x08
+#define AHCI_PXFBU   0x0C
+#define AHCI_PXIS    0x10
+#define AHCI_PXIE    0x14
+#define AHCI_PXCMD_REG 0x18
+#define AHCI_PXTFD   0x20
+#define AHCI_PXSIG   0x24
+#define AHCI_PXSSTS  0x28
+#define AHCI_PXSERR  0x30
+#define AHCI_PXSACT  0x34
+#define AHCI_PXCI    0x38
+
 #define AHCI_PXCMD_ST    (1 << 0UL)
 #define AHCI_PXCMD_SUD   (1 << 1UL)
 #define AHCI_PXCMD_POD   (1 << 2UL)
@@ -45,6 +96,143 @@ static char * ahci_device_name(uint32_t pcidev, int port) {
 #define AHCI_PXCMD_FR    (1 << 14UL)
 #define AHCI_PXCMD_CR    (1 << 15UL)
 
+#define AHCI_PXIS_DHRS   (1UL << 0)
+#define AHCI_PXIS_PSS    (1UL << 1)
+#define AHCI_PXIS_DSS    (1UL << 2)
+#define AHCI_PXIS_SDBS   (1UL << 3)
+#define AHCI_PXIS_DPS    (1UL << 5)
+#define AHCI_PXIS_IFS    (1UL << 27)
+#define AHCI_PXIS_HBDS   (1UL << 28)
+#define AHCI_PXIS_HBFS   (1UL << 29)
+#define AHCI_PXIS_TFES   (1UL << 30)
+
+#define AHCI_PXIS_ERRORS (AHCI_PXIS_IFS | AHCI_PXIS_HBDS | AHCI_PXIS_HBFS | AHCI_PXIS_TFES)
+#define AHCI_PXIE_DEFAULT (AHCI_PXIS_DHRS | AHCI_PXIS_PSS | AHCI_PXIS_DSS | AHCI_PXIS_SDBS | AHCI_PXIS_DPS | AHCI_PXIS_ERRORS)
+
+#define AHCI_SSTS_DET(s) ((s) & 0xF)
+#define AHCI_DET_PRESENT 3
+
+#define ATA_SR_BSY 0x80
+#define ATA_SR_DRQ 0x08
+#define ATA_SR_ERR 0x01
+
+#define ATA_CMD_READ_DMA_EXT      0x25
+#define ATA_CMD_WRITE_DMA_EXT     0x35
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+#define ATA_CMD_CACHE_FLUSH_EXT   0xEA
+#define ATA_CMD_IDENTIFY          0xEC
+
+/* IDENTIFY DEVICE words we care about */
+#define ATA_IDENT_MODEL        27
+#define ATA_IDENT_MAX_LBA      60
+#define ATA_IDENT_QUEUE_DEPTH  75
+#define ATA_IDENT_SATA_CAPS    76
+#define ATA_IDENT_COMMANDSETS  83
+#define ATA_IDENT_MAX_LBA_EXT  100
+
+#define ATA_SATA_CAP_NCQ       (1 << 8)
+#define ATA_COMMANDSET_LBA48   (1 << 10)
+
+#define FIS_TYPE_REG_H2D 0x27
+
+#define AHCI_SECTOR_SIZE  512
+#define AHCI_SLOTS        32
+
+/* PRDT entries per command table; keeps each table a multiple of 128 bytes */
+#define AHCI_PRDT_ENTRIES 64
+
+/* Largest single PRDT entry */
+#define AHCI_PRD_MAX      0x400000
+
+/* Largest command: one PRD per page even if the buffer starts mid-page */
+#define AHCI_MAX_TRANSFER ((AHCI_PRDT_ENTRIES - 1) * 0x1000)
+
+/* Register polls give up after this many reads */
+#define AHCI_SPIN_LIMIT   10000000
+
+#define AHCI_CMD_WRITE    (1 << 6)
+
+struct ahci_cmd_header {
+	uint16_t flags;          /* FIS length in dwords, W, ... */
+	uint16_t prdtl;          /* PRDT entries */
+	volatile uint32_t prdbc; /* bytes transferred, written by the HBA */
+	uint32_t ctba;
+	uint32_t ctbau;
+	uint32_t reserved[4];
+} __attribute__((packed));
+
+struct ahci_prd {
+	uint32_t dba;
+	uint32_t dbau;
+	uint32_t reserved;
+	uint32_t dbc;            /* byte count - 1; bit 31 asks for an interrupt */
+} __attribute__((packed));
+
+struct ahci_cmd_table {
+	uint8_t cfis[64];
+	uint8_t acmd[16];
+	uint8_t reserved[48];
+	struct ahci_prd prdt[AHCI_PRDT_ENTRIES];
+} __attribute__((packed));
+
+struct fis_reg_h2d {
+	uint8_t type;
+	uint8_t flags;           /* bit 7: command, not control */
+	uint8_t command;
+	uint8_t feature_low;
+	uint8_t lba0, lba1, lba2;
+	uint8_t device;
+	uint8_t lba3, lba4, lba5;
+	uint8_t feature_high;
+	uint8_t count_low;
+	uint8_t count_high;
+	uint8_t icc;
+	uint8_t control;
+	uint8_t reserved[4];
+} __attribute__((packed));
+
+struct ahci_hba;
+
+struct ahci_port {
+	struct ahci_hba * hba;
+	uintptr_t mmio;                 /* this port's registers */
+	int ncq;
+	uint32_t all;                   /* mask of the slots we use */
+	uint64_t sectors;
+
+	struct ahci_cmd_header * cmd_list;
+	struct ahci_cmd_table * cmd_tables;
+
+	spin_lock_t lock;
+	uint32_t free;                  /* slots no request owns */
+	uint32_t active;                /* slots issued and not yet complete */
+	uint32_t failed;                /* completed slots whose command failed */
+	int exclusive;                  /* a non-queued command needs the port to itself */
+	list_t * slot_wait;             /* requests waiting for a slot */
+	list_t * done_wait[AHCI_SLOTS]; /* the request waiting on each slot */
+
+	uint16_t identify[256];
+};
+
+struct ahci_hba {
+	uint32_t pcidev;
+	uintptr_t mmio;
+	int irq;
+	int s64a;
+	struct ahci_port * ports[32];
+	struct ahci_hba * next;
+};
+
+static struct ahci_hba * ahci_hbas = NULL;
+static char ahci_drive_char = 'a';
+
+static void * kvmalloc_p(size_t size, uintptr_t * outphys) {
+	uintptr_t index = mmu_allocate_n_frames(size / 0x1000) << 12;
+	*outphys = index;
+	return mmu_map_from_physical(index);
+}
+
 #define DPRINT(fmt,...) fprintf(stderr, "%s: " fmt, ahci_device_name(pcidev,port), ##__VA_ARGS__)
 static void ahci_setup_atapi(fs_node_t * stderr, uint32_t pcidev, uintptr_t mmio_addr, int port) {
 	intptr_t offset = 0x100 + port * 0x80;
@@ -66,6 +254,482 @@ static void ahci_setup_atapi(fs_node_t * stderr, uint32_t pcidev, uintptr_t mmio
 	}
 }
 
+static int ahci_port_wait_clear(struct ahci_port * port, intptr_t reg, uint32_t mask) {
+	for (int i = 0; i < AHCI_SPIN_LIMIT; ++i) {
+		if (!(mmio_read4(port->mmio, reg) & mask)) return 0;
+	}
+	return 1;
+}
+
+static void ahci_port_stop(struct ahci_port * port) {
+	mmio_write4(port->mmio, AHCI_PXCMD_REG, mmio_read4(port->mmio, AHCI_PXCMD_REG) & ~AHCI_PXCMD_ST);
+	ahci_port_wait_clear(port, AHCI_PXCMD_REG, AHCI_PXCMD_CR);
+	mmio_write4(port->mmio, AHCI_PXCMD_REG, mmio_read4(port->mmio, AHCI_PXCMD_REG) & ~AHCI_PXCMD_FRE);
+	ahci_port_wait_clear(port, AHCI_PXCMD_REG, AHCI_PXCMD_FR);
+}
+
+/**
+ * Commands can only be issued once the device is no longer busy; if it
+ * is stuck that way after an error, have the HBA override the status.
+ */
+static void ahci_port_clear_busy(struct ahci_port * port) {
+	if (mmio_read4(port->mmio, AHCI_PXTFD) & (ATA_SR_BSY | ATA_SR_DRQ)) {
+		mmio_write4(port->mmio, AHCI_PXCMD_REG, mmio_read4(port->mmio, AHCI_PXCMD_REG) | AHCI_PXCMD_CLO);
+		ahci_port_wait_clear(port, AHCI_PXCMD_REG, AHCI_PXCMD_CLO);
+	}
+}
+
+static void ahci_port_start(struct ahci_port * port) {
+	ahci_port_wait_clear(port, AHCI_PXCMD_REG, AHCI_PXCMD_CR);
+	mmio_write4(port->mmio, AHCI_PXCMD_REG, mmio_read4(port->mmio, AHCI_PXCMD_REG) | AHCI_PXCMD_FRE | AHCI_PXCMD_SUD | AHCI_PXCMD_POD);
+	ahci_port_clear_busy(port);
+	mmio_write4(port->mmio, AHCI_PXCMD_REG, mmio_read4(port->mmio, AHCI_PXCMD_REG) | AHCI_PXCMD_ST);
+}
+
+/**
+ * Bring a port back after a task file or bus error. Stopping the command
+ * list clears PxCI and PxSACT; every outstanding command is failed by the
+ * caller, since without reading the NCQ error log we can't tell which one
+ * went wrong.
+ */
+static void ahci_port_recover(struct ahci_port * port) {
+	mmio_write4(port->mmio, AHCI_PXCMD_REG, mmio_read4(port->mmio, AHCI_PXCMD_REG) & ~AHCI_PXCMD_ST);
+	ahci_port_wait_clear(port, AHCI_PXCMD_REG, AHCI_PXCMD_CR);
+	mmio_write4(port->mmio, AHCI_PXSERR, 0xFFFFFFFF);
+	mmio_write4(port->mmio, AHCI_PXIS, 0xFFFFFFFF);
+	ahci_port_clear_busy(port);
+	mmio_write4(port->mmio, AHCI_PXCMD_REG, mmio_read4(port->mmio, AHCI_PXCMD_REG) | AHCI_PXCMD_ST);
+}
+
+/**
+ * Fill in the command FIS for a slot. A non-negative @p tag makes this
+ * an NCQ command, which carries its sector count in the feature field
+ * and its tag in the count field.
+ */
+static void ahci_fis(struct ahci_cmd_table * table, uint8_t command, uint64_t lba, uint16_t count, int tag) {
+	struct fis_reg_h2d * fis = (struct fis_reg_h2d *)table->cfis;
+	memset(fis, 0, sizeof(struct fis_reg_h2d));
+	fis->type    = FIS_TYPE_REG_H2D;
+	fis->flags   = 0x80;
+	fis->command = command;
+	fis->device  = 0x40; /* LBA */
+	fis->lba0 = (lba >>  0) & 0xFF;
+	fis->lba1 = (lba >>  8) & 0xFF;
+	fis->lba2 = (lba >> 16) & 0xFF;
+	fis->lba3 = (lba >> 24) & 0xFF;
+	fis->lba4 = (lba >> 32) & 0xFF;
+	fis->lba5 = (lba >> 40) & 0xFF;
+	if (tag >= 0) {
+		fis->feature_low  = count & 0xFF;
+		fis->feature_high = count >> 8;
+		fis->count_low    = tag << 3;
+	} else {
+		fis->count_low    = count & 0xFF;
+		fis->count_high   = count >> 8;
+	}
+}
+
+/**
+ * Point a slot's PRDT at @p size bytes of @p buf, merging pages that
+ * turn out to be physically contiguous, and set up its command FIS.
+ */
+static int ahci_prepare(struct ahci_port * port, int slot, uint64_t lba, uint8_t * buf, size_t size, int write) {
+	struct ahci_cmd_table * table = &port->cmd_tables[slot];
+	int prds = 0;
+
+	for (size_t done = 0; done < size; ) {
+		uintptr_t virt = (uintptr_t)buf + done;
+		uintptr_t phys = mmu_map_to_physical(this_core->current_pml, virt);
+		if ((intptr_t)phys < 0) return -EFAULT;
+
+		size_t len = 0x1000 - (virt & 0xFFF);
+		if (len > size - done) len = size - done;
+		if (!port->hba->s64a && phys + len > 0x100000000UL) {
+			printf("ahci: buffer at %#zx is out of reach of a 32-bit controller\n", phys);
+			return -EIO;
+		}
+
+		if (prds) {
+			struct ahci_prd * last = &table->prdt[prds-1];
+			uintptr_t end = ((uintptr_t)last->dbau << 32 | last->dba) + (last->dbc & 0x3FFFFF) + 1;
+			if (end == phys && (last->dbc & 0x3FFFFF) + 1 + len <= AHCI_PRD_MAX) {
+				last->dbc += len;
+				done += len;
+				continue;
+			}
+		}
+
+		table->prdt[prds].dba  = phys & 0xFFFFFFFF;
+		table->prdt[prds].dbau = phys >> 32;
+		table->prdt[prds].reserved = 0;
+		table->prdt[prds].dbc  = len - 1;
+		prds++;
+		done += len;
+	}
+
+	uint16_t count = size / AHCI_SECTOR_SIZE;
+	if (port->ncq) {
+		ahci_fis(table, write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED, lba, count, slot);
+	} else {
+		ahci_fis(table, write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT, lba, count, -1);
+	}
+
+	struct ahci_cmd_header * header = &port->cmd_list[slot];
+	header->flags = (sizeof(struct fis_reg_h2d) / 4) | (write ? AHCI_CMD_WRITE : 0);
+	header->prdtl = prds;
+	header->prdbc = 0;
+	return 0;
+}
+
+/* Called with the port lock held. */
+static int ahci_claim_slot(struct ahci_port * port) {
+	if (port->exclusive || !port->free) return -1;
+	int slot = __builtin_ctz(port->free);
+	port->free &= ~(1U << slot);
+	return slot;
+}
+
+static void ahci_release_slot(struct ahci_port * port, int slot) {
+	port->free |= (1U << slot);
+	wakeup_queue(port->slot_wait);
+}
+
+static void ahci_issue(struct ahci_port * port, int slot, int queued) {
+	port->active |= (1U << slot);
+	if (queued) mmio_write4(port->mmio, AHCI_PXSACT, 1U << slot);
+	mmio_write4(port->mmio, AHCI_PXCI, 1U << slot);
+}
+
+/**
+ * Wait for an issued slot to complete and give it back. Called, and
+ * returns, with the port lock held. The buffer is still the target of
+ * the transfer until it completes, so signals don't cut this short.
+ */
+static int ahci_wait(struct ahci_port * port, int slot) {
+	uint32_t bit = 1U << slot;
+	while (port->active & bit) {
+		sleep_on_unlocking(port->done_wait[slot], &port->lock);
+		spin_lock(port->lock);
+	}
+	int failed = !!(port->failed & bit);
+	port->failed &= ~bit;
+	ahci_release_slot(port, slot);
+	return failed ? -EIO : 0;
+}
+
+/**
+ * Transfer whole sectors. Every command for the request is issued as
+ * soon as a slot is free, so a large request keeps the disk's queue
+ * full; if we run out of slots we wait on our own oldest command rather
+ * than on other requests, so a request can never starve itself.
+ */
+static ssize_t ahci_rw(struct ahci_port * port, uint64_t lba, size_t size, uint8_t * buf, int write) {
+	int mine[AHCI_SLOTS];
+	int first = 0, count = 0;
+	int error = 0;
+	size_t done = 0;
+
+	spin_lock(port->lock);
+	while (done < size && !error) {
+		int slot = ahci_claim_slot(port);
+		if (slot < 0) {
+			if (count) {
+				error = ahci_wait(port, mine[first]);
+				first = (first + 1) % AHCI_SLOTS;
+				count--;
+			} else {
+				sleep_on_unlocking(port->slot_wait, &port->lock);
+				spin_lock(port->lock);
+			}
+			continue;
+		}
+
+		size_t chunk = size - done > AHCI_MAX_TRANSFER ? AHCI_MAX_TRANSFER : size - done;
+		error = ahci_prepare(port, slot, lba + done / AHCI_SECTOR_SIZE, buf + done, chunk, write);
+		if (error) {
+			ahci_release_slot(port, slot);
+			break;
+		}
+
+		ahci_issue(port, slot, port->ncq);
+		mine[(first + count) % AHCI_SLOTS] = slot;
+		count++;
+		done += chunk;
+	}
+
+	while (count) {
+		int result = ahci_wait(port, mine[first]);
+		if (result && !error) error = result;
+		first = (first + 1) % AHCI_SLOTS;
+		count--;
+	}
+	spin_unlock(port->lock);
+
+	return error ? error : (ssize_t)size;
+}
+
+/**
+ * FLUSH CACHE EXT is not a queued command, so it can't be mixed with
+ * NCQ commands; hold off new requests and let the queue drain first.
+ */
+static int ahci_flush(struct ahci_port * port) {
+	spin_lock(port->lock);
+	while (port->exclusive || port->free != port->all) {
+		sleep_on_unlocking(port->slot_wait, &port->lock);
+		spin_lock(port->lock);
+	}
+	port->exclusive = 1;
+	port->free &= ~1U;
+
+	ahci_fis(&port->cmd_tables[0], ATA_CMD_CACHE_FLUSH_EXT, 0, 0, -1);
+	port->cmd_list[0].flags = sizeof(struct fis_reg_h2d) / 4;
+	port->cmd_list[0].prdtl = 0;
+	port->cmd_list[0].prdbc = 0;
+	ahci_issue(port, 0, 0);
+
+	int result = ahci_wait(port, 0);
+	port->exclusive = 0;
+	wakeup_queue(port->slot_wait);
+	spin_unlock(port->lock);
+	return result;
+}
+
+static void ahci_port_irq(struct ahci_port * port) {
+	spin_lock(port->lock);
+	uint32_t status = mmio_read4(port->mmio, AHCI_PXIS);
+	mmio_write4(port->mmio, AHCI_PXIS, status);
+
+	uint32_t done;
+	if (status & AHCI_PXIS_ERRORS) {
+		printf("ahci: port error, status %#x, task file %#x\n", status, mmio_read4(port->mmio, AHCI_PXTFD));
+		done = port->active;
+		port->failed |= done;
+		ahci_port_recover(port);
+	} else {
+		uint32_t busy = mmio_read4(port->mmio, AHCI_PXSACT) | mmio_read4(port->mmio, AHCI_PXCI);
+		done = port->active & ~busy;
+	}
+
+	port->active &= ~done;
+	while (done) {
+		int slot = __builtin_ctz(done);
+		done &= ~(1U << slot);
+		wakeup_queue(port->done_wait[slot]);
+	}
+	spin_unlock(port->lock);
+}
+
+static int ahci_irq_handler(struct regs * r) {
+	int irq = r->int_no - 32;
+	int handled = 0;
+
+	for (struct ahci_hba * hba = ahci_hbas; hba; hba = hba->next) {
+		if (hba->irq != irq) continue;
+		uint32_t pending = mmio_read4(hba->mmio, AHCI_IS);
+		if (!pending) continue;
+		for (int i = 0; i < 32; ++i) {
+			if ((pending & (1UL << i)) && hba->ports[i]) ahci_port_irq(hba->ports[i]);
+		}
+		mmio_write4(hba->mmio, AHCI_IS, pending);
+		if (!handled) {
+			handled = 1;
+			irq_ack(irq);
+		}
+	}
+
+	return handled;
+}
+
+static ssize_t read_ahci(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+	struct ahci_port * port = node->device;
+	off_t max = port->sectors * AHCI_SECTOR_SIZE;
+
+	if (offset < 0 || offset >= max) return 0;
+	if (offset + (off_t)size > max) size = max - offset;
+	if (!size) return 0;
+
+	if (offset % AHCI_SECTOR_SIZE || size % AHCI_SECTOR_SIZE || ((uintptr_t)buffer & 1)) {
+		/* Not whole sectors; read the ones that cover it and copy out. */
+		off_t start = offset - offset % AHCI_SECTOR_SIZE;
+		size_t span = (offset + size - start + AHCI_SECTOR_SIZE - 1) / AHCI_SECTOR_SIZE * AHCI_SECTOR_SIZE;
+		uint8_t * tmp = malloc(span);
+		ssize_t result = ahci_rw(port, start / AHCI_SECTOR_SIZE, span, tmp, 0);
+		if (result >= 0) {
+			memcpy(buffer, tmp + (offset - start), size);
+			result = size;
+		}
+		free(tmp);
+		return result;
+	}
+
+	return ahci_rw(port, offset / AHCI_SECTOR_SIZE, size, buffer, 0);
+}
+
+static ssize_t write_ahci(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+	struct ahci_port * port = node->device;
+	off_t max = port->sectors * AHCI_SECTOR_SIZE;
+
+	if (offset < 0 || offset >= max) return 0;
+	if (offset + (off_t)size > max) size = max - offset;
+	if (!size) return 0;
+
+	if (offset % AHCI_SECTOR_SIZE || size % AHCI_SECTOR_SIZE || ((uintptr_t)buffer & 1)) {
+		/* Read-modify-write the sectors that cover it. */
+		off_t start = offset - offset % AHCI_SECTOR_SIZE;
+		size_t span = (offset + size - start + AHCI_SECTOR_SIZE - 1) / AHCI_SECTOR_SIZE * AHCI_SECTOR_SIZE;
+		uint8_t * tmp = malloc(span);
+		ssize_t result = ahci_rw(port, start / AHCI_SECTOR_SIZE, span, tmp, 0);
+		if (result >= 0) {
+			memcpy(tmp + (offset - start), buffer, size);
+			result = ahci_rw(port, start / AHCI_SECTOR_SIZE, span, tmp, 1);
+			if (result >= 0) result = size;
+		}
+		free(tmp);
+		return result;
+	}
+
+	return ahci_rw(port, offset / AHCI_SECTOR_SIZE, size, buffer, 1);
+}
+
+static int ioctl_ahci(fs_node_t * node, unsigned long request, void * argp) {
+	switch (request) {
+		case IOCTLSYNC:
+			return ahci_flush(node->device);
+	}
+	return -EINVAL;
+}
+
+static fs_node_t * ahci_device_create(struct ahci_port * port) {
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0x00, sizeof(fs_node_t));
+	fnode->inode = 0;
+	snprintf(fnode->name, 10, "ahcidev%d", ahci_drive_char - 'a');
+	fnode->device  = port;
+	fnode->uid = 0;
+	fnode->gid = 0;
+	fnode->mask    = 0660;
+	fnode->length  = port->sectors * AHCI_SECTOR_SIZE;
+	fnode->flags   = FS_BLOCKDEVICE;
+	fnode->read    = read_ahci;
+	fnode->write   = write_ahci;
+	fnode->ioctl   = ioctl_ahci;
+	return fnode;
+}
+
+/**
+ * IDENTIFY DEVICE, polled, before the port's interrupts are enabled.
+ */
+static int ahci_identify(struct ahci_port * port) {
+	uintptr_t phys;
+	uint8_t * data = kvmalloc_p(0x1000, &phys);
+
+	struct ahci_cmd_table * table = &port->cmd_tables[0];
+	table->prdt[0].dba  = phys & 0xFFFFFFFF;
+	table->prdt[0].dbau = phys >> 32;
+	table->prdt[0].dbc  = sizeof(port->identify) - 1;
+	ahci_fis(table, ATA_CMD_IDENTIFY, 0, 0, -1);
+	port->cmd_list[0].flags = sizeof(struct fis_reg_h2d) / 4;
+	port->cmd_list[0].prdtl = 1;
+	port->cmd_list[0].prdbc = 0;
+
+	mmio_write4(port->mmio, AHCI_PXCI, 1);
+	int timeout = ahci_port_wait_clear(port, AHCI_PXCI, 1);
+	int error = timeout || (mmio_read4(port->mmio, AHCI_PXTFD) & ATA_SR_ERR);
+	mmio_write4(port->mmio, AHCI_PXIS, 0xFFFFFFFF);
+
+	memcpy(port->identify, data, sizeof(port->identify));
+	mmu_frame_release(phys);
+	return error;
+}
+
+static struct ahci_port * ahci_setup_disk(fs_node_t * stderr, struct ahci_hba * hba, int port) {
+	uint32_t pcidev = hba->pcidev;
+	uint32_t cap = mmio_read4(hba->mmio, AHCI_CAP);
+
+	struct ahci_port * p = calloc(1, sizeof(struct ahci_port));
+	p->hba  = hba;
+	p->mmio = hba->mmio + 0x100 + port * 0x80;
+
+	if (AHCI_SSTS_DET(mmio_read4(p->mmio, AHCI_PXSSTS)) != AHCI_DET_PRESENT) {
+		DPRINT("no device present\n");
+		free(p);
+		return NULL;
+	}
+
+	ahci_port_stop(p);
+
+	/* The command list (1KiB) and received FIS area (256 bytes) share a page. */
+	uintptr_t list_phys;
+	uint8_t * list = kvmalloc_p(0x1000, &list_phys);
+	memset(list, 0, 0x1000);
+	p->cmd_list = (struct ahci_cmd_header *)list;
+	mmio_write4(p->mmio, AHCI_PXCLB,  list_phys & 0xFFFFFFFF);
+	mmio_write4(p->mmio, AHCI_PXCLBU, list_phys >> 32);
+	mmio_write4(p->mmio, AHCI_PXFB,   (list_phys + 0x400) & 0xFFFFFFFF);
+	mmio_write4(p->mmio, AHCI_PXFBU,  (list_phys + 0x400) >> 32);
+
+	size_t tables_size = (sizeof(struct ahci_cmd_table) * AHCI_SLOTS + 0xFFF) & ~0xFFFUL;
+	uintptr_t tables_phys;
+	p->cmd_tables = kvmalloc_p(tables_size, &tables_phys);
+	memset(p->cmd_tables, 0, tables_size);
+	for (int i = 0; i < AHCI_SLOTS; ++i) {
+		uintptr_t table = tables_phys + i * sizeof(struct ahci_cmd_table);
+		p->cmd_list[i].ctba  = table & 0xFFFFFFFF;
+		p->cmd_list[i].ctbau = table >> 32;
+	}
+
+	mmio_write4(p->mmio, AHCI_PXSERR, 0xFFFFFFFF);
+	mmio_write4(p->mmio, AHCI_PXIS, 0xFFFFFFFF);
+	mmio_write4(p->mmio, AHCI_PXIE, 0);
+	ahci_port_start(p);
+
+	if (ahci_identify(p)) {
+		DPRINT("IDENTIFY failed\n");
+		ahci_port_stop(p);
+		return NULL;
+	}
+
+	if (p->identify[ATA_IDENT_COMMANDSETS] & ATA_COMMANDSET_LBA48) {
+		p->sectors = (uint64_t)p->identify[ATA_IDENT_MAX_LBA_EXT] |
+			((uint64_t)p->identify[ATA_IDENT_MAX_LBA_EXT+1] << 16) |
+			((uint64_t)p->identify[ATA_IDENT_MAX_LBA_EXT+2] << 32) |
+			((uint64_t)p->identify[ATA_IDENT_MAX_LBA_EXT+3] << 48);
+	} else {
+		p->sectors = (uint64_t)p->identify[ATA_IDENT_MAX_LBA] |
+			((uint64_t)p->identify[ATA_IDENT_MAX_LBA+1] << 16);
+	}
+
+	int slots = AHCI_CAP_NCS(cap);
+	if ((cap & AHCI_CAP_SNCQ) && (p->identify[ATA_IDENT_SATA_CAPS] & ATA_SATA_CAP_NCQ)) {
+		int depth = (p->identify[ATA_IDENT_QUEUE_DEPTH] & 0x1F) + 1;
+		if (depth < slots) slots = depth;
+		p->ncq = 1;
+	}
+	p->all  = slots == 32 ? 0xFFFFFFFF : ((1U << slots) - 1);
+	p->free = p->all;
+
+	char model[41];
+	for (int i = 0; i < 20; ++i) {
+		model[i*2]   = p->identify[ATA_IDENT_MODEL+i] >> 8;
+		model[i*2+1] = p->identify[ATA_IDENT_MODEL+i] & 0xFF;
+	}
+	model[40] = '\0';
+	for (int i = 39; i >= 0 && model[i] == ' '; --i) model[i] = '\0';
+
+	DPRINT("%s, %zu sectors, %s, %d slots\n", model, (size_t)p->sectors,
+		p->ncq ? "NCQ" : "no NCQ", slots);
+
+	spin_init(p->lock);
+	p->slot_wait = list_create("ahci slot waiters", p);
+	for (int i = 0; i < AHCI_SLOTS; ++i) {
+		p->done_wait[i] = list_create("ahci completion", p);
+	}
+
+	mmio_write4(p->mmio, AHCI_PXIS, 0xFFFFFFFF);
+	mmio_write4(p->mmio, AHCI_PXIE, AHCI_PXIE_DEFAULT);
+	return p;
+}
+
 static void find_ahci(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
 	if (pci_find_type(device) != 0x0106) return; /* Mass Storage, SATA controller */
 	if (pci_read_field(device, PCI_PROG_IF, 1) != 0x01) return; /* AHCI */
@@ -73,17 +737,18 @@ static void find_ahci(uint32_t device, uint16_t vendorid, uint16_t deviceid, voi
 
 	fprintf(stderr, "ahci: located device at %#x\n", device);
 
+	/* Memory space and bus mastering on, legacy interrupts not masked */
 	uint16_t command_reg = pci_read_field(device, PCI_COMMAND, 2);
 	command_reg |= (1 << 2);
 	command_reg |= (1 << 1);
-	command_reg ^= (1 << 10);
+	command_reg &= ~(1 << 10);
 	pci_write_field(device, PCI_COMMAND, 2, command_reg);
 
 	fprintf(stderr, "ahci: examining PCI config space...\n");
 	fprintf(stderr, "ahci: interrupt line = %d\n", pci_get_interrupt(device));
 	fprintf(stderr, "ahci: BAR5 = %#x\n", pci_read_field(device, PCI_BAR5, 4));
 
-	uintptr_t mmio_addr = (uintptr_t)mmu_map_mmio_region(pci_read_field(device, PCI_BAR5, 4) & 0xFFFFFFF0, 0x2000); /* I have no idea how much space this needs */
+	uintptr_t mmio_addr = (uintptr_t)mmu_map_mmio_region(pci_read_field(device, PCI_BAR5, 4) & 0xFFFFFFF0, 0x2000); /* 0x100 + 32 ports * 0x80 */
 	fprintf(stderr, "ahci: mapping mmio to %#zx\n", mmio_addr);
 
 	uint32_t enabledPorts = mmio_read4(mmio_addr, 0x0C);
@@ -98,6 +763,12 @@ static void find_ahci(uint32_t device, uint16_t vendorid, uint16_t deviceid, voi
 	fprintf(stderr, "ahci: Telling host controller we are aware of it.\n");
 	mmio_write4(mmio_addr, 0x04, mmio_read4(mmio_addr, 0x04) | (1 << 31UL));
 
+	struct ahci_hba * hba = calloc(1, sizeof(struct ahci_hba));
+	hba->pcidev = device;
+	hba->mmio   = mmio_addr;
+	hba->irq    = pci_get_interrupt(device);
+	hba->s64a   = !!(mmio_read4(mmio_addr, AHCI_CAP) & AHCI_CAP_S64A);
+
 	int offset = 0x100;
 	for (int port = 0; port < 32; ++port) {
 		if (enabledPorts & (1UL << port)) {
@@ -114,6 +785,7 @@ static void find_ahci(uint32_t device, uint16_t vendorid, uint16_t deviceid, voi
 					break;
 				case 0x00000101:
 					fprintf(stderr, "ahci:           hard disk\n");
+					hba->ports[port] = ahci_setup_disk(stderr, hba, port);
 					break;
 				case 0xffff0101:
 					fprintf(stderr, "ahci:           no device\n");
@@ -127,8 +799,28 @@ static void find_ahci(uint32_t device, uint16_t vendorid, uint16_t deviceid, voi
 		offset += 0x80;
 	}
 
+	int irq_installed = 0;
+	for (struct ahci_hba * other = ahci_hbas; other; other = other->next) {
+		if (other->irq == hba->irq) irq_installed = 1;
+	}
+	hba->next = ahci_hbas;
+	ahci_hbas = hba;
+	if (!irq_installed) irq_install_handler(hba->irq, ahci_irq_handler, "ahci");
+
+	mmio_write4(mmio_addr, AHCI_IS, 0xFFFFFFFF);
+	mmio_write4(mmio_addr, AHCI_GHC, mmio_read4(mmio_addr, AHCI_GHC) | AHCI_GHC_IE);
 
-	
+	/* Interrupts are live, so the disks can be handed to the VFS now. */
+	for (int port = 0; port < 32; ++port) {
+		if (!hba->ports[port]) continue;
+		char devname[20];
+		snprintf(devname, 20, "/dev/sd%c", ahci_drive_char);
+		fs_node_t * node = bcache_create(ahci_device_create(hba->ports[port]));
+		char options[21];
+		snprintf(options, 20, "%c", ahci_drive_char);
+		vfs_mount(devname, node, "ahci-hd", options);
+		ahci_drive_char++;
+	}
 }
 
 static int init(int argc, char * argv[]) {
@@ -146,4 +838,3 @@ struct Module metadata = {
 	.init = init,
 	.fini = fini,
 };
-
@@ -27,6 +27,7 @@
 #include <kernel/time.h>
 #include <kernel/misc.h>
 #include <kernel/mutex.h>
+#include <kernel/bcache.h>
 
 #include <kernel/arch/x86_64/ports.h>
 #include <kernel/arch/x86_64/irq.h>
@@ -170,7 +171,7 @@ static void find_ata_pci(uint32_t device, uint16_t vendorid, uint16_t deviceid,
 }
 
 typedef struct {
-	uintptr_t offset;
+	uint32_t offset;
 	uint16_t bytes;
 	uint16_t last;
 } prdt_t;
@@ -202,30 +203,16 @@ static spin_lock_t atapi_cmd_lock = { 0 };
 #define ATA_CACHE_SIZE  4096
 #define SECTORS_PER_CACHE_BLOCK 8
 
-static void ata_device_read_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf);
-static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba, uint8_t * buf);
-static void ata_device_write_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf);
-static void ata_device_write_sector_actual(struct ata_device * dev, uint64_t lba);
-
-struct CacheEntry {
-	struct ata_device * dev;
-	uint64_t lba;
-	uint64_t last_use;
-	uint64_t flags;
-};
+/* Largest transfer, in cache blocks, done with a single DMA command */
+#define ATA_DMA_BLOCKS 16
 
-#define CACHE_COUNT 4096
+static void ata_device_read_sectors(struct ata_device * dev, uint64_t lba, unsigned int count, uint8_t * buf);
+static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba, uint8_t * buf);
+static void ata_device_write_sectors(struct ata_device * dev, uint64_t lba, unsigned int count, uint8_t * buf);
+static void ata_device_write_sector_actual(struct ata_device * dev, uint64_t lba, unsigned int count);
 
-static uint64_t hit_count = 0;
-static uint64_t miss_count = 0;
-static uint64_t eviction_count = 0;
-static uint64_t write_count = 0;
 static sched_mutex_t * ata_mutex = NULL;
 
-static struct CacheEntry * cache_entries = NULL;
-static char * cache_blocks = NULL;
-static uint64_t counter = 1;
-
 static off_t ata_max_offset(struct ata_device * dev) {
 	uint64_t sectors = dev->identity.sectors_48;
 	
@@ -265,7 +252,7 @@ static ssize_t read_ata(fs_node_t *node, off_t offset, size_t size, uint8_t *buf
 		unsigned int prefix_size = (ATA_CACHE_SIZE - (offset % ATA_CACHE_SIZE));
 		if (prefix_size > size) prefix_size = size;
 		char * tmp = malloc(ATA_CACHE_SIZE);
-		ata_device_read_sector(dev, start_block, (uint8_t *)tmp);
+		ata_device_read_sectors(dev, start_block, 1, (uint8_t *)tmp);
 
 		memcpy(buffer, (void *)((uintptr_t)tmp + ((uintptr_t)offset % ATA_CACHE_SIZE)), prefix_size);
 
@@ -278,7 +265,7 @@ static ssize_t read_ata(fs_node_t *node, off_t offset, size_t size, uint8_t *buf
 	if ((offset + size)  % ATA_CACHE_SIZE && start_block <= end_block) {
 		unsigned int postfix_size = (offset + size) % ATA_CACHE_SIZE;
 		char * tmp = malloc(ATA_CACHE_SIZE);
-		ata_device_read_sector(dev, end_block, (uint8_t *)tmp);
+		ata_device_read_sectors(dev, end_block, 1, (uint8_t *)tmp);
 
 		memcpy((void *)((uintptr_t)buffer + size - postfix_size), tmp, postfix_size);
 
@@ -288,9 +275,11 @@ static ssize_t read_ata(fs_node_t *node, off_t offset, size_t size, uint8_t *buf
 	}
 
 	while (start_block <= end_block) {
-		ata_device_read_sector(dev, start_block, (uint8_t *)((uintptr_t)buffer + x_offset));
-		x_offset += ATA_CACHE_SIZE;
-		start_block++;
+		unsigned int count = end_block - start_block + 1;
+		if (count > ATA_DMA_BLOCKS) count = ATA_DMA_BLOCKS;
+		ata_device_read_sectors(dev, start_block, count, (uint8_t *)((uintptr_t)buffer + x_offset));
+		x_offset += count * ATA_CACHE_SIZE;
+		start_block += count;
 	}
 
 	return size;
@@ -371,10 +360,10 @@ static ssize_t write_ata(fs_node_t *node, off_t offset, size_t size, uint8_t *bu
 		unsigned int prefix_size = (ATA_CACHE_SIZE - (offset % ATA_CACHE_SIZE));
 
 		char * tmp = malloc(ATA_CACHE_SIZE);
-		ata_device_read_sector(dev, start_block, (uint8_t *)tmp);
+		ata_device_read_sectors(dev, start_block, 1, (uint8_t *)tmp);
 
 		memcpy((void *)((uintptr_t)tmp + ((uintptr_t)offset % ATA_CACHE_SIZE)), buffer, prefix_size);
-		ata_device_write_sector(dev, start_block, (uint8_t *)tmp);
+		ata_device_write_sectors(dev, start_block, 1, (uint8_t *)tmp);
 
 		free(tmp);
 		x_offset += prefix_size;
@@ -385,20 +374,22 @@ static ssize_t write_ata(fs_node_t *node, off_t offset, size_t size, uint8_t *bu
 		unsigned int postfix_size = (offset + size) % ATA_CACHE_SIZE;
 
 		char * tmp = malloc(ATA_CACHE_SIZE);
-		ata_device_read_sector(dev, end_block, (uint8_t *)tmp);
+		ata_device_read_sectors(dev, end_block, 1, (uint8_t *)tmp);
 
 		memcpy(tmp, (void *)((uintptr_t)buffer + size - postfix_size), postfix_size);
 
-		ata_device_write_sector(dev, end_block, (uint8_t *)tmp);
+		ata_device_write_sectors(dev, end_block, 1, (uint8_t *)tmp);
 
 		free(tmp);
 		end_block--;
 	}
 
 	while (start_block <= end_block) {
-		ata_device_write_sector(dev, start_block, (uint8_t *)((uintptr_t)buffer + x_offset));
-		x_offset += ATA_CACHE_SIZE;
-		start_block++;
+		unsigned int count = end_block - start_block + 1;
+		if (count > ATA_DMA_BLOCKS) count = ATA_DMA_BLOCKS;
+		ata_device_write_sectors(dev, start_block, count, (uint8_t *)((uintptr_t)buffer + x_offset));
+		x_offset += count * ATA_CACHE_SIZE;
+		start_block += count;
 	}
 
 	return size;
@@ -412,38 +403,6 @@ static void close_ata(fs_node_t * node) {
 	return;
 }
 
-static int ioctl_ata(fs_node_t * node, unsigned long request, void * argp) {
-	struct ata_device * dev = (struct ata_device *)node->device;
-
-	switch (request) {
-		case IOCTLSYNC: {
-			mutex_acquire(ata_mutex);
-			for (int i = 0; i < CACHE_COUNT; ++i) {
-				if (cache_entries[i].dev == dev && cache_entries[i].flags & 1) {
-					eviction_count++;
-					memcpy(cache_entries[i].dev->dma_start, cache_blocks + i * ATA_CACHE_SIZE, ATA_CACHE_SIZE);
-					ata_device_write_sector_actual(cache_entries[i].dev, cache_entries[i].lba);
-					cache_entries[i].flags = 0;
-				}
-			}
-			mutex_release(ata_mutex);
-			return 0;
-		}
-
-		case 0x2A01234UL: {
-			uint64_t * args = argp;
-			memcpy(&args[0], &hit_count, sizeof(uint64_t));
-			memcpy(&args[1], &miss_count, sizeof(uint64_t));
-			memcpy(&args[2], &eviction_count, sizeof(uint64_t));
-			memcpy(&args[3], &write_count, sizeof(uint64_t));
-			return 0;
-		}
-
-		default:
-			return -ENOTTY;
-	}
-}
-
 static fs_node_t * atapi_device_create(struct ata_device * device) {
 	fs_node_t * fnode = malloc(sizeof(fs_node_t));
 	memset(fnode, 0x00, sizeof(fs_node_t));
@@ -482,7 +441,7 @@ static fs_node_t * ata_device_create(struct ata_device * device) {
 	fnode->close   = close_ata;
 	fnode->readdir = NULL;
 	fnode->finddir = NULL;
-	fnode->ioctl   = ioctl_ata; /* TODO, identify, etc? */
+	fnode->ioctl   = NULL; /* TODO, identify, etc? */
 	return fnode;
 }
 
@@ -574,10 +533,12 @@ static void ata_device_init(struct ata_device * dev) {
 
 	dev->is_atapi = 0;
 	dev->dma_prdt  = (void *)kvmalloc_p(4096, &dev->dma_prdt_phys);
-	dev->dma_start = (void *)kvmalloc_p(4096, &dev->dma_start_phys);
-	dev->dma_prdt[0].offset = dev->dma_start_phys;
-	dev->dma_prdt[0].bytes = ATA_CACHE_SIZE;
-	dev->dma_prdt[0].last = 0x8000;
+	dev->dma_start = (void *)kvmalloc_p(ATA_DMA_BLOCKS * ATA_CACHE_SIZE, &dev->dma_start_phys);
+	for (int i = 0; i < ATA_DMA_BLOCKS; ++i) {
+		dev->dma_prdt[i].offset = dev->dma_start_phys + i * ATA_CACHE_SIZE;
+		dev->dma_prdt[i].bytes = ATA_CACHE_SIZE;
+		dev->dma_prdt[i].last = 0;
+	}
 
 	uint16_t command_reg = pci_read_field(ata_pci, PCI_COMMAND, 4);
 	if (!(command_reg & (1 << 2))) {
@@ -726,11 +687,10 @@ static int ata_device_detect(struct ata_device * dev) {
 
 		char devname[64];
 		snprintf((char *)&devname, 20, "/dev/hd%c", ata_drive_char);
-		fs_node_t * node = ata_device_create(dev);
+		fs_node_t * node = bcache_create(ata_device_create(dev));
 		char options[21];
 		snprintf(options, 20, "%c", ata_drive_char);
 		vfs_mount(devname, node, "ata-hd", options);
-		node->length  = sectors;
 
 		ata_drive_char++;
 		found_something = 1;
@@ -758,13 +718,24 @@ static int ata_device_detect(struct ata_device * dev) {
 	return 0;
 }
 
-static void ata_device_read_sector_actual(struct ata_device * dev, uint64_t lba) {
+/**
+ * Mark the end of the PRDT after @p count blocks. The entries
+ * themselves never change; each covers one block of the DMA buffer.
+ */
+static void ata_dma_prepare(struct ata_device * dev, unsigned int count) {
+	for (unsigned int i = 0; i < ATA_DMA_BLOCKS; ++i) {
+		dev->dma_prdt[i].last = (i == count - 1) ? 0x8000 : 0;
+	}
+}
+
+static void ata_device_read_sector_actual(struct ata_device * dev, uint64_t lba, unsigned int count) {
 	uint16_t bus = dev->io_base;
 	uint8_t slave = dev->slave;
 
 	if (dev->is_atapi) return;
 
 	ata_wait(dev, 0);
+	ata_dma_prepare(dev, count);
 
 	/* Stop */
 	outportb(dev->bar4, 0x00);
@@ -793,7 +764,7 @@ static void ata_device_read_sector_actual(struct ata_device * dev, uint64_t lba)
 	outportb(bus + ATA_REG_LBA1, (lba & 0xff00000000) >> 32);
 	outportb(bus + ATA_REG_LBA2, (lba & 0xff0000000000) >> 40);
 
-	outportb(bus + ATA_REG_SECCOUNT0, SECTORS_PER_CACHE_BLOCK);
+	outportb(bus + ATA_REG_SECCOUNT0, count * SECTORS_PER_CACHE_BLOCK);
 	outportb(bus + ATA_REG_LBA0, (lba & 0x000000ff) >>  0);
 	outportb(bus + ATA_REG_LBA1, (lba & 0x0000ff00) >>  8);
 	outportb(bus + ATA_REG_LBA2, (lba & 0x00ff0000) >> 16);
@@ -895,11 +866,12 @@ atapi_timeout:
 	return;
 }
 
-static void ata_device_write_sector_actual(struct ata_device * dev, uint64_t lba) {
+static void ata_device_write_sector_actual(struct ata_device * dev, uint64_t lba, unsigned int count) {
 	uint16_t bus = dev->io_base;
 	uint8_t slave = dev->slave;
 
 	ata_wait(dev, 0);
+	ata_dma_prepare(dev, count);
 	outportb(dev->bar4, 0x00);
 	outportl(dev->bar4 + 0x04, dev->dma_prdt_phys);
 	outportb(dev->bar4 + 0x2, inportb(dev->bar4 + 0x02) | 0x04 | 0x02);
@@ -922,7 +894,7 @@ static void ata_device_write_sector_actual(struct ata_device * dev, uint64_t lba
 	outportb(bus + ATA_REG_LBA1, (lba & 0xff00000000) >> 32);
 	outportb(bus + ATA_REG_LBA2, (lba & 0xff0000000000) >> 40);
 
-	outportb(bus + ATA_REG_SECCOUNT0, SECTORS_PER_CACHE_BLOCK);
+	outportb(bus + ATA_REG_SECCOUNT0, count * SECTORS_PER_CACHE_BLOCK);
 	outportb(bus + ATA_REG_LBA0, (lba & 0x000000ff) >>  0);
 	outportb(bus + ATA_REG_LBA1, (lba & 0x0000ff00) >>  8);
 	outportb(bus + ATA_REG_LBA2, (lba & 0x00ff0000) >> 16);
@@ -953,83 +925,20 @@ static void ata_device_write_sector_actual(struct ata_device * dev, uint64_t lba
 #endif
 }
 
-static void ata_device_read_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
-	lba *= SECTORS_PER_CACHE_BLOCK;
-	/* Is it in the cache? */
+static void ata_device_read_sectors(struct ata_device * dev, uint64_t lba, unsigned int count, uint8_t * buf) {
 	mutex_acquire(ata_mutex);
-	int found = 0;
-	int oldest = 0;
-	uint64_t lu = -1;
-	for (int i = 0; i < CACHE_COUNT; ++i) {
-		if (cache_entries[i].dev == dev && cache_entries[i].lba == lba) {
-			//dprintf("ata: cache hit\n");
-			hit_count++;
-			oldest = i;
-			found = 1;
-			break;
-		} else if (cache_entries[i].dev == NULL) {
-			oldest = i;
-			break;
-		} else if (cache_entries[i].last_use < lu) {
-			oldest = i;
-			lu = cache_entries[oldest].last_use;
-		}
-	}
-	if (!found) {
-		miss_count++;
-		if (cache_entries[oldest].dev && cache_entries[oldest].flags & 1) {
-			eviction_count++;
-			memcpy(cache_entries[oldest].dev->dma_start, cache_blocks + oldest * ATA_CACHE_SIZE, ATA_CACHE_SIZE);
-			ata_device_write_sector_actual(cache_entries[oldest].dev, cache_entries[oldest].lba);
-		}
-		ata_device_read_sector_actual(dev, lba);
-		cache_entries[oldest].dev = dev;
-		cache_entries[oldest].lba = lba;
-		cache_entries[oldest].flags = 0;
-		memcpy(cache_blocks + oldest * ATA_CACHE_SIZE, dev->dma_start, ATA_CACHE_SIZE);
-	}
-	cache_entries[oldest].last_use = counter++;
-	memcpy(buf, cache_blocks + ATA_CACHE_SIZE * oldest, ATA_CACHE_SIZE);
+	ata_device_read_sector_actual(dev, lba * SECTORS_PER_CACHE_BLOCK, count);
+	memcpy(buf, dev->dma_start, count * ATA_CACHE_SIZE);
 	mutex_release(ata_mutex);
 }
 
-static void ata_device_write_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
-	lba *= SECTORS_PER_CACHE_BLOCK;
+static void ata_device_write_sectors(struct ata_device * dev, uint64_t lba, unsigned int count, uint8_t * buf) {
 	mutex_acquire(ata_mutex);
-	int found = 0;
-	int oldest = 0;
-	uint64_t lu = -1;
-	for (int i = 0; i < CACHE_COUNT; ++i) {
-		if (cache_entries[i].dev == dev && cache_entries[i].lba == lba) {
-			//dprintf("ata: cache hit\n");
-			hit_count++;
-			oldest = i;
-			found = 1;
-			break;
-		} else if (cache_entries[i].dev == NULL) {
-			oldest = i;
-			break;
-		} else if (cache_entries[i].last_use < lu) {
-			oldest = i;
-			lu = cache_entries[oldest].last_use;
-		}
-	}
-	if (!found) {
-		miss_count++;
-		if (cache_entries[oldest].dev && cache_entries[oldest].flags & 1) {
-			eviction_count++;
-			memcpy(cache_entries[oldest].dev->dma_start, cache_blocks + oldest * ATA_CACHE_SIZE, ATA_CACHE_SIZE);
-			ata_device_write_sector_actual(cache_entries[oldest].dev, cache_entries[oldest].lba);
-		}
-		cache_entries[oldest].dev = dev;
-		cache_entries[oldest].lba = lba;
-	}
-	write_count++;
-	cache_entries[oldest].last_use = counter++;
-	memcpy(cache_blocks + oldest * ATA_CACHE_SIZE, buf, ATA_CACHE_SIZE);
-	cache_entries[oldest].flags = 1;
+	memcpy(dev->dma_start, buf, count * ATA_CACHE_SIZE);
+	ata_device_write_sector_actual(dev, lba * SECTORS_PER_CACHE_BLOCK, count);
 	mutex_release(ata_mutex);
 }
+
 static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
 	mutex_acquire(ata_mutex);
 	ata_device_read_sector_atapi_actual(dev, lba, buf);
@@ -1047,9 +956,6 @@ static int ata_initialize(int argc, char * argv[]) {
 
 	atapi_waiter = list_create("atapi waiter", NULL);
 
-	cache_entries = malloc(sizeof(struct CacheEntry) * CACHE_COUNT);
-	memset(cache_entries, 0, sizeof(struct CacheEntry) * CACHE_COUNT);
-	cache_blocks  = mmu_map_module(CACHE_COUNT * ATA_CACHE_SIZE);
 	ata_mutex = mutex_init("ata lock");
 
 	ata_device_detect(&ata_primary_master);
@@ -24,6 +24,7 @@
 #include <kernel/vfs.h>
 #include <kernel/net/netif.h>
 #include <kernel/net/eth.h>
+#include <kernel/net/ipv4.h>
 #include <kernel/module.h>
 #include <bits/errno.h>
 
@@ -38,6 +39,7 @@
 #include <net/if.h>
 
 #define INTS (ICR_LSC | ICR_RXO | ICR_RXT0 | ICR_TXQE | ICR_TXDW | ICR_ACK | ICR_RXDMT0 | ICR_SRPD)
+#define RX_INTS (ICR_RXO | ICR_RXT0 | ICR_ACK | ICR_RXDMT0 | ICR_SRPD)
 
 struct e1000_nic {
 	struct EthernetDevice eth;
@@ -61,8 +63,7 @@ struct e1000_nic {
 	uintptr_t tx_phys;
 
 	int configured;
-	process_t * queuer;
-	process_t * processor;
+	struct net_poll rx_poll;
 
 	netif_counters_t counts;
 };
@@ -192,61 +193,69 @@ static void e1000_handle(struct e1000_nic * nic, uint32_t status) {
 		nic->link_status= (read_command(nic, E1000_REG_STATUS) & (1 << 1));
 	}
 
-	make_process_ready(nic->queuer);
+	if (status & RX_INTS) {
+		/* Leave receive interrupts off until the worker has emptied the ring. */
+		write_command(nic, E1000_REG_IMC, RX_INTS);
+		net_poll_schedule(&nic->rx_poll);
+	}
 }
 
-static void e1000_queuer(void * data) {
-	struct e1000_nic * nic = data;
-
-	int head = read_command(nic, E1000_REG_RXDESCHEAD);
-	int budget = 8;
+static int e1000_rx_poll(struct net_poll * poll, int budget) {
+	struct e1000_nic * nic = poll->device;
+	int processed = 0;
 
-	while (1) {
-		int processed = 0;
-		if (head == nic->rx_index) {
-			head = read_command(nic, E1000_REG_RXDESCHEAD);
-		}
-		if (head != nic->rx_index) {
 #ifdef __aarch64__
-			__sync_synchronize();
+	__sync_synchronize();
 #endif
-			while ((nic->rx[nic->rx_index].status & 0x01) && (processed < budget)) {
-				int i = nic->rx_index;
-				if (!(nic->rx[i].errors & (0x97))) {
-					nic->counts.rx_count++;
-					nic->counts.rx_bytes += nic->rx[i].length;
+	while (processed < budget && (nic->rx[nic->rx_index].status & 0x01)) {
+		int i = nic->rx_index;
+		if (!(nic->rx[i].errors & (0x97))) {
+			nic->counts.rx_count++;
+			nic->counts.rx_bytes += nic->rx[i].length;
 #ifdef __aarch64__
-					cache_invalidate(nic->rx_virt[i]);
+			cache_invalidate(nic->rx_virt[i]);
 #endif
-					net_eth_handle((void*)nic->rx_virt[i], nic->eth.device_node, nic->rx[i].length);
-				} else {
-					printf("error bits set in packet: %x\n", nic->rx[i].errors);
-				}
-				processed++;
+			/* A bad checksum isn't an error here; the stack drops the packet when it checks again. */
+			uint8_t status = nic->rx[i].status;
+			int flags = ((status & (RX_STATUS_TCPCS | RX_STATUS_IXSM)) == RX_STATUS_TCPCS &&
+				!(nic->rx[i].errors & RX_ERRORS_TCPE)) ? NET_BUFFER_CSUM_OK : 0;
+			net_eth_handle((void*)nic->rx_virt[i], nic->eth.device_node, nic->rx[i].length, flags);
+		} else {
+			printf("error bits set in packet: %x\n", nic->rx[i].errors);
+		}
+		processed++;
 #ifdef __aarch64__
-				__sync_synchronize();
+		__sync_synchronize();
 #endif
-				nic->rx[i].status = 0;
-				if (++nic->rx_index == E1000_NUM_RX_DESC) {
-					nic->rx_index = 0;
-				}
-				if (nic->rx_index == head) {
-					head = read_command(nic, E1000_REG_RXDESCHEAD);
-					if (nic->rx_index == head) break;
-				}
-				write_command(nic, E1000_REG_RXDESCTAIL, nic->rx_index);
-				read_command(nic, E1000_REG_STATUS);
+		nic->rx[i].status = 0;
+		if (++nic->rx_index == E1000_NUM_RX_DESC) {
+			nic->rx_index = 0;
+		}
+	}
+
+	if (processed) {
+		/* Give the whole batch back at once; the tail sits on the last descriptor we emptied. */
+		write_command(nic, E1000_REG_RXDESCTAIL, (nic->rx_index + E1000_NUM_RX_DESC - 1) % E1000_NUM_RX_DESC);
+		read_command(nic, E1000_REG_STATUS);
 #ifdef __aarch64__
-				__sync_synchronize();
+		__sync_synchronize();
 #endif
-			}
-		}
-		if (processed == 0) {
-			delay_yield(100000);
-		} else {
-			if (this_core->cpu_id == 0) switch_task(1);
-		}
 	}
+
+	return processed;
+}
+
+static int e1000_rx_enable(struct net_poll * poll) {
+	struct e1000_nic * nic = poll->device;
+	write_command(nic, E1000_REG_IMS, RX_INTS);
+#ifdef __aarch64__
+	__sync_synchronize();
+#endif
+	if (nic->rx[nic->rx_index].status & 0x01) {
+		write_command(nic, E1000_REG_IMC, RX_INTS);
+		return 1;
+	}
+	return 0;
 }
 
 #if defined(__x86_64__)
@@ -282,7 +291,12 @@ static int tx_full(struct e1000_nic * device, int tx_tail, int tx_head) {
 	return 0;
 }
 
-static void send_packet(struct e1000_nic * device, uint8_t* payload, size_t payload_size) {
+/**
+ * Queue a frame for transmission. If @p cso is set, the card
+ * sums from @p css to the end of the frame and stores the
+ * complement at @p cso.
+ */
+static void send_packet(struct e1000_nic * device, uint8_t* payload, size_t payload_size, uint8_t css, uint8_t cso) {
 	spin_lock(device->tx_lock);
 	int tx_tail = read_command(device, E1000_REG_TXDESCTAIL);
 	int tx_head = read_command(device, E1000_REG_TXDESCHEAD);
@@ -312,7 +326,9 @@ static void send_packet(struct e1000_nic * device, uint8_t* payload, size_t payl
 #endif
 
 	device->tx[device->tx_index].length = payload_size;
-	device->tx[device->tx_index].cmd = CMD_EOP | CMD_IFCS | CMD_RS | CMD_RPS;
+	device->tx[device->tx_index].css = css;
+	device->tx[device->tx_index].cso = cso;
+	device->tx[device->tx_index].cmd = CMD_EOP | CMD_IFCS | CMD_RS | CMD_RPS | (cso ? CMD_IC : 0);
 	device->tx[device->tx_index].status = 0;
 #if defined(__aarch64__)
 	asm volatile ("dmb ish\nisb" ::: "memory");
@@ -347,6 +363,8 @@ static void init_rx(struct e1000_nic * device) {
 
 	device->rx_index = 0;
 
+	write_command(device, E1000_REG_RXCSUM, RXCSUM_IPOFL | RXCSUM_TUOFL);
+
 	write_command(device, E1000_REG_RCTRL,
 		RCTL_EN  |
 		(1 << 2) | /* store bad packets */
@@ -454,10 +472,22 @@ static int ioctl_e1000(fs_node_t * node, unsigned long request, void * argp) {
 static ssize_t write_e1000(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	struct e1000_nic * nic = node->device;
 	/* write packet */
-	send_packet(nic, buffer, size);
+	send_packet(nic, buffer, size, 0, 0);
 	return size;
 }
 
+static void e1000_send_partial(struct EthernetDevice * eth, void * frame, size_t size, size_t csum_start, size_t csum_offset) {
+	struct e1000_nic * nic = (struct e1000_nic *)eth;
+	size_t cso = csum_start + csum_offset;
+	if (cso > 0xFF) {
+		/* Legacy descriptors only have a byte for each offset. */
+		uint16_t * csum = (uint16_t *)((uint8_t *)frame + cso);
+		*csum = net_checksum_finish(net_checksum_add((uint8_t *)frame + csum_start, size - csum_start, 0));
+		cso = 0;
+	}
+	send_packet(nic, frame, size, csum_start, cso);
+}
+
 static void ints_off(struct e1000_nic * nic) {
 	write_command(nic, E1000_REG_IMC, 0xFFFFFFFF);
 	write_command(nic, E1000_REG_ICR, 0xFFFFFFFF);
@@ -515,8 +545,6 @@ static void e1000_init(struct e1000_nic * nic) {
 	read_mac(nic);
 	write_mac(nic);
 
-	nic->queuer = (process_t*)this_core->current_process;
-
 	#define CTRL_PHY_RST (1UL << 31UL)
 	#define CTRL_RST     (1UL << 26UL)
 	#define CTRL_SLU     (1UL << 6UL)
@@ -592,17 +620,17 @@ static void e1000_init(struct e1000_nic * nic) {
 	nic->eth.device_node->device = nic;
 
 	nic->eth.mtu = 1500; /* guess */
+	nic->eth.send_partial = e1000_send_partial;
 
 	net_add_interface(nic->eth.if_name, nic->eth.device_node);
 
 	char worker_name[34];
 	snprintf(worker_name, 33, "[%s]", nic->eth.if_name);
-	nic->queuer = spawn_worker_thread(e1000_queuer, worker_name, nic);
-
 	nic->configured = 1;
+	net_poll_start(&nic->rx_poll, worker_name, nic, e1000_rx_poll, e1000_rx_enable);
 
-	/* Twiddle interrupts */
-	write_command(nic, E1000_REG_IMS, INTS);
+	/* Twiddle interrupts; receive interrupts are turned on by the worker once it finds the ring empty. */
+	write_command(nic, E1000_REG_IMS, INTS & ~RX_INTS);
 	delay_yield(10000);
 }
 
@@ -14,6 +14,7 @@
 #include <bits/errno.h>
 #include <kernel/types.h>
 #include <kernel/vfs.h>
+#include <kernel/slab.h>
 #include <kernel/printf.h>
 #include <kernel/time.h>
 #include <kernel/string.h>
@@ -21,6 +22,9 @@
 #include <kernel/tokenize.h>
 #include <kernel/module.h>
 #include <kernel/mutex.h>
+#include <kernel/list.h>
+#include <kernel/bcache.h>
+#include <kernel/pagecache.h>
 
 #include <sys/ioctl.h>
 
@@ -95,7 +99,18 @@ struct ext2_superblock {
 	/* Other Options */
 	uint32_t default_mount_options;
 	uint32_t first_meta_bg;
-	uint8_t _unused[760];
+	uint32_t mkfs_time;
+	uint32_t jnl_blocks[17];
+
+	/* 64-bit Support */
+	uint32_t blocks_count_hi;
+	uint32_t r_blocks_count_hi;
+	uint32_t free_blocks_count_hi;
+	uint16_t min_extra_isize;
+	uint16_t want_extra_isize;
+
+	uint32_t flags;
+	uint8_t _unused[668];
 
 } __attribute__ ((packed));
 
@@ -186,6 +201,67 @@ typedef struct ext2_dir ext2_dir_t;
 #undef _symlink
 #define _symlink(inode) ((char *)(inode)->block)
 
+#define EXT2_ICACHE_ENTRIES   512
+#define EXT2_ICACHE_BUCKETS   128
+#define EXT2_MAPCACHE_ENTRIES 64
+#define EXT2_MAPCACHE_BUCKETS 32
+
+/* How far ahead of a sequential reader to read */
+#define EXT2_READAHEAD_BYTES (128 * 1024)
+
+/* Block numbers looked up at a time when mapping a read or write */
+#define EXT2_MAP_BATCH 64
+
+/* Files being written to that can have a reservation window at once */
+#define EXT2_RESERVATIONS 16
+
+/* Reservation window sizes, in blocks; windows double as a file uses them up */
+#define EXT2_RESERVE_BLOCKS 64
+#define EXT2_RESERVE_MAX    1024
+
+/* Allocation metadata dirty for longer than this many seconds is written out */
+#define EXT2_FLUSH_AGE 5
+
+/*
+ * In-memory copy of an on-disk inode. Entries also track where the last
+ * read of the file ended, so that sequential readers can be read ahead of.
+ */
+struct ext2_icache {
+	struct ext2_icache * next;
+	node_t lru_node;
+	uint32_t ino;
+	uint32_t ra_next;   /* Block a sequential reader would ask for next */
+	uint32_t ra_end;    /* Blocks before this have already been read ahead */
+	uint8_t inode[];
+};
+
+/*
+ * Copy of an indirect block, so mapping file blocks to disk blocks
+ * does not have to go back to the device for every lookup.
+ */
+struct ext2_mapcache {
+	struct ext2_mapcache * next;
+	node_t lru_node;
+	uint32_t block;
+	uint32_t pointers[];
+};
+
+/*
+ * A run of free blocks set aside for the file an inode was last
+ * allocating blocks for. Other files do not allocate inside it, so
+ * files written at the same time do not interleave on disk. Nothing
+ * is marked in the bitmap until blocks are actually allocated, so
+ * dropping a window costs nothing.
+ */
+struct ext2_reservation {
+	uint32_t ino;
+	uint32_t start;
+	uint32_t end;       /* One past the last block */
+};
+
+#define EXT2_DIRTY_BLOCK_BITMAP 0x01
+#define EXT2_DIRTY_INODE_BITMAP 0x02
+
 /*
  * EXT2 filesystem object
  */
@@ -210,10 +286,29 @@ typedef struct {
 	int flags;
 
 	sched_mutex_t *           mutex;
+
+	/* Inode and indirect block caches, see icache_fetch and mapcache_lookup */
+	spin_lock_t               cache_lock;
+	uint64_t                  cache_generation;
+	struct ext2_icache *      icache[EXT2_ICACHE_BUCKETS];
+	list_t                    icache_lru;
+	struct ext2_mapcache *    mapcache[EXT2_MAPCACHE_BUCKETS];
+	list_t                    mapcache_lru;
+
+	/* Allocation state, protected by mutex, see allocate_blocks and flush_metadata */
+	uint8_t **                block_bitmaps;       /* Per group, loaded when first needed */
+	uint8_t **                inode_bitmaps;
+	uint8_t *                 group_dirty;         /* EXT2_DIRTY_* for each group */
+	uint32_t *                group_hint;          /* No free blocks in a group before this offset */
+	int                       meta_dirty;          /* Group descriptors and superblock need writing */
+	uint64_t                  meta_dirtied;        /* When they first did */
+	struct ext2_reservation   reservations[EXT2_RESERVATIONS];
+	unsigned int              reservation_next;
 } ext2_fs_t;
 
-#define EXT2_FLAG_READWRITE 0x0002
-#define EXT2_FLAG_LOUD      0x0004
+#define EXT2_FLAG_READWRITE    0x0002
+#define EXT2_FLAG_LOUD         0x0004
+#define EXT2_FLAG_NO_READAHEAD 0x0008
 
 /*
  * These macros were used in the original toaru ext2 driver.
@@ -237,7 +332,7 @@ static ext2_inodetable_t * read_inode(ext2_fs_t * this, size_t inode);
 static void refresh_inode(ext2_fs_t * this, ext2_inodetable_t * inodet,  size_t inode);
 static int write_inode(ext2_fs_t * this, ext2_inodetable_t *inode, size_t index);
 static fs_node_t * finddir_ext2(fs_node_t *node, const char *name);
-static size_t allocate_block(ext2_fs_t * this);
+static uint32_t allocate_blocks(ext2_fs_t * this, uint32_t ino, uint32_t goal, unsigned int * count);
 
 /**
  * ext2->rewrite_superblock Rewrite the superblock.
@@ -294,124 +389,323 @@ static int write_block(ext2_fs_t * this, unsigned int block_no, uint8_t *buf) {
 	return E_SUCCESS;
 }
 
+static struct ext2_icache * icache_find(ext2_fs_t * this, uint32_t ino) {
+	for (struct ext2_icache * entry = this->icache[ino % EXT2_ICACHE_BUCKETS]; entry; entry = entry->next) {
+		if (entry->ino == ino) return entry;
+	}
+	return NULL;
+}
+
+static void icache_remove(ext2_fs_t * this, struct ext2_icache * entry) {
+	struct ext2_icache ** link = &this->icache[entry->ino % EXT2_ICACHE_BUCKETS];
+	while (*link != entry) link = &(*link)->next;
+	*link = entry->next;
+	list_delete(&this->icache_lru, &entry->lru_node);
+	free(entry);
+}
+
 /**
- * ext2->set_block_number Set the "real" block number for a given "inode" block number.
+ * ext2->icache_fetch Copy an inode out of the inode cache.
  *
- * @param inode   Inode to operate on
- * @param iblock  Block offset within the inode
- * @param rblock  Real block number
- * @returns Error code or E_SUCCESS
+ * @param generation Set to a token to pass to icache_store after a miss.
+ * @returns 1 if the inode was cached, 0 if it has to be read from disk.
  */
-static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int iblock, unsigned int rblock) {
+static int icache_fetch(ext2_fs_t * this, uint32_t ino, ext2_inodetable_t * inode, uint64_t * generation) {
+	spin_lock(this->cache_lock);
+	*generation = this->cache_generation;
+	struct ext2_icache * entry = icache_find(this, ino);
+	if (entry) {
+		memcpy(inode, entry->inode, this->inode_size);
+		list_delete(&this->icache_lru, &entry->lru_node);
+		list_append(&this->icache_lru, &entry->lru_node);
+	}
+	spin_unlock(this->cache_lock);
+	return entry != NULL;
+}
 
-	unsigned int p = this->pointers_per_block;
+/**
+ * ext2->icache_store Remember the contents of an inode.
+ *
+ * Inodes that were just written are passed with a generation of -1 and
+ * always replace what is cached. Inodes read from disk after a miss are
+ * dropped if any inode was written while they were being read.
+ */
+static void icache_store(ext2_fs_t * this, uint32_t ino, ext2_inodetable_t * inode, uint64_t generation) {
+	int written = generation == (uint64_t)-1;
+
+	spin_lock(this->cache_lock);
+	if (written) generation = ++this->cache_generation;
+	struct ext2_icache * entry = icache_find(this, ino);
+	if (entry && written) memcpy(entry->inode, inode, this->inode_size);
+	spin_unlock(this->cache_lock);
+	if (entry) return;
+
+	struct ext2_icache * fresh = malloc(sizeof(struct ext2_icache) + this->inode_size);
+	fresh->ino = ino;
+	fresh->ra_next = 0;
+	fresh->ra_end = 0;
+	fresh->lru_node.value = fresh;
+	memcpy(fresh->inode, inode, this->inode_size);
+
+	spin_lock(this->cache_lock);
+	if (generation != this->cache_generation || icache_find(this, ino)) {
+		spin_unlock(this->cache_lock);
+		free(fresh);
+		return;
+	}
+	if (this->icache_lru.length >= EXT2_ICACHE_ENTRIES) {
+		icache_remove(this, this->icache_lru.head->value);
+	}
+	fresh->next = this->icache[ino % EXT2_ICACHE_BUCKETS];
+	this->icache[ino % EXT2_ICACHE_BUCKETS] = fresh;
+	list_append(&this->icache_lru, &fresh->lru_node);
+	spin_unlock(this->cache_lock);
+}
 
-	/* We're going to do some crazy math in a bit... */
-	unsigned int a, b, c, d, e, f, g;
+/**
+ * ext2->icache_readahead Note a read and decide whether to read ahead of it.
+ *
+ * Reads that pick up where the last read of the same inode left off are
+ * sequential; once such a reader gets within half a window of what has
+ * already been read ahead, another window is asked for.
+ *
+ * @param first First block being read
+ * @param last  One past the last block being read
+ * @param ahead Set to the first block to read ahead
+ * @returns Number of blocks to read ahead, or 0.
+ */
+static unsigned int icache_readahead(ext2_fs_t * this, uint32_t ino, uint32_t first, uint32_t last, uint32_t * ahead) {
+	unsigned int window = EXT2_READAHEAD_BYTES / this->block_size;
+	unsigned int count = 0;
+
+	spin_lock(this->cache_lock);
+	struct ext2_icache * entry = icache_find(this, ino);
+	if (entry) {
+		if (first != entry->ra_next) {
+			entry->ra_end = last;
+		} else if (entry->ra_end < last + window / 2) {
+			*ahead = entry->ra_end > first ? entry->ra_end : first;
+			count = last + window - *ahead;
+			entry->ra_end = last + window;
+		}
+		entry->ra_next = last;
+	}
+	spin_unlock(this->cache_lock);
 
-	uint8_t * tmp;
+	return count;
+}
 
-	if (iblock < EXT2_DIRECT_BLOCKS) {
-		inode->block[iblock] = rblock;
-		return E_SUCCESS;
-	} else if (iblock < EXT2_DIRECT_BLOCKS + p) {
-		/* XXX what if inode->block[EXT2_DIRECT_BLOCKS] isn't set? */
-		if (!inode->block[EXT2_DIRECT_BLOCKS]) {
-			unsigned int block_no = allocate_block(this);
-			if (!block_no) return E_NOSPACE;
-			inode->block[EXT2_DIRECT_BLOCKS] = block_no;
-			write_inode(this, inode, inode_no);
-		}
-		tmp = malloc(this->block_size);
-		read_block(this, inode->block[EXT2_DIRECT_BLOCKS], (uint8_t *)tmp);
+static struct ext2_mapcache * mapcache_find(ext2_fs_t * this, uint32_t block) {
+	for (struct ext2_mapcache * entry = this->mapcache[block % EXT2_MAPCACHE_BUCKETS]; entry; entry = entry->next) {
+		if (entry->block == block) return entry;
+	}
+	return NULL;
+}
 
-		((uint32_t *)tmp)[iblock - EXT2_DIRECT_BLOCKS] = rblock;
-		write_block(this, inode->block[EXT2_DIRECT_BLOCKS], (uint8_t *)tmp);
+static void mapcache_remove(ext2_fs_t * this, struct ext2_mapcache * entry) {
+	struct ext2_mapcache ** link = &this->mapcache[entry->block % EXT2_MAPCACHE_BUCKETS];
+	while (*link != entry) link = &(*link)->next;
+	*link = entry->next;
+	list_delete(&this->mapcache_lru, &entry->lru_node);
+	free(entry);
+}
 
-		free(tmp);
-		return E_SUCCESS;
-	} else if (iblock < EXT2_DIRECT_BLOCKS + p + p * p) {
-		a = iblock - EXT2_DIRECT_BLOCKS;
-		b = a - p;
-		c = b / p;
-		d = b - c * p;
+/**
+ * ext2->mapcache_lookup Read one entry of an indirect block.
+ *
+ * @param block Indirect block to look in; 0 for a hole
+ * @param index Entry within the block
+ * @returns The block number stored there
+ */
+static uint32_t mapcache_lookup(ext2_fs_t * this, uint32_t block, unsigned int index) {
+	if (!block) return 0;
+
+	spin_lock(this->cache_lock);
+	struct ext2_mapcache * entry = mapcache_find(this, block);
+	if (entry) {
+		uint32_t out = entry->pointers[index];
+		list_delete(&this->mapcache_lru, &entry->lru_node);
+		list_append(&this->mapcache_lru, &entry->lru_node);
+		spin_unlock(this->cache_lock);
+		return out;
+	}
+	uint64_t generation = this->cache_generation;
+	spin_unlock(this->cache_lock);
 
-		if (!inode->block[EXT2_DIRECT_BLOCKS+1]) {
-			unsigned int block_no = allocate_block(this);
-			if (!block_no) return E_NOSPACE;
-			inode->block[EXT2_DIRECT_BLOCKS+1] = block_no;
-			write_inode(this, inode, inode_no);
-		}
+	entry = malloc(sizeof(struct ext2_mapcache) + this->block_size);
+	entry->block = block;
+	entry->lru_node.value = entry;
+	read_block(this, block, (uint8_t *)entry->pointers);
+	uint32_t out = entry->pointers[index];
 
-		tmp = malloc(this->block_size);
-		read_block(this, inode->block[EXT2_DIRECT_BLOCKS + 1], (uint8_t *)tmp);
+	spin_lock(this->cache_lock);
+	if (generation != this->cache_generation || mapcache_find(this, block)) {
+		spin_unlock(this->cache_lock);
+		free(entry);
+		return out;
+	}
+	if (this->mapcache_lru.length >= EXT2_MAPCACHE_ENTRIES) {
+		mapcache_remove(this, this->mapcache_lru.head->value);
+	}
+	entry->next = this->mapcache[block % EXT2_MAPCACHE_BUCKETS];
+	this->mapcache[block % EXT2_MAPCACHE_BUCKETS] = entry;
+	list_append(&this->mapcache_lru, &entry->lru_node);
+	spin_unlock(this->cache_lock);
+	return out;
+}
 
-		if (!((uint32_t *)tmp)[c]) {
-			unsigned int block_no = allocate_block(this);
-			if (!block_no) goto no_space_free;
-			((uint32_t *)tmp)[c] = block_no;
-			write_block(this, inode->block[EXT2_DIRECT_BLOCKS + 1], (uint8_t *)tmp);
-		}
+/**
+ * ext2->mapcache_update Keep a cached indirect block in step with a write to it.
+ */
+static void mapcache_update(ext2_fs_t * this, uint32_t block, uint8_t * buf) {
+	spin_lock(this->cache_lock);
+	this->cache_generation++;
+	struct ext2_mapcache * entry = mapcache_find(this, block);
+	if (entry) memcpy(entry->pointers, buf, this->block_size);
+	spin_unlock(this->cache_lock);
+}
 
-		uint32_t nblock = ((uint32_t *)tmp)[c];
-		read_block(this, nblock, (uint8_t *)tmp);
+/**
+ * ext2->allocate_indirect Allocate and clear a new indirect block for an inode.
+ *
+ * @returns The block number, or 0 if the disk is full.
+ */
+static uint32_t allocate_indirect(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, uint32_t goal) {
+	unsigned int count = 1;
+	uint32_t block_no = allocate_blocks(this, inode_no, goal, &count);
+	if (!block_no) return 0;
 
-		((uint32_t  *)tmp)[d] = rblock;
-		write_block(this, nblock, (uint8_t *)tmp);
+	uint8_t * tmp = malloc(this->block_size);
+	memset(tmp, 0, this->block_size);
+	write_block(this, block_no, tmp);
+	mapcache_update(this, block_no, tmp);
+	free(tmp);
 
-		free(tmp);
-		return E_SUCCESS;
-	} else if (iblock < EXT2_DIRECT_BLOCKS + p + p * p + p) {
-		a = iblock - EXT2_DIRECT_BLOCKS;
-		b = a - p;
-		c = b - p * p;
-		d = c / (p * p);
-		e = c - d * p * p;
-		f = e / p;
-		g = e - f * p;
+	inode->blocks += this->block_size / 512;
+	return block_no;
+}
 
-		if (!inode->block[EXT2_DIRECT_BLOCKS+2]) {
-			unsigned int block_no = allocate_block(this);
-			if (!block_no) return E_NOSPACE;
-			inode->block[EXT2_DIRECT_BLOCKS+2] = block_no;
-			write_inode(this, inode, inode_no);
+/**
+ * ext2->indirect_block Find the indirect block that holds the pointer to a file block.
+ *
+ * Any indirect blocks missing on the way down are allocated near @p goal.
+ *
+ * @param iblock Block offset within the inode; must not be a direct block
+ * @param index  Set to the position of the pointer within the returned block
+ * @returns Block number of the indirect block, or 0 if the disk is full.
+ */
+static uint32_t indirect_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, uint32_t iblock, uint32_t goal, unsigned int * index) {
+	unsigned int p = this->pointers_per_block;
+	unsigned int path[3];
+	int depth;
+
+	iblock -= EXT2_DIRECT_BLOCKS;
+	if (iblock < p) {
+		depth = 1;
+		path[0] = iblock;
+	} else if ((iblock -= p) < p * p) {
+		depth = 2;
+		path[0] = iblock / p;
+		path[1] = iblock % p;
+	} else {
+		iblock -= p * p;
+		depth = 3;
+		path[0] = iblock / (p * p);
+		path[1] = (iblock / p) % p;
+		path[2] = iblock % p;
+	}
+
+	unsigned int top = EXT2_DIRECT_BLOCKS + depth - 1;
+	if (!inode->block[top]) {
+		inode->block[top] = allocate_indirect(this, inode, inode_no, goal);
+		if (!inode->block[top]) return 0;
+	}
+
+	uint32_t block = inode->block[top];
+	for (int level = 0; level < depth - 1; ++level) {
+		uint32_t next = mapcache_lookup(this, block, path[level]);
+		if (!next) {
+			next = allocate_indirect(this, inode, inode_no, goal);
+			if (!next) return 0;
+			uint8_t * tmp = malloc(this->block_size);
+			read_block(this, block, tmp);
+			((uint32_t *)tmp)[path[level]] = next;
+			write_block(this, block, tmp);
+			mapcache_update(this, block, tmp);
+			free(tmp);
 		}
+		block = next;
+	}
 
-		tmp = malloc(this->block_size);
-		read_block(this, inode->block[EXT2_DIRECT_BLOCKS + 2], (uint8_t *)tmp);
+	*index = path[depth - 1];
+	return block;
+}
 
-		if (!((uint32_t *)tmp)[d]) {
-			unsigned int block_no = allocate_block(this);
-			if (!block_no) goto no_space_free;
-			((uint32_t *)tmp)[d] = block_no;
-			write_block(this, inode->block[EXT2_DIRECT_BLOCKS + 2], (uint8_t *)tmp);
-		}
+/**
+ * ext2->set_block_numbers Map a run of file blocks onto a run of real blocks.
+ *
+ * Each indirect block touched is read and written once for the whole run.
+ * Indirect blocks that have to be allocated are counted in inode->blocks;
+ * the caller writes the inode.
+ *
+ * @param inode   Inode to operate on
+ * @param iblock  First block offset within the inode
+ * @param rblock  Real block the first one maps to
+ * @param count   Number of blocks in the run
+ * @returns Error code or E_SUCCESS
+ */
+static unsigned int set_block_numbers(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, uint32_t iblock, uint32_t rblock, unsigned int count) {
+	unsigned int p = this->pointers_per_block;
+
+	if ((uint64_t)iblock + count > EXT2_DIRECT_BLOCKS + p + (uint64_t)p * p + (uint64_t)p * p * p) {
+		debug_print(CRITICAL, "EXT2 driver tried to write to a block number that was too high (%d)", iblock + count - 1);
+		return E_BADBLOCK;
+	}
 
-		uint32_t nblock = ((uint32_t *)tmp)[d];
-		read_block(this, nblock, (uint8_t *)tmp);
+	uint8_t * tmp = NULL;
 
-		if (!((uint32_t *)tmp)[f]) {
-			unsigned int block_no = allocate_block(this);
-			if (!block_no) goto no_space_free;
-			((uint32_t *)tmp)[f] = block_no;
-			write_block(this, nblock, (uint8_t *)tmp);
+	while (count) {
+		if (iblock < EXT2_DIRECT_BLOCKS) {
+			inode->block[iblock++] = rblock++;
+			count--;
+			continue;
 		}
 
-		nblock = ((uint32_t *)tmp)[f];
-		read_block(this, nblock, (uint8_t *)tmp);
+		unsigned int index;
+		uint32_t block = indirect_block(this, inode, inode_no, iblock, rblock, &index);
+		if (!block) {
+			free(tmp);
+			return E_NOSPACE;
+		}
 
-		((uint32_t *)tmp)[g] = nblock;
-		write_block(this, nblock, (uint8_t *)tmp);
+		unsigned int run = p - index < count ? p - index : count;
+		if (!tmp) tmp = malloc(this->block_size);
+		read_block(this, block, tmp);
+		for (unsigned int i = 0; i < run; ++i) {
+			((uint32_t *)tmp)[index + i] = rblock + i;
+		}
+		write_block(this, block, tmp);
+		mapcache_update(this, block, tmp);
 
-		free(tmp);
-		return E_SUCCESS;
+		iblock += run;
+		rblock += run;
+		count  -= run;
 	}
 
-	debug_print(CRITICAL, "EXT2 driver tried to write to a block number that was too high (%d)", rblock);
-	return E_BADBLOCK;
-no_space_free:
 	free(tmp);
-	return E_NOSPACE;
+	return E_SUCCESS;
+}
+
+/**
+ * ext2->set_block_number Set the "real" block number for a given "inode" block number.
+ *
+ * @param inode   Inode to operate on
+ * @param iblock  Block offset within the inode
+ * @param rblock  Real block number
+ * @returns Error code or E_SUCCESS
+ */
+static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int iblock, unsigned int rblock) {
+	return set_block_numbers(this, inode, inode_no, iblock, rblock, 1);
 }
 
 /**
@@ -428,34 +722,19 @@ static unsigned int get_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 	/* We're going to do some crazy math in a bit... */
 	unsigned int a, b, c, d, e, f, g;
 
-	uint8_t * tmp;
-
 	if (iblock < EXT2_DIRECT_BLOCKS) {
 		return inode->block[iblock];
 	} else if (iblock < EXT2_DIRECT_BLOCKS + p) {
-		/* XXX what if inode->block[EXT2_DIRECT_BLOCKS] isn't set? */
-		tmp = malloc(this->block_size);
-		read_block(this, inode->block[EXT2_DIRECT_BLOCKS], (uint8_t *)tmp);
-
-		unsigned int out = ((uint32_t *)tmp)[iblock - EXT2_DIRECT_BLOCKS];
-		free(tmp);
-		return out;
+		return mapcache_lookup(this, inode->block[EXT2_DIRECT_BLOCKS], iblock - EXT2_DIRECT_BLOCKS);
 	} else if (iblock < EXT2_DIRECT_BLOCKS + p + p * p) {
 		a = iblock - EXT2_DIRECT_BLOCKS;
 		b = a - p;
 		c = b / p;
 		d = b - c * p;
 
-		tmp = malloc(this->block_size);
-		read_block(this, inode->block[EXT2_DIRECT_BLOCKS + 1], (uint8_t *)tmp);
-
-		uint32_t nblock = ((uint32_t *)tmp)[c];
-		read_block(this, nblock, (uint8_t *)tmp);
-
-		unsigned int out = ((uint32_t  *)tmp)[d];
-		free(tmp);
-		return out;
-	} else if (iblock < EXT2_DIRECT_BLOCKS + p + p * p + p) {
+		uint32_t nblock = mapcache_lookup(this, inode->block[EXT2_DIRECT_BLOCKS + 1], c);
+		return mapcache_lookup(this, nblock, d);
+	} else if (iblock < EXT2_DIRECT_BLOCKS + p + p * p + p * p * p) {
 		a = iblock - EXT2_DIRECT_BLOCKS;
 		b = a - p;
 		c = b - p * p;
@@ -464,18 +743,9 @@ static unsigned int get_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		f = e / p;
 		g = e - f * p;
 
-		tmp = malloc(this->block_size);
-		read_block(this, inode->block[EXT2_DIRECT_BLOCKS + 2], (uint8_t *)tmp);
-
-		uint32_t nblock = ((uint32_t *)tmp)[d];
-		read_block(this, nblock, (uint8_t *)tmp);
-
-		nblock = ((uint32_t *)tmp)[f];
-		read_block(this, nblock, (uint8_t *)tmp);
-
-		unsigned int out = ((uint32_t  *)tmp)[g];
-		free(tmp);
-		return out;
+		uint32_t nblock = mapcache_lookup(this, inode->block[EXT2_DIRECT_BLOCKS + 2], d);
+		nblock = mapcache_lookup(this, nblock, f);
+		return mapcache_lookup(this, nblock, g);
 	}
 
 	debug_print(CRITICAL, "EXT2 driver tried to read to a block number that was too high (%d)", iblock);
@@ -488,6 +758,7 @@ static int write_inode(ext2_fs_t * this, ext2_inodetable_t *inode, size_t index)
 		dprintf("ext2: Attempt to write inode 0\n");
 		return E_BADBLOCK;
 	}
+	uint32_t ino = index;
 	index--;
 
 	size_t group = index / this->inodes_per_group;
@@ -507,134 +778,1045 @@ static int write_inode(ext2_fs_t * this, ext2_inodetable_t *inode, size_t index)
 	write_block(this, inode_table_block + block_offset, (uint8_t *)inodet);
 	free(inodet);
 
+	icache_store(this, ino, inode, (uint64_t)-1);
+
 	return E_SUCCESS;
 }
 
-static size_t allocate_block(ext2_fs_t * this) {
-	size_t block_no     = 0;
-	size_t block_offset = 0;
-	size_t group        = 0;
-	uint8_t * bg_buffer = malloc(this->block_size);
+static uint32_t group_blocks(ext2_fs_t * this, unsigned int group) {
+	uint32_t left = SB->blocks_count - SB->first_data_block - group * SB->blocks_per_group;
+	return left < SB->blocks_per_group ? left : SB->blocks_per_group;
+}
 
-	mutex_acquire(this->mutex);
+/**
+ * ext2->group_bitmap Get the in-memory copy of a group's block or inode bitmap.
+ *
+ * Bitmaps are read the first time they are needed and written back by
+ * flush_metadata. Must be called with the filesystem mutex held.
+ */
+static uint8_t * group_bitmap(ext2_fs_t * this, uint8_t ** bitmaps, uint32_t block, unsigned int group) {
+	if (!bitmaps[group]) {
+		bitmaps[group] = malloc(this->block_size);
+		read_block(this, block, bitmaps[group]);
+	}
+	return bitmaps[group];
+}
+
+/**
+ * ext2->bitmap_find_clear Find the first clear bit at or after @p start and before @p end.
+ *
+ * @returns Its offset, or @p end if there is none.
+ */
+static uint32_t bitmap_find_clear(uint8_t * bg_buffer, uint32_t start, uint32_t end) {
+	uint32_t i = start;
+	while (i < end) {
+		if (!(i & 7) && i + 8 <= end && BLOCKBYTE(i) == 0xFF) {
+			i += 8;
+		} else if (BLOCKBIT(i)) {
+			i++;
+		} else {
+			return i;
+		}
+	}
+	return end;
+}
+
+static void metadata_dirtied(ext2_fs_t * this) {
+	if (!this->meta_dirty) {
+		this->meta_dirty = 1;
+		this->meta_dirtied = now();
+	}
+}
 
+/**
+ * ext2->flush_metadata Write out dirty bitmaps, group descriptors and the superblock.
+ */
+static void flush_metadata(ext2_fs_t * this) {
+	mutex_acquire(this->mutex);
 	for (unsigned int i = 0; i < BGDS; ++i) {
-		if (BGD[i].free_blocks_count > 0) {
-			read_block(this, BGD[i].block_bitmap, (uint8_t *)bg_buffer);
-			while (BLOCKBIT(block_offset)) {
-				++block_offset;
+		if (this->group_dirty[i] & EXT2_DIRTY_BLOCK_BITMAP) {
+			write_block(this, BGD[i].block_bitmap, this->block_bitmaps[i]);
+		}
+		if (this->group_dirty[i] & EXT2_DIRTY_INODE_BITMAP) {
+			write_block(this, BGD[i].inode_bitmap, this->inode_bitmaps[i]);
+		}
+		this->group_dirty[i] = 0;
+	}
+	if (this->meta_dirty) {
+		for (int i = 0; i < this->bgd_block_span; ++i) {
+			write_block(this, this->bgd_offset + i, (uint8_t *)((uintptr_t)BGD + this->block_size * i));
+		}
+		rewrite_superblock(this);
+		this->meta_dirty = 0;
+	}
+	mutex_release(this->mutex);
+}
+
+/**
+ * ext2->flush_stale_metadata Flush allocation metadata that has been dirty for a while.
+ *
+ * Metadata is otherwise only flushed when a file is closed or the
+ * filesystem is synced, which a long-running writer may not do.
+ */
+static void flush_stale_metadata(ext2_fs_t * this) {
+	if (this->meta_dirty && now() - this->meta_dirtied >= EXT2_FLUSH_AGE) {
+		flush_metadata(this);
+	}
+}
+
+static struct ext2_reservation * reservation_find(ext2_fs_t * this, uint32_t ino) {
+	for (int i = 0; i < EXT2_RESERVATIONS; ++i) {
+		if (this->reservations[i].ino == ino) return &this->reservations[i];
+	}
+	return NULL;
+}
+
+/**
+ * ext2->reservation_conflict Check whether a block is in another inode's reservation window.
+ *
+ * @returns The end of the window it is in, or 0 if @p ino may use it.
+ */
+static uint32_t reservation_conflict(ext2_fs_t * this, uint32_t ino, uint32_t block) {
+	for (int i = 0; i < EXT2_RESERVATIONS; ++i) {
+		struct ext2_reservation * rsv = &this->reservations[i];
+		if (rsv->ino && rsv->ino != ino && block >= rsv->start && block < rsv->end) return rsv->end;
+	}
+	return 0;
+}
+
+/**
+ * ext2->reservation_new Find a new reservation window for @p ino, as close after @p goal as possible.
+ *
+ * The goal's group is searched from the goal on, then the groups after
+ * it, then the goal's group again from its start. Windows do not cross
+ * groups, and end early at the first block that is already in use.
+ *
+ * @param size Blocks wanted in the window
+ * @returns The window, or NULL if every free block is in another window.
+ */
+static struct ext2_reservation * reservation_new(ext2_fs_t * this, uint32_t ino, uint32_t goal, unsigned int size) {
+	if (goal >= SB->blocks_count) goal = SB->first_data_block;
+	unsigned int goal_group = (goal - SB->first_data_block) / SB->blocks_per_group;
+
+	for (unsigned int i = 0; i <= BGDS; ++i) {
+		unsigned int group = (goal_group + i) % BGDS;
+		if (!BGD[group].free_blocks_count) continue;
+
+		uint32_t base = SB->first_data_block + group * SB->blocks_per_group;
+		uint32_t end = group_blocks(this, group);
+		uint32_t offset = this->group_hint[group];
+		if (i == 0 && goal - base > offset) offset = goal - base;
+
+		uint8_t * bg_buffer = group_bitmap(this, this->block_bitmaps, BGD[group].block_bitmap, group);
+		while ((offset = bitmap_find_clear(bg_buffer, offset, end)) < end) {
+			uint32_t skip = reservation_conflict(this, ino, base + offset);
+			if (skip) {
+				offset = skip - base;
+				continue;
 			}
-			block_no = block_offset + SB->blocks_per_group * i;
-			group = i;
-			break;
+
+			uint32_t length = 1;
+			while (length < size && offset + length < end && !BLOCKBIT(offset + length) &&
+				!reservation_conflict(this, ino, base + offset + length)) {
+				length++;
+			}
+
+			struct ext2_reservation * rsv = reservation_find(this, ino);
+			if (!rsv) {
+				rsv = &this->reservations[this->reservation_next];
+				this->reservation_next = (this->reservation_next + 1) % EXT2_RESERVATIONS;
+			}
+			rsv->ino   = ino;
+			rsv->start = base + offset;
+			rsv->end   = base + offset + length;
+			return rsv;
 		}
 	}
 
-	if (!block_no) {
-		mutex_release(this->mutex);
-		debug_print(CRITICAL, "No available blocks, disk is out of space!");
-		free(bg_buffer);
+	return NULL;
+}
+
+/**
+ * ext2->reservation_release Drop an inode's reservation window, if it has one.
+ */
+static void reservation_release(ext2_fs_t * this, uint32_t ino) {
+	mutex_acquire(this->mutex);
+	struct ext2_reservation * rsv = reservation_find(this, ino);
+	if (rsv) rsv->ino = 0;
+	mutex_release(this->mutex);
+}
+
+/**
+ * ext2->allocate_blocks Allocate a run of contiguous blocks for an inode.
+ *
+ * Blocks come from the inode's reservation window, from @p goal onwards
+ * if the goal is in it; a new window is found when there is none or the
+ * goal is outside of it. Only the in-memory bitmap and counters change
+ * here, and they reach the disk through flush_metadata. The contents of
+ * the blocks are left as they were.
+ *
+ * @param goal  Block to try to allocate first, usually the one after the
+ *              previous block of the file; 0 for anywhere in the inode's group
+ * @param count Number of blocks wanted; set to the number allocated
+ * @returns The first block allocated, or 0 if the disk is full.
+ */
+static uint32_t allocate_blocks(ext2_fs_t * this, uint32_t ino, uint32_t goal, unsigned int * count) {
+	unsigned int want = *count;
+	*count = 0;
+
+	if (goal < SB->first_data_block || goal >= SB->blocks_count) {
+		goal = SB->first_data_block + ((ino - 1) / this->inodes_per_group) * SB->blocks_per_group;
+	}
+
+	mutex_acquire(this->mutex);
+
+	struct ext2_reservation * rsv = reservation_find(this, ino);
+	uint32_t first = 0;
+
+	while (!first) {
+		if (!rsv || goal < rsv->start || goal >= rsv->end) {
+			unsigned int size = want > EXT2_RESERVE_BLOCKS ? want : EXT2_RESERVE_BLOCKS;
+			if (rsv && goal == rsv->end && size < 2 * (rsv->end - rsv->start)) {
+				/* A file that used up its window is being written sequentially; give it more. */
+				size = 2 * (rsv->end - rsv->start);
+				if (size > EXT2_RESERVE_MAX) size = EXT2_RESERVE_MAX;
+			}
+			rsv = reservation_new(this, ino, goal, size);
+			if (!rsv) {
+				/* Everything left is in other files' windows; take them back. */
+				for (int i = 0; i < EXT2_RESERVATIONS; ++i) {
+					this->reservations[i].ino = 0;
+				}
+				rsv = reservation_new(this, ino, goal, size);
+			}
+			if (!rsv) {
+				mutex_release(this->mutex);
+				debug_print(CRITICAL, "No available blocks, disk is out of space!");
+				return 0;
+			}
+			goal = rsv->start;
+		}
+
+		unsigned int group = (rsv->start - SB->first_data_block) / SB->blocks_per_group;
+		uint32_t base = SB->first_data_block + group * SB->blocks_per_group;
+		uint8_t * bg_buffer = group_bitmap(this, this->block_bitmaps, BGD[group].block_bitmap, group);
+
+		uint32_t offset = bitmap_find_clear(bg_buffer, goal - base, rsv->end - base);
+		if (offset == rsv->end - base) {
+			/* The rest of the window was used; move on to a new one after it. */
+			goal = rsv->end;
+			continue;
+		}
+
+		unsigned int length = 0;
+		while (length < want && offset + length < rsv->end - base && !BLOCKBIT(offset + length)) {
+			BLOCKBYTE(offset + length) |= SETBIT(offset + length);
+			length++;
+		}
+
+		if (this->group_hint[group] == offset) this->group_hint[group] = offset + length;
+		BGD[group].free_blocks_count -= length;
+		SB->free_blocks_count -= length;
+		this->group_dirty[group] |= EXT2_DIRTY_BLOCK_BITMAP;
+		metadata_dirtied(this);
+
+		first = base + offset;
+		*count = length;
+	}
+
+	mutex_release(this->mutex);
+
+	debug_print(WARNING, "allocated %u blocks at #%u for inode %u", *count, first, ino);
+	return first;
+}
+
+/**
+ * ext2->block_goal Pick where a new block of a file should go: right after the one before it.
+ */
+static uint32_t block_goal(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t block) {
+	uint32_t previous = block ? get_block_number(this, inode, block - 1) : 0;
+	return previous ? previous + 1 : 0;
+}
+
+/**
+ * ext2->allocate_inode_block Allocate a block in an inode.
+ *
+ * The block is cleared, as directories and symlinks, which grow a block at
+ * a time, expect. File data is allocated in bulk by write_inode_buffer.
+ *
+ * @param inode Inode to operate on
+ * @param inode_no Number of the inode (this is not part of the struct)
+ * @param block Block within inode to allocate
+ * @returns Error code or E_SUCCESS
+ */
+static int allocate_inode_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int block) {
+	debug_print(NOTICE, "Allocating block #%d for inode #%d", block, inode_no);
+	unsigned int count = 1;
+	uint32_t block_no = allocate_blocks(this, inode_no, block_goal(this, inode, block), &count);
+
+	if (!block_no) return E_NOSPACE;
+
+	uint8_t * empty = malloc(this->block_size);
+	memset(empty, 0, this->block_size);
+	write_block(this, block_no, empty);
+	free(empty);
+
+	inode->blocks += this->block_size / 512;
+	int result = set_block_number(this, inode, inode_no, block, block_no);
+	write_inode(this, inode, inode_no);
+
+	return result;
+}
+
+/**
+ * ext2->inode_read_block
+ *
+ * @param inode
+ * @param no
+ * @param block
+ * @parma buf
+ * @returns Real block number for reference, or 0 for a hole.
+ */
+static unsigned int inode_read_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int block, uint8_t * buf) {
+	unsigned int real_block = get_block_number(this, inode, block);
+
+	if (!real_block) {
+		memset(buf, 0x00, this->block_size);
 		return 0;
 	}
 
-	debug_print(WARNING, "allocating block #%zu (group %zu)", block_no, group);
+	read_block(this, real_block, buf);
+
+	return real_block;
+}
+
+/**
+ * ext2->inode_write_block
+ */
+static unsigned int inode_write_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int block, uint8_t * buf) {
+	unsigned int real_block = get_block_number(this, inode, block);
+
+	if (!real_block) {
+		if (allocate_inode_block(this, inode, inode_no, block) != E_SUCCESS) return 0;
+		real_block = get_block_number(this, inode, block);
+	}
+
+	debug_print(WARNING, "Writing virtual block %d for inode %d maps to real block %d", block, inode_no, real_block);
+
+	write_block(this, real_block, buf);
+	return real_block;
+}
+
+/*
+ * Hashed directory indexes (dir_index, or "htree").
+ *
+ * An indexed directory keeps a tree of hash ranges in its first block,
+ * hidden in the slack space of the ".." entry, and in any further index
+ * blocks, which look like a single deleted entry spanning the block.
+ * The leaves are ordinary directory blocks, each holding the names
+ * whose hashes fall in its range, so anything that scans a directory
+ * linearly still sees every entry. The layout and hash functions
+ * match ext3 and ext4.
+ */
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x0020
+#define EXT2_INDEX_FL                 0x00001000
+#define EXT2_FLAGS_UNSIGNED_HASH      0x0002
+
+#define DX_HASH_LEGACY   0
+#define DX_HASH_HALF_MD4 1
+#define DX_HASH_TEA      2
+#define DX_HASH_UNSIGNED 3   /* Added to the above for the unsigned char variants */
+
+/* Index levels we can follow. We only ever add the second one ourselves. */
+#define DX_MAX_DEPTH 3
+
+#define DX_LINEAR    -1      /* No usable index; search the directory linearly */
+#define DX_NOT_FOUND -2
+
+/* Where the entry table starts in the root and in other index blocks */
+#define DX_ROOT_ENTRIES 0x20
+#define DX_NODE_ENTRIES 0x08
+
+struct ext2_dx_root_info {
+	uint32_t reserved_zero;
+	uint8_t hash_version;
+	uint8_t info_length;
+	uint8_t indirect_levels;
+	uint8_t unused_flags;
+} __attribute__ ((packed));
+
+struct ext2_dx_entry {
+	uint32_t hash;
+	uint32_t block;
+} __attribute__ ((packed));
+
+/* Overlays the hash of the first entry in a table, which is implicitly 0 */
+struct ext2_dx_countlimit {
+	uint16_t limit;
+	uint16_t count;
+} __attribute__ ((packed));
+
+#define DX_LIMIT(entries) (((struct ext2_dx_countlimit *)(entries))->limit)
+#define DX_COUNT(entries) (((struct ext2_dx_countlimit *)(entries))->count)
+#define DX_BLOCK(entry)   ((entry)->block & 0x0FFFFFFF)
+
+#define DIR_REC_LEN(name_len) ((sizeof(ext2_dir_t) + (name_len) + 3) & ~3)
+
+/* One index block on the way from the root to a leaf */
+struct dx_frame {
+	uint8_t * block;
+	uint32_t block_nr;
+	struct ext2_dx_entry * entries;
+	struct ext2_dx_entry * at;
+};
+
+struct dx_path {
+	int levels;          /* Index levels below the root */
+	int version;         /* Hash function in use */
+	uint32_t hash;       /* Hash of the name being looked for */
+	struct dx_frame frames[DX_MAX_DEPTH];
+};
+
+#define ROL32(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+
+static uint32_t dx_hack_hash(const char * name, int len, int is_unsigned) {
+	uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+	for (int i = 0; i < len; ++i) {
+		uint32_t c = is_unsigned ? (uint32_t)(unsigned char)name[i] : (uint32_t)(int)(signed char)name[i];
+		hash = hash1 + (hash0 ^ (c * 7152373));
+		if (hash & 0x80000000) hash -= 0x7fffffff;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+	return hash0 << 1;
+}
+
+static void dx_str2hashbuf(const char * msg, int len, uint32_t * buf, int num, int is_unsigned) {
+	uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+	pad |= pad << 16;
+
+	uint32_t val = pad;
+	if (len > num * 4) len = num * 4;
+	for (int i = 0; i < len; ++i) {
+		uint32_t c = is_unsigned ? (uint32_t)(unsigned char)msg[i] : (uint32_t)(int)(signed char)msg[i];
+		val = c + (val << 8);
+		if ((i % 4) == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0) *buf++ = val;
+	while (--num >= 0) *buf++ = pad;
+}
+
+static void dx_tea_transform(uint32_t buf[4], const uint32_t in[4]) {
+	uint32_t sum = 0;
+	uint32_t b0 = buf[0], b1 = buf[1];
+	for (int n = 0; n < 16; ++n) {
+		sum += 0x9E3779B9;
+		b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+		b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+	}
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+#define MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD4_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = ROL32(a, s))
+#define MD4_K2 013240474631U
+#define MD4_K3 015666365641U
+
+static void dx_half_md4_transform(uint32_t buf[4], const uint32_t in[8]) {
+	uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	MD4_ROUND(MD4_F, a, b, c, d, in[0],  3);
+	MD4_ROUND(MD4_F, d, a, b, c, in[1],  7);
+	MD4_ROUND(MD4_F, c, d, a, b, in[2], 11);
+	MD4_ROUND(MD4_F, b, c, d, a, in[3], 19);
+	MD4_ROUND(MD4_F, a, b, c, d, in[4],  3);
+	MD4_ROUND(MD4_F, d, a, b, c, in[5],  7);
+	MD4_ROUND(MD4_F, c, d, a, b, in[6], 11);
+	MD4_ROUND(MD4_F, b, c, d, a, in[7], 19);
+
+	MD4_ROUND(MD4_G, a, b, c, d, in[1] + MD4_K2,  3);
+	MD4_ROUND(MD4_G, d, a, b, c, in[3] + MD4_K2,  5);
+	MD4_ROUND(MD4_G, c, d, a, b, in[5] + MD4_K2,  9);
+	MD4_ROUND(MD4_G, b, c, d, a, in[7] + MD4_K2, 13);
+	MD4_ROUND(MD4_G, a, b, c, d, in[0] + MD4_K2,  3);
+	MD4_ROUND(MD4_G, d, a, b, c, in[2] + MD4_K2,  5);
+	MD4_ROUND(MD4_G, c, d, a, b, in[4] + MD4_K2,  9);
+	MD4_ROUND(MD4_G, b, c, d, a, in[6] + MD4_K2, 13);
+
+	MD4_ROUND(MD4_H, a, b, c, d, in[3] + MD4_K3,  3);
+	MD4_ROUND(MD4_H, d, a, b, c, in[7] + MD4_K3,  9);
+	MD4_ROUND(MD4_H, c, d, a, b, in[2] + MD4_K3, 11);
+	MD4_ROUND(MD4_H, b, c, d, a, in[6] + MD4_K3, 15);
+	MD4_ROUND(MD4_H, a, b, c, d, in[1] + MD4_K3,  3);
+	MD4_ROUND(MD4_H, d, a, b, c, in[5] + MD4_K3,  9);
+	MD4_ROUND(MD4_H, c, d, a, b, in[0] + MD4_K3, 11);
+	MD4_ROUND(MD4_H, b, c, d, a, in[4] + MD4_K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+/**
+ * ext2->dx_hash Hash a name the way the directory index does.
+ *
+ * @param version One of DX_HASH_*, plus DX_HASH_UNSIGNED if the filesystem says so
+ * @returns The major hash, with the low bit clear.
+ */
+static uint32_t dx_hash(ext2_fs_t * this, int version, const char * name, int len) {
+	uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	uint32_t in[8];
+	uint32_t hash = 0;
+	int is_unsigned = version >= DX_HASH_UNSIGNED;
+
+	if (SB->hash_seed[0] || SB->hash_seed[1] || SB->hash_seed[2] || SB->hash_seed[3]) {
+		memcpy(buf, SB->hash_seed, sizeof(buf));
+	}
+
+	switch (version % DX_HASH_UNSIGNED) {
+		case DX_HASH_LEGACY:
+			hash = dx_hack_hash(name, len, is_unsigned);
+			break;
+		case DX_HASH_HALF_MD4:
+			for (; len > 0; len -= 32, name += 32) {
+				dx_str2hashbuf(name, len, in, 8, is_unsigned);
+				dx_half_md4_transform(buf, in);
+			}
+			hash = buf[1];
+			break;
+		case DX_HASH_TEA:
+			for (; len > 0; len -= 16, name += 16) {
+				dx_str2hashbuf(name, len, in, 4, is_unsigned);
+				dx_tea_transform(buf, in);
+			}
+			hash = buf[0];
+			break;
+	}
+
+	hash &= ~1;
+	if (hash == (0x7fffffffU << 1)) hash = (0x7fffffffU - 1) << 1;
+	return hash;
+}
+
+static void dx_release(struct dx_path * path) {
+	for (int i = 0; i <= path->levels; ++i) {
+		free(path->frames[i].block);
+	}
+}
+
+/**
+ * ext2->dx_search Find the last entry of an index table whose hash is at most @p hash.
+ */
+static struct ext2_dx_entry * dx_search(struct ext2_dx_entry * entries, uint32_t hash) {
+	struct ext2_dx_entry * p = entries + 1;
+	struct ext2_dx_entry * q = entries + DX_COUNT(entries) - 1;
+	while (p <= q) {
+		struct ext2_dx_entry * m = p + (q - p) / 2;
+		if (m->hash > hash) {
+			q = m - 1;
+		} else {
+			p = m + 1;
+		}
+	}
+	return p - 1;
+}
+
+/**
+ * ext2->dx_probe Walk a directory's index from the root to the leaf for @p name.
+ *
+ * @returns 0 with @p path filled in, or DX_LINEAR if the directory has
+ *          no index, or one we don't understand.
+ */
+static int dx_probe(ext2_fs_t * this, ext2_inodetable_t * inode, const char * name, struct dx_path * path) {
+	if (!(SB->feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)) return DX_LINEAR;
+	if (!(inode->flags & EXT2_INDEX_FL)) return DX_LINEAR;
+
+	uint32_t dir_blocks = inode->size / this->block_size;
+	uint8_t * block = malloc(this->block_size);
+	inode_read_block(this, inode, 0, block);
+
+	struct ext2_dx_root_info * info = (struct ext2_dx_root_info *)(block + 24);
+	if (info->reserved_zero || info->info_length != 8 ||
+		info->hash_version > DX_HASH_TEA || info->indirect_levels >= DX_MAX_DEPTH) {
+		free(block);
+		goto _corrupt;
+	}
+
+	path->levels  = info->indirect_levels;
+	path->version = info->hash_version;
+	if (SB->flags & EXT2_FLAGS_UNSIGNED_HASH) path->version += DX_HASH_UNSIGNED;
+	path->hash    = dx_hash(this, path->version, name, strlen(name));
+
+	uint32_t block_nr = 0;
+	struct ext2_dx_entry * entries = (struct ext2_dx_entry *)(block + DX_ROOT_ENTRIES);
+	unsigned int limit = (this->block_size - DX_ROOT_ENTRIES) / sizeof(struct ext2_dx_entry);
+
+	for (int level = 0; ; ++level) {
+		if (DX_LIMIT(entries) != limit || !DX_COUNT(entries) || DX_COUNT(entries) > limit) {
+			path->levels = level - 1;
+			dx_release(path);
+			free(block);
+			goto _corrupt;
+		}
+
+		struct dx_frame * frame = &path->frames[level];
+		frame->block    = block;
+		frame->block_nr = block_nr;
+		frame->entries  = entries;
+		frame->at       = dx_search(entries, path->hash);
+
+		if (level == path->levels) break;
+
+		block_nr = DX_BLOCK(frame->at);
+		if (!block_nr || block_nr >= dir_blocks) {
+			path->levels = level;
+			dx_release(path);
+			goto _corrupt;
+		}
+
+		block = malloc(this->block_size);
+		inode_read_block(this, inode, block_nr, block);
+		entries = (struct ext2_dx_entry *)(block + DX_NODE_ENTRIES);
+		limit = (this->block_size - DX_NODE_ENTRIES) / sizeof(struct ext2_dx_entry);
+	}
+
+	if (DX_BLOCK(path->frames[path->levels].at) >= dir_blocks) {
+		dx_release(path);
+		goto _corrupt;
+	}
+
+	return 0;
+
+_corrupt:
+	debug_print(WARNING, "Directory index is damaged; searching the directory linearly.");
+	return DX_LINEAR;
+}
+
+/**
+ * ext2->dx_next_leaf Move a lookup on to the next leaf if the name's hash continues there.
+ *
+ * Names with the same hash can straddle two leaves; the second is marked
+ * in the index by setting the low bit of its hash.
+ *
+ * @returns 1 if there is another leaf to search, 0 if not.
+ */
+static int dx_next_leaf(ext2_fs_t * this, ext2_inodetable_t * inode, struct dx_path * path) {
+	int level = path->levels;
+	struct dx_frame * frame;
+
+	while (1) {
+		frame = &path->frames[level];
+		if (frame->at + 1 < frame->entries + DX_COUNT(frame->entries)) break;
+		if (!level) return 0;
+		level--;
+	}
 
-	BLOCKBYTE(block_offset) |= SETBIT(block_offset);
-	write_block(this, BGD[group].block_bitmap, (uint8_t *)bg_buffer);
+	frame->at++;
+	if ((frame->at->hash & ~1) != path->hash) return 0;
 
-	BGD[group].free_blocks_count--;
-	for (int i = 0; i < this->bgd_block_span; ++i) {
-		write_block(this, this->bgd_offset + i, (uint8_t *)((uintptr_t)BGD + this->block_size * i));
+	while (level < path->levels) {
+		uint32_t block_nr = DX_BLOCK(frame->at);
+		frame = &path->frames[++level];
+		frame->block_nr = block_nr;
+		inode_read_block(this, inode, block_nr, frame->block);
+		frame->entries = (struct ext2_dx_entry *)(frame->block + DX_NODE_ENTRIES);
+		frame->at = frame->entries;
 	}
 
-	SB->free_blocks_count--;
-	rewrite_superblock(this);
+	return 1;
+}
 
-	memset(bg_buffer, 0x00, this->block_size);
-	write_block(this, block_no, bg_buffer);
+/**
+ * ext2->dir_block_find Search one directory block for @p name.
+ *
+ * @returns Offset of the entry within the block, or -1.
+ */
+static int dir_block_find(ext2_fs_t * this, uint8_t * block, const char * name) {
+	size_t len = strlen(name);
+	unsigned int offset = 0;
+	while (offset + sizeof(ext2_dir_t) <= this->block_size) {
+		ext2_dir_t * d_ent = (ext2_dir_t *)(block + offset);
+		if (d_ent->rec_len < sizeof(ext2_dir_t) || offset + d_ent->rec_len > this->block_size) break;
+		if (d_ent->inode && d_ent->name_len == len && !memcmp(d_ent->name, name, len)) return offset;
+		offset += d_ent->rec_len;
+	}
+	return -1;
+}
 
-	mutex_release(this->mutex);
+/**
+ * ext2->dir_block_insert Add an entry to a directory block if it has room.
+ *
+ * Not for index blocks, whose fake entries look like free space.
+ *
+ * @returns 1 if the entry was added, 0 if the block is full.
+ */
+static int dir_block_insert(ext2_fs_t * this, uint8_t * block, const char * name, uint32_t inode) {
+	size_t len = strlen(name);
+	unsigned int needed = DIR_REC_LEN(len);
+	unsigned int offset = 0;
+	while (offset + sizeof(ext2_dir_t) <= this->block_size) {
+		ext2_dir_t * d_ent = (ext2_dir_t *)(block + offset);
+		if (d_ent->rec_len < sizeof(ext2_dir_t) || offset + d_ent->rec_len > this->block_size) break;
+
+		unsigned int used = d_ent->inode ? DIR_REC_LEN(d_ent->name_len) : 0;
+		if (d_ent->rec_len >= used + needed) {
+			if (used) {
+				ext2_dir_t * next = (ext2_dir_t *)(block + offset + used);
+				next->rec_len = d_ent->rec_len - used;
+				d_ent->rec_len = used;
+				d_ent = next;
+			}
+			d_ent->inode     = inode;
+			d_ent->name_len  = len;
+			d_ent->file_type = 0;
+			memcpy(d_ent->name, name, len);
+			return 1;
+		}
 
-	free(bg_buffer);
+		offset += d_ent->rec_len;
+	}
+	return 0;
+}
 
-	return block_no;
+/**
+ * ext2->dir_append_block Add a block to the end of a directory.
+ *
+ * @returns The new block's number within the directory, or 0 if the disk is full.
+ */
+static uint32_t dir_append_block(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t inode_no) {
+	uint32_t block_nr = inode->size / this->block_size;
+	if (allocate_inode_block(this, inode, inode_no, block_nr) != E_SUCCESS) return 0;
+	inode->size += this->block_size;
+	write_inode(this, inode, inode_no);
+	return block_nr;
+}
+
+/**
+ * ext2->dx_lookup Find @p name through a directory's hash index.
+ *
+ * @param block_nr Set to the directory block holding the entry
+ * @param block    Filled with the contents of that block
+ * @returns Offset of the entry within the block, DX_NOT_FOUND, or
+ *          DX_LINEAR if the directory has to be searched linearly.
+ */
+static int dx_lookup(ext2_fs_t * this, ext2_inodetable_t * inode, const char * name, uint32_t * block_nr, uint8_t * block) {
+	struct dx_path path;
+	if (dx_probe(this, inode, name, &path) < 0) return DX_LINEAR;
+
+	int result = DX_NOT_FOUND;
+	do {
+		*block_nr = DX_BLOCK(path.frames[path.levels].at);
+		inode_read_block(this, inode, *block_nr, block);
+		int offset = dir_block_find(this, block, name);
+		if (offset >= 0) {
+			result = offset;
+			break;
+		}
+	} while (dx_next_leaf(this, inode, &path));
+
+	dx_release(&path);
+	return result;
+}
 
+/**
+ * ext2->dx_insert_entry Add an index entry just after the one @p frame is following.
+ */
+static void dx_insert_entry(struct dx_frame * frame, uint32_t hash, uint32_t block_nr) {
+	struct ext2_dx_entry * entries = frame->entries;
+	struct ext2_dx_entry * slot = frame->at + 1;
+	uint16_t count = DX_COUNT(entries);
+	memmove(slot + 1, slot, (entries + count - slot) * sizeof(struct ext2_dx_entry));
+	slot->hash  = hash;
+	slot->block = block_nr;
+	DX_COUNT(entries) = count + 1;
 }
 
+static uint8_t * dx_new_node(ext2_fs_t * this) {
+	uint8_t * node = malloc(this->block_size);
+	memset(node, 0, this->block_size);
+	((ext2_dir_t *)node)->rec_len = this->block_size;
+	DX_LIMIT(node + DX_NODE_ENTRIES) = (this->block_size - DX_NODE_ENTRIES) / sizeof(struct ext2_dx_entry);
+	return node;
+}
 
 /**
- * ext2->allocate_inode_block Allocate a block in an inode.
+ * ext2->dx_grow Make room for another entry in the lowest index block of a lookup path.
  *
- * @param inode Inode to operate on
- * @param inode_no Number of the inode (this is not part of the struct)
- * @param block Block within inode to allocate
- * @returns Error code or E_SUCCESS
+ * A full root is moved down into a new index block, adding a level
+ * to the tree. A full index block below the root is split in two if
+ * its parent has room. The path is left following the same entry,
+ * wherever it ended up.
+ *
+ * @returns 0 on success, -1 if the index can not grow any further.
  */
-static int allocate_inode_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int block) {
-	debug_print(NOTICE, "Allocating block #%d for inode #%d", block, inode_no);
-	unsigned int block_no = allocate_block(this);
+static int dx_grow(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t inode_no, struct dx_path * path) {
+	struct dx_frame * frame = &path->frames[path->levels];
+	uint16_t count = DX_COUNT(frame->entries);
+
+	if (path->levels == 0) {
+		uint32_t node_nr = dir_append_block(this, inode, inode_no);
+		if (!node_nr) return -1;
+
+		uint8_t * node = dx_new_node(this);
+		struct ext2_dx_entry * entries = (struct ext2_dx_entry *)(node + DX_NODE_ENTRIES);
+		uint16_t limit = DX_LIMIT(entries);
+		memcpy(entries, frame->entries, count * sizeof(struct ext2_dx_entry));
+		DX_LIMIT(entries) = limit;
+
+		/* The root is left with a single entry, for the new block */
+		DX_COUNT(frame->entries) = 1;
+		frame->entries[0].block = node_nr;
+		((struct ext2_dx_root_info *)(frame->block + 24))->indirect_levels = 1;
+
+		inode_write_block(this, inode, inode_no, node_nr, node);
+		inode_write_block(this, inode, inode_no, frame->block_nr, frame->block);
+
+		path->levels = 1;
+		path->frames[1].block    = node;
+		path->frames[1].block_nr = node_nr;
+		path->frames[1].entries  = entries;
+		path->frames[1].at       = entries + (frame->at - frame->entries);
+		frame->at = frame->entries;
+		return 0;
+	}
 
-	if (!block_no) return E_NOSPACE;
+	struct dx_frame * parent = &path->frames[path->levels - 1];
+	if (DX_COUNT(parent->entries) >= DX_LIMIT(parent->entries)) return -1;
+
+	uint32_t node_nr = dir_append_block(this, inode, inode_no);
+	if (!node_nr) return -1;
+
+	/* Move the upper half of the entries to a new index block */
+	uint8_t * node = dx_new_node(this);
+	struct ext2_dx_entry * entries = (struct ext2_dx_entry *)(node + DX_NODE_ENTRIES);
+	uint16_t limit = DX_LIMIT(entries);
+	uint16_t keep = count / 2;
+	uint32_t split_hash = frame->entries[keep].hash;
+	memcpy(entries, frame->entries + keep, (count - keep) * sizeof(struct ext2_dx_entry));
+	DX_LIMIT(entries) = limit;
+	DX_COUNT(entries) = count - keep;
+	DX_COUNT(frame->entries) = keep;
+
+	dx_insert_entry(parent, split_hash, node_nr);
+
+	inode_write_block(this, inode, inode_no, node_nr, node);
+	inode_write_block(this, inode, inode_no, frame->block_nr, frame->block);
+	inode_write_block(this, inode, inode_no, parent->block_nr, parent->block);
+
+	if (frame->at >= frame->entries + keep) {
+		struct ext2_dx_entry * at = entries + (frame->at - frame->entries - keep);
+		free(frame->block);
+		frame->block    = node;
+		frame->block_nr = node_nr;
+		frame->entries  = entries;
+		frame->at       = at;
+		parent->at++;
+	} else {
+		free(node);
+	}
 
-	set_block_number(this, inode, inode_no, block, block_no);
+	return 0;
+}
 
-	unsigned int t = (block + 1) * (this->block_size / 512);
-	if (inode->blocks < t) {
-		debug_print(NOTICE, "Setting inode->blocks to %d = (%d fs blocks)", t, t / (this->block_size / 512));
-		inode->blocks = t;
-	}
-	write_inode(this, inode, inode_no);
+struct dx_map_entry {
+	uint32_t hash;
+	uint16_t offset;
+	uint16_t size;
+};
 
-	return E_SUCCESS;
+/**
+ * ext2->dx_pack Lay out a run of directory entries from @p from compactly in @p to.
+ */
+static void dx_pack(ext2_fs_t * this, uint8_t * to, uint8_t * from, struct dx_map_entry * map, int count) {
+	unsigned int offset = 0;
+	ext2_dir_t * last = NULL;
+	memset(to, 0, this->block_size);
+	for (int i = 0; i < count; ++i) {
+		last = (ext2_dir_t *)(to + offset);
+		memcpy(last, from + map[i].offset, map[i].size);
+		last->rec_len = map[i].size;
+		offset += map[i].size;
+	}
+	last->rec_len += this->block_size - offset;
 }
 
 /**
- * ext2->inode_read_block
+ * ext2->dx_split_leaf Move the names in the upper half of a full leaf's hash range to a new block.
  *
- * @param inode
- * @param no
- * @param block
- * @parma buf
- * @returns Real block number for reference.
+ * @param leaf       Contents of the full leaf; rewritten with the names that stay
+ * @param out        Filled with the contents of the new leaf
+ * @param split_hash Set to the lowest hash in the new leaf, with the low
+ *                   bit set if names with that hash remain in the old one
+ * @returns The new leaf's block number, or 0 if it could not be allocated.
  */
-static unsigned int inode_read_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int block, uint8_t * buf) {
+static uint32_t dx_split_leaf(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t inode_no, int version,
+		uint8_t * leaf, uint8_t * out, uint32_t * split_hash) {
+	int max = this->block_size / DIR_REC_LEN(1);
+	struct dx_map_entry * map = malloc(sizeof(struct dx_map_entry) * max);
+	int count = 0;
+
+	unsigned int offset = 0;
+	while (offset + sizeof(ext2_dir_t) <= this->block_size) {
+		ext2_dir_t * d_ent = (ext2_dir_t *)(leaf + offset);
+		if (d_ent->rec_len < sizeof(ext2_dir_t) || offset + d_ent->rec_len > this->block_size) break;
+		if (d_ent->inode && count < max) {
+			map[count].hash   = dx_hash(this, version, d_ent->name, d_ent->name_len);
+			map[count].offset = offset;
+			map[count].size   = DIR_REC_LEN(d_ent->name_len);
+			count++;
+		}
+		offset += d_ent->rec_len;
+	}
 
-	if (block >= inode->blocks / (this->block_size / 512)) {
-		memset(buf, 0x00, this->block_size);
-		debug_print(WARNING, "Tried to read an invalid block. Asked for %d (0-indexed), but inode only has %d!", block, inode->blocks / (this->block_size / 512));
-		return 0;
+	uint32_t new_nr = 0;
+	if (count < 2) goto _done;
+
+	/* Sort by hash; a leaf holds at most a few hundred names */
+	for (int i = 1; i < count; ++i) {
+		struct dx_map_entry m = map[i];
+		int j = i;
+		while (j > 0 && map[j - 1].hash > m.hash) {
+			map[j] = map[j - 1];
+			j--;
+		}
+		map[j] = m;
 	}
 
-	unsigned int real_block = get_block_number(this, inode, block);
-	read_block(this, real_block, buf);
+	new_nr = dir_append_block(this, inode, inode_no);
+	if (!new_nr) goto _done;
 
-	return real_block;
+	int split = count / 2;
+	*split_hash = map[split].hash | (map[split].hash == map[split - 1].hash);
+
+	uint8_t * old = malloc(this->block_size);
+	memcpy(old, leaf, this->block_size);
+	dx_pack(this, out, old, map + split, count - split);
+	dx_pack(this, leaf, old, map, split);
+	free(old);
+
+_done:
+	free(map);
+	return new_nr;
 }
 
 /**
- * ext2->inode_write_block
+ * ext2->dx_add_entry Add a name to an indexed directory.
+ *
+ * @returns 0 on success, a negative errno, or DX_LINEAR if the directory has no usable index.
  */
-static unsigned int inode_write_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int block, uint8_t * buf) {
-	if (block >= inode->blocks / (this->block_size / 512)) {
-		debug_print(WARNING, "Attempting to write beyond the existing allocated blocks for this inode.");
-		debug_print(WARNING, "Inode %d, Block %d", inode_no, block);
+static int dx_add_entry(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t inode_no, const char * name, uint32_t child) {
+	struct dx_path path;
+	if (dx_probe(this, inode, name, &path) < 0) return DX_LINEAR;
+
+	int result = 0;
+	struct dx_frame * frame = &path.frames[path.levels];
+	uint32_t leaf_nr = DX_BLOCK(frame->at);
+	uint8_t * leaf = malloc(this->block_size);
+	uint8_t * fresh = NULL;
+	inode_read_block(this, inode, leaf_nr, leaf);
+
+	if (dir_block_insert(this, leaf, name, child)) {
+		inode_write_block(this, inode, inode_no, leaf_nr, leaf);
+		goto _done;
+	}
+
+	/* The leaf has to be split, and its index block needs room for the new half */
+	if (DX_COUNT(frame->entries) >= DX_LIMIT(frame->entries)) {
+		if (dx_grow(this, inode, inode_no, &path) < 0) {
+			result = -ENOSPC;
+			goto _done;
+		}
+		frame = &path.frames[path.levels];
+	}
+
+	fresh = malloc(this->block_size);
+	uint32_t split_hash;
+	uint32_t fresh_nr = dx_split_leaf(this, inode, inode_no, path.version, leaf, fresh, &split_hash);
+	if (!fresh_nr) {
+		result = -ENOSPC;
+		goto _done;
 	}
 
-	debug_print(WARNING, "clearing and allocating up to required blocks (block=%d, %d)", block, inode->blocks);
-	char * empty = NULL;
+	dx_insert_entry(frame, split_hash, fresh_nr);
+	inode_write_block(this, inode, inode_no, frame->block_nr, frame->block);
 
-	while (block >= inode->blocks / (this->block_size / 512)) {
-		allocate_inode_block(this, inode, inode_no, inode->blocks / (this->block_size / 512));
-		refresh_inode(this, inode, inode_no);
+	if (!dir_block_insert(this, path.hash >= split_hash ? fresh : leaf, name, child)) {
+		result = -ENOSPC;
 	}
-	if (empty) free(empty);
-	debug_print(WARNING, "... done");
 
-	unsigned int real_block = get_block_number(this, inode, block);
-	debug_print(WARNING, "Writing virtual block %d for inode %d maps to real block %d", block, inode_no, real_block);
+	inode_write_block(this, inode, inode_no, fresh_nr, fresh);
+	inode_write_block(this, inode, inode_no, leaf_nr, leaf);
 
-	write_block(this, real_block, buf);
-	return real_block;
+_done:
+	free(fresh);
+	free(leaf);
+	dx_release(&path);
+	return result;
+}
+
+/**
+ * ext2->dx_make_indexed Give a directory that has outgrown its first block an index.
+ *
+ * Everything after ".." moves to a new leaf, and the first block
+ * becomes the root of an index with that leaf as its only entry.
+ *
+ * @param root Contents of the directory's first block
+ * @returns 0 on success, -1 if the directory was left as it was.
+ */
+static int dx_make_indexed(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t inode_no, uint8_t * root) {
+	ext2_dir_t * dot    = (ext2_dir_t *)root;
+	ext2_dir_t * dotdot = (ext2_dir_t *)(root + 12);
+	if (dot->rec_len != 12 || dot->name_len != 1 || dot->name[0] != '.') return -1;
+	if (dotdot->name_len != 2 || memcmp(dotdot->name, "..", 2)) return -1;
+	if (SB->def_hash_version > DX_HASH_TEA) return -1;
+
+	unsigned int start = 12 + dotdot->rec_len;
+	if (start >= this->block_size) return -1;
+
+	uint32_t leaf_nr = dir_append_block(this, inode, inode_no);
+	if (!leaf_nr) return -1;
+
+	uint8_t * leaf = malloc(this->block_size);
+	memset(leaf, 0, this->block_size);
+	memcpy(leaf, root + start, this->block_size - start);
+
+	/* The last entry has to reach the end of its new block */
+	unsigned int offset = 0;
+	ext2_dir_t * last;
+	while (1) {
+		last = (ext2_dir_t *)(leaf + offset);
+		if (last->rec_len < sizeof(ext2_dir_t) || offset + last->rec_len >= this->block_size - start) break;
+		offset += last->rec_len;
+	}
+	last->rec_len = this->block_size - offset;
+
+	memset(root + 24, 0, this->block_size - 24);
+	dotdot->rec_len = this->block_size - 12;
+
+	struct ext2_dx_root_info * info = (struct ext2_dx_root_info *)(root + 24);
+	info->hash_version = SB->def_hash_version;
+	info->info_length  = 8;
+
+	struct ext2_dx_entry * entries = (struct ext2_dx_entry *)(root + DX_ROOT_ENTRIES);
+	DX_LIMIT(entries) = (this->block_size - DX_ROOT_ENTRIES) / sizeof(struct ext2_dx_entry);
+	DX_COUNT(entries) = 1;
+	entries[0].block  = leaf_nr;
+
+	inode_write_block(this, inode, inode_no, leaf_nr, leaf);
+	inode_write_block(this, inode, inode_no, 0, root);
+	free(leaf);
+
+	inode->flags |= EXT2_INDEX_FL;
+	write_inode(this, inode, inode_no);
+	return 0;
 }
 
 /**
@@ -653,6 +1835,29 @@ static int create_entry(fs_node_t * parent, const char * name, uint32_t inode) {
 
 	debug_print(WARNING, "Creating a directory entry for %s pointing to inode %d.", name, inode);
 
+	int indexed = dx_add_entry(this, pinode, parent->inode, name, inode);
+	if (indexed != DX_LINEAR) {
+		free(pinode);
+		return indexed;
+	}
+
+	if ((SB->feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) && pinode->size == this->block_size) {
+		/* Directories that outgrow their first block get an index */
+		uint8_t * root = malloc(this->block_size);
+		inode_read_block(this, pinode, 0, root);
+		if (dir_block_insert(this, root, name, inode)) {
+			inode_write_block(this, pinode, parent->inode, 0, root);
+			indexed = 0;
+		} else if (!dx_make_indexed(this, pinode, parent->inode, root)) {
+			indexed = dx_add_entry(this, pinode, parent->inode, name, inode);
+		}
+		free(root);
+		if (indexed != DX_LINEAR) {
+			free(pinode);
+			return indexed;
+		}
+	}
+
 	/* okay, how big is it... */
 
 	debug_print(WARNING, "We need to append %zd bytes to the direcotry.", sizeof(ext2_dir_t) + strlen(name));
@@ -671,7 +1876,7 @@ static int create_entry(fs_node_t * parent, const char * name, uint32_t inode) {
 	debug_print(WARNING, "Block size is %d", this->block_size);
 
 	uint8_t * block = malloc(this->block_size);
-	uint8_t block_nr = 0;
+	uint32_t block_nr = 0;
 	uint32_t dir_offset = 0;
 	uint32_t total_offset = 0;
 	int modify_or_replace = 0;
@@ -765,69 +1970,56 @@ static int create_entry(fs_node_t * parent, const char * name, uint32_t inode) {
 	return E_NOSPACE;
 }
 
-static unsigned int allocate_inode(ext2_fs_t * this) {
-	uint32_t node_no     = 0;
-	uint32_t node_offset = 0;
-	uint32_t group       = 0;
-	uint8_t * bg_buffer  = malloc(this->block_size);
+/**
+ * ext2->allocate_inode Allocate an inode.
+ *
+ * Files go in the same group as their directory, so that they and their
+ * blocks end up near it. New directories go in the group with the most
+ * free blocks, to leave room for what they will hold.
+ *
+ * @param parent    Inode number of the directory the new inode will be in
+ * @param directory Whether the new inode is for a directory
+ * @returns The inode number, or 0 if there are none left.
+ */
+static unsigned int allocate_inode(ext2_fs_t * this, uint32_t parent, int directory) {
+	uint32_t first_ino = SB->rev_level ? SB->first_ino : 11;
 
 	mutex_acquire(this->mutex);
 
-	for (unsigned int i = 0; i < BGDS; ++i) {
-		if (BGD[i].free_inodes_count > 0) {
-			debug_print(NOTICE, "Group %d has %d free inodes.", i, BGD[i].free_inodes_count);
-			read_block(this, BGD[i].inode_bitmap, (uint8_t *)bg_buffer);
-
-			/* Sorry for the weird loops */
-			while (1) {
-				while (BLOCKBIT(node_offset)) {
-					node_offset++;
-					if (node_offset == this->inodes_per_group) {
-						goto _next_block;
-					}
-				}
-				node_no = node_offset + i * this->inodes_per_group + 1;
-				/* Is this a reserved inode? */
-				if (node_no <= 10) {
-					node_offset++;
-					if (node_offset == this->inodes_per_group) {
-						goto _next_block;
-					}
-					continue;
-				}
-				break;
-			}
-			if (node_offset == this->inodes_per_group) {
-				_next_block:
-				node_offset = 0;
-				continue;
+	unsigned int first_group = (parent - 1) / this->inodes_per_group;
+	if (directory) {
+		for (unsigned int i = 0; i < BGDS; ++i) {
+			if (BGD[i].free_inodes_count && BGD[i].free_blocks_count > BGD[first_group].free_blocks_count) {
+				first_group = i;
 			}
-			group = i;
-			break;
 		}
 	}
-	if (!node_no) {
-		mutex_release(this->mutex);
-		dprintf("ext2: Out of inodes? node_no = 0\n");
-		return 0;
-	}
 
-	BLOCKBYTE(node_offset) |= SETBIT(node_offset);
+	for (unsigned int i = 0; i < BGDS; ++i) {
+		unsigned int group = (first_group + i) % BGDS;
+		if (!BGD[group].free_inodes_count) continue;
+
+		uint8_t * bg_buffer = group_bitmap(this, this->inode_bitmaps, BGD[group].inode_bitmap, group);
 
-	write_block(this, BGD[group].inode_bitmap, (uint8_t *)bg_buffer);
-	free(bg_buffer);
+		/* Skip the reserved inodes at the start of the first group */
+		uint32_t start = group * this->inodes_per_group + 1 < first_ino ? first_ino - 1 - group * this->inodes_per_group : 0;
+		uint32_t offset = bitmap_find_clear(bg_buffer, start, this->inodes_per_group);
+		if (offset == this->inodes_per_group) continue;
 
-	BGD[group].free_inodes_count--;
-	for (int i = 0; i < this->bgd_block_span; ++i) {
-		write_block(this, this->bgd_offset + i, (uint8_t *)((uintptr_t)BGD + this->block_size * i));
-	}
+		BLOCKBYTE(offset) |= SETBIT(offset);
+		BGD[group].free_inodes_count--;
+		if (directory) BGD[group].used_dirs_count++;
+		SB->free_inodes_count--;
+		this->group_dirty[group] |= EXT2_DIRTY_INODE_BITMAP;
+		metadata_dirtied(this);
 
-	SB->free_inodes_count--;
-	rewrite_superblock(this);
+		mutex_release(this->mutex);
+		return group * this->inodes_per_group + offset + 1;
+	}
 
 	mutex_release(this->mutex);
-
-	return node_no;
+	dprintf("ext2: Out of inodes\n");
+	return 0;
 }
 
 static int mkdir_ext2(fs_node_t * parent, const char * name, mode_t permission, fs_node_t **out) {
@@ -849,7 +2041,8 @@ static int mkdir_ext2(fs_node_t * parent, const char * name, mode_t permission,
 	}
 
 	/* Allocate an inode for it */
-	unsigned int inode_no = allocate_inode(this);
+	unsigned int inode_no = allocate_inode(this, parent->inode, 1);
+	if (!inode_no) return -ENOSPC;
 	ext2_inodetable_t * inode = read_inode(this,inode_no);
 
 	/* Set the access and creation times to now */
@@ -915,7 +2108,7 @@ static int mkdir_ext2(fs_node_t * parent, const char * name, mode_t permission,
 		fake->name_len = strlen(name);
 
 		memcpy(fake->name, name, fake->name_len);
-		fs_node_t * _out = calloc(1,sizeof(fs_node_t));
+		fs_node_t * _out = kmem_cache_zalloc(&fs_node_cache);
 		node_from_file(this, inode, fake, _out);
 		*out = _out;
 
@@ -931,12 +2124,7 @@ static int mkdir_ext2(fs_node_t * parent, const char * name, mode_t permission,
 	write_inode(this, pinode, parent->inode);
 	free(pinode);
 
-	/* Update directory count in block group descriptor */
-	uint32_t group = inode_no / this->inodes_per_group;
-	BGD[group].used_dirs_count++;
-	for (int i = 0; i < this->bgd_block_span; ++i) {
-		write_block(this, this->bgd_offset + i, (uint8_t *)((uintptr_t)BGD + this->block_size * i));
-	}
+	flush_metadata(this);
 
 	return 0;
 }
@@ -956,7 +2144,8 @@ static int create_ext2(fs_node_t * parent, const char * name, mode_t permission,
 	}
 
 	/* Allocate an inode for it */
-	unsigned int inode_no = allocate_inode(this);
+	unsigned int inode_no = allocate_inode(this, parent->inode, 0);
+	if (!inode_no) return -ENOSPC;
 	ext2_inodetable_t * inode = read_inode(this,inode_no);
 
 	/* Set the access and creation times to now */
@@ -1001,7 +2190,7 @@ static int create_ext2(fs_node_t * parent, const char * name, mode_t permission,
 	fake->name_len = strlen(name);
 	memcpy(fake->name, name, fake->name_len);
 
-	fs_node_t * _out = calloc(1,sizeof(fs_node_t));
+	fs_node_t * _out = kmem_cache_zalloc(&fs_node_cache);
 	node_from_file(this, inode, fake, _out);
 	*out = _out;
 
@@ -1029,7 +2218,7 @@ static int chmod_ext2(fs_node_t * node, mode_t mode) {
  */
 static ext2_dir_t * direntry_ext2(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t no, uint32_t index) {
 	uint8_t *block = malloc(this->block_size);
-	uint8_t block_nr = 0;
+	uint32_t block_nr = 0;
 	inode_read_block(this, inode, block_nr, block);
 	uint32_t dir_offset = 0;
 	uint32_t total_offset = 0;
@@ -1074,46 +2263,54 @@ static fs_node_t * finddir_ext2(fs_node_t *node, const char *name) {
 	//assert(inode->mode & EXT2_S_IFDIR);
 	uint8_t * block = malloc(this->block_size);
 	ext2_dir_t *direntry = NULL;
-	uint8_t block_nr = 0;
-	inode_read_block(this, inode, block_nr, block);
-	uint32_t dir_offset = 0;
-	uint32_t total_offset = 0;
-
-	while (total_offset < inode->size) {
-		if (dir_offset >= this->block_size) {
-			block_nr++;
-			dir_offset -= this->block_size;
-			inode_read_block(this, inode, block_nr, block);
-		}
-		ext2_dir_t *d_ent = (ext2_dir_t *)((uintptr_t)block + dir_offset);
+	uint32_t block_nr = 0;
+
+	int found = dx_lookup(this, inode, name, &block_nr, block);
+	if (found >= 0) {
+		ext2_dir_t *d_ent = (ext2_dir_t *)((uintptr_t)block + found);
+		direntry = malloc(d_ent->rec_len);
+		memcpy(direntry, d_ent, d_ent->rec_len);
+	} else if (found == DX_LINEAR) {
+		inode_read_block(this, inode, block_nr, block);
+		uint32_t dir_offset = 0;
+		uint32_t total_offset = 0;
+
+		while (total_offset < inode->size) {
+			if (dir_offset >= this->block_size) {
+				block_nr++;
+				dir_offset -= this->block_size;
+				inode_read_block(this, inode, block_nr, block);
+			}
+			ext2_dir_t *d_ent = (ext2_dir_t *)((uintptr_t)block + dir_offset);
 
-		if (d_ent->inode == 0 || strlen(name) != d_ent->name_len) {
-			dir_offset += d_ent->rec_len;
-			total_offset += d_ent->rec_len;
+			if (d_ent->inode == 0 || strlen(name) != d_ent->name_len) {
+				dir_offset += d_ent->rec_len;
+				total_offset += d_ent->rec_len;
 
-			continue;
-		}
+				continue;
+			}
 
-		char *dname = malloc(sizeof(char) * (d_ent->name_len + 1));
-		memcpy(dname, &(d_ent->name), d_ent->name_len);
-		dname[d_ent->name_len] = '\0';
-		if (!strcmp(dname, name)) {
+			char *dname = malloc(sizeof(char) * (d_ent->name_len + 1));
+			memcpy(dname, &(d_ent->name), d_ent->name_len);
+			dname[d_ent->name_len] = '\0';
+			if (!strcmp(dname, name)) {
+				free(dname);
+				direntry = malloc(d_ent->rec_len);
+				memcpy(direntry, d_ent, d_ent->rec_len);
+				break;
+			}
 			free(dname);
-			direntry = malloc(d_ent->rec_len);
-			memcpy(direntry, d_ent, d_ent->rec_len);
-			break;
-		}
-		free(dname);
 
-		dir_offset += d_ent->rec_len;
-		total_offset += d_ent->rec_len;
+			dir_offset += d_ent->rec_len;
+			total_offset += d_ent->rec_len;
+		}
 	}
 	free(inode);
 	if (!direntry) {
 		free(block);
 		return NULL;
 	}
-	fs_node_t *outnode = malloc(sizeof(fs_node_t));
+	fs_node_t *outnode = kmem_cache_alloc(&fs_node_cache);
 	memset(outnode, 0, sizeof(fs_node_t));
 
 	inode = read_inode(this, direntry->inode);
@@ -1128,6 +2325,36 @@ static fs_node_t * finddir_ext2(fs_node_t *node, const char *name) {
 	return outnode;
 }
 
+/**
+ * iget_ext2
+ *
+ * Build a node for an entry of this directory whose inode the
+ * dentry cache already knows, without searching the directory.
+ */
+static fs_node_t * iget_ext2(fs_node_t *node, const char *name, uint64_t ino) {
+	ext2_fs_t * this = (ext2_fs_t *)node->device;
+
+	if (!ino || ino > this->inodes_per_group * BGDS) return NULL;
+
+	ext2_inodetable_t * inode = read_inode(this, ino);
+	if (!inode->links_count) {
+		free(inode);
+		return NULL;
+	}
+
+	ext2_dir_t * fake = malloc(sizeof(ext2_dir_t) + strlen(name));
+	fake->inode = ino;
+	fake->name_len = strlen(name);
+	memcpy(fake->name, name, fake->name_len);
+
+	fs_node_t * outnode = kmem_cache_zalloc(&fs_node_cache);
+	node_from_file(this, inode, fake, outnode);
+
+	free(fake);
+	free(inode);
+	return outnode;
+}
+
 static int unlink_ext2(fs_node_t * node, const char * name) {
 	/* XXX this is a very bad implementation */
 	ext2_fs_t * this = (ext2_fs_t *)node->device;
@@ -1137,38 +2364,44 @@ static int unlink_ext2(fs_node_t * node, const char * name) {
 	//assert(inode->mode & EXT2_S_IFDIR);
 	uint8_t * block = malloc(this->block_size);
 	ext2_dir_t *direntry = NULL;
-	uint8_t block_nr = 0;
-	inode_read_block(this, inode, block_nr, block);
-	uint32_t dir_offset = 0;
-	uint32_t total_offset = 0;
-
-	while (total_offset < inode->size) {
-		if (dir_offset >= this->block_size) {
-			block_nr++;
-			dir_offset -= this->block_size;
-			inode_read_block(this, inode, block_nr, block);
-		}
-		ext2_dir_t *d_ent = (ext2_dir_t *)((uintptr_t)block + dir_offset);
+	uint32_t block_nr = 0;
+
+	int found = dx_lookup(this, inode, name, &block_nr, block);
+	if (found >= 0) {
+		direntry = (ext2_dir_t *)((uintptr_t)block + found);
+	} else if (found == DX_LINEAR) {
+		inode_read_block(this, inode, block_nr, block);
+		uint32_t dir_offset = 0;
+		uint32_t total_offset = 0;
+
+		while (total_offset < inode->size) {
+			if (dir_offset >= this->block_size) {
+				block_nr++;
+				dir_offset -= this->block_size;
+				inode_read_block(this, inode, block_nr, block);
+			}
+			ext2_dir_t *d_ent = (ext2_dir_t *)((uintptr_t)block + dir_offset);
 
-		if (d_ent->inode == 0 || strlen(name) != d_ent->name_len) {
-			dir_offset += d_ent->rec_len;
-			total_offset += d_ent->rec_len;
+			if (d_ent->inode == 0 || strlen(name) != d_ent->name_len) {
+				dir_offset += d_ent->rec_len;
+				total_offset += d_ent->rec_len;
 
-			continue;
-		}
+				continue;
+			}
 
-		char *dname = malloc(sizeof(char) * (d_ent->name_len + 1));
-		memcpy(dname, &(d_ent->name), d_ent->name_len);
-		dname[d_ent->name_len] = '\0';
-		if (!strcmp(dname, name)) {
+			char *dname = malloc(sizeof(char) * (d_ent->name_len + 1));
+			memcpy(dname, &(d_ent->name), d_ent->name_len);
+			dname[d_ent->name_len] = '\0';
+			if (!strcmp(dname, name)) {
+				free(dname);
+				direntry = d_ent;
+				break;
+			}
 			free(dname);
-			direntry = d_ent;
-			break;
-		}
-		free(dname);
 
-		dir_offset += d_ent->rec_len;
-		total_offset += d_ent->rec_len;
+			dir_offset += d_ent->rec_len;
+			total_offset += d_ent->rec_len;
+		}
 	}
 	if (!direntry) {
 		free(inode);
@@ -1194,6 +2427,10 @@ static int unlink_ext2(fs_node_t * node, const char * name) {
 		write_inode(this, inode, new_inode);
 	}
 
+	if (inode->links_count == 0) {
+		pagecache_invalidate(this, new_inode);
+	}
+
 	free(inode);
 
 	return 0;
@@ -1205,6 +2442,11 @@ static void refresh_inode(ext2_fs_t * this, ext2_inodetable_t * inodet,  size_t
 		dprintf("ext2: Attempt to read inode 0\n");
 		return;
 	}
+
+	uint64_t generation;
+	uint32_t ino = inode;
+	if (icache_fetch(this, ino, inodet, &generation)) return;
+
 	inode--;
 
 	uint32_t group = inode / this->inodes_per_group;
@@ -1225,6 +2467,8 @@ static void refresh_inode(ext2_fs_t * this, ext2_inodetable_t * inodet,  size_t
 	memcpy(inodet, (uint8_t *)((uintptr_t)inodes + offset_in_block * this->inode_size), this->inode_size);
 
 	free(buf);
+
+	icache_store(this, ino, inodet, generation);
 }
 
 /**
@@ -1236,91 +2480,220 @@ static ext2_inodetable_t * read_inode(ext2_fs_t * this, size_t inode) {
 	return inodet;
 }
 
+/**
+ * ext2->map_blocks Look up where @p count blocks of a file starting at @p first live.
+ *
+ * Blocks the inode does not have map to 0.
+ */
+static void map_blocks(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t first, unsigned int count, uint32_t * map) {
+	for (unsigned int i = 0; i < count; ++i) {
+		map[i] = get_block_number(this, inode, first + i);
+	}
+}
+
+/**
+ * ext2->readahead Ask the block cache to read in blocks of a file before they are needed.
+ *
+ * Each physically contiguous run becomes one request, which the
+ * cache turns into a single device read.
+ */
+static void readahead(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t ino, uint32_t first, uint32_t last) {
+	if (this->flags & EXT2_FLAG_NO_READAHEAD) return;
+
+	uint32_t block;
+	unsigned int count = icache_readahead(this, ino, first, last, &block);
+	if (!count) return;
+
+	uint32_t file_blocks = (inode->size + this->block_size - 1) / this->block_size;
+	if (block >= file_blocks) return;
+	if (count > file_blocks - block) count = file_blocks - block;
+
+	uint32_t map[EXT2_MAP_BATCH];
+	while (count) {
+		unsigned int batch = count < EXT2_MAP_BATCH ? count : EXT2_MAP_BATCH;
+		map_blocks(this, inode, block, batch, map);
+
+		for (unsigned int i = 0; i < batch;) {
+			unsigned int run = 1;
+			while (i + run < batch && map[i] && map[i + run] == map[i] + run) run++;
+			if (map[i]) {
+				struct bcache_readahead request = {
+					(uint64_t)map[i] * this->block_size,
+					(uint64_t)run * this->block_size
+				};
+				if (ioctl_fs(this->block_device, BCACHE_IOCTL_READAHEAD, &request) != 0) {
+					/* Not on a cached block device */
+					this->flags |= EXT2_FLAG_NO_READAHEAD;
+					return;
+				}
+			}
+			i += run;
+		}
+
+		block += batch;
+		count -= batch;
+	}
+}
+
 static ssize_t read_ext2(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	ext2_fs_t * this = (ext2_fs_t *)node->device;
 	ext2_inodetable_t * inode = read_inode(this, node->inode);
 	uint32_t end;
-	if (inode->size == 0) return 0;
+	if (offset < 0 || (uint64_t)offset >= inode->size || !size) {
+		free(inode);
+		return 0;
+	}
 	if (offset + size > inode->size) {
 		end = inode->size;
 	} else {
 		end = offset + size;
 	}
 	uint32_t start_block  = offset / this->block_size;
-	uint32_t end_block    = end / this->block_size;
-	uint32_t end_size     = end - end_block * this->block_size;
-	uint32_t size_to_read = end - offset;
-
-	uint8_t * buf = malloc(this->block_size);
-	if (start_block == end_block) {
-		inode_read_block(this, inode, start_block, buf);
-		memcpy(buffer, (uint8_t *)(((uintptr_t)buf) + ((uintptr_t)offset % this->block_size)), size_to_read);
-	} else {
-		uint32_t block_offset;
-		uint32_t blocks_read = 0;
-		for (block_offset = start_block; block_offset < end_block; block_offset++, blocks_read++) {
-			if (block_offset == start_block) {
-				inode_read_block(this, inode, block_offset, buf);
-				memcpy(buffer, (uint8_t *)(((uintptr_t)buf) + ((uintptr_t)offset % this->block_size)), this->block_size - (offset % this->block_size));
+	uint32_t end_block    = (end + this->block_size - 1) / this->block_size;
+
+	readahead(this, inode, node->inode, start_block, end_block);
+
+	/*
+	 * Map the blocks in batches and read each physically contiguous
+	 * run with a single request to the block device.
+	 */
+	uint32_t map[EXT2_MAP_BATCH];
+	uint32_t block = start_block;
+	while (block < end_block) {
+		unsigned int batch = end_block - block;
+		if (batch > EXT2_MAP_BATCH) batch = EXT2_MAP_BATCH;
+		map_blocks(this, inode, block, batch, map);
+
+		for (unsigned int i = 0; i < batch;) {
+			unsigned int run = 1;
+			while (i + run < batch && map[i] && map[i + run] == map[i] + run) run++;
+
+			uint64_t from = (uint64_t)(block + i) * this->block_size;
+			uint64_t to   = (uint64_t)(block + i + run) * this->block_size;
+			if (from < (uint64_t)offset) from = offset;
+			if (to > end) to = end;
+
+			uint8_t * out = buffer + (from - offset);
+			uint64_t within = from - (uint64_t)(block + i) * this->block_size;
+			if (map[i]) {
+				read_fs(this->block_device, (uint64_t)map[i] * this->block_size + within, to - from, out);
 			} else {
-				inode_read_block(this, inode, block_offset, buf);
-				memcpy(buffer + this->block_size * blocks_read - (offset % this->block_size), buf, this->block_size);
+				/* Holes, and anything past what was allocated, read as zeroes */
+				memset(out, 0, to - from);
 			}
+
+			i += run;
 		}
-		if (end_size) {
-			inode_read_block(this, inode, end_block, buf);
-			memcpy(buffer + this->block_size * blocks_read - (offset % this->block_size), buf, end_size);
-		}
+
+		block += batch;
 	}
+
 	free(inode);
-	free(buf);
-	return size_to_read;
+	return end - offset;
 }
 
+/**
+ * ext2->write_inode_buffer Write to a file, allocating any blocks it does not have yet.
+ *
+ * Blocks are mapped EXT2_MAP_BATCH at a time. Missing ones are allocated
+ * in runs that follow on from the block before them, each run of blocks
+ * that is contiguous on disk is written with one request, and the inode
+ * is written once at the end.
+ */
 static ssize_t write_inode_buffer(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t inode_number, off_t offset, size_t size, uint8_t *buffer) {
-	uint32_t end = offset + size;
-	if (end > inode->size) {
-		inode->size = end;
-		write_inode(this, inode, inode_number);
-	}
+	if (!size) return 0;
+
+	uint64_t end = offset + size;
+	uint32_t first = offset / this->block_size;
+	uint32_t last = (end - 1) / this->block_size;
+	uint32_t blocks_before = inode->blocks;
+	uint32_t map[EXT2_MAP_BATCH];
+	uint8_t fresh[EXT2_MAP_BATCH];
+	uint8_t * tmp = NULL;
+	size_t written = 0;
+	int error = 0;
+
+	for (uint32_t batch = first; batch <= last && !error; batch += EXT2_MAP_BATCH) {
+		unsigned int count = last - batch + 1 < EXT2_MAP_BATCH ? last - batch + 1 : EXT2_MAP_BATCH;
+		map_blocks(this, inode, batch, count, map);
+		memset(fresh, 0, count);
+
+		/* Allocate the blocks that are missing */
+		unsigned int i = 0;
+		while (i < count && !error) {
+			if (map[i]) {
+				i++;
+				continue;
+			}
 
-	uint32_t start_block  = offset / this->block_size;
-	uint32_t end_block    = end / this->block_size;
-	uint32_t end_size     = end - end_block * this->block_size;
-	uint32_t size_to_read = end - offset;
-	uint8_t * buf = malloc(this->block_size);
-	if (start_block == end_block) {
-		inode_read_block(this, inode, start_block, buf);
-		memcpy((uint8_t *)(((uintptr_t)buf) + ((uintptr_t)offset % this->block_size)), buffer, size_to_read);
-		inode_write_block(this, inode, inode_number, start_block, buf);
-	} else {
-		uint32_t block_offset;
-		uint32_t blocks_read = 0;
-		for (block_offset = start_block; block_offset < end_block; block_offset++, blocks_read++) {
-			if (block_offset == start_block) {
-				int b = inode_read_block(this, inode, block_offset, buf);
-				memcpy((uint8_t *)(((uintptr_t)buf) + ((uintptr_t)offset % this->block_size)), buffer, this->block_size - (offset % this->block_size));
-				inode_write_block(this, inode, inode_number, block_offset, buf);
-				if (!b) {
-					refresh_inode(this, inode, inode_number);
+			unsigned int missing = 1;
+			while (i + missing < count && !map[i + missing]) missing++;
+
+			uint32_t goal = i ? map[i - 1] + 1 : block_goal(this, inode, batch);
+			while (missing) {
+				unsigned int got = missing;
+				uint32_t run = allocate_blocks(this, inode_number, goal, &got);
+				if (!run) {
+					error = -ENOSPC;
+					break;
 				}
-			} else {
-				int b = inode_read_block(this, inode, block_offset, buf);
-				memcpy(buf, buffer + this->block_size * blocks_read - (offset % this->block_size), this->block_size);
-				inode_write_block(this, inode, inode_number, block_offset, buf);
-				if (!b) {
-					refresh_inode(this, inode, inode_number);
+				inode->blocks += got * (this->block_size / 512);
+				if (set_block_numbers(this, inode, inode_number, batch + i, run, got) != E_SUCCESS) {
+					error = -ENOSPC;
+					break;
 				}
+				for (unsigned int j = 0; j < got; ++j) {
+					map[i + j] = run + j;
+					fresh[i + j] = 1;
+				}
+				i += got;
+				missing -= got;
+				goal = run + got;
 			}
 		}
-		if (end_size) {
-			inode_read_block(this, inode, end_block, buf);
-			memcpy(buf, buffer + this->block_size * blocks_read - (offset % this->block_size), end_size);
-			inode_write_block(this, inode, inode_number, end_block, buf);
+
+		/* Then write them, stopping at the first that could not be allocated */
+		i = 0;
+		while (i < count && map[i]) {
+			uint64_t block_start = (uint64_t)(batch + i) * this->block_size;
+			size_t within = (uint64_t)offset > block_start ? offset - block_start : 0;
+			size_t length = this->block_size - within;
+			if (block_start + within + length > end) length = end - block_start - within;
+
+			if (length < this->block_size) {
+				/* Part of a block: merge with what is there, or with zeroes if it is new */
+				if (!tmp) tmp = malloc(this->block_size);
+				if (fresh[i]) {
+					memset(tmp, 0, this->block_size);
+				} else {
+					read_block(this, map[i], tmp);
+				}
+				memcpy(tmp + within, buffer + written, length);
+				write_block(this, map[i], tmp);
+				written += length;
+				i++;
+				continue;
+			}
+
+			unsigned int run = 1;
+			while (i + run < count && map[i + run] == map[i] + run &&
+				block_start + (uint64_t)(run + 1) * this->block_size <= end) {
+				run++;
+			}
+			write_fs(this->block_device, (uint64_t)map[i] * this->block_size, run * this->block_size, buffer + written);
+			written += run * this->block_size;
+			i += run;
 		}
 	}
-	free(buf);
-	return size_to_read;
+
+	free(tmp);
+
+	if (offset + written > inode->size || inode->blocks != blocks_before) {
+		if (offset + written > inode->size) inode->size = offset + written;
+		write_inode(this, inode, inode_number);
+	}
+
+	return written ? (ssize_t)written : error;
 }
 
 static ssize_t write_ext2(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
@@ -1331,6 +2704,7 @@ static ssize_t write_ext2(fs_node_t *node, off_t offset, size_t size, uint8_t *b
 
 	ssize_t rv = write_inode_buffer(this, inode, node->inode, offset, size, buffer);
 	free(inode);
+	flush_stale_metadata(this);
 	return rv;
 }
 
@@ -1350,7 +2724,9 @@ static void open_ext2(fs_node_t *node, unsigned int flags) {
 }
 
 static void close_ext2(fs_node_t *node) {
-	/* Nothing to do here */
+	ext2_fs_t * this = node->device;
+	reservation_release(this, node->inode);
+	if (this->meta_dirty) flush_metadata(this);
 }
 
 
@@ -1391,7 +2767,8 @@ static int symlink_ext2(fs_node_t * parent, const char * target, const char * na
 	}
 
 	/* Allocate an inode for it */
-	unsigned int inode_no = allocate_inode(this);
+	unsigned int inode_no = allocate_inode(this, parent->inode, 0);
+	if (!inode_no) return -ENOSPC;
 	ext2_inodetable_t * inode = read_inode(this,inode_no);
 
 	/* Set the access and creation times to now */
@@ -1446,6 +2823,8 @@ static int symlink_ext2(fs_node_t * parent, const char * target, const char * na
 	}
 	free(inode);
 
+	flush_metadata(this);
+
 	return 0;
 }
 
@@ -1468,6 +2847,7 @@ static int ioctl_ext2(fs_node_t * node, unsigned long request, void * argp) {
 
 	switch (request) {
 		case IOCTLSYNC:
+			flush_metadata(this);
 			return ioctl_fs(this->block_device, IOCTLSYNC, NULL);
 
 		default:
@@ -1494,7 +2874,7 @@ static int node_from_file(ext2_fs_t * this, ext2_inodetable_t *inode, ext2_dir_t
 	/* File Flags */
 	fnode->flags = 0;
 	if ((inode->mode & EXT2_S_IFREG) == EXT2_S_IFREG) {
-		fnode->flags   |= FS_FILE;
+		fnode->flags   |= FS_FILE | FS_PAGECACHE;
 		fnode->read     = read_ext2;
 		fnode->write    = write_ext2;
 		fnode->truncate = truncate_ext2;
@@ -1513,6 +2893,7 @@ static int node_from_file(ext2_fs_t * this, ext2_inodetable_t *inode, ext2_dir_t
 		fnode->symlink  = symlink_ext2;
 		fnode->readdir  = readdir_ext2;
 		fnode->finddir  = finddir_ext2;
+		fnode->iget     = iget_ext2;
 		fnode->write    = NULL;
 		fnode->readlink = NULL;
 	}
@@ -1608,7 +2989,8 @@ static int ext2_root(ext2_fs_t * this, ext2_inodetable_t *inode, fs_node_t *fnod
 	fnode->close   = close_ext2;
 	fnode->readdir = readdir_ext2;
 	fnode->finddir = finddir_ext2;
-	fnode->ioctl   = NULL;
+	fnode->iget    = iget_ext2;
+	fnode->ioctl   = ioctl_ext2;
 	fnode->create  = create_ext2;
 	fnode->mkdir   = mkdir_ext2;
 	fnode->unlink  = unlink_ext2;
@@ -1667,6 +3049,15 @@ static fs_node_t * mount_ext2(fs_node_t * block_device, int flags) {
 		read_block(this, this->bgd_offset + i, (uint8_t *)((uintptr_t)BGD + this->block_size * i));
 	}
 
+	this->block_bitmaps = malloc(sizeof(uint8_t *) * BGDS);
+	this->inode_bitmaps = malloc(sizeof(uint8_t *) * BGDS);
+	this->group_dirty = malloc(BGDS);
+	this->group_hint = malloc(sizeof(uint32_t) * BGDS);
+	memset(this->block_bitmaps, 0, sizeof(uint8_t *) * BGDS);
+	memset(this->inode_bitmaps, 0, sizeof(uint8_t *) * BGDS);
+	memset(this->group_dirty, 0, BGDS);
+	memset(this->group_hint, 0, sizeof(uint32_t) * BGDS);
+
 	dprintf("ext2: %u BGDs, %u inodes, %u inodes per group\n",
 		BGDS, SB->inodes_count, this->inodes_per_group);
 
@@ -1700,7 +3091,7 @@ static fs_node_t * mount_ext2(fs_node_t * block_device, int flags) {
 #endif
 
 	ext2_inodetable_t *root_inode = read_inode(this, 2);
-	RN = (fs_node_t *)malloc(sizeof(fs_node_t));
+	RN = (fs_node_t *)calloc(1, sizeof(fs_node_t));
 	if (!ext2_root(this, root_inode, RN)) {
 		return NULL;
 	}
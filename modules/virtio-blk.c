@@ -0,0 +1,522 @@
+/**
+ * @brief Virtio Block Device Driver
+ * @file modules/virtio-blk.c
+ * @package x86_64
+ *
+ * Drives paravirtualized disks (virtio-blk over PCI). If the device
+ * has more than one request queue we use one per CPU, up to as many
+ * as it has, so CPUs don't contend for a queue lock. A request is
+ * split into commands of up to VBLK_MAX_TRANSFER bytes whose data
+ * descriptors point straight at the caller's buffer; every command is
+ * added to the queue before the device is notified once for the whole
+ * batch, and with event indexes the notification is skipped entirely
+ * if the device is still working through earlier commands.
+ *
+ * Disks are mounted through the block cache as /dev/vda, /dev/vdb, ...
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <bits/errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/syscall.h>
+#include <kernel/module.h>
+#include <kernel/printf.h>
+#include <kernel/process.h>
+#include <kernel/pci.h>
+#include <kernel/vfs.h>
+#include <kernel/mmu.h>
+#include <kernel/list.h>
+#include <kernel/spinlock.h>
+#include <kernel/bcache.h>
+#include <kernel/virtio.h>
+
+#include <kernel/arch/x86_64/irq.h>
+
+#include <sys/ioctl.h>
+
+#define VIRTIO_BLK_F_SIZE_MAX  (1ULL << 1)
+#define VIRTIO_BLK_F_SEG_MAX   (1ULL << 2)
+#define VIRTIO_BLK_F_RO        (1ULL << 5)
+#define VIRTIO_BLK_F_FLUSH     (1ULL << 9)
+#define VIRTIO_BLK_F_MQ        (1ULL << 12)
+
+#define VIRTIO_BLK_T_IN        0
+#define VIRTIO_BLK_T_OUT       1
+#define VIRTIO_BLK_T_FLUSH     4
+
+#define VIRTIO_BLK_S_OK        0
+
+/* Offsets into the device configuration */
+#define VIRTIO_BLK_CFG_CAPACITY    0
+#define VIRTIO_BLK_CFG_SIZE_MAX    8
+#define VIRTIO_BLK_CFG_SEG_MAX     12
+#define VIRTIO_BLK_CFG_NUM_QUEUES  34
+
+#define VBLK_SECTOR_SIZE   512
+#define VBLK_MAX_QUEUES    32
+#define VBLK_QUEUE_SIZE    256
+
+/* Data segments per command, not counting the header and status. */
+#define VBLK_MAX_SEGS      64
+#define VBLK_MAX_TRANSFER  (VBLK_MAX_SEGS * 0x1000)
+
+/* Commands one request may have outstanding before it waits on its oldest. */
+#define VBLK_INFLIGHT      64
+
+struct virtio_blk_req_hdr {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t sector;
+};
+
+/* The parts of a command the device reads and writes besides the data. */
+struct vblk_dma {
+	struct virtio_blk_req_hdr hdr;
+	volatile uint8_t status;
+	uint8_t pad[15];
+};
+
+struct vblk_req {
+	struct vblk_dma * dma;
+	uintptr_t dma_phys;
+	volatile int done;
+	list_t * wait;
+	struct vblk_req * next_free;
+};
+
+struct vblk_queue {
+	struct virtq * vq;
+	struct vblk_req * reqs;
+	struct vblk_req * free;
+	list_t * req_wait;          /* requests waiting for a command or descriptors */
+};
+
+struct vblk_disk {
+	struct virtio_device dev;
+	int irq;
+	uint64_t sectors;
+	uint32_t seg_max;
+	uint32_t size_max;
+	int nqueues;
+	struct vblk_queue queues[VBLK_MAX_QUEUES];
+	struct vblk_disk * next;
+};
+
+static struct vblk_disk * vblk_disks = NULL;
+static char vblk_drive_char = 'a';
+
+static uint32_t vblk_cfg_read4(struct vblk_disk * disk, int offset) {
+	return *(volatile uint32_t *)((volatile char *)disk->dev.device_cfg + offset);
+}
+
+static uint16_t vblk_cfg_read2(struct vblk_disk * disk, int offset) {
+	return *(volatile uint16_t *)((volatile char *)disk->dev.device_cfg + offset);
+}
+
+/* Called with the queue lock held. */
+static struct vblk_req * vblk_claim(struct vblk_queue * queue) {
+	struct vblk_req * req = queue->free;
+	if (req) queue->free = req->next_free;
+	return req;
+}
+
+static void vblk_release(struct vblk_queue * queue, struct vblk_req * req) {
+	req->next_free = queue->free;
+	queue->free = req;
+	wakeup_queue(queue->req_wait);
+}
+
+/**
+ * Notify the device of everything added since the last notification,
+ * if it needs to be told, without holding the lock across the exit.
+ */
+static void vblk_kick(struct vblk_queue * queue) {
+	if (virtq_kick_prepare(queue->vq)) {
+		spin_unlock(queue->vq->lock);
+		virtq_notify(queue->vq);
+		spin_lock(queue->vq->lock);
+	}
+}
+
+/**
+ * Wait for a command to complete and give it back. Called, and returns,
+ * with the queue lock held. The buffer is still the target of the
+ * transfer until it completes, so signals don't cut this short.
+ */
+static int vblk_wait(struct vblk_queue * queue, struct vblk_req * req) {
+	vblk_kick(queue);
+	while (!req->done) {
+		sleep_on_unlocking(req->wait, &queue->vq->lock);
+		spin_lock(queue->vq->lock);
+	}
+	int failed = req->dma->status != VIRTIO_BLK_S_OK;
+	vblk_release(queue, req);
+	return failed ? -EIO : 0;
+}
+
+/**
+ * Describe as much of @p buf as fits in one command, merging pages that
+ * turn out to be physically contiguous.
+ */
+static int vblk_map(struct vblk_disk * disk, uint8_t * buf, size_t size, struct virtq_sg * sg, size_t * mapped) {
+	int segs = 0;
+	size_t done = 0;
+
+	if (size > VBLK_MAX_TRANSFER) size = VBLK_MAX_TRANSFER;
+
+	while (done < size) {
+		uintptr_t virt = (uintptr_t)buf + done;
+		uintptr_t phys = mmu_map_to_physical(this_core->current_pml, virt);
+		if ((intptr_t)phys < 0) return -EFAULT;
+
+		size_t len = 0x1000 - (virt & 0xFFF);
+		if (len > size - done) len = size - done;
+
+		if (segs && sg[segs-1].phys + sg[segs-1].len == phys && sg[segs-1].len + len <= disk->size_max) {
+			sg[segs-1].len += len;
+		} else {
+			if (segs == (int)disk->seg_max) break;
+			sg[segs].phys = phys;
+			sg[segs].len  = len;
+			segs++;
+		}
+		done += len;
+	}
+
+	*mapped = done;
+	return segs;
+}
+
+/**
+ * Transfer whole sectors from a sector-aligned buffer. Every command
+ * for the request is queued before we wait on any of them; if the
+ * queue fills up we notify the device and wait on our own oldest
+ * command, so a request can never starve itself.
+ */
+static ssize_t vblk_rw(struct vblk_disk * disk, uint64_t sector, size_t size, uint8_t * buf, int write) {
+	struct vblk_queue * queue = &disk->queues[this_core->cpu_id % disk->nqueues];
+	struct vblk_req * mine[VBLK_INFLIGHT];
+	struct virtq_sg sg[VBLK_MAX_SEGS + 2];
+	int first = 0, count = 0;
+	int error = 0;
+	size_t done = 0;
+
+	spin_lock(queue->vq->lock);
+	while (done < size && !error) {
+		struct vblk_req * req = count < VBLK_INFLIGHT ? vblk_claim(queue) : NULL;
+		size_t chunk = 0;
+		int segs = 0;
+
+		if (req) {
+			segs = vblk_map(disk, buf + done, size - done, &sg[1], &chunk);
+			if (segs < 0) {
+				vblk_release(queue, req);
+				error = segs;
+				break;
+			}
+
+			req->dma->hdr.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+			req->dma->hdr.reserved = 0;
+			req->dma->hdr.sector = sector + done / VBLK_SECTOR_SIZE;
+			req->dma->status = 0xFF;
+			req->done = 0;
+			sg[0].phys = req->dma_phys;
+			sg[0].len  = sizeof(struct virtio_blk_req_hdr);
+			sg[segs+1].phys = req->dma_phys + offsetof(struct vblk_dma, status);
+			sg[segs+1].len  = 1;
+
+			if (virtq_add(queue->vq, sg, write ? segs + 1 : 1, write ? 1 : segs + 1, req) == 0) {
+				mine[(first + count) % VBLK_INFLIGHT] = req;
+				count++;
+				done += chunk;
+				continue;
+			}
+			vblk_release(queue, req);
+		}
+
+		/* Out of commands or descriptors */
+		if (count) {
+			error = vblk_wait(queue, mine[first]);
+			first = (first + 1) % VBLK_INFLIGHT;
+			count--;
+		} else {
+			sleep_on_unlocking(queue->req_wait, &queue->vq->lock);
+			spin_lock(queue->vq->lock);
+		}
+	}
+
+	while (count) {
+		int result = vblk_wait(queue, mine[first]);
+		if (result && !error) error = result;
+		first = (first + 1) % VBLK_INFLIGHT;
+		count--;
+	}
+	spin_unlock(queue->vq->lock);
+
+	return error ? error : (ssize_t)size;
+}
+
+static int vblk_flush(struct vblk_disk * disk) {
+	if (!(disk->dev.features & VIRTIO_BLK_F_FLUSH)) return 0;
+
+	struct vblk_queue * queue = &disk->queues[this_core->cpu_id % disk->nqueues];
+	spin_lock(queue->vq->lock);
+
+	struct vblk_req * req;
+	while (!(req = vblk_claim(queue))) {
+		sleep_on_unlocking(queue->req_wait, &queue->vq->lock);
+		spin_lock(queue->vq->lock);
+	}
+
+	req->dma->hdr.type = VIRTIO_BLK_T_FLUSH;
+	req->dma->hdr.reserved = 0;
+	req->dma->hdr.sector = 0;
+	req->dma->status = 0xFF;
+	req->done = 0;
+
+	struct virtq_sg sg[2] = {
+		{ req->dma_phys, sizeof(struct virtio_blk_req_hdr) },
+		{ req->dma_phys + offsetof(struct vblk_dma, status), 1 },
+	};
+	while (virtq_add(queue->vq, sg, 1, 1, req) == -ENOSPC) {
+		sleep_on_unlocking(queue->req_wait, &queue->vq->lock);
+		spin_lock(queue->vq->lock);
+	}
+
+	int result = vblk_wait(queue, req);
+	spin_unlock(queue->vq->lock);
+	return result;
+}
+
+static void vblk_complete(struct vblk_queue * queue) {
+	spin_lock(queue->vq->lock);
+	do {
+		struct vblk_req * req;
+		while ((req = virtq_get(queue->vq, NULL))) {
+			req->done = 1;
+			wakeup_queue(req->wait);
+		}
+	} while (virtq_enable_cb(queue->vq));
+	/* Descriptors were freed; anyone waiting for room can try again. */
+	wakeup_queue(queue->req_wait);
+	spin_unlock(queue->vq->lock);
+}
+
+static int vblk_irq_handler(struct regs * r) {
+	int irq = r->int_no - 32;
+	int handled = 0;
+
+	for (struct vblk_disk * disk = vblk_disks; disk; disk = disk->next) {
+		if (disk->irq != irq) continue;
+		uint8_t isr = virtio_isr(&disk->dev);
+		if (!isr) continue;
+		if (isr & 1) {
+			for (int i = 0; i < disk->nqueues; ++i) {
+				vblk_complete(&disk->queues[i]);
+			}
+		}
+		if (!handled) {
+			handled = 1;
+			irq_ack(irq);
+		}
+	}
+
+	return handled;
+}
+
+static ssize_t read_vblk(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+	struct vblk_disk * disk = node->device;
+	off_t max = disk->sectors * VBLK_SECTOR_SIZE;
+
+	if (offset < 0 || offset >= max) return 0;
+	if (offset + (off_t)size > max) size = max - offset;
+	if (!size) return 0;
+
+	if (offset % VBLK_SECTOR_SIZE || size % VBLK_SECTOR_SIZE || ((uintptr_t)buffer % VBLK_SECTOR_SIZE)) {
+		/* Not whole sectors; read the ones that cover it and copy out. */
+		off_t start = offset - offset % VBLK_SECTOR_SIZE;
+		size_t span = (offset + size - start + VBLK_SECTOR_SIZE - 1) / VBLK_SECTOR_SIZE * VBLK_SECTOR_SIZE;
+		uint8_t * tmp = valloc(span);
+		ssize_t result = vblk_rw(disk, start / VBLK_SECTOR_SIZE, span, tmp, 0);
+		if (result >= 0) {
+			memcpy(buffer, tmp + (offset - start), size);
+			result = size;
+		}
+		free(tmp);
+		return result;
+	}
+
+	return vblk_rw(disk, offset / VBLK_SECTOR_SIZE, size, buffer, 0);
+}
+
+static ssize_t write_vblk(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+	struct vblk_disk * disk = node->device;
+	off_t max = disk->sectors * VBLK_SECTOR_SIZE;
+
+	if (disk->dev.features & VIRTIO_BLK_F_RO) return -EROFS;
+	if (offset < 0 || offset >= max) return 0;
+	if (offset + (off_t)size > max) size = max - offset;
+	if (!size) return 0;
+
+	if (offset % VBLK_SECTOR_SIZE || size % VBLK_SECTOR_SIZE || ((uintptr_t)buffer % VBLK_SECTOR_SIZE)) {
+		/* Read-modify-write the sectors that cover it. */
+		off_t start = offset - offset % VBLK_SECTOR_SIZE;
+		size_t span = (offset + size - start + VBLK_SECTOR_SIZE - 1) / VBLK_SECTOR_SIZE * VBLK_SECTOR_SIZE;
+		uint8_t * tmp = valloc(span);
+		ssize_t result = vblk_rw(disk, start / VBLK_SECTOR_SIZE, span, tmp, 0);
+		if (result >= 0) {
+			memcpy(tmp + (offset - start), buffer, size);
+			result = vblk_rw(disk, start / VBLK_SECTOR_SIZE, span, tmp, 1);
+			if (result >= 0) result = size;
+		}
+		free(tmp);
+		return result;
+	}
+
+	return vblk_rw(disk, offset / VBLK_SECTOR_SIZE, size, buffer, 1);
+}
+
+static int ioctl_vblk(fs_node_t * node, unsigned long request, void * argp) {
+	switch (request) {
+		case IOCTLSYNC:
+			return vblk_flush(node->device);
+	}
+	return -EINVAL;
+}
+
+static fs_node_t * vblk_device_create(struct vblk_disk * disk) {
+	fs_node_t * fnode = calloc(1, sizeof(fs_node_t));
+	snprintf(fnode->name, 10, "vblkdev%d", vblk_drive_char - 'a');
+	fnode->device  = disk;
+	fnode->mask    = 0660;
+	fnode->length  = disk->sectors * VBLK_SECTOR_SIZE;
+	fnode->flags   = FS_BLOCKDEVICE;
+	fnode->read    = read_vblk;
+	fnode->write   = write_vblk;
+	fnode->ioctl   = ioctl_vblk;
+	return fnode;
+}
+
+static int vblk_setup_queue(struct vblk_disk * disk, int index) {
+	struct vblk_queue * queue = &disk->queues[index];
+	queue->vq = virtq_create(&disk->dev, index, VBLK_QUEUE_SIZE);
+	if (!queue->vq) return -ENODEV;
+
+	/* A command takes at least three descriptors. */
+	int count = queue->vq->size / 3;
+	if (count < 1) count = 1;
+
+	uintptr_t phys;
+	struct vblk_dma * dma = virtio_alloc(count * sizeof(struct vblk_dma), &phys);
+	queue->reqs = calloc(count, sizeof(struct vblk_req));
+	for (int i = 0; i < count; ++i) {
+		queue->reqs[i].dma = &dma[i];
+		queue->reqs[i].dma_phys = phys + i * sizeof(struct vblk_dma);
+		queue->reqs[i].wait = list_create("virtio-blk completion", &queue->reqs[i]);
+		queue->reqs[i].next_free = queue->free;
+		queue->free = &queue->reqs[i];
+	}
+	queue->req_wait = list_create("virtio-blk request waiters", queue);
+	return 0;
+}
+
+static void find_virtio_blk(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
+	if (vendorid != 0x1af4 || (deviceid != 0x1001 && deviceid != 0x1042)) return;
+	fs_node_t * stderr = extra;
+
+	struct vblk_disk * disk = calloc(1, sizeof(struct vblk_disk));
+	if (virtio_pci_init(&disk->dev, device) || !disk->dev.device_cfg) {
+		fprintf(stderr, "virtio-blk: device at %#x is not a modern virtio device\n", device);
+		free(disk);
+		return;
+	}
+
+	virtio_reset(&disk->dev);
+	if (virtio_negotiate(&disk->dev, VIRTIO_F_RING_EVENT_IDX | VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX |
+			VIRTIO_BLK_F_RO | VIRTIO_BLK_F_FLUSH | VIRTIO_BLK_F_MQ)) {
+		fprintf(stderr, "virtio-blk: feature negotiation failed\n");
+		free(disk);
+		return;
+	}
+
+	disk->sectors = vblk_cfg_read4(disk, VIRTIO_BLK_CFG_CAPACITY) |
+		((uint64_t)vblk_cfg_read4(disk, VIRTIO_BLK_CFG_CAPACITY + 4) << 32);
+
+	disk->seg_max = VBLK_MAX_SEGS;
+	if (disk->dev.features & VIRTIO_BLK_F_SEG_MAX) {
+		uint32_t seg_max = vblk_cfg_read4(disk, VIRTIO_BLK_CFG_SEG_MAX);
+		if (seg_max && seg_max < disk->seg_max) disk->seg_max = seg_max;
+	}
+
+	disk->size_max = VBLK_MAX_TRANSFER;
+	if (disk->dev.features & VIRTIO_BLK_F_SIZE_MAX) {
+		uint32_t size_max = vblk_cfg_read4(disk, VIRTIO_BLK_CFG_SIZE_MAX);
+		if (size_max >= 0x1000 && size_max < disk->size_max) disk->size_max = size_max & ~0xFFFU;
+	}
+
+	int wanted = 1;
+	if (disk->dev.features & VIRTIO_BLK_F_MQ) {
+		wanted = vblk_cfg_read2(disk, VIRTIO_BLK_CFG_NUM_QUEUES);
+		if (wanted > processor_count) wanted = processor_count;
+		if (wanted > VBLK_MAX_QUEUES) wanted = VBLK_MAX_QUEUES;
+		if (wanted < 1) wanted = 1;
+	}
+
+	for (int i = 0; i < wanted; ++i) {
+		if (vblk_setup_queue(disk, i)) break;
+		disk->nqueues++;
+	}
+
+	if (!disk->nqueues) {
+		fprintf(stderr, "virtio-blk: device has no request queues\n");
+		virtio_reset(&disk->dev);
+		free(disk);
+		return;
+	}
+
+	/* A command must always fit in an empty queue. */
+	if (disk->seg_max > disk->queues[0].vq->size - 2U) disk->seg_max = disk->queues[0].vq->size - 2U;
+
+	disk->irq = pci_get_interrupt(device);
+	int irq_installed = 0;
+	for (struct vblk_disk * other = vblk_disks; other; other = other->next) {
+		if (other->irq == disk->irq) irq_installed = 1;
+	}
+	disk->next = vblk_disks;
+	vblk_disks = disk;
+	if (!irq_installed) irq_install_handler(disk->irq, vblk_irq_handler, "virtio-blk");
+
+	virtio_driver_ok(&disk->dev);
+
+	fprintf(stderr, "virtio-blk: /dev/vd%c: %zu sectors, %d queue%s of %d, %s\n",
+		vblk_drive_char, (size_t)disk->sectors, disk->nqueues, disk->nqueues == 1 ? "" : "s",
+		disk->queues[0].vq->size, (disk->dev.features & VIRTIO_F_RING_EVENT_IDX) ? "event index" : "no event index");
+
+	char devname[20];
+	snprintf(devname, 20, "/dev/vd%c", vblk_drive_char);
+	fs_node_t * node = bcache_create(vblk_device_create(disk));
+	char options[21];
+	snprintf(options, 20, "%c", vblk_drive_char);
+	vfs_mount(devname, node, "virtio-blk", options);
+	vblk_drive_char++;
+}
+
+static int init(int argc, char * argv[]) {
+	fs_node_t * node = FD_ENTRY(1); /* Get the stdout for the process that loaded the module */
+	pci_scan(find_virtio_blk, -1, node);
+	return 0;
+}
+
+static int fini(void) {
+	return 0;
+}
+
+struct Module metadata = {
+	.name = "virtio-blk",
+	.init = init,
+	.fini = fini,
+};
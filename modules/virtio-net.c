@@ -0,0 +1,461 @@
+/**
+ * @file modules/virtio-net.c
+ * @brief Virtio Network Device Driver
+ * @package x86_64
+ *
+ * Drives paravirtualized network cards (virtio-net over PCI) with one
+ * receive and one transmit queue. The receive queue is kept full of
+ * buffers; the interrupt turns receive interrupts off and schedules
+ * the interface's receive worker (struct net_poll), which hands up to
+ * a budget of frames at a time to the network stack, refills the
+ * queue and notifies the device once for the whole batch, and only
+ * turns interrupts back on when the queue is empty. Transmit
+ * completions are reaped when sending, so transmit interrupts stay
+ * off unless we run out of buffers. With event indexes, notifications
+ * to the device are skipped while it is still working through what we
+ * gave it earlier.
+ *
+ * Checksums are offloaded both ways when the host allows it: we leave
+ * TCP and UDP checksums for the host to fill in on transmit, and trust
+ * frames the host says it has checked, or hands us with a partial
+ * checksum because they never left the machine (typically from another
+ * guest or the host itself), so the stack doesn't sum them again.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <bits/errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/process.h>
+#include <kernel/pci.h>
+#include <kernel/mmu.h>
+#include <kernel/list.h>
+#include <kernel/spinlock.h>
+#include <kernel/vfs.h>
+#include <kernel/virtio.h>
+#include <kernel/net/netif.h>
+#include <kernel/net/eth.h>
+#include <kernel/module.h>
+
+#include <kernel/arch/x86_64/irq.h>
+
+#include <sys/socket.h>
+#include <net/if.h>
+
+#define VIRTIO_NET_F_CSUM        (1ULL << 0)
+#define VIRTIO_NET_F_GUEST_CSUM  (1ULL << 1)
+#define VIRTIO_NET_F_MAC         (1ULL << 5)
+#define VIRTIO_NET_F_STATUS      (1ULL << 16)
+
+#define VIRTIO_NET_S_LINK_UP     1
+
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM  1
+#define VIRTIO_NET_HDR_F_DATA_VALID  2
+
+/* Offsets into the device configuration */
+#define VIRTIO_NET_CFG_MAC       0
+#define VIRTIO_NET_CFG_STATUS    6
+
+#define VNET_RX_QUEUE   0
+#define VNET_TX_QUEUE   1
+#define VNET_QUEUE_SIZE 256
+
+/* Room for the header and a full frame, two to a page. */
+#define VNET_BUF_SIZE   2048
+#define VNET_FRAME_MAX  (VNET_BUF_SIZE - sizeof(struct virtio_net_hdr))
+
+struct virtio_net_hdr {
+	uint8_t flags;
+	uint8_t gso_type;
+	uint16_t hdr_len;
+	uint16_t gso_size;
+	uint16_t csum_start;
+	uint16_t csum_offset;
+	uint16_t num_buffers;
+};
+
+struct vnet_buf {
+	uint8_t * virt;
+	uintptr_t phys;
+	struct vnet_buf * next;
+};
+
+struct vnet_nic {
+	struct EthernetDevice eth;
+	struct virtio_device dev;
+	int irq;
+	int link_up;
+
+	struct virtq * rx;
+	struct vnet_buf * rx_bufs;
+	struct net_poll rx_poll;
+
+	struct virtq * tx;
+	struct vnet_buf * tx_bufs;
+	struct vnet_buf * tx_free;
+	list_t * tx_wait;
+
+	netif_counters_t counts;
+};
+
+static int device_count = 0;
+static struct vnet_nic * devices[32] = {NULL};
+
+static uint8_t vnet_cfg_read1(struct vnet_nic * nic, int offset) {
+	return *((volatile uint8_t *)nic->dev.device_cfg + offset);
+}
+
+static uint16_t vnet_cfg_read2(struct vnet_nic * nic, int offset) {
+	return *(volatile uint16_t *)((volatile char *)nic->dev.device_cfg + offset);
+}
+
+static void vnet_read_status(struct vnet_nic * nic) {
+	if (nic->dev.features & VIRTIO_NET_F_STATUS) {
+		nic->link_up = !!(vnet_cfg_read2(nic, VIRTIO_NET_CFG_STATUS) & VIRTIO_NET_S_LINK_UP);
+	} else {
+		nic->link_up = 1;
+	}
+}
+
+static void vnet_rx_packet(struct vnet_nic * nic, struct vnet_buf * buf, uint32_t len) {
+	struct virtio_net_hdr * hdr = (void*)buf->virt;
+	if (len < sizeof(struct virtio_net_hdr) + sizeof(struct ethernet_packet)) return;
+
+	uint8_t * frame = buf->virt + sizeof(struct virtio_net_hdr);
+	size_t size = len - sizeof(struct virtio_net_hdr);
+
+	int flags = (hdr->flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM | VIRTIO_NET_HDR_F_DATA_VALID)) ? NET_BUFFER_CSUM_OK : 0;
+
+	nic->counts.rx_count++;
+	nic->counts.rx_bytes += size;
+	net_eth_handle((void*)frame, nic->eth.device_node, size, flags);
+}
+
+/* Called with the receive queue lock held. */
+static void vnet_rx_post(struct vnet_nic * nic, struct vnet_buf * buf) {
+	struct virtq_sg sg = { buf->phys, VNET_BUF_SIZE };
+	virtq_add(nic->rx, &sg, 0, 1, buf);
+}
+
+static int vnet_rx_poll(struct net_poll * poll, int budget) {
+	struct vnet_nic * nic = poll->device;
+	int processed = 0;
+	struct vnet_buf * buf;
+	uint32_t len;
+
+	spin_lock(nic->rx->lock);
+	while (processed < budget && (buf = virtq_get(nic->rx, &len))) {
+		spin_unlock(nic->rx->lock);
+		vnet_rx_packet(nic, buf, len);
+		spin_lock(nic->rx->lock);
+		vnet_rx_post(nic, buf);
+		processed++;
+	}
+
+	int kick = processed && virtq_kick_prepare(nic->rx);
+	spin_unlock(nic->rx->lock);
+	if (kick) virtq_notify(nic->rx);
+
+	return processed;
+}
+
+static int vnet_rx_enable(struct net_poll * poll) {
+	struct vnet_nic * nic = poll->device;
+	spin_lock(nic->rx->lock);
+	int pending = virtq_enable_cb(nic->rx);
+	if (pending) virtq_disable_cb(nic->rx);
+	spin_unlock(nic->rx->lock);
+	return pending;
+}
+
+static int vnet_irq_handler(struct regs * r) {
+	int irq = r->int_no - 32;
+	int handled = 0;
+
+	for (int i = 0; i < device_count; ++i) {
+		struct vnet_nic * nic = devices[i];
+		if (nic->irq != irq) continue;
+		uint8_t isr = virtio_isr(&nic->dev);
+		if (!isr) continue;
+
+		if (isr & 1) {
+			spin_lock(nic->rx->lock);
+			virtq_disable_cb(nic->rx);
+			spin_unlock(nic->rx->lock);
+			net_poll_schedule(&nic->rx_poll);
+
+			spin_lock(nic->tx->lock);
+			wakeup_queue(nic->tx_wait);
+			spin_unlock(nic->tx->lock);
+		}
+		if (isr & 2) {
+			vnet_read_status(nic);
+		}
+
+		if (!handled) {
+			handled = 1;
+			irq_ack(irq);
+		}
+	}
+
+	return handled;
+}
+
+/* Called with the transmit queue lock held. */
+static struct vnet_buf * vnet_tx_claim(struct vnet_nic * nic) {
+	struct vnet_buf * buf;
+	while ((buf = virtq_get(nic->tx, NULL))) {
+		buf->next = nic->tx_free;
+		nic->tx_free = buf;
+	}
+	buf = nic->tx_free;
+	if (buf) nic->tx_free = buf->next;
+	return buf;
+}
+
+/* A zero @p csum_start means the frame is complete as it is. */
+static ssize_t vnet_send(struct vnet_nic * nic, size_t size, uint8_t * buffer, size_t csum_start, size_t csum_offset) {
+	if (size > VNET_FRAME_MAX) return -EINVAL;
+
+	spin_lock(nic->tx->lock);
+	struct vnet_buf * buf;
+	while (!(buf = vnet_tx_claim(nic))) {
+		/* Ask for an interrupt when the device gives buffers back. */
+		if (virtq_enable_cb(nic->tx)) continue;
+		sleep_on_unlocking(nic->tx_wait, &nic->tx->lock);
+		spin_lock(nic->tx->lock);
+	}
+	virtq_disable_cb(nic->tx);
+
+	struct virtio_net_hdr * hdr = (void*)buf->virt;
+	memset(hdr, 0, sizeof(struct virtio_net_hdr));
+	if (csum_start) {
+		hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+		hdr->csum_start = csum_start;
+		hdr->csum_offset = csum_offset;
+	}
+	memcpy(buf->virt + sizeof(struct virtio_net_hdr), buffer, size);
+	struct virtq_sg sg = { buf->phys, sizeof(struct virtio_net_hdr) + size };
+	virtq_add(nic->tx, &sg, 1, 0, buf);
+
+	nic->counts.tx_count++;
+	nic->counts.tx_bytes += size;
+
+	int kick = virtq_kick_prepare(nic->tx);
+	spin_unlock(nic->tx->lock);
+	if (kick) virtq_notify(nic->tx);
+
+	return size;
+}
+
+static ssize_t write_vnet(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+	return vnet_send(node->device, size, buffer, 0, 0);
+}
+
+static void vnet_send_partial(struct EthernetDevice * eth, void * frame, size_t size, size_t csum_start, size_t csum_offset) {
+	vnet_send((struct vnet_nic *)eth, size, frame, csum_start, csum_offset);
+}
+
+#define privileged() do { if (this_core->current_process->user != USER_ROOT_UID) { return -EPERM; } } while (0)
+
+static int ioctl_vnet(fs_node_t * node, unsigned long request, void * argp) {
+	struct vnet_nic * nic = node->device;
+
+	switch (request) {
+		case SIOCGIFHWADDR:
+			memcpy(argp, nic->eth.mac, 6);
+			return 0;
+
+		case SIOCGIFADDR:
+			if (nic->eth.ipv4_addr == 0) return -ENOENT;
+			memcpy(argp, &nic->eth.ipv4_addr, sizeof(nic->eth.ipv4_addr));
+			return 0;
+		case SIOCSIFADDR:
+			privileged();
+			memcpy(&nic->eth.ipv4_addr, argp, sizeof(nic->eth.ipv4_addr));
+			return 0;
+		case SIOCGIFNETMASK:
+			if (nic->eth.ipv4_subnet == 0) return -ENOENT;
+			memcpy(argp, &nic->eth.ipv4_subnet, sizeof(nic->eth.ipv4_subnet));
+			return 0;
+		case SIOCSIFNETMASK:
+			privileged();
+			memcpy(&nic->eth.ipv4_subnet, argp, sizeof(nic->eth.ipv4_subnet));
+			return 0;
+		case SIOCGIFGATEWAY:
+			if (nic->eth.ipv4_subnet == 0) return -ENOENT;
+			memcpy(argp, &nic->eth.ipv4_gateway, sizeof(nic->eth.ipv4_gateway));
+			return 0;
+		case SIOCSIFGATEWAY:
+			privileged();
+			memcpy(&nic->eth.ipv4_gateway, argp, sizeof(nic->eth.ipv4_gateway));
+			net_arp_ask(nic->eth.ipv4_gateway, node);
+			return 0;
+
+		case SIOCGIFADDR6:
+			return -ENOENT;
+		case SIOCSIFADDR6:
+			privileged();
+			memcpy(&nic->eth.ipv6_addr, argp, sizeof(nic->eth.ipv6_addr));
+			return 0;
+
+		case SIOCGIFFLAGS: {
+			uint32_t * flags = argp;
+			*flags = IFF_RUNNING;
+			if (nic->link_up) *flags |= IFF_UP;
+			*flags |= IFF_BROADCAST;
+			*flags |= IFF_MULTICAST;
+			return 0;
+		}
+
+		case SIOCGIFMTU: {
+			uint32_t * mtu = argp;
+			*mtu = nic->eth.mtu;
+			return 0;
+		}
+
+		case SIOCGIFCOUNTS: {
+			memcpy(argp, &nic->counts, sizeof(netif_counters_t));
+			return 0;
+		}
+
+		default:
+			return -ENOTTY;
+	}
+}
+
+static struct vnet_buf * vnet_alloc_bufs(int count) {
+	uintptr_t phys;
+	uint8_t * virt = virtio_alloc(count * VNET_BUF_SIZE, &phys);
+	struct vnet_buf * bufs = calloc(count, sizeof(struct vnet_buf));
+	for (int i = 0; i < count; ++i) {
+		bufs[i].virt = virt + i * VNET_BUF_SIZE;
+		bufs[i].phys = phys + i * VNET_BUF_SIZE;
+	}
+	return bufs;
+}
+
+static int vnet_init(struct vnet_nic * nic, uint32_t device) {
+	if (virtio_pci_init(&nic->dev, device) || !nic->dev.device_cfg) {
+		printf("virtio-net: device at %#x is not a modern virtio device\n", device);
+		return -ENODEV;
+	}
+
+	virtio_reset(&nic->dev);
+	if (virtio_negotiate(&nic->dev, VIRTIO_F_RING_EVENT_IDX | VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM | VIRTIO_NET_F_MAC | VIRTIO_NET_F_STATUS)) {
+		printf("virtio-net: feature negotiation failed\n");
+		return -ENODEV;
+	}
+
+	if (nic->dev.features & VIRTIO_NET_F_MAC) {
+		for (int i = 0; i < 6; ++i) {
+			nic->eth.mac[i] = vnet_cfg_read1(nic, VIRTIO_NET_CFG_MAC + i);
+		}
+	} else {
+		/* Locally administered, and unique per slot. */
+		uint8_t mac[6] = {0x02, 0x00, 0x00, pci_extract_bus(device), pci_extract_slot(device), pci_extract_func(device)};
+		memcpy(nic->eth.mac, mac, 6);
+	}
+
+	nic->rx = virtq_create(&nic->dev, VNET_RX_QUEUE, VNET_QUEUE_SIZE);
+	nic->tx = virtq_create(&nic->dev, VNET_TX_QUEUE, VNET_QUEUE_SIZE);
+	if (!nic->rx || !nic->tx) {
+		printf("virtio-net: device is missing its queues\n");
+		virtio_reset(&nic->dev);
+		return -ENODEV;
+	}
+
+	nic->rx_bufs = vnet_alloc_bufs(nic->rx->size);
+	for (int i = 0; i < nic->rx->size; ++i) {
+		vnet_rx_post(nic, &nic->rx_bufs[i]);
+	}
+
+	/* One descriptor per frame, so we can never have more frames out than descriptors. */
+	nic->tx_bufs = vnet_alloc_bufs(nic->tx->size);
+	for (int i = 0; i < nic->tx->size; ++i) {
+		nic->tx_bufs[i].next = nic->tx_free;
+		nic->tx_free = &nic->tx_bufs[i];
+	}
+	virtq_disable_cb(nic->tx);
+
+	nic->tx_wait = list_create("virtio-net tx waiters", nic);
+
+	nic->eth.device_node = calloc(sizeof(fs_node_t),1);
+	snprintf(nic->eth.device_node->name, 100, "%s", nic->eth.if_name);
+	nic->eth.device_node->flags = FS_BLOCKDEVICE; /* NETDEVICE? */
+	nic->eth.device_node->mask  = 0644; /* temporary; shouldn't be doing this with these device files */
+	nic->eth.device_node->ioctl = ioctl_vnet;
+	nic->eth.device_node->write = write_vnet;
+	nic->eth.device_node->device = nic;
+
+	nic->eth.mtu = 1500;
+	if (nic->dev.features & VIRTIO_NET_F_CSUM) nic->eth.send_partial = vnet_send_partial;
+
+	char worker_name[34];
+	snprintf(worker_name, 33, "[%s]", nic->eth.if_name);
+	net_poll_start(&nic->rx_poll, worker_name, nic, vnet_rx_poll, vnet_rx_enable);
+
+	nic->irq = pci_get_interrupt(device);
+	int irq_installed = 0;
+	for (int i = 0; i < device_count; ++i) {
+		if (devices[i]->irq == nic->irq) irq_installed = 1;
+	}
+	devices[device_count++] = nic;
+	if (!irq_installed) irq_install_handler(nic->irq, vnet_irq_handler, "virtio-net");
+
+	virtio_driver_ok(&nic->dev);
+	vnet_read_status(nic);
+
+	net_add_interface(nic->eth.if_name, nic->eth.device_node);
+
+	spin_lock(nic->rx->lock);
+	virtq_kick(nic->rx);
+	spin_unlock(nic->rx->lock);
+
+	printf("virtio-net: %s: " MAC_FORMAT ", link %s, %s\n", nic->eth.if_name, FORMAT_MAC(nic->eth.mac),
+		nic->link_up ? "up" : "down", (nic->dev.features & VIRTIO_F_RING_EVENT_IDX) ? "event index" : "no event index");
+	return 0;
+}
+
+static void find_virtio_net(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * found) {
+	if (vendorid != 0x1af4 || (deviceid != 0x1000 && deviceid != 0x1041)) return;
+	if (device_count == 32) return;
+
+	struct vnet_nic * nic = calloc(1,sizeof(struct vnet_nic));
+	snprintf(nic->eth.if_name, 31,
+		"enp%ds%d",
+		(int)pci_extract_bus(device),
+		(int)pci_extract_slot(device));
+
+	if (vnet_init(nic, device)) {
+		free(nic);
+		return;
+	}
+
+	*(int*)found = 1;
+}
+
+static int vnet_install(int argc, char * argv[]) {
+	uint32_t found = 0;
+	pci_scan(&find_virtio_net, -1, &found);
+
+	if (!found) {
+		return -ENODEV;
+	}
+
+	return 0;
+}
+
+static int fini(void) {
+	return 0;
+}
+
+struct Module metadata = {
+	.name = "virtio-net",
+	.init = vnet_install,
+	.fini = fini,
+};
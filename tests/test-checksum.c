@@ -0,0 +1,209 @@
+/**
+ * @brief Internet checksum benchmark.
+ *
+ * Compares three ways of computing the one's complement sum used by
+ * IPv4, ICMP, UDP and TCP: one big-endian 16-bit word at a time with
+ * a carry fold per word, as the network stack used to; eight bytes
+ * at a time into a 64-bit accumulator, as kernel/net/checksum.c does;
+ * and with SSE2 or NEON, which the kernel can't use as it doesn't
+ * save vector registers for itself. All three are first checked
+ * against each other on random lengths and alignments.
+ *
+ * Usage: test-checksum [iterations [bytes]]
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#define SIMD_NAME "sse2"
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SIMD_NAME "neon"
+#endif
+
+static uint16_t csum_scalar(const void * data, size_t len) {
+	const uint8_t * p = data;
+	uint32_t sum = 0;
+	size_t i;
+	for (i = 0; i + 1 < len; i += 2) {
+		uint16_t word;
+		memcpy(&word, p + i, 2);
+		sum += ntohs(word);
+		if (sum > 0xFFFF) sum = (sum >> 16) + (sum & 0xFFFF);
+	}
+	if (i < len) {
+		sum += p[i] << 8;
+		if (sum > 0xFFFF) sum = (sum >> 16) + (sum & 0xFFFF);
+	}
+	return htons(~sum & 0xFFFF);
+}
+
+static uint16_t fold(uint64_t sum) {
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return ~sum & 0xFFFF;
+}
+
+static inline uint64_t load64(const uint8_t * p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint16_t csum_wide(const void * data, size_t len) {
+	const uint8_t * p = data;
+	uint64_t acc = 0, carries = 0;
+
+	while (len >= 32) {
+		uint64_t a = load64(p), b = load64(p + 8), c = load64(p + 16), d = load64(p + 24);
+		acc += a; carries += acc < a;
+		acc += b; carries += acc < b;
+		acc += c; carries += acc < c;
+		acc += d; carries += acc < d;
+		p += 32;
+		len -= 32;
+	}
+	while (len >= 8) {
+		uint64_t a = load64(p);
+		acc += a; carries += acc < a;
+		p += 8;
+		len -= 8;
+	}
+	if (len) {
+		uint64_t tail = 0;
+		memcpy(&tail, p, len);
+		acc += tail; carries += acc < tail;
+	}
+
+	acc += carries;
+	if (acc < carries) acc++;
+	return fold(acc);
+}
+
+#ifdef SIMD_NAME
+/* 16-bit lanes widen into 32-bit ones, which could overflow after 65537 adds; flush well before. */
+#define SIMD_FLUSH 4096
+
+static uint16_t csum_simd(const void * data, size_t len) {
+	const uint8_t * p = data;
+	uint64_t total = 0;
+
+	while (len >= 16) {
+		size_t blocks = len / 16;
+		if (blocks > SIMD_FLUSH) blocks = SIMD_FLUSH;
+		len -= blocks * 16;
+#if defined(__x86_64__)
+		__m128i zero = _mm_setzero_si128();
+		__m128i acc = zero;
+		for (size_t i = 0; i < blocks; ++i, p += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)p);
+			acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+			acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+		}
+		uint32_t lanes[4];
+		_mm_storeu_si128((__m128i *)lanes, acc);
+		total += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#else
+		uint32x4_t acc = vdupq_n_u32(0);
+		for (size_t i = 0; i < blocks; ++i, p += 16) {
+			acc = vpadalq_u16(acc, vld1q_u16((const uint16_t *)p));
+		}
+		total += vaddlvq_u32(acc);
+#endif
+	}
+
+	if (len) {
+		uint8_t tail[16] = {0};
+		memcpy(tail, p, len);
+		for (int i = 0; i < 16; i += 2) {
+			uint16_t word;
+			memcpy(&word, tail + i, 2);
+			total += word;
+		}
+	}
+
+	return fold(total);
+}
+#endif
+
+struct method {
+	const char * name;
+	uint16_t (*func)(const void *, size_t);
+};
+
+static struct method methods[] = {
+	{"scalar", csum_scalar},
+	{"wide64", csum_wide},
+#ifdef SIMD_NAME
+	{SIMD_NAME, csum_simd},
+#endif
+};
+
+#define METHOD_COUNT (sizeof(methods) / sizeof(*methods))
+
+static double elapsed_since(struct timeval * start) {
+	struct timeval end;
+	gettimeofday(&end, NULL);
+	return (end.tv_sec - start->tv_sec) + (end.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static int check(uint8_t * buf, size_t max) {
+	for (int i = 0; i < 10000; ++i) {
+		size_t off = rand() % 16;
+		size_t len = rand() % (max - 16);
+		uint16_t expected = csum_scalar(buf + off, len);
+		for (size_t m = 1; m < METHOD_COUNT; ++m) {
+			uint16_t got = methods[m].func(buf + off, len);
+			if (got != expected) {
+				fprintf(stderr, "%s: checksum of %zu bytes at offset %zu is %#x, expected %#x\n",
+					methods[m].name, len, off, got, expected);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char * argv[]) {
+	long iterations = argc > 1 ? atol(argv[1]) : 100000;
+	size_t size = argc > 2 ? strtoul(argv[2], NULL, 10) : 1500;
+
+	size_t max = size > 4096 ? size : 4096;
+	uint8_t * buf = malloc(max + 16);
+	for (size_t i = 0; i < max + 16; ++i) buf[i] = rand();
+
+	if (check(buf, max)) return 1;
+
+	/* All ones sums to the largest intermediate values, so it finds overflows. */
+	memset(buf, 0xFF, max + 16);
+	if (check(buf, max)) return 1;
+	for (size_t i = 0; i < max + 16; ++i) buf[i] = rand();
+
+	for (size_t m = 0; m < METHOD_COUNT; ++m) {
+		volatile uint16_t sink = 0;
+		struct timeval start;
+		gettimeofday(&start, NULL);
+		for (long i = 0; i < iterations; ++i) {
+			/* Change the data every time, so the sum can't be hoisted out of the loop. */
+			buf[i & 15]++;
+			sink ^= methods[m].func(buf, size);
+		}
+		double elapsed = elapsed_since(&start);
+		printf("%-8s %zu bytes x %ld: %.3f s, %.2f MiB/s\n", methods[m].name, size, iterations,
+			elapsed, (double)size * iterations / elapsed / (1024 * 1024));
+	}
+
+	return 0;
+}
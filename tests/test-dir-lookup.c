@@ -0,0 +1,167 @@
+/**
+ * @brief Large directory create/lookup benchmark.
+ *
+ * Creates the given number of empty files in a fresh directory, then
+ * stats each of them, then removes them, printing the rate for each
+ * phase. On a filesystem with hashed directory indexes, the rates should
+ * stay flat as the count grows instead of falling off linearly.
+ *
+ * Each file holds its own number, and every lookup checks the size of
+ * what it found. Between the timed phases, the directory is listed to
+ * check that every name is there exactly once, and after the removals,
+ * that every name is gone and the directory is empty.
+ *
+ * Usage: test-dir-lookup DIRECTORY [files]
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+static struct timeval start;
+
+static void begin(void) {
+	gettimeofday(&start, NULL);
+}
+
+static void report(const char * what, size_t count) {
+	struct timeval end;
+	gettimeofday(&end, NULL);
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+	printf("%-7s %zu files in %.3f s: %10.1f/s\n", what, count, elapsed, elapsed > 0 ? count / elapsed : 0.0);
+}
+
+/**
+ * @brief List @p dir and check it holds exactly file-0 through file-(count-1).
+ */
+static int check_listing(const char * dir, size_t count) {
+	DIR * d = opendir(dir);
+	if (!d) {
+		perror(dir);
+		return 1;
+	}
+	char * seen = calloc(count ? count : 1, 1);
+	size_t found = 0;
+	int failed = 0;
+	struct dirent * ent;
+	while ((ent = readdir(d))) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+		char * end;
+		size_t i;
+		if (strncmp(ent->d_name, "file-", 5) || (i = strtoul(ent->d_name + 5, &end, 10), *end) || i >= count) {
+			fprintf(stderr, "%s: unexpected entry '%s'\n", dir, ent->d_name);
+			failed = 1;
+			continue;
+		}
+		if (seen[i]) {
+			fprintf(stderr, "%s: '%s' listed twice\n", dir, ent->d_name);
+			failed = 1;
+		}
+		seen[i] = 1;
+		found++;
+	}
+	closedir(d);
+	free(seen);
+	if (!failed && found != count) {
+		fprintf(stderr, "%s: listed %zu files, expected %zu\n", dir, found, count);
+		failed = 1;
+	}
+	return failed;
+}
+
+int main(int argc, char * argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s DIRECTORY [files]\n", argv[0]);
+		return 1;
+	}
+
+	const char * dir = argv[1];
+	size_t count = argc > 2 ? (size_t)atoi(argv[2]) : 10000;
+	char path[1024];
+
+	if (mkdir(dir, 0755) < 0) {
+		perror(dir);
+		return 1;
+	}
+
+	begin();
+	for (size_t i = 0; i < count; ++i) {
+		snprintf(path, sizeof(path), "%s/file-%zu", dir, i);
+		int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd < 0) {
+			perror(path);
+			return 1;
+		}
+		char data[32];
+		int len = snprintf(data, sizeof(data), "%zu", i);
+		if (write(fd, data, len) != len) {
+			perror(path);
+			return 1;
+		}
+		close(fd);
+	}
+	report("create", count);
+
+	if (check_listing(dir, count)) return 1;
+
+	begin();
+	struct stat st;
+	for (size_t i = 0; i < count; ++i) {
+		/* Walk the names in a different order than they were created */
+		size_t n = (i * 7919) % count;
+		snprintf(path, sizeof(path), "%s/file-%zu", dir, n);
+		if (stat(path, &st) < 0) {
+			perror(path);
+			return 1;
+		}
+		/* The file holds its own number, so its size says which one we found */
+		char data[32];
+		if (!S_ISREG(st.st_mode) || (size_t)st.st_size != (size_t)snprintf(data, sizeof(data), "%zu", n)) {
+			fprintf(stderr, "%s: wrong file found\n", path);
+			return 1;
+		}
+	}
+	report("lookup", count);
+
+	/* A name that was never created must not be found */
+	snprintf(path, sizeof(path), "%s/file-%zu", dir, count);
+	if (stat(path, &st) == 0 || errno != ENOENT) {
+		fprintf(stderr, "%s: found a file that was never created\n", path);
+		return 1;
+	}
+
+	begin();
+	for (size_t i = 0; i < count; ++i) {
+		snprintf(path, sizeof(path), "%s/file-%zu", dir, i);
+		if (unlink(path) < 0) {
+			perror(path);
+			return 1;
+		}
+	}
+	report("unlink", count);
+
+	for (size_t i = 0; i < count; ++i) {
+		snprintf(path, sizeof(path), "%s/file-%zu", dir, i);
+		if (stat(path, &st) == 0 || errno != ENOENT) {
+			fprintf(stderr, "%s: still there after unlink\n", path);
+			return 1;
+		}
+	}
+	if (check_listing(dir, 0)) return 1;
+
+	if (rmdir(dir) < 0) {
+		perror(dir);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,137 @@
+/**
+ * @brief Random block device read benchmark.
+ *
+ * Reads 4KiB blocks at random offsets across a block device from one
+ * or more processes at once and prints how many reads per second they
+ * managed together. With a queueing driver (AHCI with NCQ) the rate
+ * should go up with the number of processes instead of staying flat.
+ *
+ * Each process keeps a checksum of every block it read. Once all of them
+ * are done and the clock has stopped, each reads its blocks again one at
+ * a time and checks they still match, which catches a driver handing back
+ * the wrong block or mixing up concurrent requests. Run it on a device
+ * nothing is writing to.
+ *
+ * Usage: test-disk-random DEVICE [processes] [reads per process]
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+
+#define BLOCK 4096
+
+static uint32_t checksum(const unsigned char * buf) {
+	/* FNV-1a */
+	uint32_t h = 2166136261U;
+	for (int i = 0; i < BLOCK; ++i) {
+		h = (h ^ buf[i]) * 16777619U;
+	}
+	return h;
+}
+
+static int reader(const char * path, uint64_t blocks, int reads, uint32_t seed, int done, int go) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return 1;
+	unsigned char buf[BLOCK];
+	uint64_t * block = malloc(sizeof(uint64_t) * reads);
+	uint32_t * sums = malloc(sizeof(uint32_t) * reads);
+	uint32_t x = seed;
+	for (int i = 0; i < reads; ++i) {
+		/* xorshift; every process walks its own sequence */
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		block[i] = x % blocks;
+		if (pread(fd, buf, BLOCK, (off_t)block[i] * BLOCK) != BLOCK) return 1;
+		sums[i] = checksum(buf);
+	}
+
+	/* Tell the parent we're done, and wait for the others to be done too */
+	char c = 0;
+	write(done, &c, 1);
+	read(go, &c, 1);
+
+	for (int i = 0; i < reads; ++i) {
+		if (pread(fd, buf, BLOCK, (off_t)block[i] * BLOCK) != BLOCK) return 1;
+		if (checksum(buf) != sums[i]) {
+			fprintf(stderr, "%s: block %llu read back differently\n", path, (unsigned long long)block[i]);
+			return 1;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+int main(int argc, char * argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s DEVICE [processes] [reads per process]\n", argv[0]);
+		return 1;
+	}
+
+	int processes = argc > 2 ? atoi(argv[2]) : 1;
+	int reads = argc > 3 ? atoi(argv[3]) : 2000;
+
+	struct stat st;
+	if (stat(argv[1], &st) < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	uint64_t blocks = st.st_size / BLOCK;
+	if (!blocks) {
+		fprintf(stderr, "%s: device is too small\n", argv[1]);
+		return 1;
+	}
+
+	int done[2], go[2];
+	pipe(done);
+	pipe(go);
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+
+	for (int i = 0; i < processes; ++i) {
+		if (!fork()) {
+			close(done[0]);
+			close(go[1]);
+			return reader(argv[1], blocks, reads, 2463534242U + i * 7919, done[1], go[0]);
+		}
+	}
+	close(done[1]);
+	close(go[0]);
+
+	/* Stop the clock when every reader is through its timed reads,
+	 * or has exited early; they then check their blocks. */
+	char c;
+	for (int i = 0; i < processes; ++i) {
+		if (read(done[0], &c, 1) != 1) break;
+	}
+	gettimeofday(&end, NULL);
+	close(go[1]);
+
+	int failed = 0;
+	for (int i = 0; i < processes; ++i) {
+		int status;
+		wait(&status);
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) failed = 1;
+	}
+
+	if (failed) {
+		fprintf(stderr, "%s: a reader failed\n", argv[1]);
+		return 1;
+	}
+
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+	long total = (long)processes * reads;
+	printf("%d processes, %ld reads in %.3f s: %8.0f reads/s\n", processes, total, elapsed, elapsed > 0 ? total / elapsed : 0.0);
+	return 0;
+}
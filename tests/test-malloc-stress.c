@@ -0,0 +1,161 @@
+/**
+ * @brief Fragmentation stress test for malloc.
+ *
+ * Churns through rounds of mixed-size allocations the way a long-lived
+ * GUI process does: mostly small objects, a good number of buffers in
+ * the tens of kilobytes, and the occasional large surface. Each round
+ * frees a random half of what is live and allocates again. Reports the
+ * peak and final live bytes next to the process's mapped memory, so
+ * growth that never comes back shows up as a widening gap.
+ *
+ * Every allocation is stamped with its slot and a serial number at its
+ * start, its end, and every page in between, and all live allocations
+ * are checked after each round, so overlapping blocks or a free that
+ * scribbles on a neighbor fail the test.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SLOTS  4096
+#define ROUNDS 200
+
+static char * ptrs[SLOTS];
+static size_t sizes[SLOTS];
+static uint32_t stamps[SLOTS];
+static uint32_t serial = 0;
+
+static size_t live = 0;
+static size_t peak_live = 0;
+static size_t peak_mapped = 0;
+
+/* VmSize in /proc/self/status counts the pages actually mapped for us */
+static size_t mapped_bytes(void) {
+	FILE * f = fopen("/proc/self/status", "r");
+	if (!f) return 0;
+	char line[256];
+	size_t kb = 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "VmSize:", 7)) {
+			kb = strtoul(line + 7, NULL, 10);
+			break;
+		}
+	}
+	fclose(f);
+	return kb * 1024;
+}
+
+static size_t random_size(void) {
+	int r = rand() % 100;
+	if (r < 70) return 16 + rand() % 1024;
+	if (r < 95) return 4096 + rand() % 60000;
+	return 128 * 1024 + rand() % (1024 * 1024);
+}
+
+static void stamp_at(int i, size_t offset) {
+	memcpy(ptrs[i] + offset, &stamps[i], sizeof(uint32_t));
+}
+
+static int check_at(int i, size_t offset) {
+	uint32_t found;
+	memcpy(&found, ptrs[i] + offset, sizeof(uint32_t));
+	if (found != stamps[i]) {
+		fprintf(stderr, "test-malloc-stress: slot %d (%zu bytes at %p) was corrupted at offset %zu\n",
+			i, sizes[i], (void *)ptrs[i], offset);
+		return 1;
+	}
+	return 0;
+}
+
+static int check(int i) {
+	for (size_t offset = 0; offset + 2 * sizeof(uint32_t) <= sizes[i]; offset += 4096) {
+		if (check_at(i, offset)) return 1;
+	}
+	return check_at(i, sizes[i] - sizeof(uint32_t));
+}
+
+static void release(int i) {
+	live -= sizes[i];
+	free(ptrs[i]);
+	ptrs[i] = NULL;
+}
+
+static void allocate(int i) {
+	sizes[i] = random_size();
+	ptrs[i] = malloc(sizes[i]);
+	if (!ptrs[i]) {
+		fprintf(stderr, "test-malloc-stress: allocation of %zu bytes failed\n", sizes[i]);
+		exit(1);
+	}
+	if ((uintptr_t)ptrs[i] % sizeof(void *)) {
+		fprintf(stderr, "test-malloc-stress: %p is misaligned\n", (void *)ptrs[i]);
+		exit(1);
+	}
+	memset(ptrs[i], i & 0xFF, sizes[i]);
+	stamps[i] = ((uint32_t)i << 20) ^ ++serial;
+	for (size_t offset = 0; offset + 2 * sizeof(uint32_t) <= sizes[i]; offset += 4096) {
+		stamp_at(i, offset);
+	}
+	stamp_at(i, sizes[i] - sizeof(uint32_t));
+	live += sizes[i];
+	if (live > peak_live) peak_live = live;
+}
+
+static void sample(void) {
+	size_t mapped = mapped_bytes();
+	if (mapped > peak_mapped) peak_mapped = mapped;
+}
+
+int main(int argc, char * argv[]) {
+	srand(argc > 1 ? atoi(argv[1]) : 1);
+
+	size_t baseline = mapped_bytes();
+
+	for (int i = 0; i < SLOTS; ++i) allocate(i);
+	sample();
+
+	for (int round = 0; round < ROUNDS; ++round) {
+		for (int i = 0; i < SLOTS; ++i) {
+			if (rand() % 2) release(i);
+		}
+		for (int i = 0; i < SLOTS; ++i) {
+			if (!ptrs[i]) allocate(i);
+		}
+		for (int i = 0; i < SLOTS; ++i) {
+			if (check(i)) return 1;
+		}
+		sample();
+	}
+
+	/* Keep a handful of objects alive, as a long-running process would */
+	for (int i = 0; i < SLOTS; ++i) {
+		if (i % 64) release(i);
+	}
+	for (int i = 0; i < SLOTS; i += 64) {
+		if (check(i)) return 1;
+	}
+
+	size_t final_mapped = mapped_bytes();
+	peak_mapped = peak_mapped > baseline ? peak_mapped - baseline : 0;
+	final_mapped = final_mapped > baseline ? final_mapped - baseline : 0;
+
+	printf("baseline mapped: %8zu KiB\n", baseline / 1024);
+	printf("peak live:       %8zu KiB\n", peak_live / 1024);
+	printf("peak mapped:     %8zu KiB (%zu%% of peak live)\n", peak_mapped / 1024,
+		peak_live ? peak_mapped * 100 / peak_live : 0);
+	printf("final live:      %8zu KiB\n", live / 1024);
+	printf("final mapped:    %8zu KiB\n", final_mapped / 1024);
+
+	for (int i = 0; i < SLOTS; ++i) {
+		if (ptrs[i]) release(i);
+	}
+
+	return 0;
+}
@@ -0,0 +1,140 @@
+/**
+ * @brief Multi-thread malloc scaling benchmark.
+ *
+ * Each thread churns a private working set of small objects, freeing
+ * and reallocating random slots. The same total amount of work per
+ * thread is run with 1, 2, ... N threads, and the aggregate rate is
+ * printed next to the speedup over a single thread. With allocations
+ * serialized on one lock the rate stays flat; it should climb with
+ * the thread count when threads mostly hit their own caches.
+ *
+ * Each object is stamped with its thread and a serial number at both
+ * ends, and checked before it is freed, so an object handed to two
+ * threads at once fails the test. Whatever each thread leaves live is
+ * checked and freed by the main thread, which also exercises freeing
+ * objects that came from another thread's cache.
+ *
+ * Usage: test-malloc-threads [max-threads] [operations-per-thread]
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#define MAX_THREADS 32
+#define SLOTS       256
+
+static long operations = 1000000;
+static volatile int failed = 0;
+
+struct worker {
+	uint32_t id;
+	char * slots[SLOTS];
+	size_t sizes[SLOTS];
+	uint32_t stamps[SLOTS];
+};
+
+static struct worker workers[MAX_THREADS];
+
+static int check(struct worker * w, int slot) {
+	uint32_t head, tail;
+	memcpy(&head, w->slots[slot], sizeof(uint32_t));
+	memcpy(&tail, w->slots[slot] + w->sizes[slot] - sizeof(uint32_t), sizeof(uint32_t));
+	if (head != w->stamps[slot] || tail != w->stamps[slot]) {
+		fprintf(stderr, "test-malloc-threads: thread %u slot %d (%p) was corrupted\n",
+			w->id, slot, (void *)w->slots[slot]);
+		return 1;
+	}
+	return 0;
+}
+
+static void * worker(void * arg) {
+	struct worker * w = arg;
+	uint32_t seed = w->id * 2654435761U + 1;
+	uint32_t serial = 0;
+
+	for (long i = 0; i < operations; ++i) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		int slot = seed % SLOTS;
+		if (w->slots[slot]) {
+			if (check(w, slot)) {
+				failed = 1;
+				break;
+			}
+			free(w->slots[slot]);
+			w->slots[slot] = NULL;
+		} else {
+			size_t size = 8 + (seed >> 8) % 512;
+			w->slots[slot] = malloc(size);
+			if (!w->slots[slot]) {
+				fprintf(stderr, "test-malloc-threads: allocation failed\n");
+				failed = 1;
+				break;
+			}
+			w->sizes[slot] = size;
+			w->stamps[slot] = (w->id << 24) ^ ++serial;
+			memcpy(w->slots[slot], &w->stamps[slot], sizeof(uint32_t));
+			memcpy(w->slots[slot] + size - sizeof(uint32_t), &w->stamps[slot], sizeof(uint32_t));
+		}
+	}
+
+	return NULL;
+}
+
+static double run(int count) {
+	pthread_t threads[MAX_THREADS];
+	struct timeval start, end;
+
+	memset(workers, 0, sizeof(workers));
+
+	gettimeofday(&start, NULL);
+	for (int i = 0; i < count; ++i) {
+		workers[i].id = i + 1;
+		pthread_create(&threads[i], NULL, worker, &workers[i]);
+	}
+	for (int i = 0; i < count; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	gettimeofday(&end, NULL);
+
+	if (failed) exit(1);
+
+	/* Check and free what the threads left behind from here instead */
+	for (int i = 0; i < count; ++i) {
+		for (int slot = 0; slot < SLOTS; ++slot) {
+			if (!workers[i].slots[slot]) continue;
+			if (check(&workers[i], slot)) exit(1);
+			free(workers[i].slots[slot]);
+		}
+	}
+
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+	return (double)operations * count / elapsed;
+}
+
+int main(int argc, char * argv[]) {
+	int max = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+	if (argc > 2) operations = atol(argv[2]);
+	if (max < 1) max = 1;
+	if (max > MAX_THREADS) max = MAX_THREADS;
+
+	double base = 0;
+	printf("threads     ops/sec  speedup\n");
+	for (int count = 1; count <= max; ++count) {
+		double rate = run(count);
+		if (count == 1) base = rate;
+		printf("%7d %11.0f  %6.2fx\n", count, rate, rate / base);
+	}
+
+	return 0;
+}
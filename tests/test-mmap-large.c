@@ -0,0 +1,162 @@
+/**
+ * @brief Large anonymous mapping benchmark.
+ *
+ * Maps an anonymous region of the given size, writes to every page of
+ * it, then reads it back at random page offsets, and unmaps it, printing
+ * the time each step took. With 2MiB pages behind the mapping, setting
+ * it up takes far fewer page table writes and the random reads take far
+ * fewer TLB misses than with 4KiB pages.
+ *
+ * Outside the timed steps, it checks that the region starts out zeroed
+ * and holds exactly what was written, that a forked child sees the same
+ * contents and that its writes stay out of the parent's copy, and that
+ * a new mapping made after the unmap is zeroed again. The random reads
+ * check every value they load.
+ *
+ * Usage: test-mmap-large [megabytes] [random reads]
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+
+static struct timeval start;
+
+static void begin(void) {
+	gettimeofday(&start, NULL);
+}
+
+static void report(const char * what) {
+	struct timeval end;
+	gettimeofday(&end, NULL);
+	long elapsed = (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec);
+	printf("%-7s %8ldus\n", what, elapsed);
+}
+
+/**
+ * @brief Check that page @p i holds its number in its first byte and zeroes elsewhere.
+ */
+static int check_page(volatile uint8_t * region, size_t i, uint8_t first) {
+	volatile uint8_t * page = region + i * 4096;
+	if (page[0] != first) {
+		fprintf(stderr, "page %zu: found %#x, expected %#x\n", i, page[0], first);
+		return 1;
+	}
+	for (size_t j = 1; j < 4096; ++j) {
+		if (page[j]) {
+			fprintf(stderr, "page %zu: found %#x at offset %zu, expected zero\n", i, page[j], j);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int check_region(volatile uint8_t * region, size_t pages, int written) {
+	for (size_t i = 0; i < pages; ++i) {
+		if (check_page(region, i, written ? (uint8_t)i : 0)) return 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Fork a child that checks the region and then overwrites it,
+ *        and make sure the parent's copy is unchanged afterwards.
+ */
+static int check_fork(volatile uint8_t * region, size_t pages) {
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (!pid) {
+		if (check_region(region, pages, 1)) _exit(1);
+		for (size_t i = 0; i < pages; ++i) region[i * 4096 + 1] = 0xFF;
+		for (size_t i = 0; i < pages; ++i) {
+			if (region[i * 4096 + 1] != 0xFF) _exit(1);
+		}
+		_exit(0);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "forked child saw the wrong contents\n");
+		return 1;
+	}
+	if (check_region(region, pages, 1)) {
+		fprintf(stderr, "the child's writes showed up in the parent\n");
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char * argv[]) {
+	size_t size = (argc > 1 ? (size_t)atoi(argv[1]) : 64) * 1024 * 1024;
+	size_t reads = argc > 2 ? (size_t)atoi(argv[2]) : 1000000;
+	size_t pages = size / 4096;
+
+	begin();
+	volatile uint8_t * region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (region == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	report("map");
+
+	printf("region at %p (%s)\n", (void*)region, ((uintptr_t)region & 0x1FFFFF) ? "not 2MiB-aligned" : "2MiB-aligned");
+
+	begin();
+	for (size_t i = 0; i < pages; ++i) {
+		if (region[i * 4096]) {
+			fprintf(stderr, "page %zu was not zeroed\n", i);
+			return 1;
+		}
+		region[i * 4096] = i;
+	}
+	report("write");
+
+	if (check_region(region, pages, 1)) return 1;
+
+	begin();
+	unsigned int sum = 0;
+	uint32_t x = 2463534242;
+	for (size_t i = 0; i < reads; ++i) {
+		/* xorshift, so the access pattern defeats the prefetcher */
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		size_t page = x % pages;
+		size_t offset = x & 0xFC0;
+		uint8_t value = region[page * 4096 + offset];
+		if (value != (offset ? 0 : (uint8_t)page)) {
+			fprintf(stderr, "page %zu: read %#x at offset %zu\n", page, value, offset);
+			return 1;
+		}
+		sum += value;
+	}
+	report("read");
+
+	if (check_fork(region, pages)) return 1;
+
+	begin();
+	munmap((void*)region, size);
+	report("unmap");
+
+	/* Whatever backed the old region must come back zeroed */
+	region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (region == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	if (check_region(region, pages, 0)) return 1;
+	munmap((void*)region, size);
+
+	return sum == 0xFFFFFFFF;
+}
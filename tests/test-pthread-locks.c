@@ -0,0 +1,103 @@
+/**
+ * @brief Stress test for futex-backed mutexes, condvars, and semaphores.
+ *
+ * Several threads increment a shared counter under a mutex, then hand
+ * a token around a ring with a condition variable, then drain a
+ * semaphore. Prints the totals and exits non-zero on any mismatch.
+ *
+ * Each thread also checks that it is alone in the critical section and
+ * that turns come round in ring order, and once they are done, the
+ * semaphore must be empty and a held mutex must refuse a trylock.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#define THREADS    4
+#define ITERATIONS 100000
+#define ROUNDS     1000
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static sem_t sem;
+
+static long counter = 0;
+static int turn = 0;
+static int consumed = 0;
+static volatile int inside = 0;
+static volatile int failed = 0;
+
+static void * worker(void * arg) {
+	int me = (int)(uintptr_t)arg;
+
+	for (int i = 0; i < ITERATIONS; ++i) {
+		pthread_mutex_lock(&mutex);
+		if (__sync_add_and_fetch(&inside, 1) != 1) failed = 1;
+		counter++;
+		__sync_sub_and_fetch(&inside, 1);
+		pthread_mutex_unlock(&mutex);
+	}
+
+	for (int i = 0; i < ROUNDS; ++i) {
+		pthread_mutex_lock(&mutex);
+		while (turn % THREADS != me) pthread_cond_wait(&cond, &mutex);
+		/* Our i'th turn comes after every thread has had i turns */
+		if (turn != i * THREADS + me) failed = 1;
+		turn++;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&mutex);
+	}
+
+	for (int i = 0; i < ROUNDS; ++i) {
+		sem_wait(&sem);
+		__sync_fetch_and_add(&consumed, 1);
+	}
+
+	return NULL;
+}
+
+int main(int argc, char * argv[]) {
+	pthread_t threads[THREADS];
+
+	sem_init(&sem, 0, 0);
+
+	for (int i = 0; i < THREADS; ++i) {
+		pthread_create(&threads[i], NULL, worker, (void*)(uintptr_t)i);
+	}
+
+	for (int i = 0; i < THREADS * ROUNDS; ++i) {
+		sem_post(&sem);
+	}
+
+	for (int i = 0; i < THREADS; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+
+	if (failed) printf("threads overlapped in the critical section or took turns out of order\n");
+
+	/* Every post was consumed, so there must be nothing left to take */
+	if (sem_trywait(&sem) == 0 || errno != EAGAIN) {
+		printf("semaphore was not empty after draining\n");
+		failed = 1;
+	}
+
+	pthread_mutex_lock(&mutex);
+	if (pthread_mutex_trylock(&mutex) != EBUSY) {
+		printf("trylock succeeded on a held mutex\n");
+		failed = 1;
+	}
+	pthread_mutex_unlock(&mutex);
+
+	printf("counter = %ld (expected %d)\n", counter, THREADS * ITERATIONS);
+	printf("turns = %d (expected %d)\n", turn, THREADS * ROUNDS);
+	printf("consumed = %d (expected %d)\n", consumed, THREADS * ROUNDS);
+
+	return failed || !(counter == THREADS * ITERATIONS && turn == THREADS * ROUNDS && consumed == THREADS * ROUNDS);
+}
@@ -0,0 +1,147 @@
+/**
+ * @brief PTY output throughput benchmark.
+ *
+ * A child writes a few megabytes of log-like text to the slave side
+ * of a PTY while the parent drains the master side, the way a terminal
+ * does when something cats a large file. Runs once with output
+ * processing on (newlines become CR-LF) and once with it off, and
+ * prints the rate for each. Every byte read from the master is checked
+ * against what was written, with each newline expected as CR-LF when
+ * output processing is on.
+ *
+ * Usage: test-pty-throughput [megabytes]
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pty.h>
+#include <termios.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+
+#define CHUNK 4096
+
+static char chunk[CHUNK];
+static size_t newlines = 0;
+
+static void fill_chunk(void) {
+	/* Lines of 64 to 127 printable characters */
+	size_t i = 0;
+	while (i < CHUNK) {
+		size_t len = 64 + rand() % 64;
+		for (size_t j = 0; j < len && i < CHUNK - 1; ++j) chunk[i++] = ' ' + rand() % 95;
+		chunk[i++] = '\n';
+		newlines++;
+	}
+}
+
+/**
+ * @brief Check output from the master against the chunk, picking up at @p pos.
+ *
+ * @p cr is set while we've seen the CR that ONLCR puts before a newline
+ * and are waiting for the newline itself.
+ * @returns 0 if it matches, or 1 after saying where it doesn't.
+ */
+static int check(const char * buf, size_t len, size_t received, size_t * pos, int * cr, int opost) {
+	for (size_t i = 0; i < len; ++i) {
+		char expect = chunk[*pos];
+		if (opost && expect == '\n' && !*cr) {
+			expect = '\r';
+			*cr = 1;
+		} else {
+			*cr = 0;
+			*pos = (*pos + 1) % CHUNK;
+		}
+		if (buf[i] != expect) {
+			fprintf(stderr, "test-pty-throughput: byte %zu is %#x, expected %#x\n", received + i, (unsigned char)buf[i], (unsigned char)expect);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static double run(size_t chunks, int opost) {
+	int master, slave;
+	if (openpty(&master, &slave, NULL, NULL, NULL) < 0) {
+		perror("openpty");
+		exit(1);
+	}
+
+	struct termios tios;
+	tcgetattr(slave, &tios);
+	if (opost) {
+		tios.c_oflag |= OPOST | ONLCR;
+	} else {
+		tios.c_oflag &= ~OPOST;
+	}
+	tcsetattr(slave, TCSANOW, &tios);
+
+	size_t expected = chunks * (CHUNK + (opost ? newlines : 0));
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+
+	pid_t child = fork();
+	if (!child) {
+		close(master);
+		for (size_t i = 0; i < chunks; ++i) {
+			size_t done = 0;
+			while (done < CHUNK) {
+				ssize_t r = write(slave, chunk + done, CHUNK - done);
+				if (r <= 0) _exit(1);
+				done += r;
+			}
+		}
+		/* Don't flush the parent's buffered output a second time */
+		_exit(0);
+	}
+
+	close(slave);
+
+	char buf[CHUNK];
+	size_t received = 0;
+	size_t pos = 0;
+	int cr = 0;
+	while (received < expected) {
+		ssize_t r = read(master, buf, sizeof(buf));
+		if (r <= 0) break;
+		if (check(buf, r, received, &pos, &cr, opost)) exit(1);
+		received += r;
+	}
+
+	gettimeofday(&end, NULL);
+	int status;
+	waitpid(child, &status, 0);
+	close(master);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "test-pty-throughput: writer failed\n");
+		exit(1);
+	}
+
+	if (received != expected) {
+		fprintf(stderr, "test-pty-throughput: expected %zu bytes, got %zu\n", expected, received);
+		exit(1);
+	}
+
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+	return (double)chunks * CHUNK / elapsed / (1024 * 1024);
+}
+
+int main(int argc, char * argv[]) {
+	size_t megabytes = argc > 1 ? (size_t)atoi(argv[1]) : 16;
+	size_t chunks = megabytes * 1024 * 1024 / CHUNK;
+
+	fill_chunk();
+
+	printf("opost:    %8.2f MiB/s\n", run(chunks, 1));
+	printf("no opost: %8.2f MiB/s\n", run(chunks, 0));
+
+	return 0;
+}
@@ -0,0 +1,149 @@
+/**
+ * @brief Sequential file read throughput benchmark.
+ *
+ * Reads a file from start to end with the given buffer size and
+ * prints the rate. Run it on a large file that has not been read
+ * since boot to measure the filesystem and disk rather than the
+ * page cache; a second run shows the cached rate.
+ *
+ * The timed read must see as many bytes as the file's size. Afterwards,
+ * untimed, the file is read again in odd sized pieces that straddle
+ * block boundaries, and then block by block in a scattered order, and
+ * the two must agree on every block.
+ *
+ * Usage: test-read-throughput FILE [buffer kilobytes]
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#define BLOCK 4096
+
+static uint32_t fnv(uint32_t h, const unsigned char * data, size_t len) {
+	for (size_t i = 0; i < len; ++i) {
+		h = (h ^ data[i]) * 16777619U;
+	}
+	return h;
+}
+
+/**
+ * @brief Checksum each block of the file, reading it in odd sized pieces.
+ */
+static uint32_t * checksum_blocks(int fd, size_t size) {
+	size_t blocks = (size + BLOCK - 1) / BLOCK;
+	uint32_t * sums = malloc(sizeof(uint32_t) * (blocks ? blocks : 1));
+	for (size_t i = 0; i < blocks; ++i) sums[i] = 2166136261U;
+
+	unsigned char buf[BLOCK + 3];
+	size_t offset = 0;
+	ssize_t r;
+	lseek(fd, 0, SEEK_SET);
+	while ((r = read(fd, buf, sizeof(buf))) > 0) {
+		for (ssize_t i = 0; i < r; ) {
+			size_t block = (offset + i) / BLOCK;
+			size_t len = (block + 1) * BLOCK - (offset + i);
+			if (len > (size_t)(r - i)) len = r - i;
+			sums[block] = fnv(sums[block], buf + i, len);
+			i += len;
+		}
+		offset += r;
+	}
+	if (r < 0 || offset != size) {
+		fprintf(stderr, "second read: got %zu bytes, expected %zu\n", offset, size);
+		return NULL;
+	}
+	return sums;
+}
+
+/**
+ * @brief Read every block on its own, in a scattered order, and compare.
+ */
+static int check_blocks(int fd, size_t size, uint32_t * sums) {
+	size_t blocks = (size + BLOCK - 1) / BLOCK;
+	unsigned char buf[BLOCK];
+	for (size_t i = 0; i < blocks; ++i) {
+		/* 7919 is prime, so unless it divides the count this visits every block */
+		size_t block = (i * 7919) % blocks;
+		size_t len = block == blocks - 1 ? size - block * BLOCK : BLOCK;
+		if (pread(fd, buf, len, (off_t)block * BLOCK) != (ssize_t)len) {
+			fprintf(stderr, "block %zu: short read\n", block);
+			return 1;
+		}
+		if (fnv(2166136261U, buf, len) != sums[block]) {
+			fprintf(stderr, "block %zu: read differently on its own than in sequence\n", block);
+			return 1;
+		}
+	}
+	/* And there is nothing past the end */
+	if (pread(fd, buf, BLOCK, (off_t)size) != 0) {
+		fprintf(stderr, "read past the end of the file returned data\n");
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char * argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s FILE [buffer kilobytes]\n", argv[0]);
+		return 1;
+	}
+
+	size_t bufsize = (argc > 2 ? (size_t)atoi(argv[2]) : 64) * 1024;
+	char * buf = malloc(bufsize);
+
+	int fd = open(argv[1], O_RDONLY);
+	if (fd < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+
+	size_t total = 0;
+	ssize_t r;
+	while ((r = read(fd, buf, bufsize)) > 0) {
+		total += r;
+	}
+
+	gettimeofday(&end, NULL);
+	close(fd);
+
+	if (r < 0) {
+		perror("read");
+		return 1;
+	}
+
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+	printf("%zu bytes in %.3f s: %8.2f MiB/s\n", total, elapsed, elapsed > 0 ? total / elapsed / (1024 * 1024) : 0.0);
+
+	struct stat st;
+	if (stat(argv[1], &st) < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	if (total != (size_t)st.st_size) {
+		fprintf(stderr, "read %zu bytes, but the file is %zu bytes\n", total, (size_t)st.st_size);
+		return 1;
+	}
+
+	fd = open(argv[1], O_RDONLY);
+	if (fd < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	uint32_t * sums = checksum_blocks(fd, total);
+	if (!sums || check_blocks(fd, total, sums)) return 1;
+	close(fd);
+
+	return 0;
+}
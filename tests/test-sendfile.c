@@ -0,0 +1,259 @@
+/**
+ * @brief File-to-file and file-to-pipe copy benchmark.
+ *
+ * Copies a file to a new file, and then through a pipe to a child,
+ * first with a read/write loop and then with sendfile, and prints the
+ * rate of each. Every copy is checked against the source: the new file
+ * is read back, and the child compares what comes out of the pipe. It
+ * then splices from a pipe fed by a slow writer, which hands over odd
+ * sized pieces with pauses in between, into a file, and into another
+ * pipe drained by a slow reader, and checks those too. Read the source
+ * once beforehand (eg. with test-read-throughput) so every timed run
+ * is served from the page cache.
+ *
+ * Usage: test-sendfile FILE COPY [buffer kilobytes]
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/sendfile.h>
+
+static size_t bufsize;
+static char * buf;
+
+/* The whole source file, to check copies against */
+static char * expected;
+static size_t expected_size;
+
+static ssize_t copy_readwrite(int in, int out) {
+	ssize_t total = 0, r;
+	while ((r = read(in, buf, bufsize)) > 0) {
+		if (write(out, buf, r) != r) return -1;
+		total += r;
+	}
+	return r < 0 ? -1 : total;
+}
+
+static ssize_t copy_sendfile(int in, int out) {
+	ssize_t total = 0, r;
+	while ((r = sendfile(out, in, NULL, bufsize)) > 0) {
+		total += r;
+	}
+	return r < 0 ? -1 : total;
+}
+
+static ssize_t copy_splice(int in, int out) {
+	ssize_t total = 0, r;
+	while ((r = splice(in, NULL, out, NULL, bufsize, 0)) > 0) {
+		total += r;
+	}
+	return r < 0 ? -1 : total;
+}
+
+static void load_expected(const char * source) {
+	int fd = open(source, O_RDONLY);
+	if (fd < 0) {
+		perror(source);
+		exit(1);
+	}
+	size_t space = 0x10000;
+	expected = malloc(space);
+	ssize_t r;
+	while ((r = read(fd, expected + expected_size, space - expected_size)) > 0) {
+		expected_size += r;
+		if (expected_size == space) {
+			space *= 2;
+			expected = realloc(expected, space);
+		}
+	}
+	close(fd);
+	if (r < 0) {
+		perror(source);
+		exit(1);
+	}
+}
+
+/**
+ * @brief Compare @p len bytes just read at @p offset with the source.
+ * @returns 0 if they match, or 1 after saying where they don't.
+ */
+static int compare(const char * what, const char * data, size_t offset, size_t len) {
+	if (offset + len > expected_size) {
+		fprintf(stderr, "%s: %zu bytes more than the %zu in the source\n", what, offset + len - expected_size, expected_size);
+		return 1;
+	}
+	for (size_t i = 0; i < len; ++i) {
+		if (data[i] != expected[offset + i]) {
+			fprintf(stderr, "%s: data mismatch at byte %zu\n", what, offset + i);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief Read everything from @p fd and check it against the source.
+ *
+ * With @p slow, read in small pieces and pause between them, so a
+ * writer into a pipe keeps finding it full.
+ */
+static int drain_and_check(const char * what, int fd, int slow) {
+	size_t total = 0;
+	size_t piece = slow ? 1000 : bufsize;
+	ssize_t r;
+	while ((r = read(fd, buf, piece)) > 0) {
+		if (compare(what, buf, total, r)) return 1;
+		total += r;
+		if (slow) usleep(100);
+	}
+	if (r < 0) {
+		perror(what);
+		return 1;
+	}
+	if (total != expected_size) {
+		fprintf(stderr, "%s: got %zu bytes, expected %zu\n", what, total, expected_size);
+		return 1;
+	}
+	return 0;
+}
+
+static void check_file(const char * what, const char * path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		exit(1);
+	}
+	if (drain_and_check(what, fd, 0)) exit(1);
+	close(fd);
+}
+
+/**
+ * @brief Start a child that writes the source into a new pipe.
+ *
+ * It writes in uneven pieces of a few hundred bytes to a few kilobytes
+ * and sleeps between them, so a reader keeps finding partial data.
+ */
+static int slow_writer(int * pid) {
+	int fds[2];
+	pipe(fds);
+	*pid = fork();
+	if (!*pid) {
+		close(fds[0]);
+		size_t offset = 0;
+		for (int i = 0; offset < expected_size; ++i) {
+			size_t piece = 300 + (i * 1237) % 4000;
+			if (piece > expected_size - offset) piece = expected_size - offset;
+			ssize_t w = write(fds[1], expected + offset, piece);
+			if (w <= 0) exit(1);
+			offset += w;
+			usleep(200);
+		}
+		exit(0);
+	}
+	close(fds[1]);
+	return fds[0];
+}
+
+/**
+ * @brief Start a child that reads from a new pipe and checks what it gets.
+ */
+static int checking_reader(const char * what, int * pid, int slow) {
+	int fds[2];
+	pipe(fds);
+	*pid = fork();
+	if (!*pid) {
+		close(fds[1]);
+		exit(drain_and_check(what, fds[0], slow));
+	}
+	close(fds[0]);
+	return fds[1];
+}
+
+static void wait_child(const char * what, int pid) {
+	int status;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "%s: reader or writer failed\n", what);
+		exit(1);
+	}
+}
+
+static void run(const char * what, const char * source, const char * dest, ssize_t (*copy)(int,int), int slow) {
+	int in, out, reader = 0, writer = 0;
+
+	if (source) {
+		in = open(source, O_RDONLY);
+		if (in < 0) {
+			perror(source);
+			exit(1);
+		}
+	} else {
+		in = slow_writer(&writer);
+	}
+
+	if (dest) {
+		out = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out < 0) {
+			perror(dest);
+			exit(1);
+		}
+	} else {
+		out = checking_reader(what, &reader, slow);
+	}
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	ssize_t total = copy(in, out);
+	close(out);
+	if (reader) wait_child(what, reader);
+	gettimeofday(&end, NULL);
+	close(in);
+	if (writer) wait_child(what, writer);
+
+	if (total < 0) {
+		perror(what);
+		exit(1);
+	}
+	if ((size_t)total != expected_size) {
+		fprintf(stderr, "%s: copied %zd bytes, expected %zu\n", what, total, expected_size);
+		exit(1);
+	}
+	if (dest) check_file(what, dest);
+
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+	printf("%-20s %zd bytes in %.3f s: %8.2f MiB/s\n", what, total, elapsed, elapsed > 0 ? total / elapsed / (1024 * 1024) : 0.0);
+	/* Don't leave this buffered for the next forked child to print again. */
+	fflush(stdout);
+}
+
+int main(int argc, char * argv[]) {
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s FILE COPY [buffer kilobytes]\n", argv[0]);
+		return 1;
+	}
+
+	bufsize = (argc > 3 ? (size_t)atoi(argv[3]) : 64) * 1024;
+	buf = malloc(bufsize);
+	load_expected(argv[1]);
+
+	run("file read/write", argv[1], argv[2], copy_readwrite, 0);
+	run("file sendfile", argv[1], argv[2], copy_sendfile, 0);
+	run("pipe read/write", argv[1], NULL, copy_readwrite, 0);
+	run("pipe sendfile", argv[1], NULL, copy_sendfile, 0);
+
+	/* These are limited by the sleeps, so their rates mean little. */
+	run("slow pipe to file", NULL, argv[2], copy_splice, 0);
+	run("slow pipe to pipe", NULL, NULL, copy_splice, 1);
+
+	unlink(argv[2]);
+	return 0;
+}
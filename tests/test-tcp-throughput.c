@@ -0,0 +1,152 @@
+/**
+ * @brief TCP bulk transfer benchmark.
+ *
+ * A child connects and writes as fast as it can while the parent
+ * reads and checks the data, so the stream runs through the send
+ * buffer, segmentation, the receive window and back out again. By
+ * default both ends are on 127.0.0.1; give a host and port to time
+ * a transfer to an external sink instead (eg. `nc -l` on the other
+ * side of an e1000), in which case nothing is read back.
+ *
+ * Usage: test-tcp-throughput [megabytes [write-size [host port]]]
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define PORT 5557
+
+static uint8_t pattern(size_t offset) {
+	return (offset * 7) ^ (offset >> 12);
+}
+
+static double elapsed_since(struct timeval * start) {
+	struct timeval end;
+	gettimeofday(&end, NULL);
+	return (end.tv_sec - start->tv_sec) + (end.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static void sender(const char * host, int port, size_t total, size_t chunk) {
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = inet_addr(host);
+	if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("connect");
+		exit(1);
+	}
+
+	uint8_t * buf = malloc(chunk);
+	size_t sent = 0;
+	while (sent < total) {
+		size_t n = total - sent < chunk ? total - sent : chunk;
+		for (size_t i = 0; i < n; ++i) buf[i] = pattern(sent + i);
+		ssize_t w = write(sock, buf, n);
+		if (w <= 0) {
+			perror("write");
+			exit(1);
+		}
+		sent += w;
+	}
+
+	close(sock);
+}
+
+int main(int argc, char * argv[]) {
+	size_t total = (argc > 1 ? strtoul(argv[1], NULL, 10) : 64) * 1024 * 1024;
+	size_t chunk = argc > 2 ? strtoul(argv[2], NULL, 10) : 65536;
+	if (!chunk) chunk = 1;
+
+	if (argc > 4) {
+		struct timeval start;
+		gettimeofday(&start, NULL);
+		sender(argv[3], atoi(argv[4]), total, chunk);
+		double elapsed = elapsed_since(&start);
+		printf("%zu bytes in %.3f s: %.2f MiB/s\n", total, elapsed, total / elapsed / (1024 * 1024));
+		return 0;
+	}
+
+	int server = socket(AF_INET, SOCK_STREAM, 0);
+	if (server < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(PORT);
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	if (bind(server, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		return 1;
+	}
+	if (listen(server, 1) < 0) {
+		perror("listen");
+		return 1;
+	}
+
+	pid_t child = fork();
+	if (!child) {
+		close(server);
+		sender("127.0.0.1", PORT, total, chunk);
+		exit(0);
+	}
+
+	int sock = accept(server, NULL, NULL);
+	if (sock < 0) {
+		perror("accept");
+		return 1;
+	}
+
+	uint8_t * buf = malloc(chunk);
+	size_t received = 0;
+	struct timeval start;
+	gettimeofday(&start, NULL);
+
+	while (1) {
+		ssize_t r = read(sock, buf, chunk);
+		if (r < 0) {
+			perror("read");
+			return 1;
+		}
+		if (r == 0) break;
+		for (ssize_t i = 0; i < r; ++i) {
+			if (buf[i] != pattern(received + i)) {
+				fprintf(stderr, "data mismatch at byte %zu\n", received + i);
+				return 1;
+			}
+		}
+		received += r;
+	}
+
+	double elapsed = elapsed_since(&start);
+	waitpid(child, NULL, 0);
+
+	if (received != total) {
+		fprintf(stderr, "expected %zu bytes, got %zu\n", total, received);
+		return 1;
+	}
+
+	printf("%zu bytes in %.3f s: %.2f MiB/s\n", received, elapsed, received / elapsed / (1024 * 1024));
+	return 0;
+}
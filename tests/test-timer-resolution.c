@@ -0,0 +1,104 @@
+/**
+ * @brief Short sleep accuracy benchmark.
+ *
+ * Sleeps for a range of short intervals with usleep and prints how
+ * long each actually took, on average and at worst. With a one-shot
+ * timer armed for the earliest sleeper, the overshoot should be small
+ * and not a multiple of the scheduler tick.
+ *
+ * No sleep may return before its interval is up, or more than a second
+ * after, which would mean a wakeup was lost until some unrelated timer
+ * interrupt came along. The same is then checked with several processes
+ * sleeping different intervals at once, so sleepers are queued from
+ * different cores and each new one may become the earliest.
+ *
+ * Usage: test-timer-resolution [iterations]
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+
+#define LATE    1000000
+#define SLEEPERS 8
+
+static long elapsed(struct timeval * start, struct timeval * end) {
+	return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_usec - start->tv_usec);
+}
+
+/**
+ * @brief Sleep for @p usecs and check we woke neither early nor very late.
+ * @returns how long the sleep took, or -1 if it was out of bounds.
+ */
+static long timed_sleep(long usecs) {
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	usleep(usecs);
+	gettimeofday(&end, NULL);
+	long took = elapsed(&start, &end);
+	if (took < usecs || took > usecs + LATE) {
+		fprintf(stderr, "test-timer-resolution: %ldus sleep took %ldus\n", usecs, took);
+		return -1;
+	}
+	return took;
+}
+
+static const long intervals[] = {100, 500, 1000, 2000, 5000, 10000, 20000};
+#define INTERVALS (sizeof(intervals) / sizeof(*intervals))
+
+/**
+ * @brief Run several processes that each sleep through the intervals
+ *        in a different order, so their sleeps overlap.
+ */
+static int concurrent_sleepers(int iterations) {
+	for (int k = 0; k < SLEEPERS; ++k) {
+		if (!fork()) {
+			for (int j = 0; j < iterations; ++j) {
+				if (timed_sleep(intervals[(j + k) % INTERVALS]) < 0) _exit(1);
+			}
+			_exit(0);
+		}
+	}
+	int failed = 0;
+	for (int k = 0; k < SLEEPERS; ++k) {
+		int status;
+		wait(&status);
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) failed = 1;
+	}
+	return failed;
+}
+
+int main(int argc, char * argv[]) {
+	int iterations = argc > 1 ? atoi(argv[1]) : 50;
+	int failed = 0;
+
+	printf("%8s %10s %10s %10s\n", "request", "average", "min", "max");
+	for (size_t i = 0; i < INTERVALS; ++i) {
+		long total = 0, min = -1, max = 0;
+		for (int j = 0; j < iterations; ++j) {
+			long took = timed_sleep(intervals[i]);
+			if (took < 0) {
+				failed = 1;
+				continue;
+			}
+			total += took;
+			if (min < 0 || took < min) min = took;
+			if (took > max) max = took;
+		}
+		printf("%6ldus %8ldus %8ldus %8ldus\n", intervals[i], total / iterations, min, max);
+	}
+	fflush(stdout);
+
+	if (concurrent_sleepers(iterations)) {
+		fprintf(stderr, "test-timer-resolution: a concurrent sleeper woke at the wrong time\n");
+		failed = 1;
+	}
+
+	return failed;
+}
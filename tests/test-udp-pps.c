@@ -0,0 +1,184 @@
+/**
+ * @brief UDP packets-per-second benchmark over the loopback interface.
+ *
+ * A child sends small datagrams to 127.0.0.1 as fast as it can while
+ * the parent receives them, so every packet makes the whole trip down
+ * the send path, through the loopback interface and back up the
+ * receive path to a socket. The receiver acknowledges every so often
+ * and the sender never gets more than a window ahead of it, so the
+ * socket queue stays bounded no matter which side is faster.
+ *
+ * Every datagram carries its sequence number and a payload pattern
+ * derived from it, and the receiver checks its length, its contents,
+ * and that no sequence number arrives twice. If nothing arrives for a
+ * while, a packet was lost and the test fails instead of waiting on it
+ * forever.
+ *
+ * Usage: test-udp-pps [packets [payload-bytes]]
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define DATA_PORT 5555
+#define ACK_PORT  5556
+
+/* Acknowledge every ACK_EVERY packets; the sender stays within WINDOW of the last one. */
+#define ACK_EVERY 128
+#define WINDOW    1024
+
+/* Seconds without ACK_EVERY packets arriving before we call one lost */
+#define STALL     10
+
+static int udp_socket(int port) {
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		exit(1);
+	}
+
+	return sock;
+}
+
+static struct sockaddr_in loopback(int port) {
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	return addr;
+}
+
+static void fill(char * buf, uint32_t seq, size_t payload) {
+	memcpy(buf, &seq, sizeof(seq));
+	for (size_t j = sizeof(seq); j < payload; ++j) buf[j] = seq + j;
+}
+
+static void stalled(int sig) {
+	(void)sig;
+	static const char msg[] = "test-udp-pps: no packets for a while; one was lost\n";
+	write(2, msg, sizeof(msg) - 1);
+	_exit(1);
+}
+
+static void sender(uint32_t packets, size_t payload) {
+	int sock = udp_socket(ACK_PORT);
+	struct sockaddr_in dest = loopback(DATA_PORT);
+
+	char * buf = calloc(payload, 1);
+	uint32_t acked = 0;
+
+	for (uint32_t i = 0; i < packets; ++i) {
+		while (i - acked >= WINDOW) {
+			uint32_t ack;
+			if (recv(sock, &ack, sizeof(ack), 0) < (ssize_t)sizeof(ack)) exit(1);
+			if (ack > acked) acked = ack;
+		}
+		fill(buf, i, payload);
+		if (sendto(sock, buf, payload, 0, (struct sockaddr*)&dest, sizeof(dest)) < 0) {
+			perror("sendto");
+			exit(1);
+		}
+	}
+
+	exit(0);
+}
+
+int main(int argc, char * argv[]) {
+	uint32_t packets = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+	size_t payload = argc > 2 ? strtoul(argv[2], NULL, 10) : 64;
+	if (payload < sizeof(uint32_t)) payload = sizeof(uint32_t);
+
+	int sock = udp_socket(DATA_PORT);
+	struct sockaddr_in ack_dest = loopback(ACK_PORT);
+
+	pid_t child = fork();
+	if (!child) {
+		close(sock);
+		sender(packets, payload);
+	}
+
+	/* Receive into a larger buffer, so an oversized datagram shows up as one */
+	char * buf = malloc(payload + 1);
+	char * expect = malloc(payload);
+	uint8_t * seen = calloc(packets ? packets : 1, 1);
+	struct timeval start, end;
+	uint32_t received = 0;
+	uint32_t out_of_order = 0;
+
+	signal(SIGALRM, stalled);
+	alarm(STALL);
+
+	while (received < packets) {
+		ssize_t r = recv(sock, buf, payload + 1, 0);
+		if (r < 0) {
+			perror("recv");
+			return 1;
+		}
+		if (!received) gettimeofday(&start, NULL);
+
+		if ((size_t)r != payload) {
+			fprintf(stderr, "test-udp-pps: got a datagram of %zd bytes, expected %zu\n", r, payload);
+			return 1;
+		}
+		uint32_t seq;
+		memcpy(&seq, buf, sizeof(seq));
+		if (seq >= packets || seen[seq]) {
+			fprintf(stderr, "test-udp-pps: packet %u was %s\n", seq, seq >= packets ? "never sent" : "received twice");
+			return 1;
+		}
+		seen[seq] = 1;
+		fill(expect, seq, payload);
+		if (memcmp(buf, expect, payload)) {
+			fprintf(stderr, "test-udp-pps: packet %u was corrupted\n", seq);
+			return 1;
+		}
+		if (seq != received) out_of_order++;
+		received++;
+
+		if (received % ACK_EVERY == 0) {
+			alarm(STALL);
+			sendto(sock, &received, sizeof(received), 0, (struct sockaddr*)&ack_dest, sizeof(ack_dest));
+		}
+	}
+
+	gettimeofday(&end, NULL);
+	alarm(0);
+	int status;
+	waitpid(child, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "test-udp-pps: sender failed\n");
+		return 1;
+	}
+
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+	printf("%u packets of %zu bytes in %.3f s: %.0f packets/s, %.2f MiB/s",
+		received, payload, elapsed, received / elapsed, (double)received * payload / elapsed / (1024 * 1024));
+	if (out_of_order) printf(", %u out of order", out_of_order);
+	printf("\n");
+
+	return 0;
+}
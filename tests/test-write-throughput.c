@@ -0,0 +1,133 @@
+/**
+ * @brief Sequential file write throughput benchmark.
+ *
+ * Writes a new file of the given size from start to end with the given
+ * buffer size, syncs it, and prints the rate both before and after the
+ * sync, so the cost of allocating blocks and of getting them to the
+ * disk can be seen separately.
+ *
+ * Each 4KiB of the file starts with its own offset, and the file is
+ * read back afterwards, untimed, to check its size and that every
+ * block holds what was written to it.
+ *
+ * Usage: test-write-throughput FILE [megabytes] [buffer kilobytes]
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#define BLOCK 4096
+
+static double since(struct timeval * start) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/**
+ * @brief Read the file back and check every byte of it.
+ */
+static int check_file(const char * path, size_t total, char * buf, size_t bufsize) {
+	struct stat st;
+	if (stat(path, &st) < 0) {
+		perror(path);
+		return 1;
+	}
+	if ((size_t)st.st_size != total) {
+		fprintf(stderr, "%s: file is %zu bytes, expected %zu\n", path, (size_t)st.st_size, total);
+		return 1;
+	}
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+	size_t offset = 0;
+	ssize_t r;
+	while ((r = read(fd, buf, bufsize)) > 0) {
+		for (ssize_t i = 0; i < r; ++i, ++offset) {
+			char expect = 'x';
+			if (offset % BLOCK < sizeof(uint64_t)) {
+				uint64_t stamp = offset - offset % BLOCK;
+				expect = ((char *)&stamp)[offset % BLOCK];
+			}
+			if (buf[i] != expect) {
+				fprintf(stderr, "%s: wrong data at byte %zu\n", path, offset);
+				return 1;
+			}
+		}
+	}
+	close(fd);
+	if (r < 0 || offset != total) {
+		fprintf(stderr, "%s: read back %zu bytes, expected %zu\n", path, offset, total);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char * argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s FILE [megabytes] [buffer kilobytes]\n", argv[0]);
+		return 1;
+	}
+
+	size_t total = (argc > 2 ? (size_t)atoi(argv[2]) : 64) * 1024 * 1024;
+	size_t bufsize = (argc > 3 ? (size_t)atoi(argv[3]) : 64) * 1024;
+	char * buf = malloc(bufsize);
+	memset(buf, 'x', bufsize);
+
+	int fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	struct timeval start;
+	gettimeofday(&start, NULL);
+
+	size_t done = 0;
+	while (done < total) {
+		size_t count = total - done < bufsize ? total - done : bufsize;
+		/* Stamp each block with where it goes, so misplaced blocks show up */
+		size_t first = (BLOCK - done % BLOCK) % BLOCK;
+		for (size_t i = first; i + sizeof(uint64_t) <= count; i += BLOCK) {
+			uint64_t stamp = done + i;
+			memcpy(buf + i, &stamp, sizeof(uint64_t));
+		}
+		ssize_t r = write(fd, buf, count);
+		for (size_t i = first; i + sizeof(uint64_t) <= count; i += BLOCK) {
+			memset(buf + i, 'x', sizeof(uint64_t));
+		}
+		if (r <= 0) {
+			perror("write");
+			return 1;
+		}
+		if ((size_t)r != count) {
+			fprintf(stderr, "write: %zd of %zu bytes\n", r, count);
+			return 1;
+		}
+		done += r;
+	}
+
+	double written = since(&start);
+	ioctl(fd, IOCTLSYNC, NULL);
+	double synced = since(&start);
+	close(fd);
+
+	printf("%zu bytes written in %.3f s: %8.2f MiB/s\n", total, written, written > 0 ? total / written / (1024 * 1024) : 0.0);
+	printf("%zu bytes synced  in %.3f s: %8.2f MiB/s\n", total, synced, synced > 0 ? total / synced / (1024 * 1024) : 0.0);
+
+	return check_file(argv[1], total, buf, bufsize);
+}
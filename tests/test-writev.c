@@ -0,0 +1,171 @@
+/**
+ * @brief Vectored write benchmark.
+ *
+ * Sends a stream of small records, each a short header and a body,
+ * through a pipe to a child and then into a file, once with a write()
+ * per piece and once with a writev() per batch of records, and prints
+ * the rate of each. The child checks every record it reads from the
+ * pipe, and the file is read back with readv() and checked, including
+ * that nothing follows the last record.
+ *
+ * Usage: test-writev FILE [records] [record bytes]
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+
+#define BATCH 32
+
+static size_t records;
+static size_t record_size;
+static char * body;
+
+static int send_write(int out) {
+	for (size_t i = 0; i < records; ++i) {
+		unsigned int header = i;
+		if (write(out, &header, sizeof(header)) != sizeof(header)) return -1;
+		if (write(out, body, record_size) != (ssize_t)record_size) return -1;
+	}
+	return 0;
+}
+
+static int send_writev(int out) {
+	struct iovec iov[BATCH * 2];
+	unsigned int headers[BATCH];
+	for (size_t i = 0; i < records; i += BATCH) {
+		size_t count = records - i < BATCH ? records - i : BATCH;
+		for (size_t j = 0; j < count; ++j) {
+			headers[j] = i + j;
+			iov[j*2].iov_base = &headers[j];
+			iov[j*2].iov_len = sizeof(headers[j]);
+			iov[j*2+1].iov_base = body;
+			iov[j*2+1].iov_len = record_size;
+		}
+		ssize_t want = count * (sizeof(unsigned int) + record_size);
+		if (writev(out, iov, count * 2) != want) return -1;
+	}
+	return 0;
+}
+
+static int check_file(const char * path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+	char * got = malloc(record_size);
+	for (size_t i = 0; i < records; ++i) {
+		unsigned int header;
+		struct iovec iov[2] = {{&header, sizeof(header)}, {got, record_size}};
+		if (readv(fd, iov, 2) != (ssize_t)(sizeof(header) + record_size)) return -1;
+		if (header != i || memcmp(got, body, record_size)) return -1;
+	}
+	char extra;
+	if (read(fd, &extra, 1) != 0) return -1;
+	free(got);
+	close(fd);
+	return 0;
+}
+
+/**
+ * @brief Read records from a pipe and check them as they go by.
+ *
+ * Reads don't line up with records, so this tracks the offset into
+ * the stream and works out what each byte should be.
+ */
+static int check_stream(int in) {
+	size_t record_bytes = sizeof(unsigned int) + record_size;
+	size_t offset = 0;
+	char buf[4096];
+	ssize_t r;
+	while ((r = read(in, buf, sizeof(buf))) > 0) {
+		for (ssize_t i = 0; i < r; ++i, ++offset) {
+			size_t record = offset / record_bytes;
+			size_t pos = offset % record_bytes;
+			char expect;
+			if (pos < sizeof(unsigned int)) {
+				unsigned int header = record;
+				expect = ((char *)&header)[pos];
+			} else {
+				expect = body[pos - sizeof(unsigned int)];
+			}
+			if (record >= records || buf[i] != expect) return -1;
+		}
+	}
+	if (r < 0 || offset != records * record_bytes) return -1;
+	return 0;
+}
+
+static void run(const char * what, const char * dest, int (*send)(int)) {
+	int out, pid = 0;
+	int fds[2];
+	if (dest) {
+		out = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out < 0) {
+			perror(dest);
+			exit(1);
+		}
+	} else {
+		pipe(fds);
+		pid = fork();
+		if (!pid) {
+			close(fds[1]);
+			_exit(check_stream(fds[0]) < 0);
+		}
+		close(fds[0]);
+		out = fds[1];
+	}
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	int r = send(out);
+	close(out);
+	int status = 0;
+	if (pid) waitpid(pid, &status, 0);
+	gettimeofday(&end, NULL);
+
+	if (r < 0) {
+		perror(what);
+		exit(1);
+	}
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "%s: records read from the pipe do not match\n", what);
+		exit(1);
+	}
+
+	if (dest && check_file(dest) < 0) {
+		fprintf(stderr, "%s: file contents do not match\n", what);
+		exit(1);
+	}
+
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+	printf("%-14s %zu records in %.3f s: %10.0f records/s\n", what, records, elapsed, elapsed > 0 ? records / elapsed : 0.0);
+}
+
+int main(int argc, char * argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s FILE [records] [record bytes]\n", argv[0]);
+		return 1;
+	}
+
+	records = argc > 2 ? (size_t)atoi(argv[2]) : 100000;
+	record_size = argc > 3 ? (size_t)atoi(argv[3]) : 60;
+	body = malloc(record_size);
+	for (size_t i = 0; i < record_size; ++i) body[i] = 'a' + i % 26;
+
+	run("pipe write", NULL, send_write);
+	run("pipe writev", NULL, send_writev);
+	run("file write", argv[1], send_write);
+	run("file writev", argv[1], send_writev);
+
+	unlink(argv[1]);
+	return 0;
+}